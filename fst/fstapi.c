@@ -28,17 +28,25 @@
  * FST_DYNAMIC_ALIAS_DISABLE : dynamic aliases are not processed
  * FST_DYNAMIC_ALIAS2_DISABLE : new encoding for dynamic aliases is not generated
  * FST_WRITEX_DISABLE : fast write I/O routines are disabled
+ * FST_VARINT_SIMD_DISABLE : batch varint decoding does not use SSE2/AVX2
  *
  * possible enables:
  *
  * FST_DEBUG : not for production use, only enable for development
  * FST_REMOVE_DUPLICATE_VC : glitch removal (has writer performance impact)
- * HAVE_LIBPTHREAD -> FST_WRITER_PARALLEL : enables inclusion of parallel writer code
+ * HAVE_LIBPTHREAD -> FST_WRITER_PARALLEL : enables inclusion of parallel writer code (background section
+ * flushes and fstWriterSetPackThreads() per-signal compression)
+ * HAVE_LIBPTHREAD -> FST_READER_PARALLEL : enables fstReaderSetUnpackThreads() section decompression in
+ * fstReaderIterBlocks2()
  * FST_DO_MISALIGNED_OPS (defined automatically for x86 and some others) : CPU architecture can handle misaligned
  * loads/stores _WAVE_HAVE_JUDY : use Judy arrays instead of Jenkins (undefine if LGPL is not acceptable)
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* fopencookie() for fstReaderClone() */
+#endif
+
 #ifndef FST_CONFIG_INCLUDE
 #define FST_CONFIG_INCLUDE <config.h>
 #endif
@@ -51,9 +59,10 @@
 
 #ifndef HAVE_LIBPTHREAD
 #undef FST_WRITER_PARALLEL
+#undef FST_READER_PARALLEL
 #endif
 
-#ifdef FST_WRITER_PARALLEL
+#if defined(FST_WRITER_PARALLEL) || defined(FST_READER_PARALLEL)
 #include <pthread.h>
 #endif
 
@@ -118,6 +127,12 @@ void **JenkinsIns(void *base_i, const unsigned char *mem, uint32_t length, uint3
 #define FST_ACTIVATE_HUGE_BREAK (1000000)
 #define FST_ACTIVATE_HUGE_INC (1000000)
 
+/* parallel chain packing: handles are split into this many runs per worker */
+/* so that threads finishing early can pick up more work, small designs are */
+/* packed serially as thread startup would dominate.                        */
+#define FST_WRITER_PACK_CHUNKS_PER_THREAD (16)
+#define FST_WRITER_PACK_MIN_HANDLES (1024)
+
 #define FST_WRITER_STR "fstWriter"
 #define FST_ID_NAM_SIZ (512)
 #define FST_ID_NAM_ATTR_SIZ (65536 + 4096)
@@ -127,6 +142,22 @@ void **JenkinsIns(void *base_i, const unsigned char *mem, uint32_t length, uint3
 #define FST_HDR_FILETYPE_SIZE (1)
 #define FST_HDR_TIMEZERO_SIZE (8)
 #define FST_GZIO_LEN (32768)
+#define FST_ZWRAPPER_CHUNK_LEN (32 * 1024) /* uncompressed bytes per FST_BL_ZWRAPPER_CHUNKED member */
+#define FST_ZWRAPPER_CHUNKS_PER_THREAD (32) /* members read and compressed per worker between writes */
+
+/* writer scratch files which fstWriterSetScratchInMemory() can keep in memory */
+#define FST_SCRATCH_HIER (1)
+#define FST_SCRATCH_GEOM (2)
+#define FST_SCRATCH_VALPOS (4)
+#define FST_SCRATCH_CURVAL (8)
+#define FST_SCRATCH_TCHN (16)
+
+/* summary pyramid sidecar written by fstReaderWriteSummary() */
+#define FST_SUMMARY_MAGIC "FSTSUM1\n"
+#define FST_SUMMARY_AUTO_BUCKETS (1024) /* level 0 buckets across the dump when no base shift is given */
+#define FST_SUMMARY_F_XZ (1)             /* a value with non 0/1 bits was taken in the bucket */
+#define FST_SUMMARY_F_FIRST (2)          /* the first value field is valid */
+
 #define FST_HDR_FOURPACK_DUO_SIZE (4 * 1024 * 1024)
 
 #if defined(__i386__) || defined(__x86_64__) || defined(_AIX)
@@ -148,6 +179,13 @@ void **JenkinsIns(void *base_i, const unsigned char *mem, uint32_t length, uint3
 #define FST_UNLIKELY(x) (!!(x))
 #endif
 
+/* batch varint decoding, see fstGetVarint64Batch() */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(FST_VARINT_SIMD_DISABLE) && \
+        (defined(__clang__) || (__GNUC__ >= 5))
+#define FST_VARINT_SIMD
+#include <immintrin.h>
+#endif
+
 #define FST_APIMESS "FSTAPI  | "
 
 /***********************/
@@ -342,6 +380,33 @@ static void *fstMmap2(size_t __len, int __fd, fst_off_t __off)
     }
 #endif
 
+/*
+ * memory backed scratch files: these still have a descriptor, so the writer can
+ * mmap them exactly as it does its disk temp files
+ */
+#if defined(__linux__) && defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 27)))
+#define FST_HAVE_MEMFD
+static FILE *tmpfile_open_mem(char **nam)
+{
+    int fd = memfd_create("fstWriter", MFD_CLOEXEC);
+    FILE *f = (fd >= 0) ? fdopen(fd, "w+b") : NULL;
+
+    if (!f) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return (tmpfile_open(nam)); /* kernel without memfd support */
+    }
+
+    if (nam) {
+        *nam = NULL;
+    }
+    return (f);
+}
+#else
+#define tmpfile_open_mem(nam) tmpfile_open(nam)
+#endif
+
 /*
  * regular and variable-length integer access functions
  */
@@ -391,6 +456,19 @@ static uint64_t fstReaderUint64(FILE *f)
     return (val);
 }
 
+static uint64_t fstGetUint64(unsigned char *mem)
+{
+    uint64_t val = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(uint64_t); i++) {
+        val <<= 8;
+        val |= mem[i];
+    }
+
+    return (val);
+}
+
 static uint32_t fstGetVarint32(unsigned char *mem, int *skiplen)
 {
     unsigned char *mem_orig = mem;
@@ -624,6 +702,160 @@ static int64_t fstGetSVarint64(unsigned char *mem, int *skiplen)
     return (rc);
 }
 
+/*
+ * single pass decode of the varint at *memp for the batch decoders, *memp is
+ * advanced past it
+ */
+static uint64_t fstGetVarint64Next(unsigned char **memp)
+{
+    unsigned char *mem = *memp;
+    uint64_t rc = *(mem++);
+
+    if (rc & 0x80) {
+        int shift = 7;
+
+        rc &= 0x7f;
+        do {
+            rc |= (uint64_t)(*mem & 0x7f) << shift;
+            shift += 7;
+        } while (*(mem++) & 0x80);
+    }
+
+    *memp = mem;
+    return (rc);
+}
+
+static uint64_t fstGetVarint64BatchScalar(unsigned char **memp, unsigned char *mem_end, uint64_t *out,
+                                          unsigned char *lens, uint64_t count)
+{
+    unsigned char *mem = *memp;
+    uint64_t n;
+
+    for (n = 0; (n < count) && (mem < mem_end); n++) {
+        unsigned char *mem_orig = mem;
+
+        out[n] = fstGetVarint64Next(&mem);
+        if (lens) {
+            lens[n] = mem - mem_orig;
+        }
+    }
+
+    *memp = mem;
+    return (n);
+}
+
+#ifdef FST_VARINT_SIMD
+/*
+ * a block whose high bits are all clear holds nothing but single byte varints and
+ * is widened directly, any other block is walked a varint at a time
+ */
+static uint64_t fstGetVarint64BatchSse2(unsigned char **memp, unsigned char *mem_end, uint64_t *out,
+                                        unsigned char *lens, uint64_t count)
+{
+    unsigned char *mem = *memp;
+    uint64_t n = 0;
+    const __m128i zero = _mm_setzero_si128();
+
+    while ((n < count) && (mem_end - mem >= 16)) {
+        __m128i b = _mm_loadu_si128((const __m128i *)mem);
+        unsigned int cont = _mm_movemask_epi8(b);
+        unsigned char *blk_end;
+
+        if ((!cont) && (count - n >= 16)) {
+            __m128i lo = _mm_unpacklo_epi8(b, zero);
+            __m128i hi = _mm_unpackhi_epi8(b, zero);
+            __m128i w;
+
+            w = _mm_unpacklo_epi16(lo, zero);
+            _mm_storeu_si128((__m128i *)(out + n), _mm_unpacklo_epi32(w, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 2), _mm_unpackhi_epi32(w, zero));
+            w = _mm_unpackhi_epi16(lo, zero);
+            _mm_storeu_si128((__m128i *)(out + n + 4), _mm_unpacklo_epi32(w, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 6), _mm_unpackhi_epi32(w, zero));
+            w = _mm_unpacklo_epi16(hi, zero);
+            _mm_storeu_si128((__m128i *)(out + n + 8), _mm_unpacklo_epi32(w, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 10), _mm_unpackhi_epi32(w, zero));
+            w = _mm_unpackhi_epi16(hi, zero);
+            _mm_storeu_si128((__m128i *)(out + n + 12), _mm_unpacklo_epi32(w, zero));
+            _mm_storeu_si128((__m128i *)(out + n + 14), _mm_unpackhi_epi32(w, zero));
+
+            if (lens) {
+                memset(lens + n, 1, 16);
+            }
+            mem += 16;
+            n += 16;
+            continue;
+        }
+
+        blk_end = (mem_end - mem > 64) ? (mem + 64) : mem_end;
+        n += fstGetVarint64BatchScalar(&mem, blk_end, out + n, lens ? (lens + n) : NULL, count - n);
+    }
+
+    *memp = mem;
+    return (n + fstGetVarint64BatchScalar(memp, mem_end, out + n, lens ? (lens + n) : NULL, count - n));
+}
+
+__attribute__((target("avx2"))) static uint64_t fstGetVarint64BatchAvx2(unsigned char **memp, unsigned char *mem_end,
+                                                                        uint64_t *out, unsigned char *lens,
+                                                                        uint64_t count)
+{
+    unsigned char *mem = *memp;
+    uint64_t n = 0;
+
+    while ((n < count) && (mem_end - mem >= 32)) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)mem);
+        unsigned int cont = _mm256_movemask_epi8(b);
+        unsigned char *blk_end;
+
+        if ((!cont) && (count - n >= 32)) {
+            __m128i lo = _mm256_castsi256_si128(b);
+            __m128i hi = _mm256_extracti128_si256(b, 1);
+
+            _mm256_storeu_si256((__m256i *)(out + n), _mm256_cvtepu8_epi64(lo));
+            _mm256_storeu_si256((__m256i *)(out + n + 4), _mm256_cvtepu8_epi64(_mm_srli_si128(lo, 4)));
+            _mm256_storeu_si256((__m256i *)(out + n + 8), _mm256_cvtepu8_epi64(_mm_srli_si128(lo, 8)));
+            _mm256_storeu_si256((__m256i *)(out + n + 12), _mm256_cvtepu8_epi64(_mm_srli_si128(lo, 12)));
+            _mm256_storeu_si256((__m256i *)(out + n + 16), _mm256_cvtepu8_epi64(hi));
+            _mm256_storeu_si256((__m256i *)(out + n + 20), _mm256_cvtepu8_epi64(_mm_srli_si128(hi, 4)));
+            _mm256_storeu_si256((__m256i *)(out + n + 24), _mm256_cvtepu8_epi64(_mm_srli_si128(hi, 8)));
+            _mm256_storeu_si256((__m256i *)(out + n + 28), _mm256_cvtepu8_epi64(_mm_srli_si128(hi, 12)));
+
+            if (lens) {
+                memset(lens + n, 1, 32);
+            }
+            mem += 32;
+            n += 32;
+            continue;
+        }
+
+        blk_end = (mem_end - mem > 128) ? (mem + 128) : mem_end;
+        n += fstGetVarint64BatchScalar(&mem, blk_end, out + n, lens ? (lens + n) : NULL, count - n);
+    }
+
+    *memp = mem;
+    return (n + fstGetVarint64BatchSse2(memp, mem_end, out + n, lens ? (lens + n) : NULL, count - n));
+}
+#endif
+
+/*
+ * decodes up to count varints starting at *memp and ending before mem_end into
+ * out, advancing *memp past them and returning how many were decoded.  lens, if
+ * not NULL, receives the byte length of each one.  on x86-64 blocks are scanned
+ * with AVX2 when the CPU has it, otherwise with SSE2.
+ */
+static uint64_t fstGetVarint64Batch(unsigned char **memp, unsigned char *mem_end, uint64_t *out, unsigned char *lens,
+                                    uint64_t count)
+{
+#ifdef FST_VARINT_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return (fstGetVarint64BatchAvx2(memp, mem_end, out, lens, count));
+    }
+    return (fstGetVarint64BatchSse2(memp, mem_end, out, lens, count));
+#else
+    return (fstGetVarint64BatchScalar(memp, mem_end, out, lens, count));
+#endif
+}
+
 #ifndef FST_DYNAMIC_ALIAS2_DISABLE
 static int fstWriterSVarint(FILE *handle, int64_t v)
 {
@@ -720,13 +952,12 @@ struct fstWriterContext
     unsigned char filetype; /* default is 0, FST_FT_VERILOG */
 
     unsigned compress_hier : 1;
-    unsigned repack_on_close : 1;
+    unsigned repack_on_close : 2; /* fstWriterSetRepackOnClose() type */
     unsigned skip_writing_section_hdr : 1;
     unsigned size_limit_locked : 1;
     unsigned section_header_only : 1;
     unsigned flush_context_pending : 1;
     unsigned parallel_enabled : 1;
-    unsigned parallel_was_enabled : 1;
 
     /* should really be semaphores, but are bytes to cut down on read-modify-write window size */
     unsigned char already_in_flush; /* in case control-c handlers interrupt */
@@ -734,11 +965,29 @@ struct fstWriterContext
 
 #ifdef FST_WRITER_PARALLEL
     pthread_mutex_t mutex;
+    pthread_cond_t flush_cond; /* flush thread waits here for work */
+    pthread_cond_t idle_cond;  /* writer waits here for the flush thread to finish */
     pthread_t thread;
-    pthread_attr_t thread_attr;
     struct fstWriterContext *xc_parent;
+    struct fstWriterContext *xc_flush; /* snapshot of the section being written by the flush thread */
+
+    /* second buffer set, swapped with the active one on every parallel flush */
+    unsigned char *vchg_mem_spare;
+    uint32_t vchg_alloc_siz_spare;
+    uint32_t *valpos_mem_spare;
+    uint32_t *valpos_mem_mapped;
+#ifdef FST_REMOVE_DUPLICATE_VC
+    unsigned char *curval_mem_spare;
+#endif
+    FILE *tchn_handle_spare;
+    char *tchn_handle_nam_spare;
+
+    /* not bitfields as these are shared with the flush thread */
+    unsigned char in_pthread;
+    unsigned char flush_thread_exit;
+    unsigned char flush_thread_running;
 #endif
-    unsigned in_pthread : 1;
+    unsigned int pack_threads;
 
     size_t fst_orig_break_size;
     size_t fst_orig_break_add_size;
@@ -760,6 +1009,9 @@ struct fstWriterContext
     char *curval_handle_nam;
     char *tchn_handle_nam;
 
+    uint64_t scratch_spill;       /* fstWriterSetScratchInMemory() threshold per file, 0 = never */
+    unsigned char scratch_in_mem; /* FST_SCRATCH_* files currently held in memory */
+
     fstEnumHandle max_enumhandle;
 };
 
@@ -804,6 +1056,93 @@ static uint32_t fstWriterUint32WithVarint32(struct fstWriterContext *xc, uint32_
     return (len);
 }
 
+#ifndef FST_REMOVE_DUPLICATE_VC
+/*
+ * vectors (len > 1) which are entirely 0/1 are kept bit-packed in vchg_mem,
+ * MSB first with the last byte zero padded, which is exactly how the chains
+ * store them.  the low bit of the time delta varint flags a packed record.
+ * flagpnt is the first byte of that varint: it is written with the flag set
+ * and cleared here if the value turns out to need the byte per bit form.
+ */
+static unsigned char *fstWriterStoreVector(unsigned char *pnt, unsigned char *flagpnt, const unsigned char *buf,
+                                           uint32_t len)
+{
+    unsigned char *dst = pnt;
+    unsigned char acc;
+    uint32_t i, rem;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        const unsigned char *b = buf + i;
+        unsigned char v0 = b[0] ^ '0', v1 = b[1] ^ '0', v2 = b[2] ^ '0', v3 = b[3] ^ '0';
+        unsigned char v4 = b[4] ^ '0', v5 = b[5] ^ '0', v6 = b[6] ^ '0', v7 = b[7] ^ '0';
+
+        if (FST_UNLIKELY((v0 | v1 | v2 | v3 | v4 | v5 | v6 | v7) > 1)) /* neither '0' nor '1' */
+        {
+            goto unpackable;
+        }
+        *(dst++) = (v0 << 7) | (v1 << 6) | (v2 << 5) | (v3 << 4) | (v4 << 3) | (v5 << 2) | (v6 << 1) | v7;
+    }
+
+    rem = len - i;
+    if (rem) {
+        acc = 0;
+        for (; i < len; i++) {
+            unsigned char v = buf[i] ^ '0';
+            if (FST_UNLIKELY(v > 1)) {
+                goto unpackable;
+            }
+            acc = (acc << 1) | v;
+        }
+        *(dst++) = acc << (8 - rem);
+    }
+
+    return (dst);
+
+unpackable:
+    *flagpnt &= ~1;
+    memcpy(pnt, buf, len);
+    return (pnt + len);
+}
+
+static uint32_t fstWriterUint32WithVarint32Vector(struct fstWriterContext *xc, uint32_t *u, uint32_t v,
+                                                  const void *dbuf, uint32_t siz)
+{
+    unsigned char *buf = xc->vchg_mem + xc->vchg_siz;
+    unsigned char *pnt = buf;
+    unsigned char *flagpnt;
+    uint32_t nxt;
+
+#ifdef FST_DO_MISALIGNED_OPS
+    (*(uint32_t *)(pnt)) = (*(uint32_t *)(u));
+#else
+    memcpy(pnt, u, sizeof(uint32_t));
+#endif
+    pnt += 4;
+
+    flagpnt = pnt;
+    v = (v << 1) | 1;
+    while ((nxt = v >> 7)) {
+        *(pnt++) = ((unsigned char)v) | 0x80;
+        v = nxt;
+    }
+    *(pnt++) = (unsigned char)v;
+
+    pnt = fstWriterStoreVector(pnt, flagpnt, (const unsigned char *)dbuf, siz);
+    return (pnt - buf);
+}
+#endif
+
+#ifndef FST_REMOVE_DUPLICATE_VC
+static void fstWriterUnpackVector(unsigned char *dst, const unsigned char *src, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = '0' + ((src[i >> 3] >> (7 - (i & 7))) & 1);
+    }
+}
+#endif
+
 static uint32_t fstWriterUint32WithVarint32AndLength(struct fstWriterContext *xc, uint32_t *u, uint32_t v,
                                                      const void *dbuf, uint32_t siz)
 {
@@ -921,9 +1260,31 @@ static void fstWriterMmapSanity(void *pnt, const char *file, int line, const cha
 #endif
 }
 
+#ifdef FST_WRITER_PARALLEL
+/*
+ * blocks until the flush thread has finished writing its section, after which
+ * the output file and the spare buffers can be touched again
+ */
+static void fstWriterFlushWait(struct fstWriterContext *xc)
+{
+    if (xc->flush_thread_running) {
+        pthread_mutex_lock(&xc->mutex);
+        while (xc->in_pthread) {
+            pthread_cond_wait(&xc->idle_cond, &xc->mutex);
+        }
+        pthread_mutex_unlock(&xc->mutex);
+    }
+}
+#endif
+
 static void fstWriterCreateMmaps(struct fstWriterContext *xc)
 {
-    fst_off_t curpos = ftello(xc->handle);
+    fst_off_t curpos;
+
+#ifdef FST_WRITER_PARALLEL
+    fstWriterFlushWait(xc);
+#endif
+    curpos = ftello(xc->handle);
 
     fflush(xc->hier_handle);
 
@@ -949,6 +1310,9 @@ static void fstWriterCreateMmaps(struct fstWriterContext *xc)
                                                                      fileno(xc->valpos_handle), 0),
                                 __FILE__, __LINE__, "xc->valpos_mem");
         }
+#ifdef FST_WRITER_PARALLEL
+        xc->valpos_mem_mapped = xc->valpos_mem;
+#endif
     }
     if (!xc->curval_mem) {
         fflush(xc->curval_handle);
@@ -967,6 +1331,24 @@ static void fstDestroyMmaps(struct fstWriterContext *xc, int is_closing)
     (void)is_closing;
 #endif
 
+#ifdef FST_WRITER_PARALLEL
+    fstWriterFlushWait(xc);
+    if (xc->valpos_mem_spare) {
+        if (xc->valpos_mem != xc->valpos_mem_mapped) /* keep chain state of the active set in the mapping */
+        {
+            memcpy(xc->valpos_mem_mapped, xc->valpos_mem, xc->maxhandle * 4 * sizeof(uint32_t));
+            xc->valpos_mem_spare = xc->valpos_mem;
+            xc->valpos_mem = xc->valpos_mem_mapped;
+        }
+        free(xc->valpos_mem_spare);
+        xc->valpos_mem_spare = NULL;
+    }
+#ifdef FST_REMOVE_DUPLICATE_VC
+    free(xc->curval_mem_spare);
+    xc->curval_mem_spare = NULL;
+#endif
+#endif
+
     fstMunmap(xc->valpos_mem, xc->maxhandle * 4 * sizeof(uint32_t));
     xc->valpos_mem = NULL;
 
@@ -1069,6 +1451,67 @@ static void fstDetermineBreakSize(struct fstWriterContext *xc)
     xc->next_huge_break = FST_ACTIVATE_HUGE_BREAK;
 }
 
+/*
+ * copies a scratch file into a fresh memory backed or disk one, keeping its position
+ */
+static void fstWriterScratchMove(struct fstWriterContext *xc, FILE **fh, char **nam, int to_mem)
+{
+    char *nnam = NULL;
+    FILE *nf = to_mem ? tmpfile_open_mem(&nnam) : tmpfile_open(&nnam);
+    char buf[FST_GZIO_LEN];
+    fst_off_t pos, len, offs;
+
+    if (!nf) {
+        return; /* keep using the old one */
+    }
+
+    fflush(*fh);
+    pos = ftello(*fh);
+    fstWriterFseeko(xc, *fh, 0, SEEK_END);
+    len = ftello(*fh);
+    fstWriterFseeko(xc, *fh, 0, SEEK_SET);
+    for (offs = 0; offs < len; offs += FST_GZIO_LEN) {
+        size_t this_len = ((len - offs) > FST_GZIO_LEN) ? FST_GZIO_LEN : (len - offs);
+        fstFread(buf, this_len, 1, *fh);
+        fstFwrite(buf, this_len, 1, nf);
+    }
+    fflush(nf);
+    fstWriterFseeko(xc, nf, pos, SEEK_SET);
+
+    tmpfile_close(fh, nam);
+    *fh = nf;
+    if (nam) {
+        *nam = nnam;
+    } else {
+        free(nnam);
+    }
+}
+
+/*
+ * moves memory backed scratch files which have outgrown the spill threshold to disk,
+ * the mmaps must not be active
+ */
+static void fstWriterScratchSpill(struct fstWriterContext *xc)
+{
+    if ((xc->scratch_in_mem & FST_SCRATCH_HIER) && ((uint64_t)xc->hier_file_len > xc->scratch_spill)) {
+        fstWriterScratchMove(xc, &xc->hier_handle, NULL, 0);
+        xc->scratch_in_mem &= ~FST_SCRATCH_HIER;
+    }
+
+    /* geom grows in step with valpos at a fraction of its size so goes along with it */
+    if ((xc->scratch_in_mem & FST_SCRATCH_VALPOS) &&
+        ((uint64_t)xc->maxhandle * 4 * sizeof(uint32_t) > xc->scratch_spill)) {
+        fstWriterScratchMove(xc, &xc->geom_handle, &xc->geom_handle_nam, 0);
+        fstWriterScratchMove(xc, &xc->valpos_handle, &xc->valpos_handle_nam, 0);
+        xc->scratch_in_mem &= ~(FST_SCRATCH_GEOM | FST_SCRATCH_VALPOS);
+    }
+
+    if ((xc->scratch_in_mem & FST_SCRATCH_CURVAL) && ((uint64_t)xc->maxvalpos > xc->scratch_spill)) {
+        fstWriterScratchMove(xc, &xc->curval_handle, &xc->curval_handle_nam, 0);
+        xc->scratch_in_mem &= ~FST_SCRATCH_CURVAL;
+    }
+}
+
 /*
  * file creation and close
  */
@@ -1106,8 +1549,6 @@ void *fstWriterCreate(const char *nam, int use_compressed_hier)
             xc->nan = strtod("NaN", NULL);
 #ifdef FST_WRITER_PARALLEL
             pthread_mutex_init(&xc->mutex, NULL);
-            pthread_attr_init(&xc->thread_attr);
-            pthread_attr_setdetachstate(&xc->thread_attr, PTHREAD_CREATE_DETACHED);
 #endif
         } else {
             fclose(xc->handle);
@@ -1181,328 +1622,495 @@ static void fstWriterEmitSectionHeader(void *ctx)
 }
 
 /*
- * only to be called directly by fst code...otherwise must
- * be synced up with time changes
+ * builds the value change chain for a single handle right-to-left so that it
+ * ends at scratchend, returns the start of the chain
  */
-#ifdef FST_WRITER_PARALLEL
-static void fstWriterFlushContextPrivate2(void *ctx)
-#else
-static void fstWriterFlushContextPrivate(void *ctx)
-#endif
+static unsigned char *fstWriterBuildChain(struct fstWriterContext *xc, uint32_t *vm4ip, unsigned char *scratchend)
 {
-#ifdef FST_DEBUG
-    int cnt = 0;
-#endif
-    unsigned int i;
-    unsigned char *vchg_mem;
-    FILE *f;
-    fst_off_t fpos, indxpos, endpos;
-    uint32_t prevpos;
-    int zerocnt;
-    unsigned char *scratchpad;
-    unsigned char *scratchpnt;
-    unsigned char *tmem;
-    fst_off_t tlen;
-    fst_off_t unc_memreq = 0; /* for reader */
-    unsigned char *packmem;
-    unsigned int packmemlen;
-    uint32_t *vm4ip;
-    struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
-#ifdef FST_WRITER_PARALLEL
-    struct fstWriterContext *xc2 = xc->xc_parent;
-#else
-    struct fstWriterContext *xc2 = xc;
-#endif
+    unsigned char *vchg_mem = xc->vchg_mem;
+    unsigned char *scratchpnt = scratchend; /* build this buffer backwards */
+    uint32_t offs = vm4ip[2];
+    uint32_t next_offs;
+    unsigned int wrlen;
 
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-    Pvoid_t PJHSArray = (Pvoid_t)NULL;
-#ifndef _WAVE_HAVE_JUDY
-    uint32_t hashmask = xc->maxhandle;
-    hashmask |= hashmask >> 1;
-    hashmask |= hashmask >> 2;
-    hashmask |= hashmask >> 4;
-    hashmask |= hashmask >> 8;
-    hashmask |= hashmask >> 16;
-#endif
+    if (vm4ip[1] <= 1) {
+        if (vm4ip[1] == 1) {
+            wrlen = fstGetVarint32Length(vchg_mem + offs + 4); /* used to advance and determine wrlen */
+#ifndef FST_REMOVE_DUPLICATE_VC
+            xc->curval_mem[vm4ip[0]] = vchg_mem[offs + 4 + wrlen]; /* checkpoint variable */
 #endif
+            while (offs) {
+                unsigned char val;
+                uint32_t time_delta, rcv;
+                next_offs = fstGetUint32(vchg_mem + offs);
+                offs += 4;
+
+                time_delta = fstGetVarint32(vchg_mem + offs, (int *)&wrlen);
+                val = vchg_mem[offs + wrlen];
+                offs = next_offs;
+
+                switch (val) {
+                case '0':
+                case '1':
+                    rcv = ((val & 1) << 1) | (time_delta << 2);
+                    break; /* pack more delta bits in for 0/1 vchs */
+
+                case 'x':
+                case 'X':
+                    rcv = FST_RCV_X | (time_delta << 4);
+                    break;
+                case 'z':
+                case 'Z':
+                    rcv = FST_RCV_Z | (time_delta << 4);
+                    break;
+                case 'h':
+                case 'H':
+                    rcv = FST_RCV_H | (time_delta << 4);
+                    break;
+                case 'u':
+                case 'U':
+                    rcv = FST_RCV_U | (time_delta << 4);
+                    break;
+                case 'w':
+                case 'W':
+                    rcv = FST_RCV_W | (time_delta << 4);
+                    break;
+                case 'l':
+                case 'L':
+                    rcv = FST_RCV_L | (time_delta << 4);
+                    break;
+                default:
+                    rcv = FST_RCV_D | (time_delta << 4);
+                    break;
+                }
 
-    if ((xc->vchg_siz <= 1) || (xc->already_in_flush))
-        return;
-    xc->already_in_flush = 1; /* should really do this with a semaphore */
-
-    xc->section_header_only = 0;
-    scratchpad = (unsigned char *)malloc(xc->vchg_siz);
-
-    vchg_mem = xc->vchg_mem;
-
-    f = xc->handle;
-    fstWriterVarint(f, xc->maxhandle); /* emit current number of handles */
-    fputc(xc->fourpack ? '4' : (xc->fastpack ? 'F' : 'Z'), f);
-    fpos = 1;
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt, rcv);
+            }
+        } else {
+            /* variable length */
+            /* fstGetUint32 (next_offs) + fstGetVarint32 (time_delta) + fstGetVarint32 (len) + payload */
+            unsigned char *pnt;
+            uint32_t record_len;
+            uint32_t time_delta;
+
+            while (offs) {
+                next_offs = fstGetUint32(vchg_mem + offs);
+                offs += 4;
+                pnt = vchg_mem + offs;
+                offs = next_offs;
+                time_delta = fstGetVarint32(pnt, (int *)&wrlen);
+                pnt += wrlen;
+                record_len = fstGetVarint32(pnt, (int *)&wrlen);
+                pnt += wrlen;
+
+                scratchpnt -= record_len;
+                memcpy(scratchpnt, pnt, record_len);
+
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt, record_len);
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt,
+                                                   (time_delta << 1)); /* reserve | 1 case for future expansion */
+            }
+        }
+    } else {
+#ifndef FST_REMOVE_DUPLICATE_VC
+        uint32_t packed_len = (vm4ip[1] + 7) >> 3;
 
-    packmemlen = 1024;                             /* maintain a running "longest" allocation to */
-    packmem = (unsigned char *)malloc(packmemlen); /* prevent continual malloc...free every loop iter */
+        if (fstGetVarint32(vchg_mem + offs + 4, (int *)&wrlen) & 1) {
+            fstWriterUnpackVector(xc->curval_mem + vm4ip[0], vchg_mem + offs + 4 + wrlen,
+                                  vm4ip[1]); /* checkpoint variable */
+        } else {
+            memcpy(xc->curval_mem + vm4ip[0], vchg_mem + offs + 4 + wrlen, vm4ip[1]); /* checkpoint variable */
+        }
+#endif
+        while (offs) {
+            unsigned int idx;
+            char is_binary = 1;
+            unsigned char *pnt;
+            uint32_t time_delta;
 
-    for (i = 0; i < xc->maxhandle; i++) {
-        vm4ip = &(xc->valpos_mem[4 * i]);
+            next_offs = fstGetUint32(vchg_mem + offs);
+            offs += 4;
 
-        if (vm4ip[2]) {
-            uint32_t offs = vm4ip[2];
-            uint32_t next_offs;
-            unsigned int wrlen;
+            time_delta = fstGetVarint32(vchg_mem + offs, (int *)&wrlen);
 
-            vm4ip[2] = fpos;
+            pnt = vchg_mem + offs + wrlen;
+            offs = next_offs;
 
-            scratchpnt = scratchpad + xc->vchg_siz; /* build this buffer backwards */
-            if (vm4ip[1] <= 1) {
-                if (vm4ip[1] == 1) {
-                    wrlen = fstGetVarint32Length(vchg_mem + offs + 4); /* used to advance and determine wrlen */
 #ifndef FST_REMOVE_DUPLICATE_VC
-                    xc->curval_mem[vm4ip[0]] = vchg_mem[offs + 4 + wrlen]; /* checkpoint variable */
-#endif
-                    while (offs) {
-                        unsigned char val;
-                        uint32_t time_delta, rcv;
-                        next_offs = fstGetUint32(vchg_mem + offs);
-                        offs += 4;
-
-                        time_delta = fstGetVarint32(vchg_mem + offs, (int *)&wrlen);
-                        val = vchg_mem[offs + wrlen];
-                        offs = next_offs;
-
-                        switch (val) {
-                        case '0':
-                        case '1':
-                            rcv = ((val & 1) << 1) | (time_delta << 2);
-                            break; /* pack more delta bits in for 0/1 vchs */
-
-                        case 'x':
-                        case 'X':
-                            rcv = FST_RCV_X | (time_delta << 4);
-                            break;
-                        case 'z':
-                        case 'Z':
-                            rcv = FST_RCV_Z | (time_delta << 4);
-                            break;
-                        case 'h':
-                        case 'H':
-                            rcv = FST_RCV_H | (time_delta << 4);
-                            break;
-                        case 'u':
-                        case 'U':
-                            rcv = FST_RCV_U | (time_delta << 4);
-                            break;
-                        case 'w':
-                        case 'W':
-                            rcv = FST_RCV_W | (time_delta << 4);
-                            break;
-                        case 'l':
-                        case 'L':
-                            rcv = FST_RCV_L | (time_delta << 4);
-                            break;
-                        default:
-                            rcv = FST_RCV_D | (time_delta << 4);
-                            break;
-                        }
+            if (time_delta & 1) /* already packed on emit */
+            {
+                scratchpnt -= packed_len;
+                memcpy(scratchpnt, pnt, packed_len);
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt, (time_delta & ~1));
+                continue;
+            }
+#endif
+            time_delta >>= 1;
 
-                        scratchpnt = fstCopyVarint32ToLeft(scratchpnt, rcv);
-                    }
+            for (idx = 0; idx < vm4ip[1]; idx++) {
+                if ((pnt[idx] == '0') || (pnt[idx] == '1')) {
+                    continue;
                 } else {
-                    /* variable length */
-                    /* fstGetUint32 (next_offs) + fstGetVarint32 (time_delta) + fstGetVarint32 (len) + payload */
-                    unsigned char *pnt;
-                    uint32_t record_len;
-                    uint32_t time_delta;
-
-                    while (offs) {
-                        next_offs = fstGetUint32(vchg_mem + offs);
-                        offs += 4;
-                        pnt = vchg_mem + offs;
-                        offs = next_offs;
-                        time_delta = fstGetVarint32(pnt, (int *)&wrlen);
-                        pnt += wrlen;
-                        record_len = fstGetVarint32(pnt, (int *)&wrlen);
-                        pnt += wrlen;
-
-                        scratchpnt -= record_len;
-                        memcpy(scratchpnt, pnt, record_len);
-
-                        scratchpnt = fstCopyVarint32ToLeft(scratchpnt, record_len);
-                        scratchpnt = fstCopyVarint32ToLeft(
-                                scratchpnt, (time_delta << 1)); /* reserve | 1 case for future expansion */
-                    }
+                    is_binary = 0;
+                    break;
+                }
+            }
+
+            if (is_binary) {
+                unsigned char acc = 0;
+                /* new algorithm */
+                idx = ((vm4ip[1] + 7) & ~7);
+                switch (vm4ip[1] & 7) {
+                case 0:
+                    do {
+                        acc = (pnt[idx + 7 - 8] & 1) << 0; /* fallthrough */
+                    case 7:
+                        acc |= (pnt[idx + 6 - 8] & 1) << 1; /* fallthrough */
+                    case 6:
+                        acc |= (pnt[idx + 5 - 8] & 1) << 2; /* fallthrough */
+                    case 5:
+                        acc |= (pnt[idx + 4 - 8] & 1) << 3; /* fallthrough */
+                    case 4:
+                        acc |= (pnt[idx + 3 - 8] & 1) << 4; /* fallthrough */
+                    case 3:
+                        acc |= (pnt[idx + 2 - 8] & 1) << 5; /* fallthrough */
+                    case 2:
+                        acc |= (pnt[idx + 1 - 8] & 1) << 6; /* fallthrough */
+                    case 1:
+                        acc |= (pnt[idx + 0 - 8] & 1) << 7;
+                        *(--scratchpnt) = acc;
+                        idx -= 8;
+                    } while (idx);
                 }
+
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt, (time_delta << 1));
             } else {
-                wrlen = fstGetVarint32Length(vchg_mem + offs + 4); /* used to advance and determine wrlen */
-#ifndef FST_REMOVE_DUPLICATE_VC
-                memcpy(xc->curval_mem + vm4ip[0], vchg_mem + offs + 4 + wrlen, vm4ip[1]); /* checkpoint variable */
-#endif
-                while (offs) {
-                    unsigned int idx;
-                    char is_binary = 1;
-                    unsigned char *pnt;
-                    uint32_t time_delta;
+                scratchpnt -= vm4ip[1];
+                memcpy(scratchpnt, pnt, vm4ip[1]);
 
-                    next_offs = fstGetUint32(vchg_mem + offs);
-                    offs += 4;
+                scratchpnt = fstCopyVarint32ToLeft(scratchpnt, (time_delta << 1) | 1);
+            }
+        }
+    }
 
-                    time_delta = fstGetVarint32(vchg_mem + offs, (int *)&wrlen);
+    return (scratchpnt);
+}
 
-                    pnt = vchg_mem + offs + wrlen;
-                    offs = next_offs;
+/*
+ * compresses a value change chain if it is worthwhile.  returns the bytes to write
+ * along with their length (*wlen) and the uncompressed length (*uclen) to emit ahead
+ * of them, where zero indicates that the chain is stored as-is
+ */
+static unsigned char *fstWriterPackChain(struct fstWriterContext *xc, unsigned char *scratchpnt, unsigned int wrlen,
+                                         unsigned char **packmem, unsigned int *packmemlen, unsigned int *wlen,
+                                         unsigned int *uclen)
+{
+    if (wrlen > 32) {
+        unsigned long destlen = wrlen;
+        unsigned char *dmem;
+        unsigned int rc;
 
-                    for (idx = 0; idx < vm4ip[1]; idx++) {
-                        if ((pnt[idx] == '0') || (pnt[idx] == '1')) {
-                            continue;
-                        } else {
-                            is_binary = 0;
-                            break;
-                        }
-                    }
+        if (!xc->fastpack) {
+            if (wrlen <= *packmemlen) {
+                dmem = *packmem;
+            } else {
+                free(*packmem);
+                dmem = *packmem = (unsigned char *)malloc(compressBound(*packmemlen = wrlen));
+            }
 
-                    if (is_binary) {
-                        unsigned char acc = 0;
-                        /* new algorithm */
-                        idx = ((vm4ip[1] + 7) & ~7);
-                        switch (vm4ip[1] & 7) {
-                        case 0:
-                            do {
-                                acc = (pnt[idx + 7 - 8] & 1) << 0; /* fallthrough */
-                            case 7:
-                                acc |= (pnt[idx + 6 - 8] & 1) << 1; /* fallthrough */
-                            case 6:
-                                acc |= (pnt[idx + 5 - 8] & 1) << 2; /* fallthrough */
-                            case 5:
-                                acc |= (pnt[idx + 4 - 8] & 1) << 3; /* fallthrough */
-                            case 4:
-                                acc |= (pnt[idx + 3 - 8] & 1) << 4; /* fallthrough */
-                            case 3:
-                                acc |= (pnt[idx + 2 - 8] & 1) << 5; /* fallthrough */
-                            case 2:
-                                acc |= (pnt[idx + 1 - 8] & 1) << 6; /* fallthrough */
-                            case 1:
-                                acc |= (pnt[idx + 0 - 8] & 1) << 7;
-                                *(--scratchpnt) = acc;
-                                idx -= 8;
-                            } while (idx);
-                        }
+            rc = compress2(dmem, &destlen, scratchpnt, wrlen, 4);
+            if (rc == Z_OK) {
+                *wlen = destlen;
+                *uclen = wrlen;
+                return (dmem);
+            }
+        } else {
+            /* this is extremely conservative: fastlz needs +5% for worst case, lz4 needs siz+(siz/255)+16 */
+            if (((wrlen * 2) + 2) <= *packmemlen) {
+                dmem = *packmem;
+            } else {
+                free(*packmem);
+                dmem = *packmem = (unsigned char *)malloc(*packmemlen = (wrlen * 2) + 2);
+            }
 
-                        scratchpnt = fstCopyVarint32ToLeft(scratchpnt, (time_delta << 1));
-                    } else {
-                        scratchpnt -= vm4ip[1];
-                        memcpy(scratchpnt, pnt, vm4ip[1]);
+            rc = (xc->fourpack) ? LZ4_compress((char *)scratchpnt, (char *)dmem, wrlen)
+                                : fastlz_compress(scratchpnt, wrlen, dmem);
+            if (rc < destlen) {
+                *wlen = rc;
+                *uclen = wrlen;
+                return (dmem);
+            }
+        }
+    }
 
-                        scratchpnt = fstCopyVarint32ToLeft(scratchpnt, (time_delta << 1) | 1);
-                    }
-                }
+    *wlen = wrlen;
+    *uclen = 0;
+    return (scratchpnt);
+}
+
+#ifdef FST_WRITER_PARALLEL
+/*
+ * chains are built and compressed by a pool of workers, each grabbing runs of
+ * handles and appending (uclen, wlen, bytes) records to that run's buffer.
+ * dynamic alias detection and the actual writes are then done serially in
+ * handle order so the section is identical to one built by a single thread.
+ */
+struct fstWriterPackChunk
+{
+    unsigned char *mem;
+    size_t len;
+    size_t alloc;
+    fst_off_t unc_memreq;
+};
+
+struct fstWriterPackPool
+{
+    struct fstWriterContext *xc;
+    struct fstWriterPackChunk *chunks;
+    unsigned int num_chunks;
+    unsigned int chunk_siz;
+    unsigned int next_chunk;
+    pthread_mutex_t mutex;
+};
+
+static void fstWriterPackChunkAppend(struct fstWriterPackChunk *pc, unsigned int uclen, unsigned int wlen,
+                                     const unsigned char *wmem)
+{
+    size_t need = pc->len + 2 * sizeof(uint32_t) + wlen;
+    uint32_t hdr[2];
+
+    if (need > pc->alloc) {
+        pc->alloc = (need > 2 * pc->alloc) ? need : (2 * pc->alloc);
+        pc->mem = (unsigned char *)realloc(pc->mem, pc->alloc);
+    }
+
+    hdr[0] = uclen;
+    hdr[1] = wlen;
+    memcpy(pc->mem + pc->len, hdr, sizeof(hdr));
+    memcpy(pc->mem + pc->len + sizeof(hdr), wmem, wlen);
+    pc->len = need;
+}
+
+static void *fstWriterPackWorker(void *ctx)
+{
+    struct fstWriterPackPool *pool = (struct fstWriterPackPool *)ctx;
+    struct fstWriterContext *xc = pool->xc;
+    unsigned char *scratchpad = (unsigned char *)malloc(xc->vchg_siz);
+    unsigned int packmemlen = 1024;
+    unsigned char *packmem = (unsigned char *)malloc(packmemlen);
+
+    for (;;) {
+        struct fstWriterPackChunk *pc;
+        unsigned int c, i, iend;
+
+        pthread_mutex_lock(&pool->mutex);
+        c = pool->next_chunk++;
+        pthread_mutex_unlock(&pool->mutex);
+        if (c >= pool->num_chunks)
+            break;
+
+        pc = &pool->chunks[c];
+        i = c * pool->chunk_siz;
+        iend = i + pool->chunk_siz;
+        if (iend > xc->maxhandle)
+            iend = xc->maxhandle;
+
+        for (; i < iend; i++) {
+            uint32_t *vm4ip = &(xc->valpos_mem[4 * i]);
+
+            if (vm4ip[2]) {
+                unsigned char *scratchpnt = fstWriterBuildChain(xc, vm4ip, scratchpad + xc->vchg_siz);
+                unsigned int wrlen = scratchpad + xc->vchg_siz - scratchpnt;
+                unsigned int wlen, uclen;
+                unsigned char *wmem =
+                        fstWriterPackChain(xc, scratchpnt, wrlen, &packmem, &packmemlen, &wlen, &uclen);
+
+                pc->unc_memreq += wrlen;
+                fstWriterPackChunkAppend(pc, uclen, wlen, wmem);
             }
+        }
+    }
 
-            wrlen = scratchpad + xc->vchg_siz - scratchpnt;
-            unc_memreq += wrlen;
-            if (wrlen > 32) {
-                unsigned long destlen = wrlen;
-                unsigned char *dmem;
-                unsigned int rc;
+    free(packmem);
+    free(scratchpad);
+    return (NULL);
+}
 
-                if (!xc->fastpack) {
-                    if (wrlen <= packmemlen) {
-                        dmem = packmem;
-                    } else {
-                        free(packmem);
-                        dmem = packmem = (unsigned char *)malloc(compressBound(packmemlen = wrlen));
-                    }
+/*
+ * runs the worker pool over all handles, the calling thread acts as one of the
+ * workers.  returns NULL if the pool is not worth spinning up.
+ */
+static struct fstWriterPackPool *fstWriterPackParallel(struct fstWriterContext *xc)
+{
+    struct fstWriterPackPool *pool;
+    pthread_t *threads;
+    unsigned int nthreads = xc->pack_threads;
+    unsigned int started = 0;
+    unsigned int t;
 
-                    rc = compress2(dmem, &destlen, scratchpnt, wrlen, 4);
-                    if (rc == Z_OK) {
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        PPvoid_t pv = JudyHSIns(&PJHSArray, dmem, destlen, NULL);
-                        if (*pv) {
-                            uint32_t pvi = (intptr_t)(*pv);
-                            vm4ip[2] = -pvi;
-                        } else {
-                            *pv = (void *)(intptr_t)(i + 1);
+    if ((nthreads <= 1) || (xc->maxhandle < FST_WRITER_PACK_MIN_HANDLES))
+        return (NULL);
+
+    pool = (struct fstWriterPackPool *)calloc(1, sizeof(struct fstWriterPackPool));
+    pool->xc = xc;
+    pool->num_chunks = nthreads * FST_WRITER_PACK_CHUNKS_PER_THREAD;
+    pool->chunk_siz = (xc->maxhandle + pool->num_chunks - 1) / pool->num_chunks;
+    pool->num_chunks = (xc->maxhandle + pool->chunk_siz - 1) / pool->chunk_siz;
+    pool->chunks = (struct fstWriterPackChunk *)calloc(pool->num_chunks, sizeof(struct fstWriterPackChunk));
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    threads = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+    for (t = 0; t < nthreads - 1; t++) {
+        if (pthread_create(&threads[started], NULL, fstWriterPackWorker, pool)) {
+            break; /* run with whatever could be started */
+        }
+        started++;
+    }
+
+    fstWriterPackWorker(pool);
+
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    pthread_mutex_destroy(&pool->mutex);
+    return (pool);
+}
+
+static void fstWriterPackPoolFree(struct fstWriterPackPool *pool)
+{
+    if (pool) {
+        unsigned int c;
+
+        for (c = 0; c < pool->num_chunks; c++) {
+            free(pool->chunks[c].mem);
+        }
+        free(pool->chunks);
+        free(pool);
+    }
+}
 #endif
-                            fpos += fstWriterVarint(f, wrlen);
-                            fpos += destlen;
-                            fstFwrite(dmem, destlen, 1, f);
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        }
+
+/*
+ * only to be called directly by fst code...otherwise must
+ * be synced up with time changes
+ */
+#ifdef FST_WRITER_PARALLEL
+static void fstWriterFlushContextPrivate2(void *ctx)
+#else
+static void fstWriterFlushContextPrivate(void *ctx)
 #endif
-                    } else {
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        PPvoid_t pv = JudyHSIns(&PJHSArray, scratchpnt, wrlen, NULL);
-                        if (*pv) {
-                            uint32_t pvi = (intptr_t)(*pv);
-                            vm4ip[2] = -pvi;
-                        } else {
-                            *pv = (void *)(intptr_t)(i + 1);
+{
+#ifdef FST_DEBUG
+    int cnt = 0;
 #endif
-                            fpos += fstWriterVarint(f, 0);
-                            fpos += wrlen;
-                            fstFwrite(scratchpnt, wrlen, 1, f);
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        }
+    unsigned int i;
+    FILE *f;
+    fst_off_t fpos, indxpos, endpos;
+    uint32_t prevpos;
+    int zerocnt;
+    unsigned char *scratchpad = NULL;
+    unsigned char *scratchpnt;
+    unsigned char *tmem;
+    fst_off_t tlen;
+    fst_off_t unc_memreq = 0; /* for reader */
+    unsigned char *packmem = NULL;
+    unsigned int packmemlen = 0;
+    uint32_t *vm4ip;
+    struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
+#ifdef FST_WRITER_PARALLEL
+    struct fstWriterPackPool *pool;
+    struct fstWriterPackChunk *pc = NULL;
+    size_t pcpos = 0;
 #endif
-                    }
-                } else {
-                    /* this is extremely conservative: fastlz needs +5% for worst case, lz4 needs siz+(siz/255)+16 */
-                    if (((wrlen * 2) + 2) <= packmemlen) {
-                        dmem = packmem;
-                    } else {
-                        free(packmem);
-                        dmem = packmem = (unsigned char *)malloc(packmemlen = (wrlen * 2) + 2);
-                    }
 
-                    rc = (xc->fourpack) ? LZ4_compress((char *)scratchpnt, (char *)dmem, wrlen)
-                                        : fastlz_compress(scratchpnt, wrlen, dmem);
-                    if (rc < destlen) {
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        PPvoid_t pv = JudyHSIns(&PJHSArray, dmem, rc, NULL);
-                        if (*pv) {
-                            uint32_t pvi = (intptr_t)(*pv);
-                            vm4ip[2] = -pvi;
-                        } else {
-                            *pv = (void *)(intptr_t)(i + 1);
-#endif
-                            fpos += fstWriterVarint(f, wrlen);
-                            fpos += rc;
-                            fstFwrite(dmem, rc, 1, f);
 #ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        }
+    Pvoid_t PJHSArray = (Pvoid_t)NULL;
+    PPvoid_t pv;
+#ifndef _WAVE_HAVE_JUDY
+    uint32_t hashmask = xc->maxhandle;
+    hashmask |= hashmask >> 1;
+    hashmask |= hashmask >> 2;
+    hashmask |= hashmask >> 4;
+    hashmask |= hashmask >> 8;
+    hashmask |= hashmask >> 16;
 #endif
-                    } else {
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        PPvoid_t pv = JudyHSIns(&PJHSArray, scratchpnt, wrlen, NULL);
-                        if (*pv) {
-                            uint32_t pvi = (intptr_t)(*pv);
-                            vm4ip[2] = -pvi;
-                        } else {
-                            *pv = (void *)(intptr_t)(i + 1);
 #endif
-                            fpos += fstWriterVarint(f, 0);
-                            fpos += wrlen;
-                            fstFwrite(scratchpnt, wrlen, 1, f);
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                        }
+
+    if ((xc->vchg_siz <= 1) || (xc->already_in_flush))
+        return;
+    xc->already_in_flush = 1; /* should really do this with a semaphore */
+
+    xc->section_header_only = 0;
+
+    f = xc->handle;
+    fstWriterVarint(f, xc->maxhandle); /* emit current number of handles */
+    fputc(xc->fourpack ? '4' : (xc->fastpack ? 'F' : 'Z'), f);
+    fpos = 1;
+
+#ifdef FST_WRITER_PARALLEL
+    pool = fstWriterPackParallel(xc);
+    if (pool) {
+        pc = pool->chunks;
+        for (i = 0; i < pool->num_chunks; i++) {
+            unc_memreq += pool->chunks[i].unc_memreq;
+        }
+    } else
 #endif
-                    }
+    {
+        scratchpad = (unsigned char *)malloc(xc->vchg_siz);
+
+        packmemlen = 1024;                             /* maintain a running "longest" allocation to */
+        packmem = (unsigned char *)malloc(packmemlen); /* prevent continual malloc...free every loop iter */
+    }
+
+    for (i = 0; i < xc->maxhandle; i++) {
+        vm4ip = &(xc->valpos_mem[4 * i]);
+
+        if (vm4ip[2]) {
+            unsigned char *wmem;
+            unsigned int wlen, uclen;
+
+#ifdef FST_WRITER_PARALLEL
+            if (pool) {
+                uint32_t hdr[2];
+
+                if (i >= (unsigned int)(pc - pool->chunks + 1) * pool->chunk_siz) {
+                    pc = &pool->chunks[i / pool->chunk_siz];
+                    pcpos = 0;
                 }
-            } else {
-#ifndef FST_DYNAMIC_ALIAS_DISABLE
-                PPvoid_t pv = JudyHSIns(&PJHSArray, scratchpnt, wrlen, NULL);
-                if (*pv) {
-                    uint32_t pvi = (intptr_t)(*pv);
-                    vm4ip[2] = -pvi;
-                } else {
-                    *pv = (void *)(intptr_t)(i + 1);
+                memcpy(hdr, pc->mem + pcpos, sizeof(hdr));
+                uclen = hdr[0];
+                wlen = hdr[1];
+                wmem = pc->mem + pcpos + sizeof(hdr);
+                pcpos += sizeof(hdr) + wlen;
+            } else
 #endif
-                    fpos += fstWriterVarint(f, 0);
-                    fpos += wrlen;
-                    fstFwrite(scratchpnt, wrlen, 1, f);
+            {
+                unsigned int wrlen;
+
+                scratchpnt = fstWriterBuildChain(xc, vm4ip, scratchpad + xc->vchg_siz);
+                wrlen = scratchpad + xc->vchg_siz - scratchpnt;
+                unc_memreq += wrlen;
+                wmem = fstWriterPackChain(xc, scratchpnt, wrlen, &packmem, &packmemlen, &wlen, &uclen);
+            }
+
+            vm4ip[2] = fpos;
 #ifndef FST_DYNAMIC_ALIAS_DISABLE
-                }
+            pv = JudyHSIns(&PJHSArray, wmem, wlen, NULL);
+            if (*pv) {
+                uint32_t pvi = (intptr_t)(*pv);
+                vm4ip[2] = -pvi;
+            } else {
+                *pv = (void *)(intptr_t)(i + 1);
 #endif
+                fpos += fstWriterVarint(f, uclen);
+                fpos += wlen;
+                fstFwrite(wmem, wlen, 1, f);
+#ifndef FST_DYNAMIC_ALIAS_DISABLE
             }
+#endif
 
             /* vm4ip[3] = 0; ...redundant with clearing below */
 #ifdef FST_DEBUG
@@ -1515,6 +2123,10 @@ static void fstWriterFlushContextPrivate(void *ctx)
     JudyHSFreeArray(&PJHSArray, NULL);
 #endif
 
+#ifdef FST_WRITER_PARALLEL
+    fstWriterPackPoolFree(pool);
+    pool = NULL;
+#endif
     free(packmem);
     packmem = NULL; /* packmemlen = 0; */ /* scan-build */
 
@@ -1653,19 +2265,19 @@ static void fstWriterFlushContextPrivate(void *ctx)
 
     fstWriterFseeko(xc, xc->handle, endpos, SEEK_SET); /* seek to end of file */
 
-    xc2->section_header_truncpos = endpos; /* cache in case of need to truncate */
+    xc->section_header_truncpos = endpos; /* cache in case of need to truncate */
     if (xc->dump_size_limit) {
         if (endpos >= ((fst_off_t)xc->dump_size_limit)) {
-            xc2->skip_writing_section_hdr = 1;
-            xc2->size_limit_locked = 1;
-            xc2->is_initial_time = 1; /* to trick emit value and emit time change */
+            xc->skip_writing_section_hdr = 1;
+            xc->size_limit_locked = 1;
+            xc->is_initial_time = 1; /* to trick emit value and emit time change */
 #ifdef FST_DEBUG
             fprintf(stderr, FST_APIMESS "<< dump file size limit reached, stopping dumping >>\n");
 #endif
         }
     }
 
-    if (!xc2->skip_writing_section_hdr) {
+    if (!xc->skip_writing_section_hdr) {
         fstWriterEmitSectionHeader(xc); /* emit next section header */
     }
     fflush(xc->handle);
@@ -1674,86 +2286,187 @@ static void fstWriterFlushContextPrivate(void *ctx)
 }
 
 #ifdef FST_WRITER_PARALLEL
-static void *fstWriterFlushContextPrivate1(void *ctx)
+/*
+ * long-lived flush thread: sleeps until a section snapshot is queued in
+ * xc->xc_flush, writes it out, then signals that its buffers are free again
+ */
+static void *fstWriterFlushThread(void *ctx)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
-    struct fstWriterContext *xc_parent;
 
-    pthread_mutex_lock(&(xc->xc_parent->mutex));
-    fstWriterFlushContextPrivate2(xc);
+    pthread_mutex_lock(&xc->mutex);
+    for (;;) {
+        while (!xc->in_pthread && !xc->flush_thread_exit) {
+            pthread_cond_wait(&xc->flush_cond, &xc->mutex);
+        }
+        if (!xc->in_pthread) /* exit requested and nothing left queued */
+            break;
+        pthread_mutex_unlock(&xc->mutex);
 
-#ifdef FST_REMOVE_DUPLICATE_VC
-    free(xc->curval_mem);
-#endif
-    free(xc->valpos_mem);
-    free(xc->vchg_mem);
-    tmpfile_close(&xc->tchn_handle, &xc->tchn_handle_nam);
-    xc_parent = xc->xc_parent;
-    free(xc);
+        fstWriterFlushContextPrivate2(xc->xc_flush);
 
-    xc_parent->in_pthread = 0;
-    pthread_mutex_unlock(&(xc_parent->mutex));
+        pthread_mutex_lock(&xc->mutex);
+        xc->in_pthread = 0;
+        pthread_cond_signal(&xc->idle_cond);
+    }
+    pthread_mutex_unlock(&xc->mutex);
 
     return (NULL);
 }
 
+/*
+ * picks up the state fstWriterFlushContextPrivate2() leaves behind in the
+ * snapshot, only to be called when the flush thread is idle
+ */
+static void fstWriterFlushThreadSync(struct fstWriterContext *xc)
+{
+    struct fstWriterContext *xcf = xc->xc_flush;
+
+    xc->section_header_truncpos = xcf->section_header_truncpos;
+    xc->fseek_failed |= xcf->fseek_failed;
+    if (xcf->size_limit_locked) {
+        xc->curtime = xcf->curtime; /* time stopped advancing at the limit */
+        xc->skip_writing_section_hdr = 1;
+        xc->size_limit_locked = 1;
+        xc->is_initial_time = 1;
+    }
+}
+
+static void fstWriterFlushThreadStart(struct fstWriterContext *xc)
+{
+    xc->xc_flush = (struct fstWriterContext *)malloc(sizeof(struct fstWriterContext));
+    if (xc->xc_flush) {
+        memcpy(xc->xc_flush, xc, sizeof(struct fstWriterContext)); /* so the first sync is a no-op */
+    }
+    xc->vchg_alloc_siz_spare = xc->vchg_alloc_siz;
+    xc->vchg_mem_spare = (unsigned char *)malloc(xc->vchg_alloc_siz_spare);
+    xc->tchn_handle_spare = (xc->scratch_in_mem & FST_SCRATCH_TCHN) ? tmpfile_open_mem(&xc->tchn_handle_nam_spare)
+                                                                     : tmpfile_open(&xc->tchn_handle_nam_spare);
+
+    pthread_cond_init(&xc->flush_cond, NULL);
+    pthread_cond_init(&xc->idle_cond, NULL);
+    xc->in_pthread = 0;
+    xc->flush_thread_exit = 0;
+
+    if ((!xc->xc_flush) || (!xc->vchg_mem_spare) || (!xc->tchn_handle_spare) ||
+        pthread_create(&xc->thread, NULL, fstWriterFlushThread, xc)) {
+        fprintf(stderr, FST_APIMESS "fstWriterFlushThreadStart(), could not start flush thread, exiting.\n");
+        exit(255);
+    }
+
+    xc->flush_thread_running = 1;
+}
+
+/*
+ * lets the flush thread drain its queued section then tears it down along with
+ * the spare buffer set (the spare valpos/curval are owned by the mmap code)
+ */
+static void fstWriterFlushThreadStop(struct fstWriterContext *xc)
+{
+    if (xc->flush_thread_running) {
+        pthread_mutex_lock(&xc->mutex);
+        xc->flush_thread_exit = 1;
+        pthread_cond_signal(&xc->flush_cond);
+        pthread_mutex_unlock(&xc->mutex);
+
+        pthread_join(xc->thread, NULL);
+        xc->flush_thread_running = 0;
+
+        fstWriterFlushThreadSync(xc);
+        xc->section_header_only = xc->xc_flush->section_header_only;
+
+        pthread_cond_destroy(&xc->flush_cond);
+        pthread_cond_destroy(&xc->idle_cond);
+        tmpfile_close(&xc->tchn_handle_spare, &xc->tchn_handle_nam_spare);
+        free(xc->vchg_mem_spare);
+        xc->vchg_mem_spare = NULL;
+        free(xc->xc_flush);
+        xc->xc_flush = NULL;
+    }
+}
+
 static void fstWriterFlushContextPrivate(void *ctx)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
 
     if (xc->parallel_enabled) {
-        struct fstWriterContext *xc2 = (struct fstWriterContext *)malloc(sizeof(struct fstWriterContext));
-        unsigned int i;
+        struct fstWriterContext *xcf;
+        unsigned char *vchg_mem;
+        uint32_t vchg_alloc_siz;
+        uint32_t *valpos_mem;
+        FILE *tchn_handle;
+        char *tchn_handle_nam;
+
+        if ((xc->vchg_siz <= 1) || (xc->already_in_flush))
+            return;
+
+        if (!xc->flush_thread_running) {
+            fstWriterFlushThreadStart(xc);
+        }
 
-        pthread_mutex_lock(&xc->mutex);
-        pthread_mutex_unlock(&xc->mutex);
+        /* only stalls when the previous section is still being written out */
+        fstWriterFlushWait(xc);
+        fstWriterFlushThreadSync(xc);
+        if (xc->size_limit_locked) /* previous section hit the dump size limit */
+            return;
 
-        xc->xc_parent = xc;
-        memcpy(xc2, xc, sizeof(struct fstWriterContext));
+        if (!xc->valpos_mem_spare) /* (re)built whenever the mappings change */
+        {
+            unsigned int i;
+
+            xc->valpos_mem_spare = (uint32_t *)calloc(xc->maxhandle * 4, sizeof(uint32_t));
+            for (i = 0; i < xc->maxhandle; i++) {
+                xc->valpos_mem_spare[4 * i + 0] = xc->valpos_mem[4 * i + 0];
+                xc->valpos_mem_spare[4 * i + 1] = xc->valpos_mem[4 * i + 1];
+            }
+        }
+#ifdef FST_REMOVE_DUPLICATE_VC
+        if (!xc->curval_mem_spare) {
+            xc->curval_mem_spare = (unsigned char *)malloc(xc->maxvalpos);
+        }
+#endif
 
-        xc2->valpos_mem = (uint32_t *)malloc(xc->maxhandle * 4 * sizeof(uint32_t));
-        memcpy(xc2->valpos_mem, xc->valpos_mem, xc->maxhandle * 4 * sizeof(uint32_t));
+        xcf = xc->xc_flush;
+        xc->xc_parent = xc;
+        memcpy(xcf, xc, sizeof(struct fstWriterContext));
 
-        /* curval mem is updated in the thread */
 #ifdef FST_REMOVE_DUPLICATE_VC
-        xc2->curval_mem = (unsigned char *)malloc(xc->maxvalpos);
-        memcpy(xc2->curval_mem, xc->curval_mem, xc->maxvalpos);
+        /* values keep being updated by emits, so the next section header needs a snapshot */
+        memcpy(xc->curval_mem_spare, xc->curval_mem, xc->maxvalpos);
+        xcf->curval_mem = xc->curval_mem_spare;
 #endif
 
-        xc->vchg_mem = (unsigned char *)malloc(xc->vchg_alloc_siz);
+        /* flush thread takes the filled buffers, writing continues into the spare ones */
+        vchg_mem = xc->vchg_mem;
+        vchg_alloc_siz = xc->vchg_alloc_siz;
+        xc->vchg_mem = xc->vchg_mem_spare;
+        xc->vchg_alloc_siz = xc->vchg_alloc_siz_spare;
+        xc->vchg_mem_spare = vchg_mem;
+        xc->vchg_alloc_siz_spare = vchg_alloc_siz;
+
+        valpos_mem = xc->valpos_mem;
+        xc->valpos_mem = xc->valpos_mem_spare;
+        xc->valpos_mem_spare = valpos_mem;
+
+        tchn_handle = xc->tchn_handle;
+        tchn_handle_nam = xc->tchn_handle_nam;
+        xc->tchn_handle = xc->tchn_handle_spare;
+        xc->tchn_handle_nam = xc->tchn_handle_nam_spare;
+        xc->tchn_handle_spare = tchn_handle;
+        xc->tchn_handle_nam_spare = tchn_handle_nam;
+
         xc->vchg_mem[0] = '!';
         xc->vchg_siz = 1;
-
-        for (i = 0; i < xc->maxhandle; i++) {
-            uint32_t *vm4ip = &(xc->valpos_mem[4 * i]);
-            vm4ip[2] = 0; /* zero out offset val */
-            vm4ip[3] = 0; /* zero out last time change val */
-        }
-
         xc->tchn_cnt = xc->tchn_idx = 0;
-        xc->tchn_handle = tmpfile_open(&xc->tchn_handle_nam); /* child thread will deallocate file/name */
-        fstWriterFseeko(xc, xc->tchn_handle, 0, SEEK_SET);
-        fstFtruncate(fileno(xc->tchn_handle), 0);
-
         xc->section_header_only = 0;
         xc->secnum++;
 
-        while (xc->in_pthread) {
-            pthread_mutex_lock(&xc->mutex);
-            pthread_mutex_unlock(&xc->mutex);
-        };
-
         pthread_mutex_lock(&xc->mutex);
         xc->in_pthread = 1;
+        pthread_cond_signal(&xc->flush_cond);
         pthread_mutex_unlock(&xc->mutex);
-
-        pthread_create(&xc->thread, &xc->thread_attr, fstWriterFlushContextPrivate1, xc2);
     } else {
-        if (xc->parallel_was_enabled) /* conservatively block */
-        {
-            pthread_mutex_lock(&xc->mutex);
-            pthread_mutex_unlock(&xc->mutex);
-        }
+        fstWriterFlushThreadStop(xc);
 
         xc->xc_parent = xc;
         fstWriterFlushContextPrivate2(xc);
@@ -1774,6 +2487,172 @@ void fstWriterFlushContext(void *ctx)
     }
 }
 
+/*
+ * deflate src into dst as one complete gzip member, returns its length (0 on failure)
+ */
+static uint64_t fstWriterGzipChunk(unsigned char *dst, uint64_t dstlen, unsigned char *src, uint64_t srclen)
+{
+    z_stream strm;
+    uint64_t clen = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, 4, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return (0);
+    }
+
+    strm.next_in = src;
+    strm.avail_in = srclen;
+    strm.next_out = dst;
+    strm.avail_out = dstlen;
+    if (deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+        clen = strm.total_out;
+    }
+
+    deflateEnd(&strm);
+    return (clen);
+}
+
+/*
+ * one batch of consecutive FST_BL_ZWRAPPER_CHUNKED members: the uncompressed data is
+ * read serially, the members are deflated by the pack threads into fixed slots and
+ * then written out in order
+ */
+struct fstWriterRepackBatch
+{
+    unsigned char *ucmem;
+    unsigned char *cmem;
+    uint64_t cbound;
+    uint64_t *clens;
+    uint64_t len;
+    unsigned int num_chunks;
+    unsigned int next_chunk;
+#ifdef FST_WRITER_PARALLEL
+    pthread_mutex_t mutex;
+#endif
+};
+
+static void *fstWriterRepackWorker(void *ctx)
+{
+    struct fstWriterRepackBatch *rb = (struct fstWriterRepackBatch *)ctx;
+
+    for (;;) {
+        unsigned int c;
+        uint64_t this_len;
+
+#ifdef FST_WRITER_PARALLEL
+        pthread_mutex_lock(&rb->mutex);
+#endif
+        c = rb->next_chunk++;
+#ifdef FST_WRITER_PARALLEL
+        pthread_mutex_unlock(&rb->mutex);
+#endif
+        if (c >= rb->num_chunks)
+            break;
+
+        this_len = rb->len - (uint64_t)c * FST_ZWRAPPER_CHUNK_LEN;
+        if (this_len > FST_ZWRAPPER_CHUNK_LEN)
+            this_len = FST_ZWRAPPER_CHUNK_LEN;
+        rb->clens[c] = fstWriterGzipChunk(rb->cmem + c * rb->cbound, rb->cbound,
+                                          rb->ucmem + (uint64_t)c * FST_ZWRAPPER_CHUNK_LEN, this_len);
+    }
+
+    return (NULL);
+}
+
+static void fstWriterRepackBatchRun(struct fstWriterRepackBatch *rb, unsigned int nthreads)
+{
+#ifdef FST_WRITER_PARALLEL
+    pthread_t *threads = NULL;
+    unsigned int started = 0;
+    unsigned int t;
+
+    if (nthreads > rb->num_chunks)
+        nthreads = rb->num_chunks;
+    if (nthreads > 1) {
+        threads = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+        for (t = 0; t < nthreads - 1; t++) {
+            if (pthread_create(&threads[started], NULL, fstWriterRepackWorker, rb)) {
+                break; /* run with whatever could be started */
+            }
+            started++;
+        }
+    }
+
+    fstWriterRepackWorker(rb);
+
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+#else
+    (void)nthreads;
+    fstWriterRepackWorker(rb);
+#endif
+}
+
+/*
+ * FST_BL_ZWRAPPER_CHUNKED: each FST_ZWRAPPER_CHUNK_LEN bytes of the finished file
+ * become an independent gzip member and the member lengths follow them, so that
+ * readers can inflate just the chunks they touch.  members are deflated on the
+ * fstWriterSetPackThreads() threads.
+ */
+static void fstWriterRepackChunked(struct fstWriterContext *xc, FILE *fp, fst_off_t uclen)
+{
+    uint64_t nchunks = (uclen + FST_ZWRAPPER_CHUNK_LEN - 1) / FST_ZWRAPPER_CHUNK_LEN;
+    uint64_t *clens = (uint64_t *)calloc(nchunks ? nchunks : 1, sizeof(uint64_t));
+    unsigned int nthreads = (xc->pack_threads > 1) ? xc->pack_threads : 1;
+    unsigned int batch_chunks = nthreads * FST_ZWRAPPER_CHUNKS_PER_THREAD;
+    struct fstWriterRepackBatch rb;
+    fst_off_t offpnt;
+    uint64_t i, c;
+
+    memset(&rb, 0, sizeof(rb));
+    rb.cbound = compressBound(FST_ZWRAPPER_CHUNK_LEN) + 32; /* room for the gzip header and trailer */
+    rb.ucmem = (unsigned char *)malloc((size_t)batch_chunks * FST_ZWRAPPER_CHUNK_LEN);
+    rb.cmem = (unsigned char *)malloc((size_t)batch_chunks * rb.cbound);
+#ifdef FST_WRITER_PARALLEL
+    pthread_mutex_init(&rb.mutex, NULL);
+#endif
+
+    fputc(FST_BL_ZWRAPPER_CHUNKED, fp);
+    fstWriterUint64(fp, 0);
+    fstWriterUint64(fp, uclen);
+    fstWriterUint64(fp, FST_ZWRAPPER_CHUNK_LEN);
+
+    fstWriterFseeko(xc, xc->handle, 0, SEEK_SET);
+    for (i = 0; i < nchunks; i += rb.num_chunks) {
+        rb.num_chunks = ((nchunks - i) > batch_chunks) ? batch_chunks : (unsigned int)(nchunks - i);
+        rb.len = (uint64_t)uclen - i * FST_ZWRAPPER_CHUNK_LEN;
+        if (rb.len > (uint64_t)rb.num_chunks * FST_ZWRAPPER_CHUNK_LEN)
+            rb.len = (uint64_t)rb.num_chunks * FST_ZWRAPPER_CHUNK_LEN;
+        rb.clens = clens + i;
+        rb.next_chunk = 0;
+
+        fstFread(rb.ucmem, rb.len, 1, xc->handle);
+        fstWriterRepackBatchRun(&rb, nthreads);
+
+        for (c = 0; c < rb.num_chunks; c++) {
+            fstFwrite(rb.cmem + c * rb.cbound, rb.clens[c], 1, fp);
+        }
+    }
+
+    for (i = 0; i < nchunks; i++) {
+        fstWriterUint64(fp, clens[i]);
+    }
+
+    fstWriterFseeko(xc, fp, 0, SEEK_END);
+    offpnt = ftello(fp);
+    fstWriterFseeko(xc, fp, 1, SEEK_SET);
+    fstWriterUint64(fp, offpnt - 1);
+
+#ifdef FST_WRITER_PARALLEL
+    pthread_mutex_destroy(&rb.mutex);
+#endif
+    free(rb.cmem);
+    free(rb.ucmem);
+    free(clens);
+}
+
 /*
  * close out FST file
  */
@@ -1783,8 +2662,8 @@ void fstWriterClose(void *ctx)
 
 #ifdef FST_WRITER_PARALLEL
     if (xc) {
-        pthread_mutex_lock(&xc->mutex);
-        pthread_mutex_unlock(&xc->mutex);
+        fstWriterFlushThreadStop(xc);
+        xc->parallel_enabled = 0; /* final section is written inline */
     }
 #endif
 
@@ -1813,15 +2692,6 @@ void fstWriterClose(void *ctx)
                     }
                 }
                 fstWriterFlushContextPrivate(xc);
-#ifdef FST_WRITER_PARALLEL
-                pthread_mutex_lock(&xc->mutex);
-                pthread_mutex_unlock(&xc->mutex);
-
-                while (xc->in_pthread) {
-                    pthread_mutex_lock(&xc->mutex);
-                    pthread_mutex_unlock(&xc->mutex);
-                };
-#endif
             }
         }
         fstDestroyMmaps(xc, 1);
@@ -2037,28 +2907,32 @@ void fstWriterClose(void *ctx)
                     fstWriterFseeko(xc, xc->handle, 0, SEEK_END);
                     uclen = ftello(xc->handle);
 
-                    fputc(FST_BL_ZWRAPPER, fp);
-                    fstWriterUint64(fp, 0);
-                    fstWriterUint64(fp, uclen);
-                    fflush(fp);
-
-                    fstWriterFseeko(xc, xc->handle, 0, SEEK_SET);
-                    zfd = dup(fileno(fp));
-                    dsth = gzdopen(zfd, "wb4");
-                    if (dsth) {
-                        for (offpnt = 0; offpnt < uclen; offpnt += FST_GZIO_LEN) {
-                            size_t this_len = ((uclen - offpnt) > FST_GZIO_LEN) ? FST_GZIO_LEN : (uclen - offpnt);
-                            fstFread(gz_membuf, this_len, 1, xc->handle);
-                            gzwrite(dsth, gz_membuf, this_len);
-                        }
-                        gzclose(dsth);
+                    if (xc->repack_on_close == 2) {
+                        fstWriterRepackChunked(xc, fp, uclen);
                     } else {
-                        close(zfd);
+                        fputc(FST_BL_ZWRAPPER, fp);
+                        fstWriterUint64(fp, 0);
+                        fstWriterUint64(fp, uclen);
+                        fflush(fp);
+
+                        fstWriterFseeko(xc, xc->handle, 0, SEEK_SET);
+                        zfd = dup(fileno(fp));
+                        dsth = gzdopen(zfd, "wb4");
+                        if (dsth) {
+                            for (offpnt = 0; offpnt < uclen; offpnt += FST_GZIO_LEN) {
+                                size_t this_len = ((uclen - offpnt) > FST_GZIO_LEN) ? FST_GZIO_LEN : (uclen - offpnt);
+                                fstFread(gz_membuf, this_len, 1, xc->handle);
+                                gzwrite(dsth, gz_membuf, this_len);
+                            }
+                            gzclose(dsth);
+                        } else {
+                            close(zfd);
+                        }
+                        fstWriterFseeko(xc, fp, 0, SEEK_END);
+                        offpnt = ftello(fp);
+                        fstWriterFseeko(xc, fp, 1, SEEK_SET);
+                        fstWriterUint64(fp, offpnt - 1);
                     }
-                    fstWriterFseeko(xc, fp, 0, SEEK_END);
-                    offpnt = ftello(fp);
-                    fstWriterFseeko(xc, fp, 1, SEEK_SET);
-                    fstWriterUint64(fp, offpnt - 1);
                     fclose(fp);
                     fclose(xc->handle);
                     xc->handle = NULL;
@@ -2095,7 +2969,6 @@ void fstWriterClose(void *ctx)
 
 #ifdef FST_WRITER_PARALLEL
         pthread_mutex_destroy(&xc->mutex);
-        pthread_attr_destroy(&xc->thread_attr);
 #endif
 
         if (xc->path_array) {
@@ -2364,7 +3237,7 @@ void fstWriterSetRepackOnClose(void *ctx, int enable)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
     if (xc) {
-        xc->repack_on_close = (enable != 0);
+        xc->repack_on_close = (enable == 2) ? 2 : (enable != 0);
     }
 }
 
@@ -2372,7 +3245,6 @@ void fstWriterSetParallelMode(void *ctx, int enable)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
     if (xc) {
-        xc->parallel_was_enabled |= xc->parallel_enabled; /* make sticky */
         xc->parallel_enabled = (enable != 0);
 #ifndef FST_WRITER_PARALLEL
         if (xc->parallel_enabled) {
@@ -2384,6 +3256,66 @@ void fstWriterSetParallelMode(void *ctx, int enable)
     }
 }
 
+void fstWriterSetPackThreads(void *ctx, int numthreads)
+{
+    struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
+    if (xc) {
+#ifdef FST_WRITER_PARALLEL
+        xc->pack_threads = (numthreads > 1) ? numthreads : 1;
+#else
+        (void)numthreads; /* chains are always packed serially */
+        xc->pack_threads = 1;
+#endif
+    }
+}
+
+/*
+ * keeps the writer's scratch files (hierarchy, geometry, value positions, current
+ * values and time table) in memory rather than in temp files.  a scratch file which
+ * grows past spill_threshold bytes is moved to a temp file, 0 never spills.  the time
+ * table is emptied on every flush so stays in memory.  only honored before the first
+ * time change and where memfd_create() is available.
+ */
+void fstWriterSetScratchInMemory(void *ctx, uint64_t spill_threshold)
+{
+    struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
+#ifdef FST_HAVE_MEMFD
+    if (xc && xc->is_initial_time && !xc->scratch_in_mem) {
+#ifdef FST_WRITER_PARALLEL
+        if (xc->flush_thread_running)
+            return;
+#endif
+        if (xc->valpos_mem) {
+            fstDestroyMmaps(xc, 0);
+        }
+
+        if (xc->compress_hier) /* otherwise the .hier file is part of the output */
+        {
+            char *hf = (char *)malloc(strlen(xc->filename) + 5 + 1);
+
+            fstWriterScratchMove(xc, &xc->hier_handle, NULL, 1);
+            sprintf(hf, "%s.hier", xc->filename);
+            unlink(hf);
+            free(hf);
+            xc->scratch_in_mem |= FST_SCRATCH_HIER;
+        }
+        fstWriterScratchMove(xc, &xc->geom_handle, &xc->geom_handle_nam, 1);
+        fstWriterScratchMove(xc, &xc->valpos_handle, &xc->valpos_handle_nam, 1);
+        fstWriterScratchMove(xc, &xc->curval_handle, &xc->curval_handle_nam, 1);
+        fstWriterScratchMove(xc, &xc->tchn_handle, &xc->tchn_handle_nam, 1);
+        xc->scratch_in_mem |= FST_SCRATCH_GEOM | FST_SCRATCH_VALPOS | FST_SCRATCH_CURVAL | FST_SCRATCH_TCHN;
+
+        xc->scratch_spill = spill_threshold;
+        if (xc->scratch_spill) {
+            fstWriterScratchSpill(xc);
+        }
+    }
+#else
+    (void)xc;
+    (void)spill_threshold; /* temp files stay on disk */
+#endif
+}
+
 void fstWriterSetDumpSizeLimit(void *ctx, uint64_t numbytes)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
@@ -2437,6 +3369,9 @@ fstHandle fstWriterCreateVar(void *ctx, enum fstVarType vt, enum fstVarDir vd, u
         if (xc->valpos_mem) {
             fstDestroyMmaps(xc, 0);
         }
+        if (xc->scratch_in_mem && xc->scratch_spill) {
+            fstWriterScratchSpill(xc);
+        }
 
         fputc(vt, xc->hier_handle);
         fputc(vd, xc->hier_handle);
@@ -2694,15 +3629,103 @@ void fstWriterEmitEnumTableRef(void *ctx, fstEnumHandle handle)
 /*
  * value and time change emission
  */
+
+/*
+ * appends a fixed length value change to vchg_mem, the caller has already
+ * validated the handle and reserved at least len + 10 bytes
+ */
+static void fstWriterAppendValueChange(struct fstWriterContext *xc, uint32_t *vm4ip, const unsigned char *buf,
+                                       uint32_t len)
+{
+    uint32_t fpos = xc->vchg_siz;
+#ifdef FST_REMOVE_DUPLICATE_VC
+    uint32_t offs = vm4ip[0];
+
+    if (len != 1) {
+        if ((vm4ip[3] == xc->tchn_idx) && (vm4ip[2])) {
+            unsigned char *old_value = xc->vchg_mem + vm4ip[2] + 4; /* the +4 skips old vm4ip[2] value */
+            while (*(old_value++) & 0x80) { /* skips over varint encoded "xc->tchn_idx - vm4ip[3]" */
+            }
+            memcpy(old_value, buf, len); /* overlay new value */
+
+            memcpy(xc->curval_mem + offs, buf, len);
+            return;
+        } else {
+            if (!memcmp(xc->curval_mem + offs, buf, len)) {
+                if (!xc->curtime) {
+                    uint32_t i;
+                    for (i = 0; i < len; i++) {
+                        if (buf[i] != 'x')
+                            break;
+                    }
+
+                    if (i < len)
+                        return;
+                } else {
+                    return;
+                }
+            }
+        }
+
+        memcpy(xc->curval_mem + offs, buf, len);
+    } else {
+        if ((vm4ip[3] == xc->tchn_idx) && (vm4ip[2])) {
+            unsigned char *old_value = xc->vchg_mem + vm4ip[2] + 4; /* the +4 skips old vm4ip[2] value */
+            while (*(old_value++) & 0x80) { /* skips over varint encoded "xc->tchn_idx - vm4ip[3]" */
+            }
+            *old_value = *buf; /* overlay new value */
+
+            *(xc->curval_mem + offs) = *buf;
+            return;
+        } else {
+            if ((*(xc->curval_mem + offs)) == (*buf)) {
+                if (!xc->curtime) {
+                    if (*buf != 'x')
+                        return;
+                } else {
+                    return;
+                }
+            }
+        }
+
+        *(xc->curval_mem + offs) = *buf;
+    }
+#endif
+    if (len == 1) {
+        xc->vchg_siz += fstWriterUint32WithVarint32(xc, &vm4ip[2], xc->tchn_idx - vm4ip[3], buf,
+                                                    len); /* do one fwrite op only */
+    } else {
+#ifndef FST_REMOVE_DUPLICATE_VC
+        xc->vchg_siz += fstWriterUint32WithVarint32Vector(xc, &vm4ip[2], xc->tchn_idx - vm4ip[3], buf, len);
+#else
+        xc->vchg_siz += fstWriterUint32WithVarint32(xc, &vm4ip[2], (xc->tchn_idx - vm4ip[3]) << 1, buf, len);
+#endif
+    }
+    vm4ip[3] = xc->tchn_idx;
+    vm4ip[2] = fpos;
+}
+
+static void fstWriterReserveValueChanges(struct fstWriterContext *xc, uint64_t siz, const char *caller)
+{
+    if (FST_UNLIKELY((xc->vchg_siz + siz) > xc->vchg_alloc_siz)) {
+        xc->vchg_alloc_siz +=
+                (xc->fst_break_add_size +
+                 siz); /* +siz added in the case of extremely long vectors and small break add sizes */
+        xc->vchg_mem = (unsigned char *)realloc(xc->vchg_mem, xc->vchg_alloc_siz);
+        if (FST_UNLIKELY(!xc->vchg_mem)) {
+            fprintf(stderr, FST_APIMESS "Could not realloc() in %s, exiting.\n", caller);
+            exit(255);
+        }
+    }
+}
+
 void fstWriterEmitValueChange(void *ctx, fstHandle handle, const void *val)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
     const unsigned char *buf = (const unsigned char *)val;
-    uint32_t offs;
     int len;
 
     if (FST_LIKELY((xc) && (handle <= xc->maxhandle))) {
-        uint32_t fpos;
         uint32_t *vm4ip;
 
         if (FST_UNLIKELY(!xc->valpos_mem)) {
@@ -2717,88 +3740,209 @@ void fstWriterEmitValueChange(void *ctx, fstHandle handle, const void *val)
         if (FST_LIKELY(len)) /* len of zero = variable length, use fstWriterEmitVariableLengthValueChange */
         {
             if (FST_LIKELY(!xc->is_initial_time)) {
-                fpos = xc->vchg_siz;
+                fstWriterReserveValueChanges(xc, len + 10, "fstWriterEmitValueChange");
+                fstWriterAppendValueChange(xc, vm4ip, buf, len);
+            } else {
+                memcpy(xc->curval_mem + vm4ip[0], buf, len);
+            }
+        }
+    }
+}
 
-                if (FST_UNLIKELY((fpos + len + 10) > xc->vchg_alloc_siz)) {
-                    xc->vchg_alloc_siz +=
-                            (xc->fst_break_add_size +
-                             len); /* +len added in the case of extremely long vectors and small break add sizes */
-                    xc->vchg_mem = (unsigned char *)realloc(xc->vchg_mem, xc->vchg_alloc_siz);
-                    if (FST_UNLIKELY(!xc->vchg_mem)) {
-                        fprintf(stderr, FST_APIMESS "Could not realloc() in fstWriterEmitValueChange, exiting.\n");
-                        exit(255);
-                    }
-                }
-#ifdef FST_REMOVE_DUPLICATE_VC
-                offs = vm4ip[0];
+/*
+ * emits num value changes at the current time with a single check of the
+ * context and a single reservation of vchg_mem; handles which are out of
+ * range or variable length are skipped as fstWriterEmitValueChange() would
+ */
+void fstWriterEmitValueChangeBatch(void *ctx, uint32_t num, const fstHandle *handles, const void *const *vals)
+{
+    struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
+    fstHandle maxhandle;
+    uint32_t *valpos;
+    uint64_t siz = 0;
+    uint32_t i;
 
-                if (len != 1) {
-                    if ((vm4ip[3] == xc->tchn_idx) && (vm4ip[2])) {
-                        unsigned char *old_value = xc->vchg_mem + vm4ip[2] + 4; /* the +4 skips old vm4ip[2] value */
-                        while (*(old_value++) & 0x80) { /* skips over varint encoded "xc->tchn_idx - vm4ip[3]" */
-                        }
-                        memcpy(old_value, buf, len); /* overlay new value */
+    if (FST_UNLIKELY(!xc || !num)) {
+        return;
+    }
 
-                        memcpy(xc->curval_mem + offs, buf, len);
-                        return;
-                    } else {
-                        if (!memcmp(xc->curval_mem + offs, buf, len)) {
-                            if (!xc->curtime) {
-                                int i;
-                                for (i = 0; i < len; i++) {
-                                    if (buf[i] != 'x')
-                                        break;
-                                }
+    if (FST_UNLIKELY(!xc->valpos_mem)) {
+        xc->vc_emitted = 1;
+        fstWriterCreateMmaps(xc);
+    }
 
-                                if (i < len)
-                                    return;
-                            } else {
-                                return;
-                            }
-                        }
-                    }
+    maxhandle = xc->maxhandle;
+    valpos = xc->valpos_mem;
 
-                    memcpy(xc->curval_mem + offs, buf, len);
-                } else {
-                    if ((vm4ip[3] == xc->tchn_idx) && (vm4ip[2])) {
-                        unsigned char *old_value = xc->vchg_mem + vm4ip[2] + 4; /* the +4 skips old vm4ip[2] value */
-                        while (*(old_value++) & 0x80) { /* skips over varint encoded "xc->tchn_idx - vm4ip[3]" */
-                        }
-                        *old_value = *buf; /* overlay new value */
+    if (FST_UNLIKELY(xc->is_initial_time)) {
+        for (i = 0; i < num; i++) {
+            fstHandle handle = handles[i];
+            if (FST_LIKELY(handle && (handle <= maxhandle))) {
+                uint32_t *vm4ip = &valpos[4 * (handle - 1)];
+                memcpy(xc->curval_mem + vm4ip[0], vals[i], vm4ip[1]);
+            }
+        }
+        return;
+    }
 
-                        *(xc->curval_mem + offs) = *buf;
-                        return;
+    for (i = 0; i < num; i++) {
+        fstHandle handle = handles[i];
+        if (FST_LIKELY(handle && (handle <= maxhandle))) {
+            siz += valpos[4 * (handle - 1) + 1] + 10;
+        }
+    }
+    fstWriterReserveValueChanges(xc, siz, "fstWriterEmitValueChangeBatch");
+
+#ifndef FST_REMOVE_DUPLICATE_VC
+    {
+        /* same encoding as fstWriterUint32WithVarint32[Vector](), but with the write position kept in a local
+           as stores through vchg_mem would otherwise force xc to be reloaded for every value change */
+        unsigned char *base = xc->vchg_mem;
+        uint32_t fpos = xc->vchg_siz;
+        uint32_t tchn_idx = xc->tchn_idx;
+
+        for (i = 0; i < num; i++) {
+            fstHandle handle = handles[i];
+            if (FST_LIKELY(handle && (handle <= maxhandle))) {
+                uint32_t *vm4ip = &valpos[4 * (handle - 1)];
+                uint32_t len = vm4ip[1];
+                if (FST_LIKELY(len)) {
+                    unsigned char *pnt = base + fpos;
+                    const unsigned char *buf = (const unsigned char *)vals[i];
+                    uint32_t v = tchn_idx - vm4ip[3];
+                    uint32_t nxt;
+                    unsigned char *flagpnt;
+
+                    memcpy(pnt, &vm4ip[2], sizeof(uint32_t));
+                    pnt += 4;
+                    flagpnt = pnt;
+                    if (len != 1) {
+                        v = (v << 1) | 1;
+                    }
+                    while ((nxt = v >> 7)) {
+                        *(pnt++) = ((unsigned char)v) | 0x80;
+                        v = nxt;
+                    }
+                    *(pnt++) = (unsigned char)v;
+                    if (len == 1) {
+                        *(pnt++) = *buf;
                     } else {
-                        if ((*(xc->curval_mem + offs)) == (*buf)) {
-                            if (!xc->curtime) {
-                                if (*buf != 'x')
-                                    return;
-                            } else {
-                                return;
-                            }
-                        }
+                        pnt = fstWriterStoreVector(pnt, flagpnt, buf, len);
                     }
 
-                    *(xc->curval_mem + offs) = *buf;
+                    vm4ip[3] = tchn_idx;
+                    vm4ip[2] = fpos;
+                    fpos = pnt - base;
                 }
+            }
+        }
+
+        xc->vchg_siz = fpos;
+    }
+#else
+    for (i = 0; i < num; i++) {
+        fstHandle handle = handles[i];
+        if (FST_LIKELY(handle && (handle <= maxhandle))) {
+            uint32_t *vm4ip = &valpos[4 * (handle - 1)];
+            if (FST_LIKELY(vm4ip[1])) {
+                fstWriterAppendValueChange(xc, vm4ip, (const unsigned char *)vals[i], vm4ip[1]);
+            }
+        }
+    }
 #endif
-                xc->vchg_siz += fstWriterUint32WithVarint32(xc, &vm4ip[2], xc->tchn_idx - vm4ip[3], buf,
-                                                            len); /* do one fwrite op only */
-                vm4ip[3] = xc->tchn_idx;
-                vm4ip[2] = fpos;
+}
+
+#ifndef FST_REMOVE_DUPLICATE_VC
+/*
+ * 2-state values handed over as machine words (least significant word first)
+ * go straight into vchg_mem as a packed record, skipping the byte per bit
+ * form entirely.  returns zero when the caller must take the ASCII path:
+ * before the first time change (curval_mem is byte per bit) or when bits does
+ * not match the declared length of the variable.
+ */
+static int fstWriterEmitPackedWords(struct fstWriterContext *xc, fstHandle handle, uint32_t bits, const void *val,
+                                    int is64)
+{
+    uint32_t *vm4ip;
+    uint32_t fpos, v, nxt;
+    uint32_t packed_len, k;
+    unsigned char *pnt;
+
+    if (FST_UNLIKELY(!xc || !handle || (handle > xc->maxhandle) || (bits < 2) || !xc->valpos_mem ||
+                     xc->is_initial_time)) {
+        return (0);
+    }
+
+    vm4ip = &(xc->valpos_mem[4 * (handle - 1)]);
+    if (FST_UNLIKELY(vm4ip[1] != bits)) {
+        return (0);
+    }
+
+    packed_len = (bits + 7) >> 3;
+    fstWriterReserveValueChanges(xc, packed_len + 10, "fstWriterEmitPackedWords");
+
+    fpos = xc->vchg_siz;
+    pnt = xc->vchg_mem + fpos;
+    memcpy(pnt, &vm4ip[2], sizeof(uint32_t));
+    pnt += 4;
+
+    v = ((xc->tchn_idx - vm4ip[3]) << 1) | 1;
+    while ((nxt = v >> 7)) {
+        *(pnt++) = ((unsigned char)v) | 0x80;
+        v = nxt;
+    }
+    *(pnt++) = (unsigned char)v;
+
+    for (k = 0; k < packed_len; k++) {
+        int32_t lo = (int32_t)bits - 8 - 8 * (int32_t)k; /* lowest value bit which lands in this byte */
+        unsigned char byte;
+
+        if (is64) {
+            const uint64_t *w = (const uint64_t *)val;
+            if (lo < 0) {
+                byte = (unsigned char)(w[0] << (-lo));
+            } else {
+                uint32_t sh = lo & 63;
+                uint64_t x = w[lo >> 6] >> sh;
+                if (sh > 56) {
+                    x |= w[(lo >> 6) + 1] << (64 - sh);
+                }
+                byte = (unsigned char)x;
+            }
+        } else {
+            const uint32_t *w = (const uint32_t *)val;
+            if (lo < 0) {
+                byte = (unsigned char)(w[0] << (-lo));
             } else {
-                offs = vm4ip[0];
-                memcpy(xc->curval_mem + offs, buf, len);
+                uint32_t sh = lo & 31;
+                uint32_t x = w[lo >> 5] >> sh;
+                if (sh > 24) {
+                    x |= w[(lo >> 5) + 1] << (32 - sh);
+                }
+                byte = (unsigned char)x;
             }
         }
+
+        *(pnt++) = byte;
     }
+
+    vm4ip[3] = xc->tchn_idx;
+    vm4ip[2] = fpos;
+    xc->vchg_siz = pnt - xc->vchg_mem;
+    return (1);
 }
+#endif
 
 void fstWriterEmitValueChange32(void *ctx, fstHandle handle, uint32_t bits, uint32_t val)
 {
     char buf[32];
     char *s = buf;
     uint32_t i;
+#ifndef FST_REMOVE_DUPLICATE_VC
+    if (fstWriterEmitPackedWords((struct fstWriterContext *)ctx, handle, bits, &val, 0)) {
+        return;
+    }
+#endif
     for (i = 0; i < bits; ++i) {
         *s++ = '0' + ((val >> (bits - i - 1)) & 1);
     }
@@ -2809,6 +3953,11 @@ void fstWriterEmitValueChange64(void *ctx, fstHandle handle, uint32_t bits, uint
     char buf[64];
     char *s = buf;
     uint32_t i;
+#ifndef FST_REMOVE_DUPLICATE_VC
+    if (fstWriterEmitPackedWords((struct fstWriterContext *)ctx, handle, bits, &val, 1)) {
+        return;
+    }
+#endif
     for (i = 0; i < bits; ++i) {
         *s++ = '0' + ((val >> (bits - i - 1)) & 1);
     }
@@ -2819,7 +3968,13 @@ void fstWriterEmitValueChangeVec32(void *ctx, fstHandle handle, uint32_t bits, c
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
     if (FST_UNLIKELY(bits <= 32)) {
         fstWriterEmitValueChange32(ctx, handle, bits, val[0]);
-    } else if (FST_LIKELY(xc)) {
+    }
+#ifndef FST_REMOVE_DUPLICATE_VC
+    else if (fstWriterEmitPackedWords(xc, handle, bits, val, 0)) {
+        return;
+    }
+#endif
+    else if (FST_LIKELY(xc)) {
         int bq = bits / 32;
         int br = bits & 31;
         int i;
@@ -2860,12 +4015,18 @@ void fstWriterEmitValueChangeVec64(void *ctx, fstHandle handle, uint32_t bits, c
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
     if (FST_UNLIKELY(bits <= 64)) {
         fstWriterEmitValueChange64(ctx, handle, bits, val[0]);
-    } else if (FST_LIKELY(xc)) {
+    }
+#ifndef FST_REMOVE_DUPLICATE_VC
+    else if (fstWriterEmitPackedWords(xc, handle, bits, val, 1)) {
+        return;
+    }
+#endif
+    else if (FST_LIKELY(xc)) {
         int bq = bits / 64;
         int br = bits & 63;
         int i;
         int w;
-        uint32_t v;
+        uint64_t v;
         unsigned char *s;
         if (FST_UNLIKELY(bits > xc->outval_alloc_siz)) {
             xc->outval_alloc_siz = bits * 2 + 1;
@@ -2985,6 +4146,13 @@ void fstWriterEmitTimeChange(void *ctx, uint64_t tim)
     }
 }
 
+void fstWriterEmitTimeChangeBatch(void *ctx, uint64_t tim, uint32_t num, const fstHandle *handles,
+                                  const void *const *vals)
+{
+    fstWriterEmitTimeChange(ctx, tim);
+    fstWriterEmitValueChangeBatch(ctx, num, handles, vals);
+}
+
 void fstWriterEmitDumpActive(void *ctx, int enable)
 {
     struct fstWriterContext *xc = (struct fstWriterContext *)ctx;
@@ -3072,9 +4240,86 @@ struct fstCurrHier
     int len;
 };
 
-struct fstReaderContext
+/*
+ * one entry per value change section, built by fstReaderInit() in file order
+ */
+struct fstReaderSection
 {
-    /* common entries */
+    fst_off_t pos; /* offset of the section type byte */
+    uint64_t seclen;
+    uint64_t beg_tim, end_tim;
+    int sectype;
+};
+
+/*
+ * value at time cache: decoded sections and the value change chains decoded
+ * out of them are kept most recently used first, and the least recently used
+ * entries are dropped once their bytes exceed rvat_cache_budget.  the entries
+ * in use by the current query are never dropped, so a zero budget keeps just
+ * one section and one chain resident.
+ */
+struct fstReaderRvatChain
+{
+    struct fstReaderRvatChain *prev, *next;
+    struct fstReaderRvatSection *sec;
+    fstHandle facidx; /* zero based */
+    uint64_t stamp;   /* xc->rvat_tick of the last use */
+
+    unsigned char *mem;
+    uint32_t len;
+
+    uint32_t pos_tidx; /* where the last lookup in this chain ended */
+    uint32_t pos_idx;
+    uint64_t pos_time;
+    unsigned pos_valid : 1;
+};
+
+struct fstReaderRvatSection
+{
+    struct fstReaderRvatSection *prev, *next;
+    fst_off_t blkpos; /* offset of the section length field */
+    uint64_t stamp;
+    uint64_t bytes; /* decoded size, chains are accounted separately */
+
+    uint64_t *time_table;
+    uint64_t beg_tim, end_tim;
+    unsigned char *frame_data;
+    uint64_t frame_maxhandle;
+    fst_off_t *chain_table;
+    uint32_t *chain_table_lengths;
+    uint64_t vc_maxhandle;
+    fst_off_t vc_start;
+    int packtype;
+
+    struct fstReaderRvatChain **chains; /* cached chains by facidx, allocated on first use */
+};
+
+/*
+ * file data that does not change after fstReaderInit(), owned jointly by a context
+ * and its fstReaderClone() copies and freed with the last of them
+ */
+struct fstReaderShared
+{
+    int refcount;
+    int fd;            /* dup of the (possibly unpacked) file, clones pread() from it, -1 if f has none */
+    fst_off_t file_len;
+
+    uint32_t *signal_lens;
+    unsigned char *signal_typs;
+    struct fstReaderSection *vc_sections;
+    uint64_t *blackout_times;
+    unsigned char *blackout_activity;
+
+    unsigned char *hier_mem;
+    uint64_t hier_mem_len;
+
+    unsigned char *mmap_base;
+    fst_off_t mmap_len;
+};
+
+struct fstReaderContext
+{
+    /* common entries */
 
     FILE *f, *fh;
 
@@ -3085,6 +4330,7 @@ struct fstReaderContext
     fstHandle maxhandle;
     uint64_t num_alias;
     uint64_t vc_section_count;
+    struct fstReaderSection *vc_sections; /* vc_section_count sized, NULL if end times are not ascending */
 
     uint32_t *signal_lens;                /* maxhandle sized */
     unsigned char *signal_typs;           /* maxhandle sized */
@@ -3117,28 +4363,20 @@ struct fstReaderContext
 
     uint64_t limit_range_start, limit_range_end;
 
+    unsigned int unpack_threads; /* sections decompressed concurrently by fstReaderIterBlocks2() */
+
     /* entries specific to read value at time functions */
 
-    unsigned rvat_data_valid : 1;
-    uint64_t *rvat_time_table;
-    uint64_t rvat_beg_tim, rvat_end_tim;
-    unsigned char *rvat_frame_data;
-    uint64_t rvat_frame_maxhandle;
-    fst_off_t *rvat_chain_table;
-    uint32_t *rvat_chain_table_lengths;
-    uint64_t rvat_vc_maxhandle;
-    fst_off_t rvat_vc_start;
     uint32_t *rvat_sig_offs;
-    int rvat_packtype;
-
-    uint32_t rvat_chain_len;
-    unsigned char *rvat_chain_mem;
-    fstHandle rvat_chain_facidx;
 
-    uint32_t rvat_chain_pos_tidx;
-    uint32_t rvat_chain_pos_idx;
-    uint64_t rvat_chain_pos_time;
-    unsigned rvat_chain_pos_valid : 1;
+    struct fstReaderRvatSection *rvat_sec;   /* section of the current query, also head of the section lru */
+    struct fstReaderRvatChain *rvat_chain;   /* chain of the current query, also head of the chain lru */
+    struct fstReaderRvatSection *rvat_sec_tail;
+    struct fstReaderRvatChain *rvat_chain_tail;
+    uint64_t rvat_cache_budget, rvat_cache_bytes;
+    uint64_t rvat_tick;
+    uint64_t rvat_sec_hits, rvat_sec_misses;
+    uint64_t rvat_chain_hits, rvat_chain_misses;
 
     /* entries specific to hierarchy traversal */
 
@@ -3151,7 +4389,17 @@ struct fstReaderContext
     char str_scope_nam[FST_ID_NAM_SIZ + 1];
     char str_scope_comp[FST_ID_NAM_SIZ + 1];
 
+    unsigned hier_in_memory : 1;    /* decompress the hierarchy into hier_mem instead of a temp file */
+    unsigned hier_fh_recreated : 1; /* fh is a temp file made by fstReaderRecreateHierFile() */
+    unsigned char *hier_mem;        /* hier_mem_len bytes followed by a NUL sentinel */
+    uint64_t hier_mem_len, hier_mem_pos;
+
+    struct fstFlatVar *flat_vars; /* built by fstReaderGetFlatVars() */
+    char *flat_var_names;
+    uint64_t num_flat_vars;
+
     unsigned fseek_failed : 1;
+    unsigned f_unpacked : 1; /* f is a temp file holding the unwrapped FST_BL_ZWRAPPER contents */
 
     /* self-buffered I/O for writes */
 
@@ -3161,8 +4409,17 @@ struct fstReaderContext
     unsigned char writex_buf[FST_WRITEX_MAX];
 #endif
 
+    /* read-only mapping of f made by fstReaderSetMmap() */
+
+    unsigned char *mmap_base;
+    fst_off_t mmap_len;
+    int mmap_advice;
+
     char *f_nam;
     char *fh_nam;
+
+    struct fstReaderShared *shared;      /* set once ctx has been cloned or is a clone */
+    struct fstReaderChunkIndex *zchunks; /* f decompresses a chunked wrapper, f holds the reference */
 };
 
 int fstReaderFseeko(struct fstReaderContext *xc, FILE *stream, fst_off_t offset, int whence)
@@ -3180,6 +4437,77 @@ int fstReaderFseeko(struct fstReaderContext *xc, FILE *stream, fst_off_t offset,
     return (rc);
 }
 
+/*
+ * returns a pointer into the fstReaderSetMmap() mapping when [offs, offs + len)
+ * lies within it, NULL otherwise (callers then fall back to stdio)
+ */
+static unsigned char *fstReaderMapped(struct fstReaderContext *xc, fst_off_t offs, uint64_t len)
+{
+    if (xc->mmap_base && (offs >= 0) && (offs <= xc->mmap_len) && (len <= (uint64_t)(xc->mmap_len - offs))) {
+        return (xc->mmap_base + offs);
+    }
+
+    return (NULL);
+}
+
+static void fstReaderMmapAdvise(struct fstReaderContext *xc, int sequential)
+{
+#if !defined __CYGWIN__ && !defined __MINGW32__ && defined(MADV_SEQUENTIAL) && defined(MADV_RANDOM)
+    int advice = sequential ? MADV_SEQUENTIAL : MADV_RANDOM;
+
+    if (xc->mmap_base && (xc->mmap_advice != advice)) {
+        madvise(xc->mmap_base, xc->mmap_len, advice);
+        xc->mmap_advice = advice;
+    }
+#else
+    (void)xc;
+    (void)sequential;
+#endif
+}
+
+/*
+ * reference counts on objects shared between a context and its clones
+ */
+static int fstReaderRefAdd(int *refcount, int delta)
+{
+#ifdef __GNUC__
+    return (__sync_add_and_fetch(refcount, delta));
+#else
+    *refcount += delta; /* clone and close from a single thread on such compilers */
+    return (*refcount);
+#endif
+}
+
+/*
+ * gunzip exactly dlen bytes of one gzip member (or zlib stream) at src into dst
+ */
+static int fstReaderGunzip(unsigned char *dst, uint64_t dlen, unsigned char *src, uint64_t slen)
+{
+    z_stream strm;
+    int rc;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 32 + MAX_WBITS) != Z_OK) { /* auto-detect gzip or zlib header */
+        return (0);
+    }
+
+    strm.next_in = src;
+    strm.next_out = dst;
+    do {
+        uInt in_step = (slen > 0x40000000) ? 0x40000000 : (uInt)slen;
+        uInt out_step = (dlen > 0x40000000) ? 0x40000000 : (uInt)dlen;
+
+        strm.avail_in = in_step;
+        strm.avail_out = out_step;
+        rc = inflate(&strm, Z_NO_FLUSH);
+        slen -= in_step - strm.avail_in;
+        dlen -= out_step - strm.avail_out;
+    } while ((rc == Z_OK) && (dlen || slen));
+
+    inflateEnd(&strm);
+    return (!dlen && ((rc == Z_STREAM_END) || (rc == Z_OK)));
+}
+
 #ifndef FST_WRITEX_DISABLE
 static void fstWritex(struct fstReaderContext *xc, void *v, int len)
 {
@@ -3534,6 +4862,86 @@ void fstReaderSetVcdExtensions(void *ctx, int enable)
     }
 }
 
+void fstReaderSetUnpackThreads(void *ctx, int numthreads)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (xc) {
+#ifdef FST_READER_PARALLEL
+        xc->unpack_threads = (numthreads > 1) ? numthreads : 1;
+#else
+        (void)numthreads;
+        xc->unpack_threads = 1;
+#endif
+    }
+}
+
+void fstReaderSetHierInMemory(void *ctx, int enable)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (xc) {
+        xc->hier_in_memory = (enable != 0);
+
+        if (enable && xc->hier_fh_recreated) { /* switch over on the next hierarchy access */
+            tmpfile_close(&xc->fh, &xc->fh_nam);
+            xc->hier_fh_recreated = 0;
+        } else if (!enable && xc->hier_mem) {
+            if (!xc->shared || (xc->hier_mem != xc->shared->hier_mem)) {
+                free(xc->hier_mem);
+            }
+            xc->hier_mem = NULL;
+        }
+        xc->do_rewind = 1;
+    }
+}
+
+void fstReaderSetMmap(void *ctx, int enable)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (!xc) {
+        return;
+    }
+
+    if (!enable) {
+        if (xc->mmap_base) {
+            if (!xc->shared || (xc->mmap_base != xc->shared->mmap_base)) {
+                fstMunmap(xc->mmap_base, xc->mmap_len);
+            }
+            xc->mmap_base = NULL;
+            xc->mmap_len = 0;
+            xc->mmap_advice = 0;
+        }
+    } else if (!xc->mmap_base) {
+        fst_off_t endfile;
+        unsigned char *pnt;
+
+        fstReaderFseeko(xc, xc->f, 0, SEEK_END);
+        endfile = ftello(xc->f);
+        if ((endfile <= 0) || ((uint64_t)endfile > (uint64_t)((size_t)-1))) {
+            return; /* nothing to map or too large for the address space, stay with stdio */
+        }
+
+        errno = 0;
+        pnt = (unsigned char *)fstMmap(NULL, endfile, PROT_READ, MAP_SHARED,
+                                       xc->shared ? xc->shared->fd : fileno(xc->f), 0);
+#if !defined __CYGWIN__ && !defined __MINGW32__
+        if (pnt == MAP_FAILED) {
+#ifdef FST_DEBUG
+            fprintf(stderr, FST_APIMESS "fstReaderSetMmap(), mmap failed: errno: %d\n", errno);
+#endif
+            pnt = NULL;
+        }
+#endif
+        if (pnt) {
+            xc->mmap_base = pnt;
+            xc->mmap_len = endfile;
+            xc->mmap_advice = 0;
+        }
+    }
+}
+
 void fstReaderIterBlocksSetNativeDoublesOnCallback(void *ctx, int enable)
 {
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
@@ -3577,10 +4985,11 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
 {
     int pass_status = 1;
 
-    if (!xc->fh) {
+    if (!xc->fh && !xc->hier_mem) {
         fst_off_t offs_cache = ftello(xc->f);
         char *fnam = (char *)malloc(strlen(xc->filename) + 6 + 16 + 32 + 1);
         unsigned char *mem = (unsigned char *)malloc(FST_GZIO_LEN);
+        unsigned char *hmem = NULL; /* in-memory destination when hier_in_memory is set */
         fst_off_t hl, uclen;
         fst_off_t clen = 0;
         gzFile zhandle = NULL;
@@ -3606,13 +5015,19 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
 #ifndef __MINGW32__
             fflush(xc->f);
 #endif
-            zfd = dup(fileno(xc->f));
-            zhandle = gzdopen(zfd, "rb");
-            if (!zhandle) {
-                close(zfd);
-                free(mem);
-                free(fnam);
-                return (0);
+            if (fileno(xc->f) < 0) { /* one of our own streams, inflate what it reads instead */
+                fstReaderFseeko(xc, xc->f, xc->hier_pos - 8, SEEK_SET);
+                clen = fstReaderUint64(xc->f) - 16;
+                uclen = fstReaderUint64(xc->f);
+            } else {
+                zfd = dup(fileno(xc->f));
+                zhandle = gzdopen(zfd, "rb");
+                if (!zhandle) {
+                    close(zfd);
+                    free(mem);
+                    free(fnam);
+                    return (0);
+                }
             }
         } else if ((htyp == FST_BL_HIER_LZ4) || (htyp == FST_BL_HIER_LZ4DUO)) {
             fstReaderFseeko(xc, xc->f, xc->hier_pos - 8, SEEK_SET); /* get section len */
@@ -3623,30 +5038,54 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
 #endif
         }
 
-#ifndef __MINGW32__
-        xc->fh = fopen(fnam, "w+b");
-        if (!xc->fh)
-#endif
-        {
-            xc->fh = tmpfile_open(&xc->fh_nam);
-            free(fnam);
-            fnam = NULL;
-            if (!xc->fh) {
-                tmpfile_close(&xc->fh, &xc->fh_nam);
+        if (xc->hier_in_memory && (htyp != FST_BL_SKIP)) {
+            if ((uint64_t)uclen >= (uint64_t)((size_t)-1) || !(hmem = (unsigned char *)malloc(uclen + 1))) {
+                if (zhandle) {
+                    gzclose(zhandle);
+                }
                 free(mem);
+                free(fnam);
                 return (0);
             }
-        }
+        } else {
+#ifndef __MINGW32__
+            xc->fh = fopen(fnam, "w+b");
+            if (!xc->fh)
+#endif
+            {
+                xc->fh = tmpfile_open(&xc->fh_nam);
+                free(fnam);
+                fnam = NULL;
+                if (!xc->fh) {
+                    tmpfile_close(&xc->fh, &xc->fh_nam);
+                    free(mem);
+                    return (0);
+                }
+            }
 
 #ifndef __MINGW32__
-        if (fnam)
-            unlink(fnam);
+            if (fnam)
+                unlink(fnam);
 #endif
+            xc->hier_fh_recreated = 1;
+        }
 
-        if (htyp == FST_BL_HIER) {
+        if ((htyp == FST_BL_HIER) && (!zhandle)) {
+            unsigned char *gz_cmem = (unsigned char *)malloc(clen);
+            unsigned char *gz_ucmem = hmem ? hmem : (unsigned char *)malloc(uclen);
+
+            pass_status = (fstFread(gz_cmem, clen, 1, xc->f) == 1) && fstReaderGunzip(gz_ucmem, uclen, gz_cmem, clen);
+            if (!hmem) {
+                if (pass_status && (fstFwrite(gz_ucmem, uclen, 1, xc->fh) != 1)) {
+                    pass_status = 0;
+                }
+                free(gz_ucmem);
+            }
+            free(gz_cmem);
+        } else if (htyp == FST_BL_HIER) {
             for (hl = 0; hl < uclen; hl += FST_GZIO_LEN) {
                 size_t len = ((uclen - hl) > FST_GZIO_LEN) ? FST_GZIO_LEN : (uclen - hl);
-                size_t gzreadlen = gzread(zhandle, mem, len); /* rc should equal len... */
+                size_t gzreadlen = gzread(zhandle, hmem ? (hmem + hl) : mem, len); /* rc should equal len... */
                 size_t fwlen;
 
                 if (gzreadlen != len) {
@@ -3654,16 +5093,18 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
                     break;
                 }
 
-                fwlen = fstFwrite(mem, len, 1, xc->fh);
-                if (fwlen != 1) {
-                    pass_status = 0;
-                    break;
+                if (!hmem) {
+                    fwlen = fstFwrite(mem, len, 1, xc->fh);
+                    if (fwlen != 1) {
+                        pass_status = 0;
+                        break;
+                    }
                 }
             }
             gzclose(zhandle);
         } else if (htyp == FST_BL_HIER_LZ4DUO) {
             unsigned char *lz4_cmem = (unsigned char *)malloc(clen);
-            unsigned char *lz4_ucmem = (unsigned char *)malloc(uclen);
+            unsigned char *lz4_ucmem = hmem ? hmem : (unsigned char *)malloc(uclen);
             unsigned char *lz4_ucmem2;
             uint64_t uclen2;
             int skiplen2 = 0;
@@ -3679,27 +5120,31 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
                 pass_status = (uclen == LZ4_decompress_safe_partial((char *)lz4_ucmem2, (char *)lz4_ucmem, uclen2,
                                                                     uclen, uclen));
 
-                if (fstFwrite(lz4_ucmem, uclen, 1, xc->fh) != 1) {
+                if (!hmem && (fstFwrite(lz4_ucmem, uclen, 1, xc->fh) != 1)) {
                     pass_status = 0;
                 }
             }
 
             free(lz4_ucmem2);
-            free(lz4_ucmem);
+            if (!hmem) {
+                free(lz4_ucmem);
+            }
             free(lz4_cmem);
         } else if (htyp == FST_BL_HIER_LZ4) {
             unsigned char *lz4_cmem = (unsigned char *)malloc(clen);
-            unsigned char *lz4_ucmem = (unsigned char *)malloc(uclen);
+            unsigned char *lz4_ucmem = hmem ? hmem : (unsigned char *)malloc(uclen);
 
             fstFread(lz4_cmem, clen, 1, xc->f);
             pass_status =
                     (uclen == LZ4_decompress_safe_partial((char *)lz4_cmem, (char *)lz4_ucmem, clen, uclen, uclen));
 
-            if (fstFwrite(lz4_ucmem, uclen, 1, xc->fh) != 1) {
-                pass_status = 0;
-            }
+            if (!hmem) {
+                if (fstFwrite(lz4_ucmem, uclen, 1, xc->fh) != 1) {
+                    pass_status = 0;
+                }
 
-            free(lz4_ucmem);
+                free(lz4_ucmem);
+            }
             free(lz4_cmem);
         } else /* FST_BL_SKIP */
         {
@@ -3710,6 +5155,17 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
             }
         }
 
+        if (hmem) {
+            if (pass_status) {
+                hmem[uclen] = 0;
+                xc->hier_mem = hmem;
+                xc->hier_mem_len = uclen;
+                xc->hier_mem_pos = 0;
+            } else {
+                free(hmem);
+            }
+        }
+
         free(mem);
         free(fnam);
 
@@ -3719,6 +5175,94 @@ static int fstReaderRecreateHierFile(struct fstReaderContext *xc)
     return (pass_status);
 }
 
+/*
+ * hierarchy stream access: reads from the decompressed in-memory copy when
+ * there is one, otherwise from the temporary (or .hier) file
+ */
+static int fstReaderHierGetc(struct fstReaderContext *xc)
+{
+    if (xc->hier_mem) {
+        return ((xc->hier_mem_pos < xc->hier_mem_len) ? xc->hier_mem[xc->hier_mem_pos++] : EOF);
+    }
+
+    return (fgetc(xc->fh));
+}
+
+static int fstReaderHierEof(struct fstReaderContext *xc)
+{
+    return (xc->hier_mem ? (xc->hier_mem_pos >= xc->hier_mem_len) : feof(xc->fh));
+}
+
+static void fstReaderHierRewind(struct fstReaderContext *xc)
+{
+    if (xc->hier_mem) {
+        xc->hier_mem_pos = 0;
+    } else {
+        fstReaderFseeko(xc, xc->fh, 0, SEEK_SET);
+        clearerr(xc->fh);
+    }
+}
+
+static uint32_t fstReaderHierVarint32(struct fstReaderContext *xc)
+{
+    if (xc->hier_mem) {
+        int skiplen;
+        uint32_t rc = fstGetVarint32(xc->hier_mem + xc->hier_mem_pos, &skiplen);
+
+        xc->hier_mem_pos += skiplen;
+        return (rc);
+    }
+
+    return (fstReaderVarint32(xc->fh));
+}
+
+static uint64_t fstReaderHierVarint64(struct fstReaderContext *xc)
+{
+    if (xc->hier_mem) {
+        int skiplen;
+        uint64_t rc = fstGetVarint64(xc->hier_mem + xc->hier_mem_pos, &skiplen);
+
+        xc->hier_mem_pos += skiplen;
+        return (rc);
+    }
+
+    return (fstReaderVarint64(xc->fh));
+}
+
+/*
+ * returns the next NUL terminated name: in place for the in-memory copy,
+ * otherwise copied into buf
+ */
+static const char *fstReaderHierString(struct fstReaderContext *xc, char *buf, uint32_t *len)
+{
+    const char *str;
+    uint32_t slen;
+
+    if (xc->hier_mem) {
+        if (xc->hier_mem_pos > xc->hier_mem_len) {
+            xc->hier_mem_pos = xc->hier_mem_len; /* points at the sentinel */
+        }
+        str = (const char *)xc->hier_mem + xc->hier_mem_pos;
+        slen = strlen(str);
+        xc->hier_mem_pos += slen + 1;
+    } else {
+        char *pnt = buf;
+        int ch;
+
+        while ((ch = fgetc(xc->fh)) && (ch != EOF)) {
+            *(pnt++) = ch;
+        }
+        *pnt = 0;
+        str = buf;
+        slen = pnt - buf;
+    }
+
+    if (len) {
+        *len = slen;
+    }
+    return (str);
+}
+
 int fstReaderIterateHierRewind(void *ctx)
 {
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
@@ -3726,7 +5270,7 @@ int fstReaderIterateHierRewind(void *ctx)
 
     if (xc) {
         pass_status = 1;
-        if (!xc->fh) {
+        if (!xc->fh && !xc->hier_mem) {
             pass_status = fstReaderRecreateHierFile(xc);
         }
 
@@ -3741,13 +5285,11 @@ struct fstHier *fstReaderIterateHier(void *ctx)
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
     int isfeof;
     fstHandle alias;
-    char *pnt;
-    int ch;
 
     if (!xc)
         return (NULL);
 
-    if (!xc->fh) {
+    if (!xc->fh && !xc->hier_mem) {
         if (!fstReaderRecreateHierFile(xc)) {
             return (NULL);
         }
@@ -3756,29 +5298,19 @@ struct fstHier *fstReaderIterateHier(void *ctx)
     if (xc->do_rewind) {
         xc->do_rewind = 0;
         xc->current_handle = 0;
-        fstReaderFseeko(xc, xc->fh, 0, SEEK_SET);
-        clearerr(xc->fh);
+        fstReaderHierRewind(xc);
     }
 
-    if (!(isfeof = feof(xc->fh))) {
-        int tag = fgetc(xc->fh);
+    if (!(isfeof = fstReaderHierEof(xc))) {
+        int tag = fstReaderHierGetc(xc);
         switch (tag) {
         case FST_ST_VCD_SCOPE:
             xc->hier.htyp = FST_HT_SCOPE;
-            xc->hier.u.scope.typ = fgetc(xc->fh);
-            xc->hier.u.scope.name = pnt = xc->str_scope_nam;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* scopename */
-            *pnt = 0;
-            xc->hier.u.scope.name_length = pnt - xc->hier.u.scope.name;
-
-            xc->hier.u.scope.component = pnt = xc->str_scope_comp;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* scopecomp */
-            *pnt = 0;
-            xc->hier.u.scope.component_length = pnt - xc->hier.u.scope.component;
+            xc->hier.u.scope.typ = fstReaderHierGetc(xc);
+            xc->hier.u.scope.name =
+                    fstReaderHierString(xc, xc->str_scope_nam, &xc->hier.u.scope.name_length); /* scopename */
+            xc->hier.u.scope.component = fstReaderHierString(xc, xc->str_scope_comp,
+                                                             &xc->hier.u.scope.component_length); /* scopecomp */
             break;
 
         case FST_ST_VCD_UPSCOPE:
@@ -3787,22 +5319,18 @@ struct fstHier *fstReaderIterateHier(void *ctx)
 
         case FST_ST_GEN_ATTRBEGIN:
             xc->hier.htyp = FST_HT_ATTRBEGIN;
-            xc->hier.u.attr.typ = fgetc(xc->fh);
-            xc->hier.u.attr.subtype = fgetc(xc->fh);
-            xc->hier.u.attr.name = pnt = xc->str_scope_nam;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* scopename */
-            *pnt = 0;
-            xc->hier.u.attr.name_length = pnt - xc->hier.u.scope.name;
+            xc->hier.u.attr.typ = fstReaderHierGetc(xc);
+            xc->hier.u.attr.subtype = fstReaderHierGetc(xc);
+            xc->hier.u.attr.name =
+                    fstReaderHierString(xc, xc->str_scope_nam, &xc->hier.u.attr.name_length); /* scopename */
 
-            xc->hier.u.attr.arg = fstReaderVarint64(xc->fh);
+            xc->hier.u.attr.arg = fstReaderHierVarint64(xc);
 
             if (xc->hier.u.attr.typ == FST_AT_MISC) {
                 if ((xc->hier.u.attr.subtype == FST_MT_SOURCESTEM) || (xc->hier.u.attr.subtype == FST_MT_SOURCEISTEM)) {
                     int sidx_skiplen_dummy = 0;
                     xc->hier.u.attr.arg_from_name =
-                            fstGetVarint64((unsigned char *)xc->str_scope_nam, &sidx_skiplen_dummy);
+                            fstGetVarint64((unsigned char *)xc->hier.u.attr.name, &sidx_skiplen_dummy);
                 }
             }
             break;
@@ -3846,20 +5374,16 @@ struct fstHier *fstReaderIterateHier(void *ctx)
             xc->hier.u.var.sdt_workspace = FST_SDT_NONE;
             xc->hier.u.var.sxt_workspace = 0;
             xc->hier.u.var.typ = tag;
-            xc->hier.u.var.direction = fgetc(xc->fh);
-            xc->hier.u.var.name = pnt = xc->str_scope_nam;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* varname */
-            *pnt = 0;
-            xc->hier.u.var.name_length = pnt - xc->hier.u.var.name;
-            xc->hier.u.var.length = fstReaderVarint32(xc->fh);
+            xc->hier.u.var.direction = fstReaderHierGetc(xc);
+            xc->hier.u.var.name =
+                    fstReaderHierString(xc, xc->str_scope_nam, &xc->hier.u.var.name_length); /* varname */
+            xc->hier.u.var.length = fstReaderHierVarint32(xc);
             if (tag == FST_VT_VCD_PORT) {
                 xc->hier.u.var.length -= 2; /* removal of delimiting spaces */
                 xc->hier.u.var.length /= 3; /* port -> signal size adjust */
             }
 
-            alias = fstReaderVarint32(xc->fh);
+            alias = fstReaderHierVarint32(xc);
 
             if (!alias) {
                 xc->current_handle++;
@@ -3881,12 +5405,117 @@ struct fstHier *fstReaderIterateHier(void *ctx)
     return (!isfeof ? &xc->hier : NULL);
 }
 
+/*
+ * flattens the hierarchy into one entry per var with its full dotted name, the
+ * table is kept until fstReaderClose() (this rewinds fstReaderIterateHier())
+ */
+const struct fstFlatVar *fstReaderGetFlatVars(void *ctx, uint64_t *num_vars)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstHier *h;
+    uint64_t vars_alloc = 0;
+    uint64_t names_len = 0, names_alloc = 0;
+    uint64_t *name_offs = NULL;
+    uint32_t *scope_lens = NULL;
+    uint32_t scope_depth = 0, scope_alloc = 0;
+    char *path = NULL;
+    uint32_t path_len = 0, path_alloc = 0;
+    uint64_t i;
+
+    if (num_vars) {
+        *num_vars = 0;
+    }
+
+    if (!xc) {
+        return (NULL);
+    }
+
+    if (!xc->flat_vars) {
+        if (!fstReaderIterateHierRewind(xc)) {
+            return (NULL);
+        }
+
+        xc->num_flat_vars = 0;
+        while ((h = fstReaderIterateHier(xc))) {
+            if (h->htyp == FST_HT_SCOPE) {
+                uint32_t need = path_len + 1 + h->u.scope.name_length + 1;
+
+                if (scope_depth == scope_alloc) {
+                    scope_alloc = scope_alloc ? (scope_alloc * 2) : 64;
+                    scope_lens = (uint32_t *)realloc(scope_lens, scope_alloc * sizeof(uint32_t));
+                }
+                scope_lens[scope_depth++] = path_len;
+
+                if (need > path_alloc) {
+                    path_alloc = need * 2;
+                    path = (char *)realloc(path, path_alloc);
+                }
+                if (path_len) {
+                    path[path_len++] = '.';
+                }
+                memcpy(path + path_len, h->u.scope.name, h->u.scope.name_length);
+                path_len += h->u.scope.name_length;
+            } else if (h->htyp == FST_HT_UPSCOPE) {
+                if (scope_depth) {
+                    path_len = scope_lens[--scope_depth];
+                }
+            } else if (h->htyp == FST_HT_VAR) {
+                struct fstFlatVar *fv;
+                uint64_t need = names_len + path_len + 1 + h->u.var.name_length + 1;
+
+                if (xc->num_flat_vars == vars_alloc) {
+                    vars_alloc = vars_alloc ? (vars_alloc * 2) : 1024;
+                    xc->flat_vars =
+                            (struct fstFlatVar *)realloc(xc->flat_vars, vars_alloc * sizeof(struct fstFlatVar));
+                    name_offs = (uint64_t *)realloc(name_offs, vars_alloc * sizeof(uint64_t));
+                }
+                if (need > names_alloc) {
+                    names_alloc = need * 2;
+                    xc->flat_var_names = (char *)realloc(xc->flat_var_names, names_alloc);
+                }
+
+                name_offs[xc->num_flat_vars] = names_len;
+                if (path_len) {
+                    memcpy(xc->flat_var_names + names_len, path, path_len);
+                    names_len += path_len;
+                    xc->flat_var_names[names_len++] = '.';
+                }
+                memcpy(xc->flat_var_names + names_len, h->u.var.name, h->u.var.name_length);
+                names_len += h->u.var.name_length;
+                xc->flat_var_names[names_len++] = 0;
+
+                fv = xc->flat_vars + xc->num_flat_vars++;
+                fv->name_length = names_len - 1 - name_offs[xc->num_flat_vars - 1];
+                fv->length = h->u.var.length;
+                fv->handle = h->u.var.handle;
+                fv->typ = h->u.var.typ;
+                fv->direction = h->u.var.direction;
+                fv->is_alias = h->u.var.is_alias;
+            }
+        }
+
+        for (i = 0; i < xc->num_flat_vars; i++) {
+            xc->flat_vars[i].name = xc->flat_var_names + name_offs[i];
+        }
+
+        free(name_offs);
+        free(scope_lens);
+        free(path);
+        xc->do_rewind = 1;
+    }
+
+    if (num_vars) {
+        *num_vars = xc->num_flat_vars;
+    }
+    return (xc->flat_vars);
+}
+
 int fstReaderProcessHier(void *ctx, FILE *fv)
 {
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
-    char *str;
-    char *pnt;
-    int ch, scopetype;
+    char *strbuf;
+    const char *str;
+    int scopetype;
     int vartype;
     uint32_t len, alias;
     /* uint32_t maxvalpos=0; */
@@ -3900,13 +5529,13 @@ int fstReaderProcessHier(void *ctx, FILE *fv)
 
     xc->longest_signal_value_len = 32; /* arbitrarily set at 32...this is much longer than an expanded double */
 
-    if (!xc->fh) {
+    if (!xc->fh && !xc->hier_mem) {
         if (!fstReaderRecreateHierFile(xc)) {
             return (0);
         }
     }
 
-    str = (char *)malloc(FST_ID_NAM_ATTR_SIZ + 1);
+    strbuf = (char *)malloc(FST_ID_NAM_ATTR_SIZ + 1);
 
     if (fv) {
         char time_dimension[2] = {0, 0};
@@ -4007,27 +5636,26 @@ int fstReaderProcessHier(void *ctx, FILE *fv)
     xc->maxhandle = 0;
     xc->num_alias = 0;
 
-    free(xc->signal_lens);
+    if (!xc->shared || (xc->signal_lens != xc->shared->signal_lens)) {
+        free(xc->signal_lens);
+    }
     xc->signal_lens = (uint32_t *)malloc(num_signal_dyn * sizeof(uint32_t));
 
-    free(xc->signal_typs);
+    if (!xc->shared || (xc->signal_typs != xc->shared->signal_typs)) {
+        free(xc->signal_typs);
+    }
     xc->signal_typs = (unsigned char *)malloc(num_signal_dyn * sizeof(unsigned char));
 
-    fstReaderFseeko(xc, xc->fh, 0, SEEK_SET);
-    while (!feof(xc->fh)) {
-        int tag = fgetc(xc->fh);
+    fstReaderHierRewind(xc);
+    while (!fstReaderHierEof(xc)) {
+        int tag = fstReaderHierGetc(xc);
         switch (tag) {
         case FST_ST_VCD_SCOPE:
-            scopetype = fgetc(xc->fh);
+            scopetype = fstReaderHierGetc(xc);
             if ((scopetype < FST_ST_MIN) || (scopetype > FST_ST_MAX))
                 scopetype = FST_ST_VCD_MODULE;
-            pnt = str;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* scopename */
-            *pnt = 0;
-            while (fgetc(xc->fh)) {
-            }; /* scopecomp */
+            str = fstReaderHierString(xc, strbuf, NULL);          /* scopename */
+            fstReaderHierString(xc, xc->str_scope_comp, NULL); /* scopecomp */
 
             if (fv)
                 fprintf(fv, "$scope %s %s $end\n", modtypes[scopetype], str);
@@ -4039,19 +5667,15 @@ int fstReaderProcessHier(void *ctx, FILE *fv)
             break;
 
         case FST_ST_GEN_ATTRBEGIN:
-            attrtype = fgetc(xc->fh);
-            subtype = fgetc(xc->fh);
-            pnt = str;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* attrname */
-            *pnt = 0;
+            attrtype = fstReaderHierGetc(xc);
+            subtype = fstReaderHierGetc(xc);
+            str = fstReaderHierString(xc, strbuf, NULL); /* attrname */
 
             if (!str[0]) {
-                strcpy(str, "\"\"");
+                str = "\"\"";
             }
 
-            attrarg = fstReaderVarint64(xc->fh);
+            attrarg = fstReaderHierVarint64(xc);
 
             if (fv && xc->use_vcd_extensions) {
                 switch (attrtype) {
@@ -4131,14 +5755,10 @@ int fstReaderProcessHier(void *ctx, FILE *fv)
         case FST_VT_SV_ENUM:
         case FST_VT_SV_SHORTREAL:
             vartype = tag;
-            /* vardir = */ fgetc(xc->fh); /* unused in VCD reader, but need to advance read pointer */
-            pnt = str;
-            while ((ch = fgetc(xc->fh))) {
-                *(pnt++) = ch;
-            }; /* varname */
-            *pnt = 0;
-            len = fstReaderVarint32(xc->fh);
-            alias = fstReaderVarint32(xc->fh);
+            /* vardir = */ fstReaderHierGetc(xc); /* unused in VCD reader, but need to advance read pointer */
+            str = fstReaderHierString(xc, strbuf, NULL); /* varname */
+            len = fstReaderHierVarint32(xc);
+            alias = fstReaderHierVarint32(xc);
 
             if (!alias) {
                 if (xc->maxhandle == num_signal_dyn) {
@@ -4204,20 +5824,320 @@ int fstReaderProcessHier(void *ctx, FILE *fv)
 
     xc->var_count = xc->maxhandle + xc->num_alias;
 
-    free(str);
+    free(strbuf);
     return (1);
 }
 
 /*
  * reader file open/close functions
  */
-int fstReaderInit(struct fstReaderContext *xc)
+/*
+ * member boundaries of an FST_BL_ZWRAPPER_CHUNKED file, shared by every
+ * stream that decompresses it
+ */
+struct fstReaderChunkIndex
 {
-    fst_off_t blkpos = 0;
-    fst_off_t endfile;
-    uint64_t seclen;
+    int refcount;
+    int fd; /* the wrapped file, only read with pread() */
+    uint64_t uclen, chunk_len, nchunks;
+    fst_off_t *offs; /* nchunks + 1 entries */
+};
+
+static void fstReaderChunkIndexRelease(struct fstReaderChunkIndex *ci)
+{
+    if (fstReaderRefAdd(&ci->refcount, -1) == 0) {
+        if (ci->fd >= 0) {
+            close(ci->fd);
+        }
+        free(ci->offs);
+        free(ci);
+    }
+}
+
+#define FST_READER_CHUNK_CACHE (16) /* decompressed chunks kept per stream */
+
+/*
+ * a read-only stdio stream of our own: either pread()s on a descriptor that
+ * other streams share (clones), or a chunked wrapper decompressed on demand
+ */
+struct fstReaderStream
+{
+    fst_off_t pos, len;
+    int fd;
+    struct fstReaderChunkIndex *ci;
+
+    uint64_t chunk_num[FST_READER_CHUNK_CACHE]; /* chunk index + 1, 0 for an empty slot */
+    uint64_t chunk_tick[FST_READER_CHUNK_CACHE];
+    unsigned char *chunk_mem[FST_READER_CHUNK_CACHE];
+    unsigned char *cmem;
+    uint64_t cmem_len;
+    uint64_t tick;
+};
+
+static unsigned char *fstReaderStreamChunk(struct fstReaderStream *rs, uint64_t cnum)
+{
+    struct fstReaderChunkIndex *ci = rs->ci;
+    uint64_t clen = ci->offs[cnum + 1] - ci->offs[cnum];
+    uint64_t uclen = (cnum + 1 < ci->nchunks) ? ci->chunk_len : (ci->uclen - cnum * ci->chunk_len);
+    int i, victim = 0;
+
+    for (i = 0; i < FST_READER_CHUNK_CACHE; i++) {
+        if (rs->chunk_num[i] == cnum + 1) {
+            rs->chunk_tick[i] = ++rs->tick;
+            return (rs->chunk_mem[i]);
+        }
+        if (rs->chunk_tick[i] < rs->chunk_tick[victim]) {
+            victim = i;
+        }
+    }
+
+    if (clen > rs->cmem_len) {
+        free(rs->cmem);
+        rs->cmem = (unsigned char *)malloc(rs->cmem_len = clen);
+    }
+    if (!rs->chunk_mem[victim]) {
+        rs->chunk_mem[victim] = (unsigned char *)malloc(ci->chunk_len);
+    }
+    rs->chunk_num[victim] = 0;
+
+    if ((pread(ci->fd, rs->cmem, clen, ci->offs[cnum]) != (ssize_t)clen) ||
+        (!fstReaderGunzip(rs->chunk_mem[victim], uclen, rs->cmem, clen))) {
+        return (NULL);
+    }
+
+    rs->chunk_num[victim] = cnum + 1;
+    rs->chunk_tick[victim] = ++rs->tick;
+    return (rs->chunk_mem[victim]);
+}
+
+static fst_off_t fstReaderStreamRead(struct fstReaderStream *rs, char *buf, size_t size)
+{
+    fst_off_t total = 0;
+
+    if (!rs->ci) {
+        ssize_t rc = pread(rs->fd, buf, size, rs->pos);
+
+        if (rc > 0) {
+            rs->pos += rc;
+        }
+        return (rc);
+    }
+
+    while (size && (rs->pos < rs->len)) {
+        uint64_t cnum = rs->pos / rs->ci->chunk_len;
+        uint64_t coff = rs->pos - cnum * rs->ci->chunk_len;
+        uint64_t clen = (cnum + 1 < rs->ci->nchunks) ? rs->ci->chunk_len : (rs->len - cnum * rs->ci->chunk_len);
+        uint64_t avail = clen - coff;
+        unsigned char *mem = fstReaderStreamChunk(rs, cnum);
+
+        if (!mem) {
+            return (total ? total : -1);
+        }
+        if (avail > size) {
+            avail = size;
+        }
+        memcpy(buf, mem + coff, avail);
+        buf += avail;
+        size -= avail;
+        rs->pos += avail;
+        total += avail;
+    }
+
+    return (total);
+}
+
+static fst_off_t fstReaderStreamSeek(struct fstReaderStream *rs, fst_off_t offset, int whence)
+{
+    fst_off_t base = (whence == SEEK_SET) ? 0 : ((whence == SEEK_CUR) ? rs->pos : rs->len);
+
+    if (base + offset < 0) {
+        return (-1);
+    }
+    return (rs->pos = base + offset);
+}
+
+static int fstReaderStreamClose(void *cookie)
+{
+    struct fstReaderStream *rs = (struct fstReaderStream *)cookie;
+    int i;
+
+    if (rs->ci) {
+        for (i = 0; i < FST_READER_CHUNK_CACHE; i++) {
+            free(rs->chunk_mem[i]);
+        }
+        free(rs->cmem);
+        fstReaderChunkIndexRelease(rs->ci);
+    }
+    free(rs);
+    return (0);
+}
+
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+#define FST_READER_STREAMS
+
+static ssize_t fstReaderStreamReadFn(void *cookie, char *buf, size_t size)
+{
+    return (fstReaderStreamRead((struct fstReaderStream *)cookie, buf, size));
+}
+
+static int fstReaderStreamSeekFn(void *cookie, off64_t *offset, int whence)
+{
+    fst_off_t pos = fstReaderStreamSeek((struct fstReaderStream *)cookie, *offset, whence);
+
+    if (pos < 0) {
+        return (-1);
+    }
+    *offset = pos;
+    return (0);
+}
+
+static FILE *fstReaderStreamFopen(struct fstReaderStream *rs)
+{
+    cookie_io_functions_t io;
+
+    io.read = fstReaderStreamReadFn;
+    io.write = NULL;
+    io.seek = fstReaderStreamSeekFn;
+    io.close = fstReaderStreamClose;
+    return (fopencookie(rs, "rb", io));
+}
+
+#elif defined(FST_MACOSX) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) ||             \
+        defined(__DragonFly__)
+#define FST_READER_STREAMS
+
+static int fstReaderStreamReadFn(void *cookie, char *buf, int size)
+{
+    return ((int)fstReaderStreamRead((struct fstReaderStream *)cookie, buf, size));
+}
+
+static fpos_t fstReaderStreamSeekFn(void *cookie, fpos_t offset, int whence)
+{
+    return (fstReaderStreamSeek((struct fstReaderStream *)cookie, offset, whence));
+}
+
+static FILE *fstReaderStreamFopen(struct fstReaderStream *rs)
+{
+    return (funopen(rs, fstReaderStreamReadFn, NULL, fstReaderStreamSeekFn, fstReaderStreamClose));
+}
+#endif
+
+#ifdef FST_READER_STREAMS
+/*
+ * opens a stream over fd (len bytes long) or, when ci is non-NULL, over the
+ * file ci decompresses; the stream takes a reference on ci
+ */
+static FILE *fstReaderStreamOpen(int fd, fst_off_t len, struct fstReaderChunkIndex *ci)
+{
+    struct fstReaderStream *rs = (struct fstReaderStream *)calloc(1, sizeof(struct fstReaderStream));
+    FILE *f;
+
+    rs->fd = fd;
+    rs->len = ci ? (fst_off_t)ci->uclen : len;
+    if (ci) {
+        rs->ci = ci;
+        fstReaderRefAdd(&ci->refcount, 1);
+    }
+
+    if (!(f = fstReaderStreamFopen(rs))) {
+        fstReaderStreamClose(rs);
+    }
+    return (f);
+}
+#endif
+
+/*
+ * reads the chunk index of an FST_BL_ZWRAPPER_CHUNKED file: type byte, seclen,
+ * uncompressed length, chunk length, the gzip members and then one u64
+ * compressed length per member; the stream starts with one reference
+ */
+static struct fstReaderChunkIndex *fstReaderReadChunkIndex(struct fstReaderContext *xc)
+{
+    struct fstReaderChunkIndex *ci;
+    uint64_t seclen, i;
+    fst_off_t idx_pos;
+
+    fstReaderFseeko(xc, xc->f, 1, SEEK_SET);
+    seclen = fstReaderUint64(xc->f);
+    if (!seclen) {
+        return (NULL); /* not finished compressing, this is a failed read */
+    }
+
+    ci = (struct fstReaderChunkIndex *)calloc(1, sizeof(struct fstReaderChunkIndex));
+    ci->refcount = 1;
+    ci->fd = -1;
+    ci->uclen = fstReaderUint64(xc->f);
+    ci->chunk_len = fstReaderUint64(xc->f);
+    ci->nchunks = ci->chunk_len ? ((ci->uclen + ci->chunk_len - 1) / ci->chunk_len) : 0;
+    idx_pos = 1 + seclen - ci->nchunks * 8;
+
+    if ((!ci->nchunks) || ((uint64_t)seclen < 24 + ci->nchunks * 8) || (ci->chunk_len > ((size_t)-1))) {
+        fstReaderChunkIndexRelease(ci);
+        return (NULL);
+    }
+
+    ci->offs = (fst_off_t *)malloc((ci->nchunks + 1) * sizeof(fst_off_t));
+    ci->offs[0] = 1 + 8 + 8 + 8;
+    fstReaderFseeko(xc, xc->f, idx_pos, SEEK_SET);
+    for (i = 0; i < ci->nchunks; i++) {
+        ci->offs[i + 1] = ci->offs[i] + fstReaderUint64(xc->f);
+    }
+
+    if (ci->offs[ci->nchunks] != idx_pos) {
+        fstReaderChunkIndexRelease(ci);
+        return (NULL);
+    }
+
+    return (ci);
+}
+
+#ifndef FST_READER_STREAMS
+/* without stdio streams of our own, inflate every chunk into a temp file up front */
+static FILE *fstReaderUnpackChunks(struct fstReaderContext *xc, struct fstReaderChunkIndex *ci)
+{
+    FILE *fcomp = tmpfile_open(&xc->f_nam);
+    unsigned char *cmem = NULL, *ucmem;
+    uint64_t i, cmem_len = 0;
+
+    if (!fcomp) {
+        return (NULL);
+    }
+
+    ucmem = (unsigned char *)malloc(ci->chunk_len);
+    fstReaderFseeko(xc, xc->f, ci->offs[0], SEEK_SET);
+    for (i = 0; i < ci->nchunks; i++) {
+        uint64_t clen = ci->offs[i + 1] - ci->offs[i];
+        uint64_t uclen = (i + 1 < ci->nchunks) ? ci->chunk_len : (ci->uclen - i * ci->chunk_len);
+
+        if (clen > cmem_len) {
+            free(cmem);
+            cmem = (unsigned char *)malloc(cmem_len = clen);
+        }
+        if ((fstFread(cmem, clen, 1, xc->f) != 1) || (!fstReaderGunzip(ucmem, uclen, cmem, clen)) ||
+            (fstFwrite(ucmem, uclen, 1, fcomp) != 1)) {
+            tmpfile_close(&fcomp, &xc->f_nam);
+            break;
+        }
+    }
+
+    free(ucmem);
+    free(cmem);
+    if (fcomp) {
+        fflush(fcomp);
+    }
+    return (fcomp);
+}
+#endif
+
+int fstReaderInit(struct fstReaderContext *xc)
+{
+    fst_off_t blkpos = 0;
+    fst_off_t endfile;
+    uint64_t seclen;
     int sectype;
     uint64_t vc_section_count_actual = 0;
+    uint64_t vc_sections_alloc = 0;
+    int vc_sections_sorted = 1;
     int hdr_incomplete = 0;
     int hdr_seen = 0;
     int gzread_pass_status = 1;
@@ -4296,6 +6216,30 @@ int fstReaderInit(struct fstReaderContext *xc)
         fflush(fcomp);
         fclose(xc->f);
         xc->f = fcomp;
+        xc->f_unpacked = 1;
+    } else if (sectype == FST_BL_ZWRAPPER_CHUNKED) {
+        struct fstReaderChunkIndex *ci = fstReaderReadChunkIndex(xc);
+        FILE *fcomp;
+
+        if (!ci) {
+            return (0);
+        }
+
+#ifdef FST_READER_STREAMS
+        ci->fd = dup(fileno(xc->f));
+        fcomp = fstReaderStreamOpen(-1, 0, ci); /* chunks are inflated as reads reach them */
+        xc->zchunks = fcomp ? ci : NULL;
+#else
+        fcomp = fstReaderUnpackChunks(xc, ci);
+#endif
+        fstReaderChunkIndexRelease(ci);
+
+        if (!fcomp) {
+            return (0);
+        }
+        fclose(xc->f);
+        xc->f = fcomp;
+        xc->f_unpacked = 1;
     }
 
     if (gzread_pass_status) {
@@ -4372,15 +6316,31 @@ int fstReaderInit(struct fstReaderContext *xc)
                 }
             } else if ((sectype == FST_BL_VCDATA) || (sectype == FST_BL_VCDATA_DYN_ALIAS) ||
                        (sectype == FST_BL_VCDATA_DYN_ALIAS2)) {
+                uint64_t bt = fstReaderUint64(xc->f);
+                uint64_t et = fstReaderUint64(xc->f);
+
                 if (hdr_incomplete) {
-                    uint64_t bt = fstReaderUint64(xc->f);
-                    xc->end_time = fstReaderUint64(xc->f);
+                    xc->end_time = et;
 
                     if (!vc_section_count_actual) {
                         xc->start_time = bt;
                     }
                 }
 
+                if (vc_section_count_actual == vc_sections_alloc) {
+                    vc_sections_alloc = vc_sections_alloc ? (vc_sections_alloc * 2) : 64;
+                    xc->vc_sections = (struct fstReaderSection *)realloc(
+                            xc->vc_sections, vc_sections_alloc * sizeof(struct fstReaderSection));
+                }
+                if (vc_section_count_actual && (et < xc->vc_sections[vc_section_count_actual - 1].end_tim)) {
+                    vc_sections_sorted = 0;
+                }
+                xc->vc_sections[vc_section_count_actual].pos = blkpos - 1;
+                xc->vc_sections[vc_section_count_actual].seclen = seclen;
+                xc->vc_sections[vc_section_count_actual].beg_tim = bt;
+                xc->vc_sections[vc_section_count_actual].end_tim = et;
+                xc->vc_sections[vc_section_count_actual].sectype = sectype;
+
                 vc_section_count_actual++;
             } else if (sectype == FST_BL_GEOM) {
                 if (!hdr_incomplete) {
@@ -4485,6 +6445,11 @@ int fstReaderInit(struct fstReaderContext *xc)
                 xc->vc_section_count = vc_section_count_actual;
             }
 
+            if (!vc_sections_sorted) {
+                free(xc->vc_sections); /* time lookups fall back to scanning the file */
+                xc->vc_sections = NULL;
+            }
+
             if (!xc->contains_geom_section) {
                 fstReaderProcessHier(xc, NULL); /* recreate signal_lens/signal_typs info */
             }
@@ -4538,1508 +6503,3897 @@ void *fstReaderOpen(const char *nam)
     return (xc);
 }
 
-static void fstReaderDeallocateRvatData(void *ctx)
-{
-    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
-    if (xc) {
-        free(xc->rvat_chain_mem);
-        xc->rvat_chain_mem = NULL;
-        free(xc->rvat_frame_data);
-        xc->rvat_frame_data = NULL;
-        free(xc->rvat_time_table);
-        xc->rvat_time_table = NULL;
-        free(xc->rvat_chain_table);
-        xc->rvat_chain_table = NULL;
-        free(xc->rvat_chain_table_lengths);
-        xc->rvat_chain_table_lengths = NULL;
-
-        xc->rvat_data_valid = 0;
-    }
-}
-
-void fstReaderClose(void *ctx)
+/* hands the immutable parts of xc over to a shared object, once */
+static struct fstReaderShared *fstReaderShare(struct fstReaderContext *xc)
 {
-    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
-
-    if (xc) {
-        fstReaderDeallocateScopeData(xc);
-        fstReaderDeallocateRvatData(xc);
-        free(xc->rvat_sig_offs);
-        xc->rvat_sig_offs = NULL;
+    struct fstReaderShared *sh = xc->shared;
 
-        free(xc->process_mask);
-        xc->process_mask = NULL;
-        free(xc->blackout_times);
-        xc->blackout_times = NULL;
-        free(xc->blackout_activity);
-        xc->blackout_activity = NULL;
-        free(xc->temp_signal_value_buf);
-        xc->temp_signal_value_buf = NULL;
-        free(xc->signal_typs);
-        xc->signal_typs = NULL;
-        free(xc->signal_lens);
-        xc->signal_lens = NULL;
-        free(xc->filename);
-        xc->filename = NULL;
+    if (!sh) {
+        fst_off_t offs_cache = ftello(xc->f);
 
-        if (xc->fh) {
-            tmpfile_close(&xc->fh, &xc->fh_nam);
-        }
+        sh = (struct fstReaderShared *)calloc(1, sizeof(struct fstReaderShared));
+        sh->refcount = 1;
+        sh->fd = (fileno(xc->f) >= 0) ? dup(fileno(xc->f)) : -1;
+        fstReaderFseeko(xc, xc->f, 0, SEEK_END);
+        sh->file_len = ftello(xc->f);
+        fstReaderFseeko(xc, xc->f, offs_cache, SEEK_SET);
 
-        if (xc->f) {
-            tmpfile_close(&xc->f, &xc->f_nam);
-            if (xc->filename_unpacked) {
-                unlink(xc->filename_unpacked);
-                free(xc->filename_unpacked);
+        sh->signal_lens = xc->signal_lens;
+        sh->signal_typs = xc->signal_typs;
+        sh->vc_sections = xc->vc_sections;
+        sh->blackout_times = xc->blackout_times;
+        sh->blackout_activity = xc->blackout_activity;
+        xc->shared = sh;
+    }
+
+    if (!sh->hier_mem && (xc->contains_hier_section || xc->contains_hier_section_lz4)) {
+        if (!xc->hier_mem) { /* decompressed once on behalf of all clones, xc keeps any fh it reads from */
+            FILE *fh = xc->fh;
+            unsigned int hier_in_memory = xc->hier_in_memory;
+
+            xc->fh = NULL;
+            xc->hier_in_memory = 1;
+            fstReaderRecreateHierFile(xc);
+            xc->hier_in_memory = hier_in_memory;
+            sh->hier_mem = xc->hier_mem;
+            sh->hier_mem_len = xc->hier_mem_len;
+            if (fh) {
+                xc->hier_mem = NULL;
+                xc->fh = fh;
             }
+        } else {
+            sh->hier_mem = xc->hier_mem;
+            sh->hier_mem_len = xc->hier_mem_len;
         }
+    }
 
-        free(xc);
+    if (!sh->mmap_base && xc->mmap_base) {
+        sh->mmap_base = xc->mmap_base;
+        sh->mmap_len = xc->mmap_len;
     }
-}
 
-/*
- * read processing
- */
+    return (sh);
+}
 
-/* normal read which re-interleaves the value change data */
-int fstReaderIterBlocks(void *ctx,
-                        void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
-                                                      const unsigned char *value),
-                        void *user_callback_data_pointer, FILE *fv)
+static void fstReaderSharedRelease(struct fstReaderShared *sh)
 {
-    return (fstReaderIterBlocks2(ctx, value_change_callback, NULL, user_callback_data_pointer, fv));
+    if (fstReaderRefAdd(&sh->refcount, -1) == 0) {
+        if (sh->mmap_base) {
+            fstMunmap(sh->mmap_base, sh->mmap_len);
+        }
+        free(sh->hier_mem);
+        free(sh->blackout_activity);
+        free(sh->blackout_times);
+        free(sh->vc_sections);
+        free(sh->signal_typs);
+        free(sh->signal_lens);
+        if (sh->fd >= 0) {
+            close(sh->fd);
+        }
+        free(sh);
+    }
 }
 
-int fstReaderIterBlocks2(void *ctx,
-                         void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time,
-                                                       fstHandle facidx, const unsigned char *value),
-                         void (*value_change_callback_varlen)(void *user_callback_data_pointer, uint64_t time,
-                                                              fstHandle facidx, const unsigned char *value,
-                                                              uint32_t len),
-                         void *user_callback_data_pointer, FILE *fv)
+/*
+ * the first clone of ctx moves its file data into the shared object (seeking
+ * ctx's file and possibly unpacking the hierarchy), and every clone copies ctx's
+ * settings.  so clones are made one at a time by the thread that owns ctx, only
+ * the clones returned are for use on other threads.
+ */
+void *fstReaderClone(void *ctx)
 {
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderContext *xc2;
+    struct fstReaderShared *sh;
+    FILE *f = NULL;
 
-    uint64_t previous_time = UINT64_MAX;
-    uint64_t *time_table = NULL;
-    uint64_t tsec_nitems;
-    unsigned int secnum = 0;
-    int blocks_skipped = 0;
-    fst_off_t blkpos = 0;
-    uint64_t seclen, beg_tim;
-    uint64_t end_tim;
-    uint64_t frame_uclen, frame_clen, frame_maxhandle, vc_maxhandle;
-    fst_off_t vc_start;
-    fst_off_t indx_pntr, indx_pos;
-    fst_off_t *chain_table = NULL;
-    uint32_t *chain_table_lengths = NULL;
-    unsigned char *chain_cmem;
-    unsigned char *pnt;
-    long chain_clen;
-    fstHandle idx, pidx = 0, i;
-    uint64_t pval;
-    uint64_t vc_maxhandle_largest = 0;
-    uint64_t tsec_uclen = 0, tsec_clen = 0;
-    int sectype;
-    uint64_t mem_required_for_traversal;
-    unsigned char *mem_for_traversal = NULL;
-    uint32_t traversal_mem_offs;
-    uint32_t *scatterptr, *headptr, *length_remaining;
-    uint32_t cur_blackout = 0;
-    int packtype;
-    unsigned char *mc_mem = NULL;
-    uint32_t mc_mem_len; /* corresponds to largest value encountered in chain_table_lengths[i] */
-    int dumpvars_state = 0;
-
-    if (!xc)
-        return (0);
+    if ((!xc) || (!xc->f) || (!xc->filename)) {
+        return (NULL);
+    }
 
-    scatterptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
-    headptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
-    length_remaining = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+    sh = fstReaderShare(xc);
 
-    if (fv) {
-#ifndef FST_WRITEX_DISABLE
-        fflush(fv);
-        setvbuf(fv, (char *)NULL, _IONBF,
-                0); /* even buffered IO is slow so disable it and use our own routines that don't need seeking */
-        xc->writex_fd = fileno(fv);
+#ifdef FST_READER_STREAMS
+    f = fstReaderStreamOpen(sh->fd, sh->file_len, xc->zchunks);
+#endif
+    if (!f) { /* no pread streams here: reopen by name, unless the name is gone */
+        if (xc->filename_unpacked) {
+            f = fopen(xc->filename_unpacked, "rb");
+        } else if (!xc->f_unpacked) {
+            f = fopen(xc->filename, "rb");
+        }
+        if (!f) {
+            return (NULL);
+        }
+#if defined(__MINGW32__) || defined(FST_MACOSX)
+        setvbuf(f, (char *)NULL, _IONBF, 0);
 #endif
     }
 
-    for (;;) {
-        uint32_t *tc_head = NULL;
-        traversal_mem_offs = 0;
-
-        fstReaderFseeko(xc, xc->f, blkpos, SEEK_SET);
+    xc2 = (struct fstReaderContext *)calloc(1, sizeof(struct fstReaderContext));
+    fstReaderRefAdd(&sh->refcount, 1);
+    xc2->shared = sh;
+    xc2->f = f;
+    xc2->zchunks = xc->zchunks;
+    xc2->filename = strdup(xc->filename);
+
+    xc2->start_time = xc->start_time;
+    xc2->end_time = xc->end_time;
+    xc2->mem_used_by_writer = xc->mem_used_by_writer;
+    xc2->scope_count = xc->scope_count;
+    xc2->var_count = xc->var_count;
+    xc2->maxhandle = xc->maxhandle;
+    xc2->num_alias = xc->num_alias;
+    xc2->vc_section_count = xc->vc_section_count;
+    xc2->vc_sections = sh->vc_sections;
+    xc2->signal_lens = sh->signal_lens;
+    xc2->signal_typs = sh->signal_typs;
+    xc2->longest_signal_value_len = xc->longest_signal_value_len;
+    xc2->temp_signal_value_buf = (unsigned char *)malloc(xc2->longest_signal_value_len + 1);
+    xc2->process_mask = (unsigned char *)malloc((xc->maxhandle + 7) / 8);
+    memcpy(xc2->process_mask, xc->process_mask, (xc->maxhandle + 7) / 8);
+
+    xc2->timescale = xc->timescale;
+    xc2->filetype = xc->filetype;
+    xc2->use_vcd_extensions = xc->use_vcd_extensions;
+    xc2->double_endian_match = xc->double_endian_match;
+    xc2->native_doubles_for_cb = xc->native_doubles_for_cb;
+    xc2->contains_geom_section = xc->contains_geom_section;
+    xc2->contains_hier_section = xc->contains_hier_section;
+    xc2->contains_hier_section_lz4duo = xc->contains_hier_section_lz4duo;
+    xc2->contains_hier_section_lz4 = xc->contains_hier_section_lz4;
+    xc2->limit_range_valid = xc->limit_range_valid;
+    xc2->limit_range_start = xc->limit_range_start;
+    xc2->limit_range_end = xc->limit_range_end;
+    memcpy(xc2->version, xc->version, sizeof(xc->version));
+    memcpy(xc2->date, xc->date, sizeof(xc->date));
+    xc2->timezero = xc->timezero;
+    xc2->hier_pos = xc->hier_pos;
+
+    xc2->num_blackouts = xc->num_blackouts;
+    xc2->blackout_times = sh->blackout_times;
+    xc2->blackout_activity = sh->blackout_activity;
+
+    xc2->unpack_threads = xc->unpack_threads;
+    xc2->rvat_cache_budget = xc->rvat_cache_budget;
+
+    xc2->hier_in_memory = xc->hier_in_memory;
+    if (sh->hier_mem) {
+        xc2->hier_mem = sh->hier_mem;
+        xc2->hier_mem_len = sh->hier_mem_len;
+    } else if (xc->fh && !xc->hier_fh_recreated) { /* separate .hier file */
+        char *hf = (char *)malloc(strlen(xc->filename) + 6);
+
+        strcpy(hf, xc->filename);
+        strcat(hf, ".hier");
+        xc2->fh = fopen(hf, "rb");
+        free(hf);
+    }
+    xc2->do_rewind = 1;
 
-        sectype = fgetc(xc->f);
-        seclen = fstReaderUint64(xc->f);
+    xc2->mmap_base = sh->mmap_base;
+    xc2->mmap_len = sh->mmap_len;
 
-        if ((sectype == EOF) || (sectype == FST_BL_SKIP)) {
-#ifdef FST_DEBUG
-            fprintf(stderr, FST_APIMESS "<< EOF >>\n");
-#endif
-            break;
-        }
+    return (xc2);
+}
 
-        blkpos++;
-        if ((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
-            (sectype != FST_BL_VCDATA_DYN_ALIAS2)) {
-            blkpos += seclen;
+static void fstReaderRvatFreeChain(struct fstReaderContext *xc, struct fstReaderRvatChain *ch)
+{
+    if (ch->prev) {
+        ch->prev->next = ch->next;
+    } else {
+        xc->rvat_chain = ch->next;
+    }
+    if (ch->next) {
+        ch->next->prev = ch->prev;
+    } else {
+        xc->rvat_chain_tail = ch->prev;
+    }
+
+    ch->sec->chains[ch->facidx] = NULL;
+    xc->rvat_cache_bytes -= ch->len;
+    free(ch->mem);
+    free(ch);
+}
+
+static void fstReaderRvatFreeSection(struct fstReaderContext *xc, struct fstReaderRvatSection *sec)
+{
+    if (sec->chains) {
+        fstHandle i;
+
+        for (i = 0; i < sec->vc_maxhandle; i++) {
+            if (sec->chains[i]) {
+                fstReaderRvatFreeChain(xc, sec->chains[i]);
+            }
+        }
+        free(sec->chains);
+    }
+
+    if (sec->prev) {
+        sec->prev->next = sec->next;
+    } else {
+        xc->rvat_sec = sec->next;
+    }
+    if (sec->next) {
+        sec->next->prev = sec->prev;
+    } else {
+        xc->rvat_sec_tail = sec->prev;
+    }
+
+    xc->rvat_cache_bytes -= sec->bytes;
+    free(sec->time_table);
+    free(sec->frame_data);
+    free(sec->chain_table);
+    free(sec->chain_table_lengths);
+    free(sec);
+}
+
+/* moves sec to the head of the section lru, which makes it the current section */
+static void fstReaderRvatUseSection(struct fstReaderContext *xc, struct fstReaderRvatSection *sec)
+{
+    sec->stamp = ++xc->rvat_tick;
+    if (xc->rvat_sec != sec) {
+        if (sec->prev || sec->next || (xc->rvat_sec_tail == sec)) {
+            if (sec->prev) {
+                sec->prev->next = sec->next;
+            }
+            if (sec->next) {
+                sec->next->prev = sec->prev;
+            } else {
+                xc->rvat_sec_tail = sec->prev;
+            }
+        }
+        sec->prev = NULL;
+        sec->next = xc->rvat_sec;
+        if (xc->rvat_sec) {
+            xc->rvat_sec->prev = sec;
+        } else {
+            xc->rvat_sec_tail = sec;
+        }
+        xc->rvat_sec = sec;
+    }
+}
+
+static void fstReaderRvatUseChain(struct fstReaderContext *xc, struct fstReaderRvatChain *ch)
+{
+    ch->stamp = ++xc->rvat_tick;
+    if (xc->rvat_chain != ch) {
+        if (ch->prev || ch->next || (xc->rvat_chain_tail == ch)) {
+            if (ch->prev) {
+                ch->prev->next = ch->next;
+            }
+            if (ch->next) {
+                ch->next->prev = ch->prev;
+            } else {
+                xc->rvat_chain_tail = ch->prev;
+            }
+        }
+        ch->prev = NULL;
+        ch->next = xc->rvat_chain;
+        if (xc->rvat_chain) {
+            xc->rvat_chain->prev = ch;
+        } else {
+            xc->rvat_chain_tail = ch;
+        }
+        xc->rvat_chain = ch;
+    }
+}
+
+/* drops least recently used entries, other than the current ones, until the cache fits its budget */
+static void fstReaderRvatTrimCache(struct fstReaderContext *xc)
+{
+    while (xc->rvat_cache_bytes > xc->rvat_cache_budget) {
+        struct fstReaderRvatChain *ch = xc->rvat_chain_tail;
+        struct fstReaderRvatSection *sec = xc->rvat_sec_tail;
+
+        if (ch == xc->rvat_chain) {
+            ch = NULL;
+        }
+        if ((sec == xc->rvat_sec) || (xc->rvat_chain && (xc->rvat_chain->sec == sec))) {
+            sec = NULL;
+        }
+
+        if (ch && (!sec || (ch->stamp <= sec->stamp))) {
+            fstReaderRvatFreeChain(xc, ch);
+        } else if (sec) {
+            fstReaderRvatFreeSection(xc, sec);
+        } else {
+            break;
+        }
+    }
+}
+
+static void fstReaderDeallocateRvatData(void *ctx)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    if (xc) {
+        while (xc->rvat_sec) {
+            fstReaderRvatFreeSection(xc, xc->rvat_sec);
+        }
+    }
+}
+
+void fstReaderSetValueAtTimeCacheSize(void *ctx, uint64_t bytes)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (xc) {
+        xc->rvat_cache_budget = bytes;
+        fstReaderRvatTrimCache(xc);
+    }
+}
+
+void fstReaderGetValueAtTimeCacheStats(void *ctx, uint64_t *section_hits, uint64_t *section_misses,
+                                       uint64_t *chain_hits, uint64_t *chain_misses)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (xc) {
+        if (section_hits)
+            *section_hits = xc->rvat_sec_hits;
+        if (section_misses)
+            *section_misses = xc->rvat_sec_misses;
+        if (chain_hits)
+            *chain_hits = xc->rvat_chain_hits;
+        if (chain_misses)
+            *chain_misses = xc->rvat_chain_misses;
+    }
+}
+
+void fstReaderClose(void *ctx)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+
+    if (xc) {
+        struct fstReaderShared *sh = xc->shared;
+
+        if (sh) { /* leave what is shared to fstReaderSharedRelease() */
+            if (xc->signal_lens == sh->signal_lens)
+                xc->signal_lens = NULL;
+            if (xc->signal_typs == sh->signal_typs)
+                xc->signal_typs = NULL;
+            if (xc->vc_sections == sh->vc_sections)
+                xc->vc_sections = NULL;
+            if (xc->blackout_times == sh->blackout_times)
+                xc->blackout_times = NULL;
+            if (xc->blackout_activity == sh->blackout_activity)
+                xc->blackout_activity = NULL;
+            if (xc->hier_mem == sh->hier_mem)
+                xc->hier_mem = NULL;
+            if (xc->mmap_base == sh->mmap_base)
+                xc->mmap_base = NULL;
+        }
+
+        fstReaderDeallocateScopeData(xc);
+        fstReaderDeallocateRvatData(xc);
+        free(xc->rvat_sig_offs);
+        xc->rvat_sig_offs = NULL;
+
+        fstReaderSetMmap(xc, 0);
+        free(xc->hier_mem);
+        xc->hier_mem = NULL;
+        free(xc->flat_vars);
+        xc->flat_vars = NULL;
+        free(xc->flat_var_names);
+        xc->flat_var_names = NULL;
+        free(xc->vc_sections);
+        xc->vc_sections = NULL;
+        free(xc->process_mask);
+        xc->process_mask = NULL;
+        free(xc->blackout_times);
+        xc->blackout_times = NULL;
+        free(xc->blackout_activity);
+        xc->blackout_activity = NULL;
+        free(xc->temp_signal_value_buf);
+        xc->temp_signal_value_buf = NULL;
+        free(xc->signal_typs);
+        xc->signal_typs = NULL;
+        free(xc->signal_lens);
+        xc->signal_lens = NULL;
+        free(xc->filename);
+        xc->filename = NULL;
+
+        if (xc->fh) {
+            tmpfile_close(&xc->fh, &xc->fh_nam);
+        }
+
+        if (xc->f) {
+            tmpfile_close(&xc->f, &xc->f_nam);
+            if (xc->filename_unpacked) {
+                unlink(xc->filename_unpacked);
+                free(xc->filename_unpacked);
+            }
+        }
+
+        if (sh) {
+            fstReaderSharedRelease(sh);
+        }
+
+        free(xc);
+    }
+}
+
+/*
+ * read processing
+ */
+
+/*
+ * returns the index of the first value change section which ends at or after
+ * tim (vc_section_count if none does), requires xc->vc_sections
+ */
+static uint64_t fstReaderFindSection(struct fstReaderContext *xc, uint64_t tim)
+{
+    uint64_t lo = 0, hi = xc->vc_section_count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + ((hi - lo) >> 1);
+
+        if (xc->vc_sections[mid].end_tim < tim) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo);
+}
+
+/*
+ * moves blkpos past the sections which end before the limit range starts,
+ * returns how many were skipped
+ */
+static int fstReaderSkipToLimitRange(struct fstReaderContext *xc, fst_off_t *blkpos)
+{
+    uint64_t first;
+
+    if (!xc->limit_range_valid || !xc->vc_sections || !xc->vc_section_count) {
+        return (0);
+    }
+
+    first = fstReaderFindSection(xc, xc->limit_range_start);
+    if (first < xc->vc_section_count) {
+        *blkpos = xc->vc_sections[first].pos;
+    } else {
+        struct fstReaderSection *last = xc->vc_sections + xc->vc_section_count - 1;
+        *blkpos = last->pos + 1 + last->seclen;
+    }
+
+    return (first != 0);
+}
+
+/*
+ * callbacks and output state carried across sections by fstReaderIterBlocksPacked()
+ */
+struct fstReaderIterState
+{
+    void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                  const unsigned char *value);
+    void (*value_change_callback_varlen)(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                         const unsigned char *value, uint32_t len);
+    void (*value_change_callback_packed)(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                         const uint64_t *value, const uint64_t *xz_mask, uint32_t bits);
+    void *user_callback_data_pointer;
+    FILE *fv;
+
+    uint64_t *packed_value; /* value plane, followed by the xz_mask plane */
+    uint32_t packed_nwords; /* words per plane */
+
+    /* set by a callback to pause the frame/section walk after the current value, see fstReaderCursorNext() */
+    unsigned char stop;
+    fstHandle frame_resume_idx;
+    uint32_t frame_resume_offs;
+    uint64_t section_resume_i;
+
+    uint64_t previous_time;
+    int dumpvars_state;
+    uint32_t cur_blackout;
+};
+
+/*
+ * decodes the nitems time deltas of an uncompressed time table into absolute times
+ */
+static void fstReaderDecodeTimeTable(unsigned char *mem, uint64_t len, uint64_t *time_table, uint64_t nitems)
+{
+    uint64_t n = fstGetVarint64Batch(&mem, mem + len, time_table, NULL, nitems);
+    uint64_t tpval = 0;
+    uint64_t ti;
+
+    for (ti = 0; ti < n; ti++) {
+        tpval = time_table[ti] += tpval;
+    }
+}
+
+/*
+ * decodes a section's chain index into per-handle offsets (relative to the
+ * packtype byte) and lengths, returns the number of handles described
+ */
+static fstHandle fstReaderDecodeChainTable(int sectype, unsigned char *chain_cmem, long chain_clen, fst_off_t chain_end,
+                                           fst_off_t *chain_table, uint32_t *chain_table_lengths)
+{
+    unsigned char *pnt = chain_cmem;
+    unsigned char *chain_cmem_end = chain_cmem + chain_clen;
+    fstHandle idx = 0, pidx = 0, i;
+    uint64_t pval = 0;
+
+    if (sectype == FST_BL_VCDATA_DYN_ALIAS2) {
+        uint32_t prev_alias = 0;
+
+        while (pnt < chain_cmem_end) {
+            unsigned char *pnt_orig = pnt;
+            uint64_t val = fstGetVarint64Next(&pnt);
+
+            if (val & 1) {
+                unsigned int bits = 7 * (pnt - pnt_orig);
+                int64_t shval;
+
+                if ((bits < 64) && ((val >> (bits - 1)) & 1)) {
+                    val |= ~((uint64_t)0) << bits; /* sign extend as fstGetSVarint64() */
+                }
+                shval = ((int64_t)val) >> 1;
+
+                if (shval > 0) {
+                    pval = chain_table[idx] = pval + shval;
+                    if (idx) {
+                        chain_table_lengths[pidx] = pval - chain_table[pidx];
+                    }
+                    pidx = idx++;
+                } else if (shval < 0) {
+                    chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
+                    chain_table_lengths[idx] = prev_alias =
+                            shval; /* because during this loop iter would give stale data! */
+                    idx++;
+                } else {
+                    chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
+                    chain_table_lengths[idx] =
+                            prev_alias; /* because during this loop iter would give stale data! */
+                    idx++;
+                }
+            } else {
+                fstHandle loopcnt = (uint32_t)val >> 1;
+                for (i = 0; i < loopcnt; i++) {
+                    chain_table[idx++] = 0;
+                }
+            }
+        }
+    } else {
+        while (pnt < chain_cmem_end) {
+            uint32_t val = fstGetVarint64Next(&pnt);
+
+            if (!val) {
+                val = fstGetVarint64Next(&pnt);
+                chain_table[idx] = 0;            /* need to explicitly zero as calloc above might not run */
+                chain_table_lengths[idx] = -val; /* because during this loop iter would give stale data! */
+                idx++;
+            } else if (val & 1) {
+                pval = chain_table[idx] = pval + (val >> 1);
+                if (idx) {
+                    chain_table_lengths[pidx] = pval - chain_table[pidx];
+                }
+                pidx = idx++;
+            } else {
+                fstHandle loopcnt = val >> 1;
+                for (i = 0; i < loopcnt; i++) {
+                    chain_table[idx++] = 0;
+                }
+            }
+        }
+    }
+
+    chain_table[idx] = chain_end;
+    chain_table_lengths[pidx] = chain_table[idx] - chain_table[pidx];
+
+    for (i = 0; i < idx; i++) {
+        int32_t v32 = chain_table_lengths[i];
+        if ((v32 < 0) && (!chain_table[i])) {
+            v32 = -v32;
+            v32--;
+            if (((uint32_t)v32) < i) /* sanity check */
+            {
+                chain_table[i] = chain_table[v32];
+                chain_table_lengths[i] = chain_table_lengths[v32];
+            }
+        }
+    }
+
+    return (idx);
+}
+
+/*
+ * locates the chain of facidx (zero based) without building the whole chain table:
+ * the index is decoded only as far as the chain following it, once more for each
+ * alias hop.  returns 0 if the signal has no value changes in the section.
+ */
+static int fstReaderFindChain(int sectype, unsigned char *chain_cmem, long chain_clen, fst_off_t chain_end,
+                              fstHandle facidx, fst_off_t *chain_pos, uint32_t *chain_len)
+{
+    for (;;) {
+        unsigned char *pnt = chain_cmem;
+        fstHandle idx = 0;
+        uint64_t pval = 0;
+        int64_t prev_alias = 0;
+        int64_t alias = -1; /* set if facidx turns out to be an alias, to what it refers to plus one */
+        int found = 0;
+
+        while (pnt != (chain_cmem + chain_clen)) {
+            int skiplen;
+
+            if (sectype == FST_BL_VCDATA_DYN_ALIAS2) {
+                if (*pnt & 0x01) {
+                    int64_t shval = fstGetSVarint64(pnt, &skiplen) >> 1;
+                    if (shval > 0) {
+                        pval += shval;
+                        if (found) {
+                            *chain_len = pval - *chain_pos;
+                            return (1);
+                        }
+                        if (idx == facidx) {
+                            *chain_pos = pval;
+                            found = 1;
+                        }
+                    } else {
+                        if (shval < 0) {
+                            prev_alias = shval;
+                        }
+                        if (idx == facidx) {
+                            alias = -prev_alias;
+                            break;
+                        }
+                    }
+                    idx++;
+                } else {
+                    fstHandle loopcnt = fstGetVarint32(pnt, &skiplen) >> 1;
+                    if ((!found) && (facidx >= idx) && (facidx - idx < loopcnt)) {
+                        return (0);
+                    }
+                    idx += loopcnt;
+                }
+            } else {
+                uint64_t val = fstGetVarint32(pnt, &skiplen);
+
+                if (!val) {
+                    pnt += skiplen;
+                    val = fstGetVarint32(pnt, &skiplen);
+                    if (idx == facidx) {
+                        alias = val;
+                        break;
+                    }
+                    idx++;
+                } else if (val & 1) {
+                    pval += (val >> 1);
+                    if (found) {
+                        *chain_len = pval - *chain_pos;
+                        return (1);
+                    }
+                    if (idx == facidx) {
+                        *chain_pos = pval;
+                        found = 1;
+                    }
+                    idx++;
+                } else {
+                    fstHandle loopcnt = val >> 1;
+                    if ((!found) && (facidx >= idx) && (facidx - idx < loopcnt)) {
+                        return (0);
+                    }
+                    idx += loopcnt;
+                }
+            }
+
+            pnt += skiplen;
+        }
+
+        if (found) {
+            *chain_len = chain_end - *chain_pos;
+            return (1);
+        }
+
+        if ((alias <= 0) || ((fstHandle)(alias - 1) >= facidx)) /* same sanity check as the full decode */
+        {
+            return (0);
+        }
+
+        facidx = alias - 1;
+    }
+}
+
+static int fstReaderUnpackChain(int packtype, unsigned char *mu, unsigned long destlen, unsigned char *mc,
+                                unsigned long sourcelen)
+{
+    int rc = Z_OK;
+    switch (packtype) {
+    case '4':
+        rc = (destlen == (unsigned long)LZ4_decompress_safe_partial((char *)mc, (char *)mu,
+                                                                    sourcelen, destlen, destlen))
+                     ? Z_OK
+                     : Z_DATA_ERROR;
+        break;
+    case 'F':
+        fastlz_decompress(mc, sourcelen, mu, destlen); /* rc appears unreliable */
+        break;
+    default:
+        rc = uncompress(mu, &destlen, mc, sourcelen);
+        break;
+    }
+
+    return (rc);
+}
+
+/*
+ * packed callback support: value bit i (bit 0 being the rightmost character of
+ * the VCD string) lives in word i / 64 at bit i % 64.  2-state chain records
+ * are MSB first with the last byte zero padded, so they are moved a byte at a
+ * time rather than a bit at a time.
+ */
+static void fstReaderBitsToWords(uint64_t *dst, const unsigned char *src, uint32_t len)
+{
+    uint32_t nbytes = (len + 7) >> 3;
+    uint32_t nwords = (len + 63) >> 6;
+    uint32_t pad = (nbytes << 3) - len;
+    uint32_t k;
+
+    memset(dst, 0, nwords * sizeof(uint64_t));
+    dst[0] = (uint64_t)src[nbytes - 1] >> pad;
+    for (k = 1; k < nbytes; k++) {
+        uint64_t byte = src[nbytes - 1 - k];
+        uint32_t lo = (k << 3) - pad; /* value bit of the byte's lsb */
+        uint32_t sh = lo & 63;
+
+        dst[lo >> 6] |= byte << sh;
+        if (sh > 56) {
+            dst[(lo >> 6) + 1] |= byte >> (64 - sh);
+        }
+    }
+}
+
+/*
+ * byte per bit values: anything other than 0/1 sets the xz_mask bit, and the
+ * value bit then separates z (0) from x and the remaining states (1) in the
+ * same way as a Verilog aval/bval pair.  returns NULL for pure 2-state values.
+ */
+static const uint64_t *fstReaderCharsToWords(uint64_t *dst, uint64_t *mask, const unsigned char *src, uint32_t len)
+{
+    uint32_t nwords = (len + 63) >> 6;
+    uint32_t i;
+    int has_xz = 0;
+
+    memset(dst, 0, nwords * sizeof(uint64_t));
+    memset(mask, 0, nwords * sizeof(uint64_t));
+    for (i = 0; i < len; i++) {
+        uint32_t pos = len - 1 - i;
+        uint64_t bit = (uint64_t)1 << (pos & 63);
+        unsigned char ch = src[i];
+
+        if (ch == '1') {
+            dst[pos >> 6] |= bit;
+        } else if (ch != '0') {
+            mask[pos >> 6] |= bit;
+            if ((ch != 'z') && (ch != 'Z')) {
+                dst[pos >> 6] |= bit;
+            }
+            has_xz = 1;
+        }
+    }
+
+    return (has_xz ? mask : NULL);
+}
+
+static void fstReaderIterPackedChars(struct fstReaderIterState *st, uint64_t time, fstHandle facidx,
+                                     const unsigned char *src, uint32_t len)
+{
+    uint64_t *mask = st->packed_value + st->packed_nwords;
+    const uint64_t *xz_mask;
+
+    if (len == 1) {
+        unsigned char ch = src[0];
+        int is_xz = (ch & 0xfe) != '0';
+
+        st->packed_value[0] = is_xz ? ((ch != 'z') && (ch != 'Z')) : (ch & 1);
+        mask[0] = is_xz;
+        xz_mask = is_xz ? mask : NULL;
+    } else {
+        xz_mask = fstReaderCharsToWords(st->packed_value, mask, src, len);
+    }
+
+    st->value_change_callback_packed(st->user_callback_data_pointer, time, facidx, st->packed_value, xz_mask, len);
+}
+
+/*
+ * emits the initial values of a section, used when iteration does not start at
+ * the beginning of the file (or the first section begins later than its first
+ * time change)
+ */
+static void fstReaderIterBlocksFrame(struct fstReaderContext *xc, struct fstReaderIterState *st, uint64_t beg_tim,
+                                     unsigned char *mu, uint64_t frame_maxhandle)
+{
+    uint32_t sig_offs = st->frame_resume_offs;
+    fstHandle idx;
+    if (st->fv) {
+        char wx_buf[32];
+        int wx_len;
+
+        if (beg_tim) {
+            if (st->dumpvars_state == 1) {
+                wx_len = sprintf(wx_buf, "$end\n");
+                fstWritex(xc, wx_buf, wx_len);
+                st->dumpvars_state = 2;
+            }
+            wx_len = sprintf(wx_buf, "#%" PRIu64 "\n", beg_tim);
+            fstWritex(xc, wx_buf, wx_len);
+            if (!st->dumpvars_state) {
+                wx_len = sprintf(wx_buf, "$dumpvars\n");
+                fstWritex(xc, wx_buf, wx_len);
+                st->dumpvars_state = 1;
+            }
+        }
+        if ((xc->num_blackouts) && (st->cur_blackout != xc->num_blackouts)) {
+            if (beg_tim == xc->blackout_times[st->cur_blackout]) {
+                wx_len = sprintf(wx_buf, "$dump%s $end\n",
+                                 (xc->blackout_activity[st->cur_blackout++]) ? "on" : "off");
+                fstWritex(xc, wx_buf, wx_len);
+            }
+        }
+    }
+
+    for (idx = st->frame_resume_idx; idx < frame_maxhandle; idx++) {
+        int process_idx = idx / 8;
+        int process_bit = idx & 7;
+
+        if (xc->process_mask[process_idx] & (1 << process_bit)) {
+            if (xc->signal_lens[idx] <= 1) {
+                if (xc->signal_lens[idx] == 1) {
+                    unsigned char val = mu[sig_offs];
+                    if (st->value_change_callback_packed) {
+                        fstReaderIterPackedChars(st, beg_tim, idx + 1, &val, 1);
+                    } else if (st->value_change_callback) {
+                        xc->temp_signal_value_buf[0] = val;
+                        xc->temp_signal_value_buf[1] = 0;
+                        st->value_change_callback(st->user_callback_data_pointer, beg_tim, idx + 1,
+                                                  xc->temp_signal_value_buf);
+                    } else {
+                        if (st->fv) {
+                            char vcd_id[16];
+
+                            int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+                            vcd_id[0] = val; /* collapse 3 writes into one I/O call */
+                            vcd_id[vcdid_len + 1] = '\n';
+                            fstWritex(xc, vcd_id, vcdid_len + 2);
+                        }
+                    }
+                } else {
+                    /* variable-length ("0" length) records have no initial state */
+                }
+            } else {
+                if (xc->signal_typs[idx] != FST_VT_VCD_REAL) {
+                    if (st->value_change_callback_packed) {
+                        fstReaderIterPackedChars(st, beg_tim, idx + 1, mu + sig_offs, xc->signal_lens[idx]);
+                    } else if (st->value_change_callback) {
+                        memcpy(xc->temp_signal_value_buf, mu + sig_offs, xc->signal_lens[idx]);
+                        xc->temp_signal_value_buf[xc->signal_lens[idx]] = 0;
+                        st->value_change_callback(st->user_callback_data_pointer, beg_tim, idx + 1,
+                                                  xc->temp_signal_value_buf);
+                    } else {
+                        if (st->fv) {
+                            char vcd_id[16];
+                            int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+
+                            vcd_id[0] = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
+                            fstWritex(xc, vcd_id, 1);
+                            fstWritex(xc, mu + sig_offs, xc->signal_lens[idx]);
+
+                            vcd_id[0] = ' '; /* collapse 3 writes into one I/O call */
+                            vcd_id[vcdid_len + 1] = '\n';
+                            fstWritex(xc, vcd_id, vcdid_len + 2);
+                        }
+                    }
+                } else {
+                    double d;
+                    unsigned char *clone_d;
+                    unsigned char *srcdata = mu + sig_offs;
+
+                    if (st->value_change_callback) {
+                        if (xc->native_doubles_for_cb) {
+                            if (xc->double_endian_match) {
+                                clone_d = srcdata;
+                            } else {
+                                int j;
+
+                                clone_d = (unsigned char *)&d;
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+                            st->value_change_callback(st->user_callback_data_pointer, beg_tim, idx + 1, clone_d);
+                        } else {
+                            clone_d = (unsigned char *)&d;
+                            if (xc->double_endian_match) {
+                                memcpy(clone_d, srcdata, 8);
+                            } else {
+                                int j;
+
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+                            sprintf((char *)xc->temp_signal_value_buf, "%.16g", d);
+                            st->value_change_callback(st->user_callback_data_pointer, beg_tim, idx + 1,
+                                                      xc->temp_signal_value_buf);
+                        }
+                    } else {
+                        if (st->fv) {
+                            char vcdid_buf[16];
+                            char wx_buf[64];
+                            int wx_len;
+
+                            clone_d = (unsigned char *)&d;
+                            if (xc->double_endian_match) {
+                                memcpy(clone_d, srcdata, 8);
+                            } else {
+                                int j;
+
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+
+                            fstVcdID(vcdid_buf, idx + 1);
+                            wx_len = sprintf(wx_buf, "r%.16g %s\n", d, vcdid_buf);
+                            fstWritex(xc, wx_buf, wx_len);
+                        }
+                    }
+                }
+            }
+        }
+
+        sig_offs += xc->signal_lens[idx];
+        if (FST_UNLIKELY(st->stop)) {
+            st->frame_resume_idx = idx + 1;
+            st->frame_resume_offs = sig_offs;
+            return;
+        }
+    }
+
+    st->frame_resume_idx = 0;
+    st->frame_resume_offs = 0;
+}
+
+/*
+ * walks the unpacked value change chains of a section in time order and issues
+ * the callbacks (or VCD writes) for them
+ */
+static void fstReaderIterBlocksSection(struct fstReaderContext *xc, struct fstReaderIterState *st,
+                                       uint64_t *time_table, uint64_t tsec_nitems, uint32_t *tc_head,
+                                       uint32_t *scatterptr, uint32_t *headptr, uint32_t *length_remaining,
+                                       unsigned char *mem_for_traversal)
+{
+    fstHandle idx, i;
+    for (i = st->section_resume_i; i < tsec_nitems; i++) {
+        uint32_t tdelta;
+        int skiplen, skiplen2;
+        uint32_t vli;
+
+        if (st->fv) {
+            char wx_buf[32];
+            int wx_len;
+
+            if (time_table[i] != st->previous_time) {
+                if (xc->limit_range_valid) {
+                    if (time_table[i] > xc->limit_range_end) {
+                        break;
+                    }
+                }
+
+                if (st->dumpvars_state == 1) {
+                    wx_len = sprintf(wx_buf, "$end\n");
+                    fstWritex(xc, wx_buf, wx_len);
+                    st->dumpvars_state = 2;
+                }
+                wx_len = sprintf(wx_buf, "#%" PRIu64 "\n", time_table[i]);
+                fstWritex(xc, wx_buf, wx_len);
+                if (!st->dumpvars_state) {
+                    wx_len = sprintf(wx_buf, "$dumpvars\n");
+                    fstWritex(xc, wx_buf, wx_len);
+                    st->dumpvars_state = 1;
+                }
+
+                if ((xc->num_blackouts) && (st->cur_blackout != xc->num_blackouts)) {
+                    if (time_table[i] == xc->blackout_times[st->cur_blackout]) {
+                        wx_len = sprintf(wx_buf, "$dump%s $end\n",
+                                         (xc->blackout_activity[st->cur_blackout++]) ? "on" : "off");
+                        fstWritex(xc, wx_buf, wx_len);
+                    }
+                }
+                st->previous_time = time_table[i];
+            }
+        }
+
+        while (tc_head[i]) {
+            idx = tc_head[i] - 1;
+            vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
+
+            if (xc->signal_lens[idx] <= 1) {
+                if (xc->signal_lens[idx] == 1) {
+                    unsigned char val;
+                    if (!(vli & 1)) {
+                        /* tdelta = vli >> 2; */ /* scan-build */
+                        val = ((vli >> 1) & 1) | '0';
+                    } else {
+                        /* tdelta = vli >> 4; */ /* scan-build */
+                        val = FST_RCV_STR[((vli >> 1) & 7)];
+                    }
+
+                    if (st->value_change_callback_packed) {
+                        fstReaderIterPackedChars(st, time_table[i], idx + 1, &val, 1);
+                    } else if (st->value_change_callback) {
+                        xc->temp_signal_value_buf[0] = val;
+                        xc->temp_signal_value_buf[1] = 0;
+                        st->value_change_callback(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                  xc->temp_signal_value_buf);
+                    } else {
+                        if (st->fv) {
+                            char vcd_id[16];
+                            int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+
+                            vcd_id[0] = val;
+                            vcd_id[vcdid_len + 1] = '\n';
+                            fstWritex(xc, vcd_id, vcdid_len + 2);
+                        }
+                    }
+                    headptr[idx] += skiplen;
+                    length_remaining[idx] -= skiplen;
+
+                    tc_head[i] = scatterptr[idx];
+                    scatterptr[idx] = 0;
+
+                    if (length_remaining[idx]) {
+                        int shamt;
+                        vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
+                        shamt = 2 << (vli & 1);
+                        tdelta = vli >> shamt;
+
+                        scatterptr[idx] = tc_head[i + tdelta];
+                        tc_head[i + tdelta] = idx + 1;
+                    }
+                } else {
+                    unsigned char *vdata;
+                    uint32_t len;
+
+                    vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
+                    len = fstGetVarint32(mem_for_traversal + headptr[idx] + skiplen, &skiplen2);
+                    /* tdelta = vli >> 1; */ /* scan-build */
+                    skiplen += skiplen2;
+                    vdata = mem_for_traversal + headptr[idx] + skiplen;
+
+                    if (!(vli & 1)) {
+                        if (st->value_change_callback_varlen) {
+                            st->value_change_callback_varlen(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                             vdata, len);
+                        } else {
+                            if (st->fv) {
+                                char vcd_id[16];
+                                int vcdid_len;
+
+                                vcd_id[0] = 's';
+                                fstWritex(xc, vcd_id, 1);
+
+                                vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+                                {
+                                    unsigned char *vesc = (unsigned char *)malloc(len * 4 + 1);
+                                    int vlen = fstUtilityBinToEsc(vesc, vdata, len);
+                                    fstWritex(xc, vesc, vlen);
+                                    free(vesc);
+                                }
+
+                                vcd_id[0] = ' ';
+                                vcd_id[vcdid_len + 1] = '\n';
+                                fstWritex(xc, vcd_id, vcdid_len + 2);
+                            }
+                        }
+                    }
+
+                    skiplen += len;
+                    headptr[idx] += skiplen;
+                    length_remaining[idx] -= skiplen;
+
+                    tc_head[i] = scatterptr[idx];
+                    scatterptr[idx] = 0;
+
+                    if (length_remaining[idx]) {
+                        vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
+                        tdelta = vli >> 1;
+
+                        scatterptr[idx] = tc_head[i + tdelta];
+                        tc_head[i + tdelta] = idx + 1;
+                    }
+                }
+            } else {
+                uint32_t len = xc->signal_lens[idx];
+                unsigned char *vdata;
+
+                vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
+                /* tdelta = vli >> 1; */ /* scan-build */
+                vdata = mem_for_traversal + headptr[idx] + skiplen;
+
+                if (xc->signal_typs[idx] != FST_VT_VCD_REAL) {
+                    if (st->value_change_callback_packed) {
+                        if (!(vli & 1)) {
+                            fstReaderBitsToWords(st->packed_value, vdata, len);
+                            st->value_change_callback_packed(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                             st->packed_value, NULL, len);
+                            len = (len + 7) >> 3;
+                        } else {
+                            fstReaderIterPackedChars(st, time_table[i], idx + 1, vdata, len);
+                        }
+                    } else if (!(vli & 1)) {
+                        int byte = 0;
+                        int bit;
+                        unsigned int j;
+
+                        for (j = 0; j < len; j++) {
+                            unsigned char ch;
+                            byte = j / 8;
+                            bit = 7 - (j & 7);
+                            ch = ((vdata[byte] >> bit) & 1) | '0';
+                            xc->temp_signal_value_buf[j] = ch;
+                        }
+                        xc->temp_signal_value_buf[j] = 0;
+
+                        if (st->value_change_callback) {
+                            st->value_change_callback(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                      xc->temp_signal_value_buf);
+                        } else {
+                            if (st->fv) {
+                                unsigned char ch_bp = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
+
+                                fstWritex(xc, &ch_bp, 1);
+                                fstWritex(xc, xc->temp_signal_value_buf, len);
+                            }
+                        }
+
+                        len = byte + 1;
+                    } else {
+                        if (st->value_change_callback) {
+                            memcpy(xc->temp_signal_value_buf, vdata, len);
+                            xc->temp_signal_value_buf[len] = 0;
+                            st->value_change_callback(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                      xc->temp_signal_value_buf);
+                        } else {
+                            if (st->fv) {
+                                unsigned char ch_bp = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
+
+                                fstWritex(xc, &ch_bp, 1);
+                                fstWritex(xc, vdata, len);
+                            }
+                        }
+                    }
+                } else {
+                    double d;
+                    unsigned char *clone_d /*= (unsigned char *)&d */; /* scan-build */
+                    unsigned char buf[8];
+                    unsigned char *srcdata;
+
+                    if (!(vli & 1)) /* very rare case, but possible */
+                    {
+                        int bit;
+                        int j;
+
+                        for (j = 0; j < 8; j++) {
+                            unsigned char ch;
+                            bit = 7 - (j & 7);
+                            ch = ((vdata[0] >> bit) & 1) | '0';
+                            buf[j] = ch;
+                        }
+
+                        len = 1;
+                        srcdata = buf;
+                    } else {
+                        srcdata = vdata;
+                    }
+
+                    if (st->value_change_callback) {
+                        if (xc->native_doubles_for_cb) {
+                            if (xc->double_endian_match) {
+                                clone_d = srcdata;
+                            } else {
+                                int j;
+
+                                clone_d = (unsigned char *)&d;
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+                            st->value_change_callback(st->user_callback_data_pointer, time_table[i], idx + 1, clone_d);
+                        } else {
+                            clone_d = (unsigned char *)&d;
+                            if (xc->double_endian_match) {
+                                memcpy(clone_d, srcdata, 8);
+                            } else {
+                                int j;
+
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+                            sprintf((char *)xc->temp_signal_value_buf, "%.16g", d);
+                            st->value_change_callback(st->user_callback_data_pointer, time_table[i], idx + 1,
+                                                      xc->temp_signal_value_buf);
+                        }
+                    } else {
+                        if (st->fv) {
+                            char wx_buf[32];
+                            int wx_len;
+
+                            clone_d = (unsigned char *)&d;
+                            if (xc->double_endian_match) {
+                                memcpy(clone_d, srcdata, 8);
+                            } else {
+                                int j;
+
+                                for (j = 0; j < 8; j++) {
+                                    clone_d[j] = srcdata[7 - j];
+                                }
+                            }
+
+                            wx_len = sprintf(wx_buf, "r%.16g", d);
+                            fstWritex(xc, wx_buf, wx_len);
+                        }
+                    }
+                }
+
+                if (st->fv) {
+                    char vcd_id[16];
+                    int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+                    vcd_id[0] = ' ';
+                    vcd_id[vcdid_len + 1] = '\n';
+                    fstWritex(xc, vcd_id, vcdid_len + 2);
+                }
+
+                skiplen += len;
+                headptr[idx] += skiplen;
+                length_remaining[idx] -= skiplen;
+
+                tc_head[i] = scatterptr[idx];
+                scatterptr[idx] = 0;
+
+                if (length_remaining[idx]) {
+                    vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
+                    tdelta = vli >> 1;
+
+                    scatterptr[idx] = tc_head[i + tdelta];
+                    tc_head[i + tdelta] = idx + 1;
+                }
+            }
+
+            if (FST_UNLIKELY(st->stop)) {
+                st->section_resume_i = i;
+                return;
+            }
+        }
+    }
+
+    st->section_resume_i = 0;
+}
+
+/*
+ * section iteration: the calling thread reads (or maps) whole value change
+ * sections, they are unpacked either inline or by worker threads, and the
+ * calling thread issues the callbacks section by section in file order.  a
+ * sparse job unpacks inline straight from the file, reading only the parts of
+ * the section that the process mask needs.
+ */
+#define FST_READER_UNPACK_OK (0)
+#define FST_READER_UNPACK_SKIP (1) /* section is unusable, carry on with the next one */
+#define FST_READER_UNPACK_STOP (2) /* file is corrupted from here on, stop iterating */
+
+struct fstReaderUnpackJob
+{
+    unsigned char *sec; /* section image, starting at its length field, NULL when sparse */
+    unsigned char sec_mapped;
+    unsigned char sparse;   /* read the needed ranges of the section from the file instead */
+    fst_off_t sec_pos;      /* file offset of the length field */
+    unsigned char *scratch; /* sparse reads land here, reused from section to section */
+    uint64_t scratch_len;
+    uint64_t seclen;
+    int sectype;
+    uint64_t beg_tim;
+    unsigned char first_section;
+    unsigned char blocks_skipped;
+    unsigned char emit_frame; /* set by the worker when the initial values need to be emitted first */
+    unsigned char keep_frame; /* decompress the frame even when it is not emitted */
+    unsigned char done;
+    int status;
+
+    uint64_t *time_table;
+    uint64_t tsec_nitems;
+    unsigned char *frame;
+    uint64_t frame_maxhandle;
+    uint32_t *tc_head;
+    uint32_t *scatterptr, *headptr, *length_remaining;
+    unsigned char *mem_for_traversal;
+
+    struct fstSignalActivity *act; /* fstReaderGetActivity() totals, the worker adds the section in */
+    uint64_t act_end;              /* time the values at the end of the section hold until */
+};
+
+struct fstReaderUnpackPool
+{
+    struct fstReaderContext *xc;
+    struct fstReaderUnpackJob *jobs;
+    unsigned int njobs;
+    unsigned int next_read, next_deliver; /* sequence numbers, modulo njobs selects the job */
+#ifdef FST_READER_PARALLEL
+    unsigned int next_decode;
+    int exiting;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; /* a section was queued or the pool is shutting down */
+    pthread_cond_t done_cond; /* a section finished unpacking */
+#endif
+    uint64_t act_t0, act_t1; /* fstReaderGetActivity() window */
+};
+
+static void fstReaderUnpackJobFree(struct fstReaderUnpackJob *job)
+{
+    if (!job->sec_mapped) {
+        free(job->sec);
+    }
+    job->sec = NULL;
+    free(job->time_table);
+    job->time_table = NULL;
+    free(job->frame);
+    job->frame = NULL;
+    free(job->tc_head);
+    job->tc_head = NULL;
+    free(job->mem_for_traversal);
+    job->mem_for_traversal = NULL;
+}
+
+/*
+ * returns the len bytes at offs into the section of job.  these point into the
+ * section image when it is in memory, a sparse job reads them from the file into
+ * its scratch buffer, so they are only valid until the next call.  reads are
+ * clipped to the end of the section, NULL means the file could not supply them.
+ */
+static unsigned char *fstReaderUnpackBytes(struct fstReaderContext *xc, struct fstReaderUnpackJob *job, uint64_t offs,
+                                           uint64_t len)
+{
+    if (job->sec) {
+        return (job->sec + offs);
+    }
+
+    if (offs >= job->seclen) {
+        return (NULL);
+    }
+    if (len > job->seclen - offs) {
+        len = job->seclen - offs;
+    }
+    if (len > job->scratch_len) {
+        free(job->scratch);
+        job->scratch = (unsigned char *)malloc(len);
+        job->scratch_len = job->scratch ? len : 0;
+        if (!job->scratch) {
+            return (NULL);
+        }
+    }
+
+    if ((fstReaderFseeko(xc, xc->f, job->sec_pos + offs, SEEK_SET) != 0) ||
+        (len && (fstFread(job->scratch, len, 1, xc->f) != 1))) {
+        return (NULL);
+    }
+    return (job->scratch);
+}
+
+/*
+ * decodes the time table and chain index of the section in job, then unpacks
+ * the chains of the signals in the process mask for traversal
+ */
+static int fstReaderUnpackSection(struct fstReaderContext *xc, struct fstReaderUnpackJob *job)
+{
+    uint64_t seclen = job->seclen;
+    uint64_t tsec_uclen, tsec_clen;
+    uint64_t frame_uclen, frame_clen, vc_maxhandle;
+    fst_off_t frame_pos, vc_start, indx_pntr, indx_pos;
+    fst_off_t *chain_table;
+    uint32_t *chain_table_lengths;
+    uint64_t mem_required_for_traversal = 0;
+    uint32_t traversal_mem_offs = 0;
+    unsigned char *pnt;
+    int packtype;
+    int skiplen;
+    int corrupted = 0;
+    long chain_clen;
+    fstHandle idx, i;
+
+    /* process time block */
+    {
+        unsigned char *ucdata;
+        unsigned long destlen;
+
+        pnt = fstReaderUnpackBytes(xc, job, seclen - 24, 24);
+        if (!pnt)
+            return (FST_READER_UNPACK_STOP);
+        tsec_uclen = fstGetUint64(pnt);
+        tsec_clen = fstGetUint64(pnt + 8);
+        job->tsec_nitems = fstGetUint64(pnt + 16);
+        if (tsec_clen > seclen)
+            return (FST_READER_UNPACK_STOP); /* corrupted tsec_clen: can't be larger than size of section */
+        pnt = fstReaderUnpackBytes(xc, job, seclen - 24 - tsec_clen, tsec_clen);
+        if (!pnt)
+            return (FST_READER_UNPACK_STOP);
+        ucdata = (unsigned char *)malloc(tsec_uclen);
+        if (!ucdata)
+            return (FST_READER_UNPACK_STOP); /* malloc fail as tsec_uclen out of range from corrupted file */
+
+        if (tsec_uclen != tsec_clen) {
+            int rc;
+
+            destlen = tsec_uclen;
+            rc = uncompress(ucdata, &destlen, pnt, tsec_clen);
+            if (rc != Z_OK) {
+                fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), tsec uncompress rc = %d, exiting.\n", rc);
+                exit(255);
+            }
+        } else {
+            memcpy(ucdata, pnt, tsec_uclen);
+        }
+
+        job->time_table = (uint64_t *)calloc(job->tsec_nitems, sizeof(uint64_t));
+        fstReaderDecodeTimeTable(ucdata, tsec_uclen, job->time_table, job->tsec_nitems);
+
+        job->tc_head = (uint32_t *)calloc(job->tsec_nitems /* scan-build */ ? job->tsec_nitems : 1, sizeof(uint32_t));
+        free(ucdata);
+    }
+
+    pnt = fstReaderUnpackBytes(xc, job, 32, 3 * 10); /* three varints */
+    if (!pnt)
+        return (FST_READER_UNPACK_STOP);
+    frame_pos = 32;
+    frame_uclen = fstGetVarint64(pnt, &skiplen);
+    pnt += skiplen;
+    frame_pos += skiplen;
+    frame_clen = fstGetVarint64(pnt, &skiplen);
+    pnt += skiplen;
+    frame_pos += skiplen;
+    job->frame_maxhandle = fstGetVarint64(pnt, &skiplen);
+    frame_pos += skiplen;
+    if (((uint64_t)frame_pos >= seclen) || (frame_clen >= seclen - frame_pos))
+        return (FST_READER_UNPACK_STOP); /* corrupted frame_clen: runs past the end of the section */
+
+    job->emit_frame = job->first_section && ((job->beg_tim != job->time_table[0]) || job->blocks_skipped);
+    if (job->emit_frame || job->keep_frame) {
+        pnt = fstReaderUnpackBytes(xc, job, frame_pos, frame_clen);
+        if (!pnt)
+            return (FST_READER_UNPACK_STOP);
+        job->frame = (unsigned char *)malloc(frame_uclen);
+
+        if (frame_uclen == frame_clen) {
+            memcpy(job->frame, pnt, frame_uclen);
+        } else {
+            unsigned long destlen = frame_uclen;
+            int rc = uncompress(job->frame, &destlen, pnt, frame_clen);
+            if (rc != Z_OK) {
+                fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), frame uncompress rc: %d, exiting.\n", rc);
+                exit(255);
+            }
+        }
+    }
+
+    pnt = fstReaderUnpackBytes(xc, job, frame_pos + frame_clen, 10 + 1); /* varint and pack type */
+    if (!pnt)
+        return (FST_READER_UNPACK_STOP);
+    vc_maxhandle = fstGetVarint64(pnt, &skiplen);
+    vc_start = frame_pos + frame_clen + skiplen; /* points to '!' character */
+    packtype = pnt[skiplen];
+
+    indx_pntr = seclen - 24 - tsec_clen - 8;
+    if (indx_pntr <= vc_start)
+        return (FST_READER_UNPACK_STOP); /* corrupted tsec_clen: leaves no room for the chains */
+    pnt = fstReaderUnpackBytes(xc, job, indx_pntr, 8);
+    if (!pnt)
+        return (FST_READER_UNPACK_STOP);
+    chain_clen = fstGetUint64(pnt);
+    if ((chain_clen < 0) || (chain_clen > indx_pntr - vc_start))
+        return (FST_READER_UNPACK_STOP); /* corrupted chain_clen: index can't overlap the chains */
+    indx_pos = indx_pntr - chain_clen;
+
+    chain_table = (fst_off_t *)calloc((vc_maxhandle + 1), sizeof(fst_off_t));
+    chain_table_lengths = (uint32_t *)calloc((vc_maxhandle + 1), sizeof(uint32_t));
+    pnt = fstReaderUnpackBytes(xc, job, indx_pos, chain_clen);
+    if (!chain_table || !chain_table_lengths || !pnt) {
+        free(chain_table);
+        free(chain_table_lengths);
+        return (pnt ? FST_READER_UNPACK_SKIP : FST_READER_UNPACK_STOP);
+    }
+
+    idx = fstReaderDecodeChainTable(job->sectype, pnt, chain_clen, indx_pos - vc_start, chain_table,
+                                    chain_table_lengths);
+    if (idx > xc->maxhandle)
+        idx = xc->maxhandle;
+
+    for (i = 0; i < idx; i++) {
+        if (chain_table[i] && (xc->process_mask[i / 8] & (1 << (i & 7))) &&
+            ((chain_table[i] < 0) || (chain_table[i] + chain_table_lengths[i] > indx_pos - vc_start))) {
+            corrupted = 1; /* chain index points outside the section */
+            break;
+        }
+    }
+
+    if (job->sec) { /* size the traversal buffer from the chain headers themselves */
+        for (i = 0; (i < idx) && !corrupted; i++) {
+            if (chain_table[i] && (xc->process_mask[i / 8] & (1 << (i & 7)))) {
+                uint32_t val = fstGetVarint32(job->sec + vc_start + chain_table[i], &skiplen);
+                mem_required_for_traversal += val ? val : (chain_table_lengths[i] - skiplen);
+            }
+        }
+        if (!corrupted) {
+            job->mem_for_traversal =
+                    (unsigned char *)malloc(mem_required_for_traversal + 66); /* add in potential fastlz overhead */
+        }
+    } else if (!corrupted) { /* ...or sparsely from the section header, for the whole mask */
+        pnt = fstReaderUnpackBytes(xc, job, 24, 8);
+        mem_required_for_traversal = pnt ? fstGetUint64(pnt) : 0;
+        job->mem_for_traversal =
+                (unsigned char *)malloc(mem_required_for_traversal + 66); /* add in potential fastlz overhead */
+    }
+    if (!job->mem_for_traversal) { /* corrupted chain headers can ask for more than there is */
+        free(chain_table);
+        free(chain_table_lengths);
+        return (FST_READER_UNPACK_STOP);
+    }
+
+    for (i = 0; i < idx; i++) {
+        if (chain_table[i] && (xc->process_mask[i / 8] & (1 << (i & 7)))) {
+            unsigned char *mu;
+            unsigned char *mc = fstReaderUnpackBytes(xc, job, vc_start + chain_table[i], chain_table_lengths[i] + 5);
+            uint32_t val;
+            uint32_t vli;
+            uint32_t tdelta;
+
+            if (!mc) {
+                corrupted = 1;
+                break;
+            }
+            val = fstGetVarint32(mc, &skiplen);
+            mc += skiplen;
+            if ((uint64_t)traversal_mem_offs + (val ? val : (chain_table_lengths[i] - skiplen)) >
+                mem_required_for_traversal) { /* only sparse jobs size from the header, which can be short */
+                unsigned char *mem;
+
+                mem_required_for_traversal = 2 * ((uint64_t)traversal_mem_offs + (val ? val : chain_table_lengths[i]));
+                mem = (unsigned char *)realloc(job->mem_for_traversal, mem_required_for_traversal + 66);
+                if (!mem) {
+                    corrupted = 1;
+                    break;
+                }
+                job->mem_for_traversal = mem;
+            }
+            mu = job->mem_for_traversal + traversal_mem_offs;
+
+            if (val) {
+                int rc = fstReaderUnpackChain(packtype, mu, val, mc, chain_table_lengths[i]);
+                if (rc != Z_OK) {
+                    fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), fac: %d clen: %d (rc=%d), exiting.\n",
+                            (int)i, (int)val, rc);
+                    exit(255);
+                }
+            } else {
+                val = chain_table_lengths[i] - skiplen;
+                memcpy(mu, mc, val);
+            }
+
+            /* data to process is for(j=0;j<val;j++) in mu[j] */
+            job->headptr[i] = traversal_mem_offs;
+            job->length_remaining[i] = val;
+            traversal_mem_offs += val;
+
+            vli = fstGetVarint32NoSkip(mu);
+            if (xc->signal_lens[i] == 1) {
+                uint32_t shcnt = 2 << (vli & 1);
+                tdelta = vli >> shcnt;
+            } else {
+                tdelta = vli >> 1;
+            }
+
+            job->scatterptr[i] = job->tc_head[tdelta];
+            job->tc_head[tdelta] = i + 1;
+        }
+    }
+
+    free(chain_table);
+    free(chain_table_lengths);
+
+    return (corrupted ? FST_READER_UNPACK_STOP : FST_READER_UNPACK_OK);
+}
+
+/* adds the time [from, to) spends inside the fstReaderGetActivity() window to a */
+static void fstReaderActivityHold(struct fstSignalActivity *a, struct fstReaderUnpackPool *pool, uint64_t from,
+                                  uint64_t to, uint32_t n0, uint32_t n1, uint32_t nx)
+{
+    if (from < pool->act_t0)
+        from = pool->act_t0;
+    if (to > pool->act_t1)
+        to = pool->act_t1;
+
+    if (from < to) {
+        uint64_t dt = to - from;
+
+        a->time_0 += dt * n0;
+        a->time_1 += dt * n1;
+        a->time_x += dt * nx;
+    }
+}
+
+static uint32_t fstReaderActivityPopcount(uint64_t v)
+{
+#ifdef __GNUC__
+    return (__builtin_popcountll(v));
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return ((uint32_t)((v * 0x0101010101010101ULL) >> 56));
+#endif
+}
+
+/*
+ * replaces the packed binary value cur with val, returning the bits which flipped
+ * and the bits now set.  the pad bits of the last byte are ignored.
+ */
+static uint32_t fstReaderActivityPacked(unsigned char *cur, const unsigned char *val, uint32_t slen, uint32_t *ones)
+{
+    uint32_t nbytes = (slen + 7) / 8;
+    uint32_t flips = 0, set = 0;
+    uint32_t k = 0;
+
+    for (; k + 8 <= nbytes; k += 8) {
+        uint64_t c, v;
+
+        memcpy(&c, cur + k, 8);
+        memcpy(&v, val + k, 8);
+        flips += fstReaderActivityPopcount(c ^ v);
+        set += fstReaderActivityPopcount(v);
+    }
+    for (; k < nbytes; k++) {
+        unsigned char mask = ((k + 1 == nbytes) && (slen & 7)) ? (unsigned char)(0xff00 >> (slen & 7)) : 0xff;
+
+        flips += fstReaderActivityPopcount((cur[k] ^ val[k]) & mask);
+        set += fstReaderActivityPopcount(val[k] & mask);
+    }
+
+    memcpy(cur, val, nbytes);
+    *ones = set;
+    return (flips);
+}
+
+/*
+ * folds the unpacked chains of job into job->act, starting every signal from the
+ * section's frame.  values are compared in their packed chain form and never
+ * formatted, so sections are independent and can be run on the unpack threads.
+ * vectors holding only 0/1 are kept packed, otherwise as one character per bit.
+ * where fstReaderIterBlocks2() would not emit the first section's frame, the
+ * changes at its first time are the initial values instead: they seed the
+ * signal without being counted, so the totals agree with what fst2vcd shows.
+ */
+static void fstReaderActivitySection(struct fstReaderContext *xc, struct fstReaderUnpackPool *pool,
+                                     struct fstReaderUnpackJob *job)
+{
+    unsigned char *cur = NULL;
+    unsigned char *bits = NULL;
+    uint32_t cur_len = 0;
+    int seed_first = job->first_section && !job->emit_frame;
+    fstHandle i;
+
+    for (i = 0; i < xc->maxhandle; i++) {
+        struct fstSignalActivity *a = job->act + i;
+        unsigned char *mu = job->mem_for_traversal + job->headptr[i];
+        uint32_t len = job->length_remaining[i];
+        uint32_t slen = xc->signal_lens[i];
+        uint32_t p = 0, tidx = 0;
+        uint32_t n0 = 0, n1 = 0, nx = 0;
+        uint64_t last = job->beg_tim;
+        int is_real = (xc->signal_typs[i] == FST_VT_VCD_REAL);
+        int packed = 0; /* value is in bits rather than cur */
+        uint32_t j;
+
+        if (!(xc->process_mask[i / 8] & (1 << (i & 7)))) {
+            continue;
+        }
+        job->length_remaining[i] = 0; /* consumed here rather than by fstReaderIterBlocksSection() */
+
+        if (slen > cur_len) {
+            cur_len = slen;
+            cur = (unsigned char *)realloc(cur, cur_len);
+            bits = (unsigned char *)realloc(bits, (cur_len + 7) / 8);
+        }
+        if ((job->frame) && (i < job->frame_maxhandle)) {
+            memcpy(cur, job->frame + xc->rvat_sig_offs[i], slen);
+        } else {
+            memset(cur, 'x', slen);
+        }
+        if (!is_real) {
+            for (j = 0; j < slen; j++) {
+                if (cur[j] == '0') {
+                    n0++;
+                } else if (cur[j] == '1') {
+                    n1++;
+                } else {
+                    nx++;
+                }
+            }
+        }
+
+        while (p < len) {
+            int skiplen;
+            uint32_t vli = fstGetVarint32(mu + p, &skiplen);
+            uint64_t tim;
+            int changed = 0;
+            uint32_t toggles = 0;
+
+            p += skiplen;
+            if (slen == 1) {
+                unsigned char v = (vli & 1) ? (unsigned char)FST_RCV_STR[((vli >> 1) & 7)]
+                                            : (unsigned char)(((vli >> 1) & 1) | '0');
+
+                tidx += vli >> (2 << (vli & 1));
+                if (tidx >= job->tsec_nitems)
+                    break;
+                tim = job->time_table[tidx];
+                fstReaderActivityHold(a, pool, last, tim, n0, n1, nx);
+
+                if (v != cur[0]) {
+                    changed = 1;
+                    toggles = ((v == '0') || (v == '1')) && ((cur[0] == '0') || (cur[0] == '1'));
+                    n0 = (v == '0');
+                    n1 = (v == '1');
+                    nx = !(n0 | n1);
+                    cur[0] = v;
+                }
+            } else {
+                tidx += vli >> 1;
+                if (tidx >= job->tsec_nitems)
+                    break;
+                tim = job->time_table[tidx];
+                fstReaderActivityHold(a, pool, last, tim, n0, n1, nx);
+
+                if (!slen) /* variable length: counted, not compared */
+                {
+                    int skiplen2;
+                    uint32_t vlen = fstGetVarint32(mu + p, &skiplen2);
+
+                    p += skiplen2 + vlen;
+                    changed = 1;
+                } else if (is_real) {
+                    unsigned char buf[8];
+                    unsigned char *srcdata = mu + p;
+
+                    if (!(vli & 1)) /* bit packed at flush, expanded as the iterators do */
+                    {
+                        for (j = 0; j < 8; j++) {
+                            buf[j] = ((mu[p] >> (7 - j)) & 1) | '0';
+                        }
+                        srcdata = buf;
+                    }
+                    if (memcmp(cur, srcdata, 8)) {
+                        changed = 1;
+                        memcpy(cur, srcdata, 8);
+                    }
+                    p += (vli & 1) ? slen : ((slen + 7) / 8);
+                } else if ((!(vli & 1)) && (packed)) {
+                    toggles = fstReaderActivityPacked(bits, mu + p, slen, &n1);
+                    n0 = slen - n1;
+                    changed = (toggles != 0);
+                    p += (slen + 7) / 8;
+                } else {
+                    if (packed) {
+                        for (j = 0; j < slen; j++) {
+                            cur[j] = ((bits[j / 8] >> (7 - (j & 7))) & 1) | '0';
+                        }
+                        packed = 0;
+                    }
+
+                    for (j = 0; j < slen; j++) {
+                        unsigned char v = (vli & 1) ? mu[p + j] : (((mu[p + j / 8] >> (7 - (j & 7))) & 1) | '0');
+
+                        if (v != cur[j]) {
+                            int was_bin = (cur[j] == '0') || (cur[j] == '1');
+                            int is_bin = (v == '0') || (v == '1');
+
+                            if (cur[j] == '0') {
+                                n0--;
+                            } else if (cur[j] == '1') {
+                                n1--;
+                            } else {
+                                nx--;
+                            }
+                            if (v == '0') {
+                                n0++;
+                            } else if (v == '1') {
+                                n1++;
+                            } else {
+                                nx++;
+                            }
+                            toggles += (was_bin && is_bin);
+                            cur[j] = v;
+                            changed = 1;
+                        }
+                    }
+                    p += (vli & 1) ? slen : ((slen + 7) / 8);
+
+                    if (!nx) {
+                        memset(bits, 0, (slen + 7) / 8);
+                        for (j = 0; j < slen; j++) {
+                            bits[j / 8] |= (cur[j] & 1) << (7 - (j & 7));
+                        }
+                        packed = 1;
+                    }
+                }
+            }
+
+            if ((seed_first) && (!tidx)) {
+                changed = 0; /* initial value, not a transition */
+            }
+            if ((changed) && (tim >= pool->act_t0) && (tim < pool->act_t1)) {
+                a->transitions++;
+                a->toggles += toggles;
+            }
+            last = tim;
+        }
+
+        fstReaderActivityHold(a, pool, last, job->act_end, n0, n1, nx);
+    }
+
+    free(bits);
+    free(cur);
+}
+
+#ifdef FST_READER_PARALLEL
+static void *fstReaderUnpackWorker(void *arg)
+{
+    struct fstReaderUnpackPool *pool = (struct fstReaderUnpackPool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        struct fstReaderUnpackJob *job;
+
+        while (!pool->exiting && (pool->next_decode == pool->next_read)) {
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        }
+        if (pool->exiting)
+            break;
+
+        job = pool->jobs + (pool->next_decode++ % pool->njobs);
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->status = fstReaderUnpackSection(pool->xc, job);
+        if (job->act && (job->status == FST_READER_UNPACK_OK)) {
+            fstReaderActivitySection(pool->xc, pool, job);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return (NULL);
+}
+#endif
+
+/*
+ * reads the next value change section (honoring the time range limits) into
+ * job, returns zero when there are no more sections to iterate over
+ */
+static int fstReaderUnpackRead(struct fstReaderContext *xc, struct fstReaderUnpackJob *job, fst_off_t *blkpos,
+                               int *blocks_skipped, unsigned int secnum)
+{
+    for (;;) {
+        int sectype;
+        uint64_t seclen, beg_tim, end_tim;
+        unsigned char *hdr = fstReaderMapped(xc, *blkpos, 25);
+
+        if (hdr) {
+            sectype = hdr[0];
+            seclen = fstGetUint64(hdr + 1);
+        } else {
+            fstReaderFseeko(xc, xc->f, *blkpos, SEEK_SET);
+
+            sectype = fgetc(xc->f);
+            seclen = fstReaderUint64(xc->f);
+        }
+
+        if ((sectype == EOF) || (sectype == FST_BL_SKIP)) {
+            return (0);
+        }
+
+        (*blkpos)++;
+        if ((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
+            (sectype != FST_BL_VCDATA_DYN_ALIAS2)) {
+            *blkpos += seclen;
             continue;
         }
 
-        if (!seclen)
-            break;
+        if (!seclen)
+            return (0);
+
+        if (hdr) {
+            beg_tim = fstGetUint64(hdr + 9);
+            end_tim = fstGetUint64(hdr + 17);
+        } else {
+            beg_tim = fstReaderUint64(xc->f);
+            end_tim = fstReaderUint64(xc->f);
+        }
+
+        if (xc->limit_range_valid) {
+            if (end_tim < xc->limit_range_start) {
+                (*blocks_skipped)++;
+                *blkpos += seclen;
+                continue;
+            }
+
+            if (beg_tim > xc->limit_range_end) {
+                return (0);
+            }
+        }
+
+        if (seclen < 32)
+            return (0); /* corrupted seclen: too small to hold the section header */
+        job->sec_pos = *blkpos;
+        job->sec = job->sparse ? NULL : fstReaderMapped(xc, *blkpos, seclen);
+        job->sec_mapped = (job->sec != NULL);
+        if (!job->sec_mapped && !job->sparse) {
+            job->sec = (unsigned char *)malloc(seclen);
+            if (!job->sec)
+                return (0);
+            fstReaderFseeko(xc, xc->f, *blkpos, SEEK_SET);
+            if (fstFread(job->sec, seclen, 1, xc->f) != 1) {
+                free(job->sec);
+                job->sec = NULL;
+                return (0);
+            }
+        }
+
+        job->seclen = seclen;
+        job->sectype = sectype;
+        job->beg_tim = beg_tim;
+        job->first_section = (secnum == 0);
+        job->blocks_skipped = (*blocks_skipped != 0);
+        job->emit_frame = 0;
+        job->done = 0;
+        job->status = FST_READER_UNPACK_OK;
+
+        *blkpos += seclen;
+        return (1);
+    }
+}
+
+static void fstReaderIterBlocksMem(struct fstReaderContext *xc, struct fstReaderIterState *st)
+{
+    struct fstReaderUnpackPool pool;
+    unsigned int nthreads = (xc->unpack_threads > 1) ? xc->unpack_threads : 0;
+    unsigned int secnum = 0;
+    unsigned int j;
+    int blocks_skipped;
+    int reading = 1;
+    int sparse = !nthreads && !xc->mmap_base; /* serial reads from the file only load what the mask needs */
+    fst_off_t blkpos = 0;
+#ifdef FST_READER_PARALLEL
+    pthread_t *threads = NULL;
+#endif
+
+    memset(&pool, 0, sizeof(pool));
+    pool.xc = xc;
+    pool.njobs = nthreads + 1; /* keeps every worker busy while the caller delivers a section */
+    pool.jobs = (struct fstReaderUnpackJob *)calloc(pool.njobs, sizeof(struct fstReaderUnpackJob));
+    for (j = 0; j < pool.njobs; j++) {
+        pool.jobs[j].scatterptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].headptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].length_remaining = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].sparse = sparse;
+    }
+
+#ifdef FST_READER_PARALLEL
+    if (nthreads) {
+        pthread_mutex_init(&pool.mutex, NULL);
+        pthread_cond_init(&pool.work_cond, NULL);
+        pthread_cond_init(&pool.done_cond, NULL);
+
+        threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+        for (j = 0; j < nthreads; j++) {
+            if (pthread_create(&threads[j], NULL, fstReaderUnpackWorker, &pool)) {
+                fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), pthread_create() failed, exiting.\n");
+                exit(255);
+            }
+        }
+    }
+#endif
+
+    fstReaderMmapAdvise(xc, 1);
+    blocks_skipped = fstReaderSkipToLimitRange(xc, &blkpos);
+
+    for (;;) {
+        struct fstReaderUnpackJob *job;
+
+        while (reading && (pool.next_read - pool.next_deliver < pool.njobs)) {
+            job = pool.jobs + (pool.next_read % pool.njobs);
+            if (!fstReaderUnpackRead(xc, job, &blkpos, &blocks_skipped, secnum)) {
+                reading = 0;
+                break;
+            }
+
+            if (nthreads) {
+#ifdef FST_READER_PARALLEL
+                pthread_mutex_lock(&pool.mutex);
+                pool.next_read++;
+                pthread_cond_signal(&pool.work_cond);
+                pthread_mutex_unlock(&pool.mutex);
+#endif
+            } else {
+                job->status = fstReaderUnpackSection(xc, job);
+                job->done = 1;
+                pool.next_read++;
+            }
+
+            secnum++;
+            if (secnum == xc->vc_section_count)
+                reading = 0; /* in case file is growing, keep with original block count */
+        }
+
+        if (pool.next_deliver == pool.next_read)
+            break;
+
+        job = pool.jobs + (pool.next_deliver % pool.njobs);
+#ifdef FST_READER_PARALLEL
+        if (nthreads) {
+            pthread_mutex_lock(&pool.mutex);
+            while (!job->done) {
+                pthread_cond_wait(&pool.done_cond, &pool.mutex);
+            }
+            pthread_mutex_unlock(&pool.mutex);
+        }
+#endif
+
+        if (job->status == FST_READER_UNPACK_STOP)
+            break;
+
+        if (job->status == FST_READER_UNPACK_OK) {
+            if (job->emit_frame) {
+                fstReaderIterBlocksFrame(xc, st, job->beg_tim, job->frame, job->frame_maxhandle);
+            }
+
+            fstReaderIterBlocksSection(xc, st, job->time_table, job->tsec_nitems, job->tc_head, job->scatterptr,
+                                       job->headptr, job->length_remaining, job->mem_for_traversal);
+        }
+
+        fstReaderUnpackJobFree(job);
+        pool.next_deliver++;
+    }
 
-        beg_tim = fstReaderUint64(xc->f);
-        end_tim = fstReaderUint64(xc->f);
+#ifdef FST_READER_PARALLEL
+    if (nthreads) {
+        pthread_mutex_lock(&pool.mutex);
+        pool.exiting = 1;
+        pthread_cond_broadcast(&pool.work_cond);
+        pthread_mutex_unlock(&pool.mutex);
+        for (j = 0; j < nthreads; j++) {
+            pthread_join(threads[j], NULL);
+        }
+        free(threads);
 
-        if (xc->limit_range_valid) {
-            if (end_tim < xc->limit_range_start) {
-                blocks_skipped++;
-                blkpos += seclen;
-                continue;
+        pthread_cond_destroy(&pool.done_cond);
+        pthread_cond_destroy(&pool.work_cond);
+        pthread_mutex_destroy(&pool.mutex);
+    }
+#endif
+
+    for (j = 0; j < pool.njobs; j++) {
+        fstReaderUnpackJobFree(pool.jobs + j);
+        free(pool.jobs[j].scatterptr);
+        free(pool.jobs[j].headptr);
+        free(pool.jobs[j].length_remaining);
+        free(pool.jobs[j].scratch);
+    }
+    free(pool.jobs);
+}
+
+
+/* normal read which re-interleaves the value change data */
+int fstReaderIterBlocks(void *ctx,
+                        void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                                      const unsigned char *value),
+                        void *user_callback_data_pointer, FILE *fv)
+{
+    return (fstReaderIterBlocks2(ctx, value_change_callback, NULL, user_callback_data_pointer, fv));
+}
+
+int fstReaderIterBlocks2(void *ctx,
+                         void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time,
+                                                       fstHandle facidx, const unsigned char *value),
+                         void (*value_change_callback_varlen)(void *user_callback_data_pointer, uint64_t time,
+                                                              fstHandle facidx, const unsigned char *value,
+                                                              uint32_t len),
+                         void *user_callback_data_pointer, FILE *fv)
+{
+    return (fstReaderIterBlocksPacked(ctx, value_change_callback, value_change_callback_varlen, NULL,
+                                      user_callback_data_pointer, fv));
+}
+
+/*
+ * as fstReaderIterBlocks2() but non-real, fixed length values (including
+ * scalars) go to value_change_callback_packed as 64-bit words instead of bit
+ * strings; xz_mask is NULL unless the value holds something other than 0/1
+ */
+int fstReaderIterBlocksPacked(void *ctx,
+                              void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time,
+                                                            fstHandle facidx, const unsigned char *value),
+                              void (*value_change_callback_varlen)(void *user_callback_data_pointer, uint64_t time,
+                                                                   fstHandle facidx, const unsigned char *value,
+                                                                   uint32_t len),
+                              void (*value_change_callback_packed)(void *user_callback_data_pointer, uint64_t time,
+                                                                   fstHandle facidx, const uint64_t *value,
+                                                                   const uint64_t *xz_mask, uint32_t bits),
+                              void *user_callback_data_pointer, FILE *fv)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderIterState st;
+
+    if (!xc)
+        return (0);
+
+    st.value_change_callback = value_change_callback;
+    st.value_change_callback_varlen = value_change_callback_varlen;
+    st.value_change_callback_packed = value_change_callback_packed;
+    st.user_callback_data_pointer = user_callback_data_pointer;
+    st.fv = fv;
+    st.packed_value = NULL;
+    st.packed_nwords = 0;
+    st.stop = 0;
+    st.frame_resume_idx = 0;
+    st.frame_resume_offs = 0;
+    st.section_resume_i = 0;
+    st.previous_time = UINT64_MAX;
+    st.dumpvars_state = 0;
+    st.cur_blackout = 0;
+
+    if (value_change_callback_packed) {
+        st.packed_nwords = (xc->longest_signal_value_len + 63) >> 6;
+        st.packed_value = (uint64_t *)malloc(2 * st.packed_nwords * sizeof(uint64_t));
+    }
+
+    if (fv) {
+#ifndef FST_WRITEX_DISABLE
+        fflush(fv);
+        setvbuf(fv, (char *)NULL, _IONBF,
+                0); /* even buffered IO is slow so disable it and use our own routines that don't need seeking */
+        xc->writex_fd = fileno(fv);
+#endif
+    }
+
+    fstReaderIterBlocksMem(xc, &st);
+    free(st.packed_value);
+
+#ifndef FST_WRITEX_DISABLE
+    if (fv) {
+        fstWritex(xc, NULL, 0);
+    }
+#endif
+
+    return (1);
+}
+
+/*
+ * pull-based traversal: a cursor holds one unpacked section and pauses the
+ * frame/section walk whenever the caller's batch is full.  values are copied
+ * into a buffer owned by the cursor which is reused from batch to batch, so
+ * steady state iteration does not allocate.
+ */
+struct fstReaderCursor
+{
+    struct fstReaderContext *xc;
+    struct fstReaderIterState st;
+    struct fstReaderUnpackJob job;
+
+    fst_off_t blkpos;
+    int blocks_skipped;
+    unsigned int secnum;
+    unsigned char in_frame;   /* job's initial values are still being delivered */
+    unsigned char in_section; /* job holds a section which is still being delivered */
+    unsigned char at_end;
+
+    struct fstReaderValueChange *batch;
+    uint32_t batch_max, batch_cnt;
+
+    unsigned char *vmem; /* value bytes for the current batch, offsets are stashed in batch[].value */
+    size_t vmem_siz, vmem_used;
+};
+
+static void fstReaderCursorAppend(struct fstReaderCursor *cur, uint64_t time, fstHandle facidx,
+                                  const unsigned char *value, uint32_t len)
+{
+    struct fstReaderValueChange *vc = cur->batch + cur->batch_cnt;
+
+    if (FST_UNLIKELY(cur->vmem_used + len + 1 > cur->vmem_siz)) {
+        cur->vmem_siz = (cur->vmem_used + len + 1) * 2;
+        cur->vmem = (unsigned char *)realloc(cur->vmem, cur->vmem_siz);
+        if (FST_UNLIKELY(!cur->vmem)) {
+            fprintf(stderr, FST_APIMESS "Could not realloc() in fstReaderCursorNext, exiting.\n");
+            exit(255);
+        }
+    }
+
+    memcpy(cur->vmem + cur->vmem_used, value, len);
+    cur->vmem[cur->vmem_used + len] = 0;
+
+    vc->time = time;
+    vc->handle = facidx;
+    vc->len = len;
+    vc->value = (const unsigned char *)(uintptr_t)cur->vmem_used;
+    cur->vmem_used += len + 1;
+
+    if (++cur->batch_cnt == cur->batch_max) {
+        cur->st.stop = 1;
+    }
+}
+
+static void fstReaderCursorCallback(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                    const unsigned char *value)
+{
+    struct fstReaderCursor *cur = (struct fstReaderCursor *)user_callback_data_pointer;
+    struct fstReaderContext *xc = cur->xc;
+    uint32_t len;
+
+    if (xc->signal_typs[facidx - 1] == FST_VT_VCD_REAL) {
+        len = xc->native_doubles_for_cb ? 8 : strlen((const char *)value);
+    } else {
+        len = xc->signal_lens[facidx - 1];
+    }
+
+    fstReaderCursorAppend(cur, time, facidx, value, len);
+}
+
+static void fstReaderCursorCallbackVarlen(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                          const unsigned char *value, uint32_t len)
+{
+    fstReaderCursorAppend((struct fstReaderCursor *)user_callback_data_pointer, time, facidx, value, len);
+}
+
+void *fstReaderCursorOpen(void *ctx)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderCursor *cur;
+
+    if (!xc)
+        return (NULL);
+
+    cur = (struct fstReaderCursor *)calloc(1, sizeof(struct fstReaderCursor));
+    cur->xc = xc;
+    cur->st.value_change_callback = fstReaderCursorCallback;
+    cur->st.value_change_callback_varlen = fstReaderCursorCallbackVarlen;
+    cur->st.user_callback_data_pointer = cur;
+    cur->st.previous_time = UINT64_MAX;
+
+    cur->job.scatterptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+    cur->job.headptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+    cur->job.length_remaining = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+
+    cur->blocks_skipped = fstReaderSkipToLimitRange(xc, &cur->blkpos);
+
+    return (cur);
+}
+
+/*
+ * fills buf with up to maxitems value changes in time order and returns how
+ * many were written, zero once traversal is complete.  the value pointers
+ * stay valid until the next call on this cursor.
+ */
+uint32_t fstReaderCursorNext(void *cursor, struct fstReaderValueChange *buf, uint32_t maxitems)
+{
+    struct fstReaderCursor *cur = (struct fstReaderCursor *)cursor;
+    struct fstReaderContext *xc;
+    struct fstReaderUnpackJob *job;
+    uint32_t i;
+
+    if (!cur || !buf || !maxitems)
+        return (0);
+
+    xc = cur->xc;
+    job = &cur->job;
+    cur->batch = buf;
+    cur->batch_max = maxitems;
+    cur->batch_cnt = 0;
+    cur->vmem_used = 0;
+
+    while (cur->batch_cnt < maxitems) {
+        cur->st.stop = 0;
+
+        if (cur->in_frame) {
+            fstReaderIterBlocksFrame(xc, &cur->st, job->beg_tim, job->frame, job->frame_maxhandle);
+            if (cur->st.stop) {
+                break;
             }
+            cur->in_frame = 0;
+            continue;
+        }
 
-            if (beg_tim >
-                xc->limit_range_end) /* likely the compare in for(i=0;i<tsec_nitems;i++) below would do this earlier */
-            {
+        if (cur->in_section) {
+            fstReaderIterBlocksSection(xc, &cur->st, job->time_table, job->tsec_nitems, job->tc_head, job->scatterptr,
+                                       job->headptr, job->length_remaining, job->mem_for_traversal);
+            if (cur->st.stop) {
                 break;
             }
+            cur->in_section = 0;
+            fstReaderUnpackJobFree(job);
+            continue;
         }
 
-        mem_required_for_traversal = fstReaderUint64(xc->f);
-        mem_for_traversal =
-                (unsigned char *)malloc(mem_required_for_traversal + 66); /* add in potential fastlz overhead */
+        if (cur->at_end || (cur->secnum == xc->vc_section_count) ||
+            !fstReaderUnpackRead(xc, job, &cur->blkpos, &cur->blocks_skipped, cur->secnum)) {
+            cur->at_end = 1;
+            break;
+        }
+        cur->secnum++;
+
+        job->status = fstReaderUnpackSection(xc, job);
+        if (job->status == FST_READER_UNPACK_OK) {
+            cur->in_frame = job->emit_frame;
+            cur->in_section = 1;
+        } else {
+            if (job->status == FST_READER_UNPACK_STOP) {
+                cur->at_end = 1;
+            }
+            fstReaderUnpackJobFree(job);
+        }
+    }
+
+    for (i = 0; i < cur->batch_cnt; i++) {
+        buf[i].value = cur->vmem + (uintptr_t)buf[i].value;
+    }
+
+    return (cur->batch_cnt);
+}
+
+void fstReaderCursorClose(void *cursor)
+{
+    struct fstReaderCursor *cur = (struct fstReaderCursor *)cursor;
+
+    if (cur) {
+        fstReaderUnpackJobFree(&cur->job);
+        free(cur->job.scatterptr);
+        free(cur->job.headptr);
+        free(cur->job.length_remaining);
+        free(cur->vmem);
+        free(cur);
+    }
+}
+
+/* rvat functions */
+
+static char *fstExtractRvatDataFromFrame(struct fstReaderContext *xc, fstHandle facidx, char *buf)
+{
+    if (facidx >= xc->rvat_sec->frame_maxhandle) {
+        return (NULL);
+    }
+
+    if (xc->signal_lens[facidx] == 1) {
+        buf[0] = (char)xc->rvat_sec->frame_data[xc->rvat_sig_offs[facidx]];
+        buf[1] = 0;
+    } else {
+        if (xc->signal_typs[facidx] != FST_VT_VCD_REAL) {
+            memcpy(buf, xc->rvat_sec->frame_data + xc->rvat_sig_offs[facidx], xc->signal_lens[facidx]);
+            buf[xc->signal_lens[facidx]] = 0;
+        } else {
+            double d;
+            unsigned char *clone_d = (unsigned char *)&d;
+            unsigned char *srcdata = xc->rvat_sec->frame_data + xc->rvat_sig_offs[facidx];
+
+            if (xc->double_endian_match) {
+                memcpy(clone_d, srcdata, 8);
+            } else {
+                int j;
+
+                for (j = 0; j < 8; j++) {
+                    clone_d[j] = srcdata[7 - j];
+                }
+            }
+
+            sprintf((char *)buf, "%.16g", d);
+        }
+    }
+
+    return (buf);
+}
+
+static void fstReaderRvatSetupOffsets(struct fstReaderContext *xc)
+{
+    if (!xc->rvat_sig_offs) {
+        uint32_t cur_offs = 0;
+        fstHandle i;
+
+        xc->rvat_sig_offs = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        for (i = 0; i < xc->maxhandle; i++) {
+            xc->rvat_sig_offs[i] = cur_offs;
+            cur_offs += xc->signal_lens[i];
+        }
+    }
+}
+
+/* index of the section rvat reads tim from, or vc_section_count if there is none */
+static uint64_t fstReaderRvatSectionIndex(struct fstReaderContext *xc, uint64_t tim)
+{
+    uint64_t si = fstReaderFindSection(xc, tim);
+
+    if ((si >= xc->vc_section_count) || (xc->vc_sections[si].beg_tim > tim)) {
+        return (xc->vc_section_count);
+    }
+
+    if ((tim == xc->vc_sections[si].end_tim) && (tim != xc->end_time) && (si + 1 < xc->vc_section_count) &&
+        (xc->vc_sections[si + 1].beg_tim == tim)) {
+        si++; /* value changes at tim continue into the next section */
+    }
+
+    return (si);
+}
+
+/* would fstReaderRvatLoadSection() resolve tim to sec? */
+static int fstReaderRvatSectionCovers(struct fstReaderContext *xc, struct fstReaderRvatSection *sec, uint64_t tim)
+{
+    if (xc->vc_sections) {
+        uint64_t si = fstReaderRvatSectionIndex(xc, tim);
+
+        return ((si < xc->vc_section_count) && (xc->vc_sections[si].pos + 1 == sec->blkpos));
+    }
+
+    return ((sec->beg_tim <= tim) && (tim <= sec->end_tim));
+}
+
+/*
+ * decodes the time table of the section whose length field is at blkpos, also
+ * returning its item count and compressed length (which locates the chain index)
+ */
+static uint64_t *fstReaderRvatTimeTable(struct fstReaderContext *xc, fst_off_t blkpos, uint64_t seclen,
+                                        uint64_t *nitems, uint64_t *clen)
+{
+    unsigned char *ucdata;
+    unsigned char *cdata;
+    int free_cdata = 0;
+    unsigned long destlen /* = tsec_uclen */;  /* scan-build */
+    unsigned long sourcelen /* = tsec_clen */; /* scan-build */
+    int rc;
+    uint64_t tsec_uclen, tsec_clen, tsec_nitems;
+    uint64_t *time_table;
+
+    fstReaderFseeko(xc, xc->f, blkpos + seclen - 24, SEEK_SET);
+    tsec_uclen = fstReaderUint64(xc->f);
+    tsec_clen = fstReaderUint64(xc->f);
+    tsec_nitems = fstReaderUint64(xc->f);
 #ifdef FST_DEBUG
-        fprintf(stderr, FST_APIMESS "sec: %u seclen: %d begtim: %d endtim: %d\n", secnum, (int)seclen, (int)beg_tim,
-                (int)end_tim);
-        fprintf(stderr, FST_APIMESS "mem_required_for_traversal: %d\n", (int)mem_required_for_traversal);
+    fprintf(stderr, FST_APIMESS "time section unc: %d, com: %d (%d items)\n", (int)tsec_uclen, (int)tsec_clen,
+            (int)tsec_nitems);
 #endif
-        /* process time block */
-        {
-            unsigned char *ucdata;
-            unsigned char *cdata;
-            unsigned long destlen /* = tsec_uclen */; /* scan-build */
-            unsigned long sourcelen /*= tsec_clen */; /* scan-build */
-            int rc;
-            unsigned char *tpnt;
-            uint64_t tpval;
-            unsigned int ti;
+    ucdata = (unsigned char *)malloc(tsec_uclen);
+    destlen = tsec_uclen;
+    sourcelen = tsec_clen;
+
+    fstReaderFseeko(xc, xc->f, -24 - ((fst_off_t)tsec_clen), SEEK_CUR);
+    cdata = fstReaderMapped(xc, blkpos + seclen - 24 - tsec_clen, tsec_clen);
+    if (tsec_uclen != tsec_clen) {
+        if (!cdata) {
+            cdata = (unsigned char *)malloc(tsec_clen);
+            fstFread(cdata, tsec_clen, 1, xc->f);
+            free_cdata = 1;
+        }
 
-            if (fstReaderFseeko(xc, xc->f, blkpos + seclen - 24, SEEK_SET) != 0)
-                break;
-            tsec_uclen = fstReaderUint64(xc->f);
-            tsec_clen = fstReaderUint64(xc->f);
-            tsec_nitems = fstReaderUint64(xc->f);
+        rc = uncompress(ucdata, &destlen, cdata, sourcelen);
+
+        if (rc != Z_OK) {
+            fprintf(stderr, FST_APIMESS "fstReaderGetValueFromHandleAtTime(), tsec uncompress rc = %d, exiting.\n", rc);
+            exit(255);
+        }
+
+        if (free_cdata) {
+            free(cdata);
+        }
+    } else if (cdata) {
+        memcpy(ucdata, cdata, tsec_uclen);
+    } else {
+        fstFread(ucdata, tsec_uclen, 1, xc->f);
+    }
+
+    time_table = (uint64_t *)calloc(tsec_nitems, sizeof(uint64_t));
+    fstReaderDecodeTimeTable(ucdata, tsec_uclen, time_table, tsec_nitems);
+
+    free(ucdata);
+
+    *nitems = tsec_nitems;
+    *clen = tsec_clen;
+    return (time_table);
+}
+
+/*
+ * locate the section holding tim and make it current, decoding its time table,
+ * frame and chain index on a cache miss; returns NULL if no section covers tim
+ */
+static struct fstReaderRvatSection *fstReaderRvatLoadSection(struct fstReaderContext *xc, uint64_t tim)
+{
+    fst_off_t blkpos = 0, prev_blkpos;
+    uint64_t beg_tim, end_tim, beg_tim2, end_tim2;
+    int sectype;
+    unsigned int secnum = 0;
+    uint64_t seclen;
+    uint64_t tsec_clen = 0;
+    uint64_t tsec_nitems;
+    uint64_t frame_uclen, frame_clen;
 #ifdef FST_DEBUG
-            fprintf(stderr, FST_APIMESS "time section unc: %d, com: %d (%d items)\n", (int)tsec_uclen, (int)tsec_clen,
-                    (int)tsec_nitems);
-#endif
-            if (tsec_clen > seclen)
-                break; /* corrupted tsec_clen: by definition it can't be larger than size of section */
-            ucdata = (unsigned char *)malloc(tsec_uclen);
-            if (!ucdata)
-                break; /* malloc fail as tsec_uclen out of range from corrupted file */
-            destlen = tsec_uclen;
-            sourcelen = tsec_clen;
+    uint64_t mem_required_for_traversal;
+#endif
+    fst_off_t indx_pntr, indx_pos;
+    long chain_clen;
+    unsigned char *chain_cmem;
+    int free_chain_cmem = 0;
+#ifdef FST_DEBUG
+    fstHandle idx;
+#endif
+    struct fstReaderRvatSection *sec;
+
+    if (!xc->vc_sections) {
+        for (sec = xc->rvat_sec; sec; sec = sec->next) {
+            if ((sec->beg_tim <= tim) && (tim <= sec->end_tim)) {
+                break;
+            }
+        }
+        if (sec) {
+            goto section_hit;
+        }
+    }
+
+    fstReaderMmapAdvise(xc, 0);
+
+    if (xc->vc_sections) {
+        uint64_t si = fstReaderRvatSectionIndex(xc, tim);
+        struct fstReaderSection *vcs;
+
+        if (si >= xc->vc_section_count) {
+            return (NULL);
+        }
+
+        vcs = xc->vc_sections + si;
+        secnum = si;
+        sectype = vcs->sectype;
+        seclen = vcs->seclen;
+        beg_tim = vcs->beg_tim;
+        end_tim = vcs->end_tim;
+        blkpos = vcs->pos + 1;
+
+        for (sec = xc->rvat_sec; sec; sec = sec->next) {
+            if (sec->blkpos == blkpos) {
+                goto section_hit;
+            }
+        }
+
+        fstReaderFseeko(xc, xc->f, blkpos + 24, SEEK_SET); /* mem_required_for_traversal */
+    } else {
+        for (;;) {
+            fstReaderFseeko(xc, xc->f, (prev_blkpos = blkpos), SEEK_SET);
+
+            sectype = fgetc(xc->f);
+            seclen = fstReaderUint64(xc->f);
+
+            if ((sectype == EOF) || (sectype == FST_BL_SKIP) || (!seclen)) {
+                return (NULL); /* if this loop exits on break, it's successful */
+            }
 
-            fstReaderFseeko(xc, xc->f, -24 - ((fst_off_t)tsec_clen), SEEK_CUR);
+            blkpos++;
+            if ((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
+                (sectype != FST_BL_VCDATA_DYN_ALIAS2)) {
+                blkpos += seclen;
+                continue;
+            }
 
-            if (tsec_uclen != tsec_clen) {
-                cdata = (unsigned char *)malloc(tsec_clen);
-                fstFread(cdata, tsec_clen, 1, xc->f);
+            beg_tim = fstReaderUint64(xc->f);
+            end_tim = fstReaderUint64(xc->f);
 
-                rc = uncompress(ucdata, &destlen, cdata, sourcelen);
+            if ((beg_tim <= tim) && (tim <= end_tim)) {
+                if ((tim == end_tim) && (tim != xc->end_time)) {
+                    fst_off_t cached_pos = ftello(xc->f);
+                    fstReaderFseeko(xc, xc->f, blkpos, SEEK_SET);
 
-                if (rc != Z_OK) {
-                    fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), tsec uncompress rc = %d, exiting.\n", rc);
-                    exit(255);
-                }
+                    sectype = fgetc(xc->f);
+                    seclen = fstReaderUint64(xc->f);
 
-                free(cdata);
-            } else {
-                fstFread(ucdata, tsec_uclen, 1, xc->f);
-            }
+                    beg_tim2 = fstReaderUint64(xc->f);
+                    end_tim2 = fstReaderUint64(xc->f);
 
-            free(time_table);
-            time_table = (uint64_t *)calloc(tsec_nitems, sizeof(uint64_t));
-            tpnt = ucdata;
-            tpval = 0;
-            for (ti = 0; ti < tsec_nitems; ti++) {
-                int skiplen;
-                uint64_t val = fstGetVarint64(tpnt, &skiplen);
-                tpval = time_table[ti] = tpval + val;
-                tpnt += skiplen;
+                    if (((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
+                         (sectype != FST_BL_VCDATA_DYN_ALIAS2)) ||
+                        (!seclen) || (beg_tim2 != tim)) {
+                        blkpos = prev_blkpos;
+                        break;
+                    }
+                    beg_tim = beg_tim2;
+                    end_tim = end_tim2;
+                    fstReaderFseeko(xc, xc->f, cached_pos, SEEK_SET);
+                }
+                break;
             }
 
-            tc_head = (uint32_t *)calloc(tsec_nitems /* scan-build */ ? tsec_nitems : 1, sizeof(uint32_t));
-            free(ucdata);
+            blkpos += seclen;
+            secnum++;
         }
+    }
 
-        fstReaderFseeko(xc, xc->f, blkpos + 32, SEEK_SET);
-
-        frame_uclen = fstReaderVarint64(xc->f);
-        frame_clen = fstReaderVarint64(xc->f);
-        frame_maxhandle = fstReaderVarint64(xc->f);
-
-        if (secnum == 0) {
-            if ((beg_tim != time_table[0]) || (blocks_skipped)) {
-                unsigned char *mu = (unsigned char *)malloc(frame_uclen);
-                uint32_t sig_offs = 0;
+    xc->rvat_sec_misses++;
+    sec = (struct fstReaderRvatSection *)calloc(1, sizeof(struct fstReaderRvatSection));
+    sec->blkpos = blkpos;
+    sec->beg_tim = beg_tim;
+    sec->end_tim = end_tim;
 
-                if (fv) {
-                    char wx_buf[32];
-                    int wx_len;
+#ifdef FST_DEBUG
+    mem_required_for_traversal =
+#endif
+            fstReaderUint64(xc->f);
 
-                    if (beg_tim) {
-                        if (dumpvars_state == 1) {
-                            wx_len = sprintf(wx_buf, "$end\n");
-                            fstWritex(xc, wx_buf, wx_len);
-                            dumpvars_state = 2;
-                        }
-                        wx_len = sprintf(wx_buf, "#%" PRIu64 "\n", beg_tim);
-                        fstWritex(xc, wx_buf, wx_len);
-                        if (!dumpvars_state) {
-                            wx_len = sprintf(wx_buf, "$dumpvars\n");
-                            fstWritex(xc, wx_buf, wx_len);
-                            dumpvars_state = 1;
-                        }
-                    }
-                    if ((xc->num_blackouts) && (cur_blackout != xc->num_blackouts)) {
-                        if (beg_tim == xc->blackout_times[cur_blackout]) {
-                            wx_len = sprintf(wx_buf, "$dump%s $end\n",
-                                             (xc->blackout_activity[cur_blackout++]) ? "on" : "off");
-                            fstWritex(xc, wx_buf, wx_len);
-                        }
-                    }
-                }
+#ifdef FST_DEBUG
+    fprintf(stderr, FST_APIMESS "rvat sec: %u seclen: %d begtim: %d endtim: %d\n", secnum, (int)seclen, (int)beg_tim,
+            (int)end_tim);
+    fprintf(stderr, FST_APIMESS "mem_required_for_traversal: %d\n", (int)mem_required_for_traversal);
+#endif
 
-                if (frame_uclen == frame_clen) {
-                    fstFread(mu, frame_uclen, 1, xc->f);
-                } else {
-                    unsigned char *mc = (unsigned char *)malloc(frame_clen);
-                    int rc;
+    /* process time block */
+    sec->time_table = fstReaderRvatTimeTable(xc, blkpos, seclen, &tsec_nitems, &tsec_clen);
 
-                    unsigned long destlen = frame_uclen;
-                    unsigned long sourcelen = frame_clen;
+    fstReaderFseeko(xc, xc->f, blkpos + 32, SEEK_SET);
 
-                    fstFread(mc, sourcelen, 1, xc->f);
-                    rc = uncompress(mu, &destlen, mc, sourcelen);
-                    if (rc != Z_OK) {
-                        fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), frame uncompress rc: %d, exiting.\n", rc);
-                        exit(255);
-                    }
-                    free(mc);
-                }
+    frame_uclen = fstReaderVarint64(xc->f);
+    frame_clen = fstReaderVarint64(xc->f);
+    sec->frame_maxhandle = fstReaderVarint64(xc->f);
+    sec->frame_data = (unsigned char *)malloc(frame_uclen);
 
-                for (idx = 0; idx < frame_maxhandle; idx++) {
-                    int process_idx = idx / 8;
-                    int process_bit = idx & 7;
-
-                    if (xc->process_mask[process_idx] & (1 << process_bit)) {
-                        if (xc->signal_lens[idx] <= 1) {
-                            if (xc->signal_lens[idx] == 1) {
-                                unsigned char val = mu[sig_offs];
-                                if (value_change_callback) {
-                                    xc->temp_signal_value_buf[0] = val;
-                                    xc->temp_signal_value_buf[1] = 0;
-                                    value_change_callback(user_callback_data_pointer, beg_tim, idx + 1,
-                                                          xc->temp_signal_value_buf);
-                                } else {
-                                    if (fv) {
-                                        char vcd_id[16];
-
-                                        int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
-                                        vcd_id[0] = val; /* collapse 3 writes into one I/O call */
-                                        vcd_id[vcdid_len + 1] = '\n';
-                                        fstWritex(xc, vcd_id, vcdid_len + 2);
-                                    }
-                                }
-                            } else {
-                                /* variable-length ("0" length) records have no initial state */
-                            }
-                        } else {
-                            if (xc->signal_typs[idx] != FST_VT_VCD_REAL) {
-                                if (value_change_callback) {
-                                    memcpy(xc->temp_signal_value_buf, mu + sig_offs, xc->signal_lens[idx]);
-                                    xc->temp_signal_value_buf[xc->signal_lens[idx]] = 0;
-                                    value_change_callback(user_callback_data_pointer, beg_tim, idx + 1,
-                                                          xc->temp_signal_value_buf);
-                                } else {
-                                    if (fv) {
-                                        char vcd_id[16];
-                                        int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
-
-                                        vcd_id[0] = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
-                                        fstWritex(xc, vcd_id, 1);
-                                        fstWritex(xc, mu + sig_offs, xc->signal_lens[idx]);
-
-                                        vcd_id[0] = ' '; /* collapse 3 writes into one I/O call */
-                                        vcd_id[vcdid_len + 1] = '\n';
-                                        fstWritex(xc, vcd_id, vcdid_len + 2);
-                                    }
-                                }
-                            } else {
-                                double d;
-                                unsigned char *clone_d;
-                                unsigned char *srcdata = mu + sig_offs;
-
-                                if (value_change_callback) {
-                                    if (xc->native_doubles_for_cb) {
-                                        if (xc->double_endian_match) {
-                                            clone_d = srcdata;
-                                        } else {
-                                            int j;
-
-                                            clone_d = (unsigned char *)&d;
-                                            for (j = 0; j < 8; j++) {
-                                                clone_d[j] = srcdata[7 - j];
-                                            }
-                                        }
-                                        value_change_callback(user_callback_data_pointer, beg_tim, idx + 1, clone_d);
-                                    } else {
-                                        clone_d = (unsigned char *)&d;
-                                        if (xc->double_endian_match) {
-                                            memcpy(clone_d, srcdata, 8);
-                                        } else {
-                                            int j;
-
-                                            for (j = 0; j < 8; j++) {
-                                                clone_d[j] = srcdata[7 - j];
-                                            }
-                                        }
-                                        sprintf((char *)xc->temp_signal_value_buf, "%.16g", d);
-                                        value_change_callback(user_callback_data_pointer, beg_tim, idx + 1,
-                                                              xc->temp_signal_value_buf);
-                                    }
-                                } else {
-                                    if (fv) {
-                                        char vcdid_buf[16];
-                                        char wx_buf[64];
-                                        int wx_len;
-
-                                        clone_d = (unsigned char *)&d;
-                                        if (xc->double_endian_match) {
-                                            memcpy(clone_d, srcdata, 8);
-                                        } else {
-                                            int j;
-
-                                            for (j = 0; j < 8; j++) {
-                                                clone_d[j] = srcdata[7 - j];
-                                            }
-                                        }
-
-                                        fstVcdID(vcdid_buf, idx + 1);
-                                        wx_len = sprintf(wx_buf, "r%.16g %s\n", d, vcdid_buf);
-                                        fstWritex(xc, wx_buf, wx_len);
-                                    }
-                                }
-                            }
-                        }
-                    }
+    if (frame_uclen == frame_clen) {
+        fstFread(sec->frame_data, frame_uclen, 1, xc->f);
+    } else {
+        unsigned char *mc = fstReaderMapped(xc, ftello(xc->f), frame_clen);
+        int rc;
 
-                    sig_offs += xc->signal_lens[idx];
-                }
+        unsigned long destlen = frame_uclen;
+        unsigned long sourcelen = frame_clen;
 
-                free(mu);
-                fstReaderFseeko(xc, xc->f, -((fst_off_t)frame_clen), SEEK_CUR);
-            }
+        if (mc) {
+            rc = uncompress(sec->frame_data, &destlen, mc, sourcelen);
+            fstReaderFseeko(xc, xc->f, (fst_off_t)frame_clen, SEEK_CUR);
+            mc = NULL;
+        } else {
+            mc = (unsigned char *)malloc(frame_clen);
+            fstFread(mc, sourcelen, 1, xc->f);
+            rc = uncompress(sec->frame_data, &destlen, mc, sourcelen);
         }
+        if (rc != Z_OK) {
+            fprintf(stderr, FST_APIMESS "fstReaderGetValueFromHandleAtTime(), frame decompress rc: %d, exiting.\n", rc);
+            exit(255);
+        }
+        free(mc);
+    }
 
-        fstReaderFseeko(xc, xc->f, (fst_off_t)frame_clen, SEEK_CUR); /* skip past compressed data */
-
-        vc_maxhandle = fstReaderVarint64(xc->f);
-        vc_start = ftello(xc->f); /* points to '!' character */
-        packtype = fgetc(xc->f);
+    sec->vc_maxhandle = fstReaderVarint64(xc->f);
+    sec->vc_start = ftello(xc->f); /* points to '!' character */
+    sec->packtype = fgetc(xc->f);
 
 #ifdef FST_DEBUG
-        fprintf(stderr, FST_APIMESS "frame_uclen: %d, frame_clen: %d, frame_maxhandle: %d\n", (int)frame_uclen,
-                (int)frame_clen, (int)frame_maxhandle);
-        fprintf(stderr, FST_APIMESS "vc_maxhandle: %d, packtype: %c\n", (int)vc_maxhandle, packtype);
+    fprintf(stderr, FST_APIMESS "frame_uclen: %d, frame_clen: %d, frame_maxhandle: %d\n", (int)frame_uclen,
+            (int)frame_clen, (int)sec->frame_maxhandle);
+    fprintf(stderr, FST_APIMESS "vc_maxhandle: %d\n", (int)sec->vc_maxhandle);
 #endif
 
-        indx_pntr = blkpos + seclen - 24 - tsec_clen - 8;
-        fstReaderFseeko(xc, xc->f, indx_pntr, SEEK_SET);
-        chain_clen = fstReaderUint64(xc->f);
-        indx_pos = indx_pntr - chain_clen;
+    indx_pntr = blkpos + seclen - 24 - tsec_clen - 8;
+    fstReaderFseeko(xc, xc->f, indx_pntr, SEEK_SET);
+    chain_clen = fstReaderUint64(xc->f);
+    indx_pos = indx_pntr - chain_clen;
 #ifdef FST_DEBUG
-        fprintf(stderr, FST_APIMESS "indx_pos: %d (%d bytes)\n", (int)indx_pos, (int)chain_clen);
+    fprintf(stderr, FST_APIMESS "indx_pos: %d (%d bytes)\n", (int)indx_pos, (int)chain_clen);
 #endif
+    chain_cmem = fstReaderMapped(xc, indx_pos, chain_clen);
+    if (!chain_cmem) {
         chain_cmem = (unsigned char *)malloc(chain_clen);
-        if (!chain_cmem)
-            goto block_err;
         fstReaderFseeko(xc, xc->f, indx_pos, SEEK_SET);
         fstFread(chain_cmem, chain_clen, 1, xc->f);
+        free_chain_cmem = 1;
+    }
 
-        if (vc_maxhandle > vc_maxhandle_largest) {
-            free(chain_table);
-            free(chain_table_lengths);
+    sec->chain_table = (fst_off_t *)calloc((sec->vc_maxhandle + 1), sizeof(fst_off_t));
+    sec->chain_table_lengths = (uint32_t *)calloc((sec->vc_maxhandle + 1), sizeof(uint32_t));
 
-            vc_maxhandle_largest = vc_maxhandle;
-            chain_table = (fst_off_t *)calloc((vc_maxhandle + 1), sizeof(fst_off_t));
-            chain_table_lengths = (uint32_t *)calloc((vc_maxhandle + 1), sizeof(uint32_t));
-        }
+#ifdef FST_DEBUG
+    idx =
+#endif
+            fstReaderDecodeChainTable(sectype, chain_cmem, chain_clen, indx_pos - sec->vc_start,
+                                      sec->chain_table, sec->chain_table_lengths);
+    if (free_chain_cmem) {
+        free(chain_cmem);
+    }
 
-        if (!chain_table || !chain_table_lengths)
-            goto block_err;
+#ifdef FST_DEBUG
+    fprintf(stderr, FST_APIMESS "decompressed chain idx len: %" PRIu32 "\n", idx);
+#endif
 
-        pnt = chain_cmem;
-        idx = 0;
-        pval = 0;
+    sec->bytes = tsec_nitems * sizeof(uint64_t) + frame_uclen +
+                 (sec->vc_maxhandle + 1) * (sizeof(fst_off_t) + sizeof(uint32_t));
+    xc->rvat_cache_bytes += sec->bytes;
+    fstReaderRvatUseSection(xc, sec);
+    fstReaderRvatTrimCache(xc);
+    return (sec);
 
-        if (sectype == FST_BL_VCDATA_DYN_ALIAS2) {
-            uint32_t prev_alias = 0;
+section_hit:
+    xc->rvat_sec_hits++;
+    fstReaderRvatUseSection(xc, sec);
+    return (sec);
+}
 
-            do {
-                int skiplen;
+/*
+ * reads and unpacks the value change chain stored at chain_pos, returning it and its length
+ */
+static unsigned char *fstReaderRvatReadChain(struct fstReaderContext *xc, int packtype, fst_off_t chain_pos,
+                                             uint32_t chain_len, uint32_t *len)
+{
+    unsigned char *mc = fstReaderMapped(xc, chain_pos, (uint64_t)chain_len + 5); /* length varint + chain */
+    unsigned char *mu;
+    uint32_t skiplen;
+    uint32_t destlen;
+
+    if (mc) {
+        int iskiplen;
+        destlen = fstGetVarint32(mc, &iskiplen);
+        skiplen = iskiplen;
+        mc += skiplen;
+    } else {
+        fstReaderFseeko(xc, xc->f, chain_pos, SEEK_SET);
+        destlen = fstReaderVarint32WithSkip(xc->f, &skiplen);
+    }
 
-                if (*pnt & 0x01) {
-                    int64_t shval = fstGetSVarint64(pnt, &skiplen) >> 1;
-                    if (shval > 0) {
-                        pval = chain_table[idx] = pval + shval;
-                        if (idx) {
-                            chain_table_lengths[pidx] = pval - chain_table[pidx];
-                        }
-                        pidx = idx++;
-                    } else if (shval < 0) {
-                        chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
-                        chain_table_lengths[idx] = prev_alias =
-                                shval; /* because during this loop iter would give stale data! */
-                        idx++;
-                    } else {
-                        chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
-                        chain_table_lengths[idx] =
-                                prev_alias; /* because during this loop iter would give stale data! */
-                        idx++;
-                    }
-                } else {
-                    uint64_t val = fstGetVarint32(pnt, &skiplen);
+    if (destlen) {
+        unsigned char *mc_mem = NULL;
+        int rc;
 
-                    fstHandle loopcnt = val >> 1;
-                    for (i = 0; i < loopcnt; i++) {
-                        chain_table[idx++] = 0;
-                    }
-                }
+        mu = (unsigned char *)malloc(destlen);
+        if (!mc) {
+            mc = mc_mem = (unsigned char *)malloc(chain_len);
+            fstFread(mc, chain_len, 1, xc->f);
+        }
 
-                pnt += skiplen;
-            } while (pnt != (chain_cmem + chain_clen));
-        } else {
-            do {
-                int skiplen;
-                uint64_t val = fstGetVarint32(pnt, &skiplen);
+        rc = fstReaderUnpackChain(packtype, mu, destlen, mc, chain_len);
 
-                if (!val) {
-                    pnt += skiplen;
-                    val = fstGetVarint32(pnt, &skiplen);
-                    chain_table[idx] = 0;            /* need to explicitly zero as calloc above might not run */
-                    chain_table_lengths[idx] = -val; /* because during this loop iter would give stale data! */
-                    idx++;
-                } else if (val & 1) {
-                    pval = chain_table[idx] = pval + (val >> 1);
-                    if (idx) {
-                        chain_table_lengths[pidx] = pval - chain_table[pidx];
-                    }
-                    pidx = idx++;
-                } else {
-                    fstHandle loopcnt = val >> 1;
-                    for (i = 0; i < loopcnt; i++) {
-                        chain_table[idx++] = 0;
-                    }
-                }
+        free(mc_mem);
 
-                pnt += skiplen;
-            } while (pnt != (chain_cmem + chain_clen));
+        if (rc != Z_OK) {
+            fprintf(stderr,
+                    FST_APIMESS "fstReaderGetValueFromHandleAtTime(), rvat decompress clen: %d (rc=%d), exiting.\n",
+                    (int)destlen, rc);
+            exit(255);
+        }
+    } else {
+        destlen = chain_len - skiplen;
+        mu = (unsigned char *)malloc(destlen);
+        if (mc) {
+            memcpy(mu, mc, destlen);
+        } else {
+            fstFread(mu, destlen, 1, xc->f);
         }
+    }
 
-        chain_table[idx] = indx_pos - vc_start;
-        chain_table_lengths[pidx] = chain_table[idx] - chain_table[pidx];
+    /* data to process is for(j=0;j<destlen;j++) in mu[j] */
+    *len = destlen;
+    return (mu);
+}
 
-        for (i = 0; i < idx; i++) {
-            int32_t v32 = chain_table_lengths[i];
-            if ((v32 < 0) && (!chain_table[i])) {
-                v32 = -v32;
-                v32--;
-                if (((uint32_t)v32) < i) /* sanity check */
-                {
-                    chain_table[i] = chain_table[v32];
-                    chain_table_lengths[i] = chain_table_lengths[v32];
-                }
+/*
+ * formats the chain entry with time varint vli, vdata points at its value bytes
+ * (unused for single bit signals).  reals are prefixed with 'r' unlike frame reals.
+ */
+static char *fstReaderRvatChainValue(struct fstReaderContext *xc, fstHandle facidx, uint32_t vli,
+                                     const unsigned char *vdata, char *buf)
+{
+    if (xc->signal_lens[facidx] == 1) {
+        if (!(vli & 1)) {
+            buf[0] = ((vli >> 1) & 1) | '0';
+        } else {
+            buf[0] = FST_RCV_STR[((vli >> 1) & 7)];
+        }
+        buf[1] = 0;
+    } else if (xc->signal_typs[facidx] != FST_VT_VCD_REAL) {
+        if (!(vli & 1)) {
+            int byte = 0;
+            int bit;
+            unsigned int j;
+
+            for (j = 0; j < xc->signal_lens[facidx]; j++) {
+                byte = j / 8;
+                bit = 7 - (j & 7);
+                buf[j] = ((vdata[byte] >> bit) & 1) | '0';
             }
+            buf[j] = 0;
+        } else {
+            memcpy(buf, vdata, xc->signal_lens[facidx]);
+            buf[xc->signal_lens[facidx]] = 0;
         }
+    } else {
+        double d;
+        unsigned char *clone_d = (unsigned char *)&d;
+        unsigned char bufd[8];
+        const unsigned char *srcdata;
 
-#ifdef FST_DEBUG
-        fprintf(stderr, FST_APIMESS "decompressed chain idx len: %" PRIu32 "\n", idx);
-#endif
-
-        mc_mem_len = 16384;
-        mc_mem = (unsigned char *)malloc(mc_mem_len); /* buffer for compressed reads */
-
-        /* check compressed VC data */
-        if (idx > xc->maxhandle)
-            idx = xc->maxhandle;
-        for (i = 0; i < idx; i++) {
-            if (chain_table[i]) {
-                int process_idx = i / 8;
-                int process_bit = i & 7;
-
-                if (xc->process_mask[process_idx] & (1 << process_bit)) {
-                    int rc = Z_OK;
-                    uint32_t val;
-                    uint32_t skiplen;
-                    uint32_t tdelta;
-
-                    fstReaderFseeko(xc, xc->f, vc_start + chain_table[i], SEEK_SET);
-                    val = fstReaderVarint32WithSkip(xc->f, &skiplen);
-                    if (val) {
-                        unsigned char *mu = mem_for_traversal + traversal_mem_offs; /* uncomp: dst */
-                        unsigned char *mc;                                          /* comp:   src */
-                        unsigned long destlen = val;
-                        unsigned long sourcelen = chain_table_lengths[i];
-
-                        if (mc_mem_len < chain_table_lengths[i]) {
-                            free(mc_mem);
-                            mc_mem = (unsigned char *)malloc(mc_mem_len = chain_table_lengths[i]);
-                        }
-                        mc = mc_mem;
-
-                        fstFread(mc, chain_table_lengths[i], 1, xc->f);
-
-                        switch (packtype) {
-                        case '4':
-                            rc = (destlen == (unsigned long)LZ4_decompress_safe_partial((char *)mc, (char *)mu,
-                                                                                        sourcelen, destlen, destlen))
-                                         ? Z_OK
-                                         : Z_DATA_ERROR;
-                            break;
-                        case 'F':
-                            fastlz_decompress(mc, sourcelen, mu, destlen); /* rc appears unreliable */
-                            break;
-                        default:
-                            rc = uncompress(mu, &destlen, mc, sourcelen);
-                            break;
-                        }
+        if (!(vli & 1)) /* very rare case, but possible */
+        {
+            int bit;
+            int j;
 
-                        /* data to process is for(j=0;j<destlen;j++) in mu[j] */
-                        headptr[i] = traversal_mem_offs;
-                        length_remaining[i] = val;
-                        traversal_mem_offs += val;
-                    } else {
-                        int destlen = chain_table_lengths[i] - skiplen;
-                        unsigned char *mu = mem_for_traversal + traversal_mem_offs;
-                        fstFread(mu, destlen, 1, xc->f);
-                        /* data to process is for(j=0;j<destlen;j++) in mu[j] */
-                        headptr[i] = traversal_mem_offs;
-                        length_remaining[i] = destlen;
-                        traversal_mem_offs += destlen;
-                    }
+            for (j = 0; j < 8; j++) {
+                bit = 7 - (j & 7);
+                bufd[j] = ((vdata[0] >> bit) & 1) | '0';
+            }
 
-                    if (rc != Z_OK) {
-                        fprintf(stderr, FST_APIMESS "fstReaderIterBlocks2(), fac: %d clen: %d (rc=%d), exiting.\n",
-                                (int)i, (int)val, rc);
-                        exit(255);
-                    }
+            srcdata = bufd;
+        } else {
+            srcdata = vdata;
+        }
 
-                    if (xc->signal_lens[i] == 1) {
-                        uint32_t vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[i]);
-                        uint32_t shcnt = 2 << (vli & 1);
-                        tdelta = vli >> shcnt;
-                    } else {
-                        uint32_t vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[i]);
-                        tdelta = vli >> 1;
-                    }
+        if (xc->double_endian_match) {
+            memcpy(clone_d, srcdata, 8);
+        } else {
+            int j;
 
-                    scatterptr[i] = tc_head[tdelta];
-                    tc_head[tdelta] = i + 1;
-                }
+            for (j = 0; j < 8; j++) {
+                clone_d[j] = srcdata[7 - j];
             }
         }
 
-        free(mc_mem); /* there is no usage below for this, no real need to clear out mc_mem or mc_mem_len */
+        sprintf(buf, "r%.16g", d);
+    }
 
-        for (i = 0; i < tsec_nitems; i++) {
-            uint32_t tdelta;
-            int skiplen, skiplen2;
-            uint32_t vli;
+    return (buf);
+}
 
-            if (fv) {
-                char wx_buf[32];
-                int wx_len;
+/* sec must be the current section: the frame fallback reads xc->rvat_sec */
+static char *fstReaderRvatValue(struct fstReaderContext *xc, struct fstReaderRvatSection *sec, uint64_t tim,
+                                fstHandle facidx, char *buf)
+{
+    struct fstReaderRvatChain *ch;
+    fstHandle i;
 
-                if (time_table[i] != previous_time) {
-                    if (xc->limit_range_valid) {
-                        if (time_table[i] > xc->limit_range_end) {
-                            break;
-                        }
-                    }
+    if (facidx > sec->vc_maxhandle) {
+        return (NULL);
+    }
 
-                    if (dumpvars_state == 1) {
-                        wx_len = sprintf(wx_buf, "$end\n");
-                        fstWritex(xc, wx_buf, wx_len);
-                        dumpvars_state = 2;
-                    }
-                    wx_len = sprintf(wx_buf, "#%" PRIu64 "\n", time_table[i]);
-                    fstWritex(xc, wx_buf, wx_len);
-                    if (!dumpvars_state) {
-                        wx_len = sprintf(wx_buf, "$dumpvars\n");
-                        fstWritex(xc, wx_buf, wx_len);
-                        dumpvars_state = 1;
-                    }
+    facidx--; /* scale down for array which starts at zero */
 
-                    if ((xc->num_blackouts) && (cur_blackout != xc->num_blackouts)) {
-                        if (time_table[i] == xc->blackout_times[cur_blackout]) {
-                            wx_len = sprintf(wx_buf, "$dump%s $end\n",
-                                             (xc->blackout_activity[cur_blackout++]) ? "on" : "off");
-                            fstWritex(xc, wx_buf, wx_len);
-                        }
-                    }
-                    previous_time = time_table[i];
-                }
-            }
+    if (((tim == sec->beg_tim) && (!sec->chain_table[facidx])) || (!sec->chain_table[facidx])) {
+        return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+    }
 
-            while (tc_head[i]) {
-                idx = tc_head[i] - 1;
-                vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
+    ch = sec->chains ? sec->chains[facidx] : NULL;
+    if (ch) {
+        xc->rvat_chain_hits++;
+    } else {
+        xc->rvat_chain_misses++;
+        if (!sec->chains) {
+            sec->chains = (struct fstReaderRvatChain **)calloc(sec->vc_maxhandle, sizeof(struct fstReaderRvatChain *));
+        }
+        ch = (struct fstReaderRvatChain *)calloc(1, sizeof(struct fstReaderRvatChain));
+        ch->sec = sec;
+        ch->facidx = facidx;
+        ch->mem = fstReaderRvatReadChain(xc, sec->packtype, sec->vc_start + sec->chain_table[facidx],
+                                         sec->chain_table_lengths[facidx], &ch->len);
 
-                if (xc->signal_lens[idx] <= 1) {
-                    if (xc->signal_lens[idx] == 1) {
-                        unsigned char val;
-                        if (!(vli & 1)) {
-                            /* tdelta = vli >> 2; */ /* scan-build */
-                            val = ((vli >> 1) & 1) | '0';
-                        } else {
-                            /* tdelta = vli >> 4; */ /* scan-build */
-                            val = FST_RCV_STR[((vli >> 1) & 7)];
-                        }
+        sec->chains[facidx] = ch;
+        xc->rvat_cache_bytes += ch->len;
+    }
 
-                        if (value_change_callback) {
-                            xc->temp_signal_value_buf[0] = val;
-                            xc->temp_signal_value_buf[1] = 0;
-                            value_change_callback(user_callback_data_pointer, time_table[i], idx + 1,
-                                                  xc->temp_signal_value_buf);
-                        } else {
-                            if (fv) {
-                                char vcd_id[16];
-                                int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
+    fstReaderRvatUseChain(xc, ch);
+    fstReaderRvatTrimCache(xc);
 
-                                vcd_id[0] = val;
-                                vcd_id[vcdid_len + 1] = '\n';
-                                fstWritex(xc, vcd_id, vcdid_len + 2);
-                            }
-                        }
-                        headptr[idx] += skiplen;
-                        length_remaining[idx] -= skiplen;
+    /* process value chain here */
 
-                        tc_head[i] = scatterptr[idx];
-                        scatterptr[idx] = 0;
+    {
+        uint32_t tidx = 0, ptidx = 0;
+        uint32_t tdelta;
+        int skiplen;
+        unsigned int iprev = ch->len;
+        uint32_t pvli = 0;
+        int pskip = 0;
 
-                        if (length_remaining[idx]) {
-                            int shamt;
-                            vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
-                            shamt = 2 << (vli & 1);
-                            tdelta = vli >> shamt;
+        if ((ch->pos_valid) && (tim >= ch->pos_time)) {
+            i = ch->pos_idx;
+            tidx = ch->pos_tidx;
+        } else {
+            i = 0;
+            tidx = 0;
+            ch->pos_time = sec->beg_tim;
+            ch->pos_valid = 0; /* a miss below must not leave a later position behind */
+        }
 
-                            scatterptr[idx] = tc_head[i + tdelta];
-                            tc_head[i + tdelta] = idx + 1;
-                        }
-                    } else {
-                        unsigned char *vdata;
-                        uint32_t len;
+        if (xc->signal_lens[facidx] == 1) {
+            while (i < ch->len) {
+                uint32_t vli = fstGetVarint32(ch->mem + i, &skiplen);
+                uint32_t shcnt = 2 << (vli & 1);
+                tdelta = vli >> shcnt;
 
-                        vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
-                        len = fstGetVarint32(mem_for_traversal + headptr[idx] + skiplen, &skiplen2);
-                        /* tdelta = vli >> 1; */ /* scan-build */
-                        skiplen += skiplen2;
-                        vdata = mem_for_traversal + headptr[idx] + skiplen;
+                if (sec->time_table[tidx + tdelta] <= tim) {
+                    iprev = i;
+                    pvli = vli;
+                    ptidx = tidx;
+                    /* pskip = skiplen; */ /* scan-build */
 
-                        if (!(vli & 1)) {
-                            if (value_change_callback_varlen) {
-                                value_change_callback_varlen(user_callback_data_pointer, time_table[i], idx + 1, vdata,
-                                                             len);
-                            } else {
-                                if (fv) {
-                                    char vcd_id[16];
-                                    int vcdid_len;
-
-                                    vcd_id[0] = 's';
-                                    fstWritex(xc, vcd_id, 1);
-
-                                    vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
-                                    {
-                                        unsigned char *vesc = (unsigned char *)malloc(len * 4 + 1);
-                                        int vlen = fstUtilityBinToEsc(vesc, vdata, len);
-                                        fstWritex(xc, vesc, vlen);
-                                        free(vesc);
-                                    }
-
-                                    vcd_id[0] = ' ';
-                                    vcd_id[vcdid_len + 1] = '\n';
-                                    fstWritex(xc, vcd_id, vcdid_len + 2);
-                                }
-                            }
-                        }
+                    tidx += tdelta;
+                    i += skiplen;
+                } else {
+                    break;
+                }
+            }
+            if (iprev != ch->len) {
+                ch->pos_tidx = ptidx;
+                ch->pos_idx = iprev;
+                ch->pos_time = tim;
+                ch->pos_valid = 1;
 
-                        skiplen += len;
-                        headptr[idx] += skiplen;
-                        length_remaining[idx] -= skiplen;
+                return (fstReaderRvatChainValue(xc, facidx, pvli, NULL, buf));
+            } else {
+                return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+            }
+        } else {
+            while (i < ch->len) {
+                uint32_t vli = fstGetVarint32(ch->mem + i, &skiplen);
+                tdelta = vli >> 1;
 
-                        tc_head[i] = scatterptr[idx];
-                        scatterptr[idx] = 0;
+                if (sec->time_table[tidx + tdelta] <= tim) {
+                    iprev = i;
+                    pvli = vli;
+                    ptidx = tidx;
+                    pskip = skiplen;
 
-                        if (length_remaining[idx]) {
-                            vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
-                            tdelta = vli >> 1;
+                    tidx += tdelta;
+                    i += skiplen;
 
-                            scatterptr[idx] = tc_head[i + tdelta];
-                            tc_head[i + tdelta] = idx + 1;
-                        }
+                    if (!(pvli & 1)) {
+                        i += ((xc->signal_lens[facidx] + 7) / 8);
+                    } else {
+                        i += xc->signal_lens[facidx];
                     }
                 } else {
-                    uint32_t len = xc->signal_lens[idx];
-                    unsigned char *vdata;
+                    break;
+                }
+            }
+
+            if (iprev != ch->len) {
+                ch->pos_tidx = ptidx;
+                ch->pos_idx = iprev;
+                ch->pos_time = tim;
+                ch->pos_valid = 1;
+
+                return (fstReaderRvatChainValue(xc, facidx, pvli, ch->mem + iprev + pskip, buf));
+            } else {
+                return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+            }
+        }
+    }
+
+    /* return(NULL); */
+}
 
-                    vli = fstGetVarint32(mem_for_traversal + headptr[idx], &skiplen);
-                    /* tdelta = vli >> 1; */ /* scan-build */
-                    vdata = mem_for_traversal + headptr[idx] + skiplen;
+char *fstReaderGetValueFromHandleAtTime(void *ctx, uint64_t tim, fstHandle facidx, char *buf)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderRvatSection *sec;
 
-                    if (xc->signal_typs[idx] != FST_VT_VCD_REAL) {
-                        if (!(vli & 1)) {
-                            int byte = 0;
-                            int bit;
-                            unsigned int j;
-
-                            for (j = 0; j < len; j++) {
-                                unsigned char ch;
-                                byte = j / 8;
-                                bit = 7 - (j & 7);
-                                ch = ((vdata[byte] >> bit) & 1) | '0';
-                                xc->temp_signal_value_buf[j] = ch;
-                            }
-                            xc->temp_signal_value_buf[j] = 0;
+    if ((!xc) || (!facidx) || (facidx > xc->maxhandle) || (!buf) || (!xc->signal_lens[facidx - 1])) {
+        return (NULL);
+    }
 
-                            if (value_change_callback) {
-                                value_change_callback(user_callback_data_pointer, time_table[i], idx + 1,
-                                                      xc->temp_signal_value_buf);
-                            } else {
-                                if (fv) {
-                                    unsigned char ch_bp = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
+    fstReaderRvatSetupOffsets(xc);
 
-                                    fstWritex(xc, &ch_bp, 1);
-                                    fstWritex(xc, xc->temp_signal_value_buf, len);
-                                }
-                            }
+    sec = fstReaderRvatLoadSection(xc, tim);
+    if (!sec) {
+        return (NULL);
+    }
 
-                            len = byte + 1;
-                        } else {
-                            if (value_change_callback) {
-                                memcpy(xc->temp_signal_value_buf, vdata, len);
-                                xc->temp_signal_value_buf[len] = 0;
-                                value_change_callback(user_callback_data_pointer, time_table[i], idx + 1,
-                                                      xc->temp_signal_value_buf);
-                            } else {
-                                if (fv) {
-                                    unsigned char ch_bp = (xc->signal_typs[idx] != FST_VT_VCD_PORT) ? 'b' : 'p';
+    return (fstReaderRvatValue(xc, sec, tim, facidx, buf));
+}
 
-                                    fstWritex(xc, &ch_bp, 1);
-                                    fstWritex(xc, vdata, len);
-                                }
-                            }
-                        }
-                    } else {
-                        double d;
-                        unsigned char *clone_d /*= (unsigned char *)&d */; /* scan-build */
-                        unsigned char buf[8];
-                        unsigned char *srcdata;
+int fstReaderGetValuesFromHandlesAtTimes(void *ctx, uint32_t num_handles, const fstHandle *handles,
+                                         uint64_t num_times, const uint64_t *times, char *out, uint32_t stride)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderRvatSection *sec;
+    uint64_t t0, t1, t;
+    uint32_t j;
 
-                        if (!(vli & 1)) /* very rare case, but possible */
-                        {
-                            int bit;
-                            int j;
-
-                            for (j = 0; j < 8; j++) {
-                                unsigned char ch;
-                                bit = 7 - (j & 7);
-                                ch = ((vdata[0] >> bit) & 1) | '0';
-                                buf[j] = ch;
-                            }
+    if ((!xc) || (!out) || ((num_handles) && (!handles)) || ((num_times) && (!times))) {
+        return (0);
+    }
 
-                            len = 1;
-                            srcdata = buf;
-                        } else {
-                            srcdata = vdata;
-                        }
+    for (j = 0; j < num_handles; j++) {
+        fstHandle facidx = handles[j];
 
-                        if (value_change_callback) {
-                            if (xc->native_doubles_for_cb) {
-                                if (xc->double_endian_match) {
-                                    clone_d = srcdata;
-                                } else {
-                                    int j;
-
-                                    clone_d = (unsigned char *)&d;
-                                    for (j = 0; j < 8; j++) {
-                                        clone_d[j] = srcdata[7 - j];
-                                    }
-                                }
-                                value_change_callback(user_callback_data_pointer, time_table[i], idx + 1, clone_d);
-                            } else {
-                                clone_d = (unsigned char *)&d;
-                                if (xc->double_endian_match) {
-                                    memcpy(clone_d, srcdata, 8);
-                                } else {
-                                    int j;
-
-                                    for (j = 0; j < 8; j++) {
-                                        clone_d[j] = srcdata[7 - j];
-                                    }
-                                }
-                                sprintf((char *)xc->temp_signal_value_buf, "%.16g", d);
-                                value_change_callback(user_callback_data_pointer, time_table[i], idx + 1,
-                                                      xc->temp_signal_value_buf);
-                            }
-                        } else {
-                            if (fv) {
-                                char wx_buf[32];
-                                int wx_len;
+        if ((facidx) && (facidx <= xc->maxhandle)) {
+            uint32_t need = (xc->signal_typs[facidx - 1] == FST_VT_VCD_REAL) ? 32 : (xc->signal_lens[facidx - 1] + 1);
+            if (stride < need) {
+                return (0);
+            }
+        }
+    }
 
-                                clone_d = (unsigned char *)&d;
-                                if (xc->double_endian_match) {
-                                    memcpy(clone_d, srcdata, 8);
-                                } else {
-                                    int j;
-
-                                    for (j = 0; j < 8; j++) {
-                                        clone_d[j] = srcdata[7 - j];
-                                    }
-                                }
+    for (t = 1; t < num_times; t++) {
+        if (times[t] < times[t - 1]) {
+            return (0);
+        }
+    }
 
-                                wx_len = sprintf(wx_buf, "r%.16g", d);
-                                fstWritex(xc, wx_buf, wx_len);
-                            }
-                        }
-                    }
+    fstReaderRvatSetupOffsets(xc);
 
-                    if (fv) {
-                        char vcd_id[16];
-                        int vcdid_len = fstVcdIDForFwrite(vcd_id + 1, idx + 1);
-                        vcd_id[0] = ' ';
-                        vcd_id[vcdid_len + 1] = '\n';
-                        fstWritex(xc, vcd_id, vcdid_len + 2);
-                    }
+    /*
+     * walk the sample times in runs that resolve to the same section: each section is
+     * decoded once and each chain in it is walked forward once, resuming where the
+     * previous sample time left off
+     */
+    for (t0 = 0; t0 < num_times; t0 = t1) {
+        sec = fstReaderRvatLoadSection(xc, times[t0]);
+        t1 = t0 + 1;
 
-                    skiplen += len;
-                    headptr[idx] += skiplen;
-                    length_remaining[idx] -= skiplen;
+        if (!sec) {
+            for (j = 0; j < num_handles; j++) {
+                out[(t0 * num_handles + j) * stride] = 0;
+            }
+            continue;
+        }
 
-                    tc_head[i] = scatterptr[idx];
-                    scatterptr[idx] = 0;
+        while ((t1 < num_times) && (fstReaderRvatSectionCovers(xc, sec, times[t1]))) {
+            t1++;
+        }
 
-                    if (length_remaining[idx]) {
-                        vli = fstGetVarint32NoSkip(mem_for_traversal + headptr[idx]);
-                        tdelta = vli >> 1;
+        for (j = 0; j < num_handles; j++) {
+            fstHandle facidx = handles[j];
+            int valid = (facidx) && (facidx <= xc->maxhandle) && (xc->signal_lens[facidx - 1]);
+            int is_real = valid && (xc->signal_typs[facidx - 1] == FST_VT_VCD_REAL);
 
-                        scatterptr[idx] = tc_head[i + tdelta];
-                        tc_head[i + tdelta] = idx + 1;
-                    }
+            for (t = t0; t < t1; t++) {
+                char *cell = out + (t * num_handles + j) * stride;
+
+                if ((!valid) || (!fstReaderRvatValue(xc, sec, times[t], facidx, cell))) {
+                    cell[0] = 0;
+                } else if ((is_real) && (cell[0] == 'r')) {
+                    memmove(cell, cell + 1, strlen(cell)); /* chain reals carry a prefix that frame reals lack */
                 }
             }
         }
+    }
 
-    block_err:
-        free(tc_head);
-        free(chain_cmem);
-        free(mem_for_traversal);
-        mem_for_traversal = NULL;
+    return (1);
+}
 
-        secnum++;
-        if (secnum == xc->vc_section_count)
-            break; /* in case file is growing, keep with original block count */
-        blkpos += seclen;
+/*
+ * appends an entry at tim to hist and returns its value cell
+ */
+static char *fstReaderHistoryCell(struct fstSignalHistory *hist, uint64_t *alloc, uint64_t tim)
+{
+    if (hist->num_entries == *alloc) {
+        *alloc = *alloc ? (*alloc * 2) : 256;
+        hist->times = (uint64_t *)realloc(hist->times, *alloc * sizeof(uint64_t));
+        hist->values = (char *)realloc(hist->values, *alloc * hist->value_stride);
     }
 
-    if (mem_for_traversal)
-        free(mem_for_traversal); /* scan-build */
-    free(length_remaining);
-    free(headptr);
-    free(scatterptr);
+    hist->times[hist->num_entries] = tim;
+    return (hist->values + hist->num_entries++ * hist->value_stride);
+}
 
-    if (chain_table)
-        free(chain_table);
-    if (chain_table_lengths)
-        free(chain_table_lengths);
+/*
+ * appends the value changes of facidx (zero based) in section si with times in
+ * (tlow, thigh].  the frame is skipped over rather than decompressed and the time
+ * table is only decoded if the signal has a chain in the section.
+ */
+static void fstReaderHistorySection(struct fstReaderContext *xc, uint64_t si, fstHandle facidx, uint64_t tlow,
+                                    uint64_t thigh, struct fstSignalHistory *hist, uint64_t *alloc)
+{
+    struct fstReaderSection *vcs = xc->vc_sections + si;
+    fst_off_t blkpos = vcs->pos + 1;
+    fst_off_t indx_pntr, indx_pos, vc_start, chain_pos;
+    uint64_t tsec_clen, tsec_nitems, frame_clen, vc_maxhandle;
+    uint64_t *time_table;
+    uint32_t chain_len, len, i, tidx;
+    uint32_t slen = xc->signal_lens[facidx];
+    int is_real = (xc->signal_typs[facidx] == FST_VT_VCD_REAL);
+    long chain_clen;
+    unsigned char *chain_cmem;
+    unsigned char *mem;
+    int free_chain_cmem = 0;
+    int packtype, found;
 
-    free(time_table);
+    fstReaderFseeko(xc, xc->f, blkpos + vcs->seclen - 16, SEEK_SET);
+    tsec_clen = fstReaderUint64(xc->f);
+    indx_pntr = blkpos + vcs->seclen - 24 - tsec_clen - 8;
+    fstReaderFseeko(xc, xc->f, indx_pntr, SEEK_SET);
+    chain_clen = fstReaderUint64(xc->f);
+    indx_pos = indx_pntr - chain_clen;
 
-#ifndef FST_WRITEX_DISABLE
-    if (fv) {
-        fstWritex(xc, NULL, 0);
-    }
-#endif
+    fstReaderFseeko(xc, xc->f, blkpos + 32, SEEK_SET);
+    fstReaderVarint64(xc->f); /* frame_uclen */
+    frame_clen = fstReaderVarint64(xc->f);
+    fstReaderVarint64(xc->f); /* frame_maxhandle */
+    fstReaderFseeko(xc, xc->f, (fst_off_t)frame_clen, SEEK_CUR);
+    vc_maxhandle = fstReaderVarint64(xc->f);
+    vc_start = ftello(xc->f); /* points to '!' character */
+    packtype = fgetc(xc->f);
 
-    return (1);
-}
+    if (facidx >= vc_maxhandle) {
+        return;
+    }
 
-/* rvat functions */
+    chain_cmem = fstReaderMapped(xc, indx_pos, chain_clen);
+    if (!chain_cmem) {
+        chain_cmem = (unsigned char *)malloc(chain_clen);
+        fstReaderFseeko(xc, xc->f, indx_pos, SEEK_SET);
+        fstFread(chain_cmem, chain_clen, 1, xc->f);
+        free_chain_cmem = 1;
+    }
 
-static char *fstExtractRvatDataFromFrame(struct fstReaderContext *xc, fstHandle facidx, char *buf)
-{
-    if (facidx >= xc->rvat_frame_maxhandle) {
-        return (NULL);
+    found = fstReaderFindChain(vcs->sectype, chain_cmem, chain_clen, indx_pos - vc_start, facidx, &chain_pos,
+                               &chain_len);
+    if (free_chain_cmem) {
+        free(chain_cmem);
+    }
+    if (!found) {
+        return;
     }
 
-    if (xc->signal_lens[facidx] == 1) {
-        buf[0] = (char)xc->rvat_frame_data[xc->rvat_sig_offs[facidx]];
-        buf[1] = 0;
-    } else {
-        if (xc->signal_typs[facidx] != FST_VT_VCD_REAL) {
-            memcpy(buf, xc->rvat_frame_data + xc->rvat_sig_offs[facidx], xc->signal_lens[facidx]);
-            buf[xc->signal_lens[facidx]] = 0;
+    mem = fstReaderRvatReadChain(xc, packtype, vc_start + chain_pos, chain_len, &len);
+    time_table = fstReaderRvatTimeTable(xc, blkpos, vcs->seclen, &tsec_nitems, &tsec_clen);
+
+    for (i = 0, tidx = 0; i < len;) {
+        int skiplen;
+        uint32_t vli = fstGetVarint32(mem + i, &skiplen);
+        unsigned char *vdata = mem + i + skiplen;
+
+        if (slen == 1) {
+            tidx += vli >> (2 << (vli & 1));
+            i += skiplen;
         } else {
-            double d;
-            unsigned char *clone_d = (unsigned char *)&d;
-            unsigned char *srcdata = xc->rvat_frame_data + xc->rvat_sig_offs[facidx];
+            tidx += vli >> 1;
+            i += skiplen + ((vli & 1) ? slen : ((slen + 7) / 8));
+        }
 
-            if (xc->double_endian_match) {
-                memcpy(clone_d, srcdata, 8);
-            } else {
-                int j;
+        if ((tidx >= tsec_nitems) || (time_table[tidx] > thigh)) {
+            break;
+        }
 
-                for (j = 0; j < 8; j++) {
-                    clone_d[j] = srcdata[7 - j];
-                }
-            }
+        if (time_table[tidx] > tlow) {
+            char *cell = fstReaderHistoryCell(hist, alloc, time_table[tidx]);
 
-            sprintf((char *)buf, "%.16g", d);
+            fstReaderRvatChainValue(xc, facidx, vli, vdata, cell);
+            if ((is_real) && (cell[0] == 'r')) {
+                memmove(cell, cell + 1, strlen(cell)); /* as in fstReaderGetValuesFromHandlesAtTimes() */
+            }
         }
     }
 
-    return (buf);
+    free(time_table);
+    free(mem);
 }
 
-char *fstReaderGetValueFromHandleAtTime(void *ctx, uint64_t tim, fstHandle facidx, char *buf)
+int fstReaderGetSignalHistory(void *ctx, fstHandle handle, uint64_t t0, uint64_t t1, struct fstSignalHistory *hist)
 {
     struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
-    fst_off_t blkpos = 0, prev_blkpos;
-    uint64_t beg_tim, end_tim, beg_tim2, end_tim2;
-    int sectype;
-    unsigned int secnum = 0;
-    uint64_t seclen;
-    uint64_t tsec_uclen = 0, tsec_clen = 0;
-    uint64_t tsec_nitems;
-    uint64_t frame_uclen, frame_clen;
-#ifdef FST_DEBUG
-    uint64_t mem_required_for_traversal;
-#endif
-    fst_off_t indx_pntr, indx_pos;
-    long chain_clen;
-    unsigned char *chain_cmem;
-    unsigned char *pnt;
-    fstHandle idx, pidx = 0, i;
-    uint64_t pval;
+    struct fstReaderRvatSection *sec;
+    uint64_t alloc = 0;
+    uint64_t tlow, si;
+    char *cell;
 
-    if ((!xc) || (!facidx) || (facidx > xc->maxhandle) || (!buf) || (!xc->signal_lens[facidx - 1])) {
-        return (NULL);
+    if (!hist) {
+        return (0);
     }
+    memset(hist, 0, sizeof(struct fstSignalHistory));
 
-    if (!xc->rvat_sig_offs) {
-        uint32_t cur_offs = 0;
+    /* without the section index (sections out of time order) there is nothing to skip with, */
+    /* variable length values do not fit the fixed value_stride cells */
+    if ((!xc) || (!handle) || (handle > xc->maxhandle) || (!xc->signal_lens[handle - 1]) || (t0 > t1) ||
+        (!xc->vc_sections)) {
+        return (0);
+    }
 
-        xc->rvat_sig_offs = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
-        for (i = 0; i < xc->maxhandle; i++) {
-            xc->rvat_sig_offs[i] = cur_offs;
-            cur_offs += xc->signal_lens[i];
-        }
+    hist->value_stride = (xc->signal_typs[handle - 1] == FST_VT_VCD_REAL) ? 32 : (xc->signal_lens[handle - 1] + 1);
+    if (!xc->vc_section_count) {
+        return (1);
     }
 
-    if (xc->rvat_data_valid) {
-        if ((xc->rvat_beg_tim <= tim) && (tim <= xc->rvat_end_tim)) {
-            goto process_value;
-        }
+    tlow = (t0 > xc->vc_sections[0].beg_tim) ? t0 : xc->vc_sections[0].beg_tim;
+    if (tlow > t1) {
+        return (1);
+    }
 
-        fstReaderDeallocateRvatData(xc);
+    fstReaderRvatSetupOffsets(xc);
+    sec = fstReaderRvatLoadSection(xc, tlow);
+    if (!sec) {
+        return (1); /* t0 is past the last section */
     }
 
-    xc->rvat_chain_pos_valid = 0;
+    cell = fstReaderHistoryCell(hist, &alloc, tlow);
+    if (!fstReaderRvatValue(xc, sec, tlow, handle, cell)) {
+        cell[0] = 0;
+    } else if ((xc->signal_typs[handle - 1] == FST_VT_VCD_REAL) && (cell[0] == 'r')) {
+        memmove(cell, cell + 1, strlen(cell));
+    }
 
-    for (;;) {
-        fstReaderFseeko(xc, xc->f, (prev_blkpos = blkpos), SEEK_SET);
+    for (si = fstReaderRvatSectionIndex(xc, tlow); (si < xc->vc_section_count) && (xc->vc_sections[si].beg_tim <= t1);
+         si++) {
+        fstReaderHistorySection(xc, si, handle - 1, tlow, t1, hist, &alloc);
+    }
 
-        sectype = fgetc(xc->f);
-        seclen = fstReaderUint64(xc->f);
+    return (1);
+}
 
-        if ((sectype == EOF) || (sectype == FST_BL_SKIP) || (!seclen)) {
-            return (NULL); /* if this loop exits on break, it's successful */
-        }
+void fstReaderFreeSignalHistory(struct fstSignalHistory *hist)
+{
+    if (hist) {
+        free(hist->times);
+        free(hist->values);
+        memset(hist, 0, sizeof(struct fstSignalHistory));
+    }
+}
 
-        blkpos++;
-        if ((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
-            (sectype != FST_BL_VCDATA_DYN_ALIAS2)) {
-            blkpos += seclen;
-            continue;
-        }
+/**********************************************************************/
 
-        beg_tim = fstReaderUint64(xc->f);
-        end_tim = fstReaderUint64(xc->f);
+/*
+ * summary pyramid sidecar: per signal and per power of two time bucket, the number
+ * of value changes, the first value changed to, the value at the end of the bucket
+ * and whether a value with non 0/1 bits was taken.  level 0 buckets are 2^base_shift
+ * time units wide starting at the dump's start time, each level doubles that up to a
+ * single bucket for the whole dump.  only buckets a signal takes a value in are
+ * stored, as fixed size records sorted by bucket, so a query binary searches one
+ * level and then reads a record per visible bucket.
+ *
+ * layout (integers big endian as in the FST file):
+ *   FST_SUMMARY_MAGIC
+ *   u64 start_time, u64 end_time, u64 maxhandle, u64 base_shift, u64 levels
+ *   per handle: u64 value length, u64 is_real, levels x (u64 record offset, u64 record count)
+ *   records: u64 bucket, u32 value changes, u8 FST_SUMMARY_F_*, value first, value last
+ */
+struct fstSummarySig
+{
+    unsigned char *recs; /* in file layout, a pending record lives at recs[nrecs] */
+    uint64_t nrecs, alloc;
+    uint64_t bucket;
+    uint32_t transitions;
+    unsigned char flags;
+    unsigned char pending;
+};
 
-        if ((beg_tim <= tim) && (tim <= end_tim)) {
-            if ((tim == end_tim) && (tim != xc->end_time)) {
-                fst_off_t cached_pos = ftello(xc->f);
-                fstReaderFseeko(xc, xc->f, blkpos, SEEK_SET);
+struct fstSummaryBuilder
+{
+    struct fstReaderContext *xc;
+    struct fstSummarySig *sigs;
+    uint64_t start_time;
+    unsigned int base_shift;
+};
 
-                sectype = fgetc(xc->f);
-                seclen = fstReaderUint64(xc->f);
+static void fstSummaryPutHeader(unsigned char *rec, uint64_t bucket, uint32_t transitions, unsigned char flags)
+{
+    int i;
 
-                beg_tim2 = fstReaderUint64(xc->f);
-                end_tim2 = fstReaderUint64(xc->f);
+    for (i = 7; i >= 0; i--) {
+        rec[i] = bucket & 0xff;
+        bucket >>= 8;
+    }
+    for (i = 11; i >= 8; i--) {
+        rec[i] = transitions & 0xff;
+        transitions >>= 8;
+    }
+    rec[12] = flags;
+}
 
-                if (((sectype != FST_BL_VCDATA) && (sectype != FST_BL_VCDATA_DYN_ALIAS) &&
-                     (sectype != FST_BL_VCDATA_DYN_ALIAS2)) ||
-                    (!seclen) || (beg_tim2 != tim)) {
-                    blkpos = prev_blkpos;
-                    break;
-                }
-                beg_tim = beg_tim2;
-                end_tim = end_tim2;
-                fstReaderFseeko(xc, xc->f, cached_pos, SEEK_SET);
-            }
-            break;
-        }
+static uint64_t fstSummaryGetBucket(const unsigned char *rec)
+{
+    uint64_t val = 0;
+    int i;
 
-        blkpos += seclen;
-        secnum++;
+    for (i = 0; i < 8; i++) {
+        val = (val << 8) | rec[i];
     }
+    return (val);
+}
 
-    xc->rvat_beg_tim = beg_tim;
-    xc->rvat_end_tim = end_tim;
+static uint32_t fstSummaryGetTransitions(const unsigned char *rec)
+{
+    return (((uint32_t)rec[8] << 24) | ((uint32_t)rec[9] << 16) | ((uint32_t)rec[10] << 8) | rec[11]);
+}
 
-#ifdef FST_DEBUG
-    mem_required_for_traversal =
-#endif
-            fstReaderUint64(xc->f);
+static int fstSummaryHasXz(const unsigned char *val, uint32_t vlen, int is_real)
+{
+    uint32_t i;
 
-#ifdef FST_DEBUG
-    fprintf(stderr, FST_APIMESS "rvat sec: %u seclen: %d begtim: %d endtim: %d\n", secnum, (int)seclen, (int)beg_tim,
-            (int)end_tim);
-    fprintf(stderr, FST_APIMESS "mem_required_for_traversal: %d\n", (int)mem_required_for_traversal);
-#endif
+    if (!is_real) {
+        for (i = 0; i < vlen; i++) {
+            if ((val[i] != '0') && (val[i] != '1')) {
+                return (1);
+            }
+        }
+    }
+    return (0);
+}
 
-    /* process time block */
-    {
-        unsigned char *ucdata;
-        unsigned char *cdata;
-        unsigned long destlen /* = tsec_uclen */;  /* scan-build */
-        unsigned long sourcelen /* = tsec_clen */; /* scan-build */
-        int rc;
-        unsigned char *tpnt;
-        uint64_t tpval;
-        unsigned int ti;
-
-        fstReaderFseeko(xc, xc->f, blkpos + seclen - 24, SEEK_SET);
-        tsec_uclen = fstReaderUint64(xc->f);
-        tsec_clen = fstReaderUint64(xc->f);
-        tsec_nitems = fstReaderUint64(xc->f);
-#ifdef FST_DEBUG
-        fprintf(stderr, FST_APIMESS "time section unc: %d, com: %d (%d items)\n", (int)tsec_uclen, (int)tsec_clen,
-                (int)tsec_nitems);
-#endif
-        ucdata = (unsigned char *)malloc(tsec_uclen);
-        destlen = tsec_uclen;
-        sourcelen = tsec_clen;
+/* makes room for the pending record of sig */
+static unsigned char *fstSummarySlot(struct fstSummarySig *sig, uint32_t rs)
+{
+    if (sig->nrecs + 1 > sig->alloc) {
+        sig->alloc = sig->alloc ? (sig->alloc * 2) : 16;
+        sig->recs = (unsigned char *)realloc(sig->recs, sig->alloc * rs);
+    }
+    return (sig->recs + sig->nrecs * rs);
+}
 
-        fstReaderFseeko(xc, xc->f, -24 - ((fst_off_t)tsec_clen), SEEK_CUR);
-        if (tsec_uclen != tsec_clen) {
-            cdata = (unsigned char *)malloc(tsec_clen);
-            fstFread(cdata, tsec_clen, 1, xc->f);
+static void fstSummaryCallback(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                               const unsigned char *value)
+{
+    struct fstSummaryBuilder *b = (struct fstSummaryBuilder *)user_callback_data_pointer;
+    struct fstReaderContext *xc = b->xc;
+    struct fstSummarySig *sig = b->sigs + facidx - 1;
+    int is_real = (xc->signal_typs[facidx - 1] == FST_VT_VCD_REAL);
+    uint32_t vlen = value ? xc->signal_lens[facidx - 1] : 0;
+    uint32_t rs = 13 + 2 * vlen;
+    uint64_t bucket = (time - b->start_time) >> b->base_shift;
+    unsigned char *rec;
 
-            rc = uncompress(ucdata, &destlen, cdata, sourcelen);
+    if ((sig->pending) && (sig->bucket != bucket)) {
+        fstSummaryPutHeader(sig->recs + sig->nrecs * rs, sig->bucket, sig->transitions, sig->flags);
+        sig->nrecs++;
+        sig->pending = 0;
+    }
 
-            if (rc != Z_OK) {
-                fprintf(stderr, FST_APIMESS "fstReaderGetValueFromHandleAtTime(), tsec uncompress rc = %d, exiting.\n",
-                        rc);
-                exit(255);
-            }
+    rec = fstSummarySlot(sig, rs);
+    if (!sig->pending) {
+        int had_value = (sig->nrecs != 0);
 
-            free(cdata);
-        } else {
-            fstFread(ucdata, tsec_uclen, 1, xc->f);
+        if (had_value) {
+            memcpy(rec + 13 + vlen, rec - rs + 13 + vlen, vlen); /* value held since the last record */
         }
-
-        xc->rvat_time_table = (uint64_t *)calloc(tsec_nitems, sizeof(uint64_t));
-        tpnt = ucdata;
-        tpval = 0;
-        for (ti = 0; ti < tsec_nitems; ti++) {
-            int skiplen;
-            uint64_t val = fstGetVarint64(tpnt, &skiplen);
-            tpval = xc->rvat_time_table[ti] = tpval + val;
-            tpnt += skiplen;
+        sig->bucket = bucket;
+        sig->transitions = 0;
+        sig->flags = 0;
+        sig->pending = 1;
+        if (!had_value) /* initial value, not a change */
+        {
+            if (vlen) {
+                memcpy(rec + 13 + vlen, value, vlen);
+                sig->flags |= fstSummaryHasXz(value, vlen, is_real) ? FST_SUMMARY_F_XZ : 0;
+            }
+            return;
         }
+    }
 
-        free(ucdata);
+    sig->transitions++;
+    if (!(sig->flags & FST_SUMMARY_F_FIRST)) {
+        if (vlen) {
+            memcpy(rec + 13, value, vlen);
+        }
+        sig->flags |= FST_SUMMARY_F_FIRST;
     }
+    if (vlen) { /* value is NULL for variable length signals */
+        memcpy(rec + 13 + vlen, value, vlen);
+        sig->flags |= fstSummaryHasXz(value, vlen, is_real) ? FST_SUMMARY_F_XZ : 0;
+    }
+}
 
-    fstReaderFseeko(xc, xc->f, blkpos + 32, SEEK_SET);
+static void fstSummaryCallbackVarlen(void *user_callback_data_pointer, uint64_t time, fstHandle facidx,
+                                     const unsigned char *value, uint32_t len)
+{
+    (void)value;
+    (void)len;
+    fstSummaryCallback(user_callback_data_pointer, time, facidx, NULL); /* counted, but no values kept */
+}
 
-    frame_uclen = fstReaderVarint64(xc->f);
-    frame_clen = fstReaderVarint64(xc->f);
-    xc->rvat_frame_maxhandle = fstReaderVarint64(xc->f);
-    xc->rvat_frame_data = (unsigned char *)malloc(frame_uclen);
+/* merges pairs of buckets of a level into the next coarser one */
+static uint64_t fstSummaryCoarsen(unsigned char *dst, const unsigned char *src, uint64_t nrecs, uint32_t vlen)
+{
+    uint32_t rs = 13 + 2 * vlen;
+    uint64_t i, n = 0;
 
-    if (frame_uclen == frame_clen) {
-        fstFread(xc->rvat_frame_data, frame_uclen, 1, xc->f);
-    } else {
-        unsigned char *mc = (unsigned char *)malloc(frame_clen);
-        int rc;
+    for (i = 0; i < nrecs; i++) {
+        const unsigned char *s = src + i * rs;
+        uint64_t parent = fstSummaryGetBucket(s) >> 1;
+        unsigned char *d = dst + (n ? (n - 1) * rs : 0);
 
-        unsigned long destlen = frame_uclen;
-        unsigned long sourcelen = frame_clen;
+        if ((n) && (fstSummaryGetBucket(d) == parent)) {
+            unsigned char flags = d[12] | (s[12] & FST_SUMMARY_F_XZ);
 
-        fstFread(mc, sourcelen, 1, xc->f);
-        rc = uncompress(xc->rvat_frame_data, &destlen, mc, sourcelen);
-        if (rc != Z_OK) {
-            fprintf(stderr, FST_APIMESS "fstReaderGetValueFromHandleAtTime(), frame decompress rc: %d, exiting.\n", rc);
-            exit(255);
+            if (!(d[12] & FST_SUMMARY_F_FIRST) && (s[12] & FST_SUMMARY_F_FIRST)) {
+                memcpy(d + 13, s + 13, vlen);
+                flags |= FST_SUMMARY_F_FIRST;
+            }
+            memcpy(d + 13 + vlen, s + 13 + vlen, vlen);
+            fstSummaryPutHeader(d, parent, fstSummaryGetTransitions(d) + fstSummaryGetTransitions(s), flags);
+        } else {
+            d = dst + n * rs;
+            memcpy(d, s, rs);
+            fstSummaryPutHeader(d, parent, fstSummaryGetTransitions(s), s[12]);
+            n++;
         }
-        free(mc);
     }
 
-    xc->rvat_vc_maxhandle = fstReaderVarint64(xc->f);
-    xc->rvat_vc_start = ftello(xc->f); /* points to '!' character */
-    xc->rvat_packtype = fgetc(xc->f);
-
-#ifdef FST_DEBUG
-    fprintf(stderr, FST_APIMESS "frame_uclen: %d, frame_clen: %d, frame_maxhandle: %d\n", (int)frame_uclen,
-            (int)frame_clen, (int)xc->rvat_frame_maxhandle);
-    fprintf(stderr, FST_APIMESS "vc_maxhandle: %d\n", (int)xc->rvat_vc_maxhandle);
-#endif
+    return (n);
+}
 
-    indx_pntr = blkpos + seclen - 24 - tsec_clen - 8;
-    fstReaderFseeko(xc, xc->f, indx_pntr, SEEK_SET);
-    chain_clen = fstReaderUint64(xc->f);
-    indx_pos = indx_pntr - chain_clen;
-#ifdef FST_DEBUG
-    fprintf(stderr, FST_APIMESS "indx_pos: %d (%d bytes)\n", (int)indx_pos, (int)chain_clen);
-#endif
-    chain_cmem = (unsigned char *)malloc(chain_clen);
-    fstReaderFseeko(xc, xc->f, indx_pos, SEEK_SET);
-    fstFread(chain_cmem, chain_clen, 1, xc->f);
+int fstReaderWriteSummary(void *ctx, const char *nam, int base_shift)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstSummaryBuilder b;
+    unsigned char *saved_mask;
+    unsigned int saved_native, saved_limit;
+    uint64_t span, levels, offs, i, l;
+    FILE *f;
 
-    xc->rvat_chain_table = (fst_off_t *)calloc((xc->rvat_vc_maxhandle + 1), sizeof(fst_off_t));
-    xc->rvat_chain_table_lengths = (uint32_t *)calloc((xc->rvat_vc_maxhandle + 1), sizeof(uint32_t));
+    if ((!xc) || (!nam) || (!xc->maxhandle) || (xc->end_time < xc->start_time)) {
+        return (0);
+    }
 
-    pnt = chain_cmem;
-    idx = 0;
-    pval = 0;
+    span = xc->end_time - xc->start_time;
+    if (base_shift < 0) {
+        for (base_shift = 0; (base_shift < 63) && ((span >> base_shift) >= FST_SUMMARY_AUTO_BUCKETS); base_shift++)
+            ;
+    } else if (base_shift > 63) {
+        base_shift = 63;
+    }
+    for (levels = 1; (base_shift + levels - 1 < 63) && ((span >> (base_shift + levels - 1)) != 0); levels++)
+        ;
 
-    if (sectype == FST_BL_VCDATA_DYN_ALIAS2) {
-        uint32_t prev_alias = 0;
+    f = fopen(nam, "wb");
+    if (!f) {
+        return (0);
+    }
 
-        do {
-            int skiplen;
+    memset(&b, 0, sizeof(struct fstSummaryBuilder));
+    b.xc = xc;
+    b.sigs = (struct fstSummarySig *)calloc(xc->maxhandle, sizeof(struct fstSummarySig));
+    b.start_time = xc->start_time;
+    b.base_shift = base_shift;
+
+    /* every signal over the whole dump, with reals as doubles so records have a fixed size */
+    saved_mask = (unsigned char *)malloc((xc->maxhandle + 7) / 8);
+    memcpy(saved_mask, xc->process_mask, (xc->maxhandle + 7) / 8);
+    saved_native = xc->native_doubles_for_cb;
+    saved_limit = xc->limit_range_valid;
+    fstReaderSetFacProcessMaskAll(xc);
+    xc->native_doubles_for_cb = 1;
+    xc->limit_range_valid = 0;
+
+    fstReaderIterBlocks2(xc, fstSummaryCallback, fstSummaryCallbackVarlen, &b, NULL);
+
+    memcpy(xc->process_mask, saved_mask, (xc->maxhandle + 7) / 8);
+    free(saved_mask);
+    xc->native_doubles_for_cb = saved_native;
+    xc->limit_range_valid = saved_limit;
+
+    fstFwrite(FST_SUMMARY_MAGIC, 8, 1, f);
+    fstWriterUint64(f, xc->start_time);
+    fstWriterUint64(f, xc->end_time);
+    fstWriterUint64(f, xc->maxhandle);
+    fstWriterUint64(f, base_shift);
+    fstWriterUint64(f, levels);
+
+    /* each level has at most as many records as the one below it, so the index can be written up front */
+    offs = 48 + xc->maxhandle * (16 + 16 * levels);
+    for (i = 0; i < xc->maxhandle; i++) {
+        struct fstSummarySig *sig = b.sigs + i;
+        uint32_t vlen = xc->signal_lens[i];
+        uint32_t rs = 13 + 2 * vlen;
+        uint64_t n = sig->nrecs;
+
+        if (sig->pending) {
+            fstSummaryPutHeader(sig->recs + sig->nrecs * rs, sig->bucket, sig->transitions, sig->flags);
+            n = ++sig->nrecs;
+            sig->pending = 0;
+        }
 
-            if (*pnt & 0x01) {
-                int64_t shval = fstGetSVarint64(pnt, &skiplen) >> 1;
-                if (shval > 0) {
-                    pval = xc->rvat_chain_table[idx] = pval + shval;
-                    if (idx) {
-                        xc->rvat_chain_table_lengths[pidx] = pval - xc->rvat_chain_table[pidx];
-                    }
-                    pidx = idx++;
-                } else if (shval < 0) {
-                    xc->rvat_chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
-                    xc->rvat_chain_table_lengths[idx] = prev_alias =
-                            shval; /* because during this loop iter would give stale data! */
-                    idx++;
-                } else {
-                    xc->rvat_chain_table[idx] = 0; /* need to explicitly zero as calloc above might not run */
-                    xc->rvat_chain_table_lengths[idx] =
-                            prev_alias; /* because during this loop iter would give stale data! */
-                    idx++;
-                }
-            } else {
-                uint64_t val = fstGetVarint32(pnt, &skiplen);
+        fstWriterUint64(f, vlen);
+        fstWriterUint64(f, xc->signal_typs[i] == FST_VT_VCD_REAL);
+        for (l = 0; l < levels; l++) {
+            uint64_t j, m = 0;
 
-                fstHandle loopcnt = val >> 1;
-                for (i = 0; i < loopcnt; i++) {
-                    xc->rvat_chain_table[idx++] = 0;
+            fstWriterUint64(f, offs);
+            fstWriterUint64(f, n);
+            offs += n * rs;
+            for (j = 0; j < sig->nrecs; j++) /* record count of the next level up */
+            {
+                if ((!j) || ((fstSummaryGetBucket(sig->recs + j * rs) >> (l + 1)) !=
+                             (fstSummaryGetBucket(sig->recs + (j - 1) * rs) >> (l + 1)))) {
+                    m++;
                 }
             }
+            n = m;
+        }
+    }
 
-            pnt += skiplen;
-        } while (pnt != (chain_cmem + chain_clen));
-    } else {
-        do {
-            int skiplen;
-            uint64_t val = fstGetVarint32(pnt, &skiplen);
-
-            if (!val) {
-                pnt += skiplen;
-                val = fstGetVarint32(pnt, &skiplen);
-                xc->rvat_chain_table[idx] = 0;
-                xc->rvat_chain_table_lengths[idx] = -val;
-                idx++;
-            } else if (val & 1) {
-                pval = xc->rvat_chain_table[idx] = pval + (val >> 1);
-                if (idx) {
-                    xc->rvat_chain_table_lengths[pidx] = pval - xc->rvat_chain_table[pidx];
-                }
-                pidx = idx++;
-            } else {
-                fstHandle loopcnt = val >> 1;
-                for (i = 0; i < loopcnt; i++) {
-                    xc->rvat_chain_table[idx++] = 0;
-                }
-            }
+    for (i = 0; i < xc->maxhandle; i++) {
+        struct fstSummarySig *sig = b.sigs + i;
+        uint32_t vlen = xc->signal_lens[i];
+        unsigned char *lvl = sig->recs;
+        unsigned char *next = sig->nrecs ? (unsigned char *)malloc(sig->nrecs * (13 + 2 * vlen)) : NULL;
+        uint64_t n = sig->nrecs;
+
+        for (l = 0; l < levels; l++) {
+            unsigned char *swap;
+
+            fstFwrite(lvl, 13 + 2 * vlen, n, f);
+            n = fstSummaryCoarsen(next, lvl, n, vlen);
+            swap = lvl;
+            lvl = next;
+            next = swap;
+        }
 
-            pnt += skiplen;
-        } while (pnt != (chain_cmem + chain_clen));
+        free(lvl);
+        free(next);
     }
 
-    free(chain_cmem);
-    xc->rvat_chain_table[idx] = indx_pos - xc->rvat_vc_start;
-    xc->rvat_chain_table_lengths[pidx] = xc->rvat_chain_table[idx] - xc->rvat_chain_table[pidx];
+    free(b.sigs);
+    fclose(f);
+    return (1);
+}
 
-    for (i = 0; i < idx; i++) {
-        int32_t v32 = xc->rvat_chain_table_lengths[i];
-        if ((v32 < 0) && (!xc->rvat_chain_table[i])) {
-            v32 = -v32;
-            v32--;
-            if (((uint32_t)v32) < i) /* sanity check */
-            {
-                xc->rvat_chain_table[i] = xc->rvat_chain_table[v32];
-                xc->rvat_chain_table_lengths[i] = xc->rvat_chain_table_lengths[v32];
-            }
-        }
-    }
+struct fstSummaryContext
+{
+    FILE *f;
+    uint64_t start_time, end_time;
+    uint64_t maxhandle, base_shift, levels;
 
-#ifdef FST_DEBUG
-    fprintf(stderr, FST_APIMESS "decompressed chain idx len: %" PRIu32 "\n", idx);
-#endif
+    unsigned char *recs; /* records read by the last query */
+    uint64_t recs_alloc;
+    char *vals; /* formatted values handed out by the last query */
+    uint64_t vals_alloc;
+};
 
-    xc->rvat_data_valid = 1;
+void *fstSummaryOpen(const char *nam)
+{
+    struct fstSummaryContext *sc;
+    char magic[8];
+    FILE *f = nam ? fopen(nam, "rb") : NULL;
 
-/* all data at this point is loaded or resident in fst cache, process and return appropriate value */
-process_value:
-    if (facidx > xc->rvat_vc_maxhandle) {
+    if (!f) {
         return (NULL);
     }
 
-    facidx--; /* scale down for array which starts at zero */
+    if ((fread(magic, 8, 1, f) != 1) || (memcmp(magic, FST_SUMMARY_MAGIC, 8))) {
+        fclose(f);
+        return (NULL);
+    }
 
-    if (((tim == xc->rvat_beg_tim) && (!xc->rvat_chain_table[facidx])) || (!xc->rvat_chain_table[facidx])) {
-        return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+    sc = (struct fstSummaryContext *)calloc(1, sizeof(struct fstSummaryContext));
+    sc->f = f;
+    sc->start_time = fstReaderUint64(f);
+    sc->end_time = fstReaderUint64(f);
+    sc->maxhandle = fstReaderUint64(f);
+    sc->base_shift = fstReaderUint64(f);
+    sc->levels = fstReaderUint64(f);
+
+    if ((!sc->levels) || (sc->base_shift + sc->levels > 64)) {
+        fclose(f);
+        free(sc);
+        return (NULL);
     }
 
-    if (facidx != xc->rvat_chain_facidx) {
-        if (xc->rvat_chain_mem) {
-            free(xc->rvat_chain_mem);
-            xc->rvat_chain_mem = NULL;
+    return (sc);
+}
 
-            xc->rvat_chain_pos_valid = 0;
-        }
+void fstSummaryClose(void *ctx)
+{
+    struct fstSummaryContext *sc = (struct fstSummaryContext *)ctx;
+
+    if (sc) {
+        fclose(sc->f);
+        free(sc->recs);
+        free(sc->vals);
+        free(sc);
     }
+}
 
-    if (!xc->rvat_chain_mem) {
-        uint32_t skiplen;
-        fstReaderFseeko(xc, xc->f, xc->rvat_vc_start + xc->rvat_chain_table[facidx], SEEK_SET);
-        xc->rvat_chain_len = fstReaderVarint32WithSkip(xc->f, &skiplen);
-        if (xc->rvat_chain_len) {
-            unsigned char *mu = (unsigned char *)malloc(xc->rvat_chain_len);
-            unsigned char *mc = (unsigned char *)malloc(xc->rvat_chain_table_lengths[facidx]);
-            unsigned long destlen = xc->rvat_chain_len;
-            unsigned long sourcelen = xc->rvat_chain_table_lengths[facidx];
-            int rc = Z_OK;
+static char *fstSummaryFormat(char *dst, const unsigned char *val, uint32_t vlen, int is_real)
+{
+    if (is_real) {
+        double d;
 
-            fstFread(mc, xc->rvat_chain_table_lengths[facidx], 1, xc->f);
+        memcpy(&d, val, sizeof(double));
+        sprintf(dst, "%.16g", d);
+    } else {
+        memcpy(dst, val, vlen);
+        dst[vlen] = 0;
+    }
+    return (dst);
+}
 
-            switch (xc->rvat_packtype) {
-            case '4':
-                rc = (destlen ==
-                      (unsigned long)LZ4_decompress_safe_partial((char *)mc, (char *)mu, sourcelen, destlen, destlen))
-                             ? Z_OK
-                             : Z_DATA_ERROR;
-                break;
-            case 'F':
-                fastlz_decompress(mc, sourcelen, mu, destlen); /* rc appears unreliable */
-                break;
-            default:
-                rc = uncompress(mu, &destlen, mc, sourcelen);
-                break;
-            }
+uint32_t fstSummaryGetBuckets(void *ctx, fstHandle handle, uint64_t t0, uint64_t t1, uint32_t max_buckets,
+                              struct fstSummaryBucket *out)
+{
+    struct fstSummaryContext *sc = (struct fstSummaryContext *)ctx;
+    uint64_t b0, b1, nb, lo, hi, offs, cnt, level, shift, k, i;
+    uint32_t vlen, rs, stride;
+    int is_real, entering_xz = 0;
+    const char *entering = NULL;
+    char *vp;
 
-            free(mc);
+    if ((!sc) || (!handle) || (handle > sc->maxhandle) || (!max_buckets) || (!out)) {
+        return (0);
+    }
 
-            if (rc != Z_OK) {
-                fprintf(stderr,
-                        FST_APIMESS "fstReaderGetValueFromHandleAtTime(), rvat decompress clen: %d (rc=%d), exiting.\n",
-                        (int)xc->rvat_chain_len, rc);
-                exit(255);
-            }
+    if (t0 < sc->start_time)
+        t0 = sc->start_time;
+    if (t1 > sc->end_time)
+        t1 = sc->end_time;
+    if (t0 > t1) {
+        return (0);
+    }
 
-            /* data to process is for(j=0;j<destlen;j++) in mu[j] */
-            xc->rvat_chain_mem = mu;
+    /* finest level which spans the range in at most max_buckets buckets */
+    for (level = 0; level < sc->levels; level++) {
+        shift = sc->base_shift + level;
+        b0 = (t0 - sc->start_time) >> shift;
+        b1 = (t1 - sc->start_time) >> shift;
+        if (b1 - b0 < max_buckets) {
+            break;
+        }
+    }
+    if (level == sc->levels) {
+        return (0);
+    }
+    nb = b1 - b0 + 1;
+
+    fstReaderFseeko(NULL, sc->f, 48 + (handle - 1) * (16 + 16 * sc->levels), SEEK_SET);
+    vlen = fstReaderUint64(sc->f);
+    is_real = (fstReaderUint64(sc->f) != 0);
+    fstReaderFseeko(NULL, sc->f, 16 * level, SEEK_CUR);
+    offs = fstReaderUint64(sc->f);
+    cnt = fstReaderUint64(sc->f);
+    rs = 13 + 2 * vlen;
+    stride = is_real ? 32 : (vlen + 1);
+
+    /* first record at or after b0 */
+    lo = 0;
+    hi = cnt;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        fstReaderFseeko(NULL, sc->f, offs + mid * rs, SEEK_SET);
+        if (fstReaderUint64(sc->f) < b0) {
+            lo = mid + 1;
         } else {
-            int destlen = xc->rvat_chain_table_lengths[facidx] - skiplen;
-            unsigned char *mu = (unsigned char *)malloc(xc->rvat_chain_len = destlen);
-            fstFread(mu, destlen, 1, xc->f);
-            /* data to process is for(j=0;j<destlen;j++) in mu[j] */
-            xc->rvat_chain_mem = mu;
+            hi = mid;
         }
-
-        xc->rvat_chain_facidx = facidx;
     }
 
-    /* process value chain here */
-
-    {
-        uint32_t tidx = 0, ptidx = 0;
-        uint32_t tdelta;
-        int skiplen;
-        unsigned int iprev = xc->rvat_chain_len;
-        uint32_t pvli = 0;
-        int pskip = 0;
+    /* the record before it holds the value entering the range, then at most nb records are visible */
+    k = lo ? (lo - 1) : lo;
+    cnt = ((cnt - k) > (nb + 1)) ? (nb + 1) : (cnt - k);
+    if (cnt * rs > sc->recs_alloc) {
+        sc->recs_alloc = cnt * rs;
+        sc->recs = (unsigned char *)realloc(sc->recs, sc->recs_alloc);
+    }
+    if ((2 * nb + 1) * stride > sc->vals_alloc) {
+        sc->vals_alloc = (2 * nb + 1) * stride;
+        sc->vals = (char *)realloc(sc->vals, sc->vals_alloc);
+    }
+    fstReaderFseeko(NULL, sc->f, offs + k * rs, SEEK_SET);
+    if (cnt && (fread(sc->recs, rs, cnt, sc->f) != cnt)) {
+        return (0);
+    }
 
-        if ((xc->rvat_chain_pos_valid) && (tim >= xc->rvat_chain_pos_time)) {
-            i = xc->rvat_chain_pos_idx;
-            tidx = xc->rvat_chain_pos_tidx;
-        } else {
-            i = 0;
-            tidx = 0;
-            xc->rvat_chain_pos_time = xc->rvat_beg_tim;
+    vp = sc->vals;
+    i = 0;
+    if (lo && cnt) {
+        if (vlen) {
+            entering = fstSummaryFormat(vp, sc->recs + 13 + vlen, vlen, is_real);
+            vp += stride;
         }
+        entering_xz = (sc->recs[12] & FST_SUMMARY_F_XZ) && fstSummaryHasXz(sc->recs + 13 + vlen, vlen, is_real);
+        i = 1;
+    }
 
-        if (xc->signal_lens[facidx] == 1) {
-            while (i < xc->rvat_chain_len) {
-                uint32_t vli = fstGetVarint32(xc->rvat_chain_mem + i, &skiplen);
-                uint32_t shcnt = 2 << (vli & 1);
-                tdelta = vli >> shcnt;
+    for (k = 0; k < nb; k++) {
+        uint64_t bucket = b0 + k;
+        struct fstSummaryBucket *ob = out + k;
 
-                if (xc->rvat_time_table[tidx + tdelta] <= tim) {
-                    iprev = i;
-                    pvli = vli;
-                    ptidx = tidx;
-                    /* pskip = skiplen; */ /* scan-build */
+        ob->beg_time = sc->start_time + (bucket << shift);
+        ob->end_time = ((sc->end_time - ob->beg_time) >> shift) ? (ob->beg_time + (((uint64_t)1 << shift) - 1))
+                                                                 : sc->end_time;
+        ob->first = NULL;
+        ob->has_xz = entering_xz;
 
-                    tidx += tdelta;
-                    i += skiplen;
-                } else {
-                    break;
-                }
-            }
-            if (iprev != xc->rvat_chain_len) {
-                xc->rvat_chain_pos_tidx = ptidx;
-                xc->rvat_chain_pos_idx = iprev;
-                xc->rvat_chain_pos_time = tim;
-                xc->rvat_chain_pos_valid = 1;
+        if ((i < cnt) && (fstSummaryGetBucket(sc->recs + i * rs) == bucket)) {
+            const unsigned char *rec = sc->recs + i * rs;
 
-                if (!(pvli & 1)) {
-                    buf[0] = ((pvli >> 1) & 1) | '0';
-                } else {
-                    buf[0] = FST_RCV_STR[((pvli >> 1) & 7)];
+            ob->transitions = fstSummaryGetTransitions(rec);
+            ob->has_xz |= ((rec[12] & FST_SUMMARY_F_XZ) != 0);
+            if (vlen) {
+                if (rec[12] & FST_SUMMARY_F_FIRST) {
+                    ob->first = fstSummaryFormat(vp, rec + 13, vlen, is_real);
+                    vp += stride;
                 }
-                buf[1] = 0;
-                return (buf);
-            } else {
-                return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+                entering = fstSummaryFormat(vp, rec + 13 + vlen, vlen, is_real);
+                vp += stride;
             }
+            entering_xz = fstSummaryHasXz(rec + 13 + vlen, vlen, is_real);
+            i++;
         } else {
-            while (i < xc->rvat_chain_len) {
-                uint32_t vli = fstGetVarint32(xc->rvat_chain_mem + i, &skiplen);
-                tdelta = vli >> 1;
+            ob->transitions = 0;
+        }
+        ob->last = entering;
+    }
 
-                if (xc->rvat_time_table[tidx + tdelta] <= tim) {
-                    iprev = i;
-                    pvli = vli;
-                    ptidx = tidx;
-                    pskip = skiplen;
+    return (nb);
+}
 
-                    tidx += tdelta;
-                    i += skiplen;
+/*
+ * per signal activity over [t0, t1): value changes, 0/1 bit toggles and the time
+ * each bit spends at 0, 1 or anything else, as needed for SAIF style power
+ * estimation.  only signals in the process mask are filled in.  sections start
+ * from their own frame so they are unpacked and counted on the
+ * fstReaderSetUnpackThreads() threads, the caller only reads and sums them.
+ */
+int fstReaderGetActivity(void *ctx, uint64_t t0, uint64_t t1, struct fstSignalActivity *act)
+{
+    struct fstReaderContext *xc = (struct fstReaderContext *)ctx;
+    struct fstReaderUnpackPool pool;
+    unsigned int nthreads;
+    unsigned int saved_limit;
+    uint64_t si = 0;
+    unsigned int j;
+    int blocks_skipped = 0;
+    int reading = 1;
+#ifdef FST_READER_PARALLEL
+    pthread_t *threads = NULL;
+#endif
 
-                    if (!(pvli & 1)) {
-                        i += ((xc->signal_lens[facidx] + 7) / 8);
-                    } else {
-                        i += xc->signal_lens[facidx];
-                    }
-                } else {
-                    break;
-                }
+    /* sections are located and bounded through the section index */
+    if ((!xc) || (!act) || (!xc->vc_sections)) {
+        return (0);
+    }
+
+    memset(act, 0, xc->maxhandle * sizeof(struct fstSignalActivity));
+    if (t0 >= t1) {
+        return (1);
+    }
+
+    fstReaderRvatSetupOffsets(xc);
+    saved_limit = xc->limit_range_valid;
+    xc->limit_range_valid = 0;
+    nthreads = (xc->unpack_threads > 1) ? xc->unpack_threads : 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.xc = xc;
+    pool.act_t0 = t0;
+    pool.act_t1 = t1;
+    pool.njobs = nthreads + 1;
+    pool.jobs = (struct fstReaderUnpackJob *)calloc(pool.njobs, sizeof(struct fstReaderUnpackJob));
+    for (j = 0; j < pool.njobs; j++) {
+        pool.jobs[j].scatterptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].headptr = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].length_remaining = (uint32_t *)calloc(xc->maxhandle, sizeof(uint32_t));
+        pool.jobs[j].act = (struct fstSignalActivity *)calloc(xc->maxhandle, sizeof(struct fstSignalActivity));
+        pool.jobs[j].keep_frame = 1;
+    }
+
+#ifdef FST_READER_PARALLEL
+    if (nthreads) {
+        pthread_mutex_init(&pool.mutex, NULL);
+        pthread_cond_init(&pool.work_cond, NULL);
+        pthread_cond_init(&pool.done_cond, NULL);
+
+        threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+        for (j = 0; j < nthreads; j++) {
+            if (pthread_create(&threads[j], NULL, fstReaderUnpackWorker, &pool)) {
+                fprintf(stderr, FST_APIMESS "fstReaderGetActivity(), pthread_create() failed, exiting.\n");
+                exit(255);
             }
+        }
+    }
+#endif
 
-            if (iprev != xc->rvat_chain_len) {
-                unsigned char *vdata = xc->rvat_chain_mem + iprev + pskip;
+    fstReaderMmapAdvise(xc, 1);
 
-                xc->rvat_chain_pos_tidx = ptidx;
-                xc->rvat_chain_pos_idx = iprev;
-                xc->rvat_chain_pos_time = tim;
-                xc->rvat_chain_pos_valid = 1;
+    for (;;) {
+        struct fstReaderUnpackJob *job;
 
-                if (xc->signal_typs[facidx] != FST_VT_VCD_REAL) {
-                    if (!(pvli & 1)) {
-                        int byte = 0;
-                        int bit;
-                        unsigned int j;
+        while (reading && (pool.next_read - pool.next_deliver < pool.njobs)) {
+            fst_off_t blkpos;
+            uint64_t act_end;
 
-                        for (j = 0; j < xc->signal_lens[facidx]; j++) {
-                            unsigned char ch;
-                            byte = j / 8;
-                            bit = 7 - (j & 7);
-                            ch = ((vdata[byte] >> bit) & 1) | '0';
-                            buf[j] = ch;
-                        }
-                        buf[j] = 0;
+            if ((si >= xc->vc_section_count) || (xc->vc_sections[si].beg_tim >= t1)) {
+                reading = 0;
+                break;
+            }
 
-                        return (buf);
-                    } else {
-                        memcpy(buf, vdata, xc->signal_lens[facidx]);
-                        buf[xc->signal_lens[facidx]] = 0;
-                        return (buf);
-                    }
-                } else {
-                    double d;
-                    unsigned char *clone_d = (unsigned char *)&d;
-                    unsigned char bufd[8];
-                    unsigned char *srcdata;
+            act_end = (si + 1 < xc->vc_section_count) ? xc->vc_sections[si + 1].beg_tim : xc->end_time;
+            if (act_end < t0) {
+                si++;
+                continue;
+            }
 
-                    if (!(pvli & 1)) /* very rare case, but possible */
-                    {
-                        int bit;
-                        int j;
+            job = pool.jobs + (pool.next_read % pool.njobs);
+            blkpos = xc->vc_sections[si].pos;
+            if (!fstReaderUnpackRead(xc, job, &blkpos, &blocks_skipped, (si != 0))) {
+                reading = 0;
+                break;
+            }
+            job->act_end = act_end;
+            si++;
+
+            if (nthreads) {
+#ifdef FST_READER_PARALLEL
+                pthread_mutex_lock(&pool.mutex);
+                pool.next_read++;
+                pthread_cond_signal(&pool.work_cond);
+                pthread_mutex_unlock(&pool.mutex);
+#endif
+            } else {
+                job->status = fstReaderUnpackSection(xc, job);
+                if (job->status == FST_READER_UNPACK_OK) {
+                    fstReaderActivitySection(xc, &pool, job);
+                }
+                job->done = 1;
+                pool.next_read++;
+            }
+        }
 
-                        for (j = 0; j < 8; j++) {
-                            unsigned char ch;
-                            bit = 7 - (j & 7);
-                            ch = ((vdata[0] >> bit) & 1) | '0';
-                            bufd[j] = ch;
-                        }
+        if (pool.next_deliver == pool.next_read)
+            break;
 
-                        srcdata = bufd;
-                    } else {
-                        srcdata = vdata;
-                    }
+        job = pool.jobs + (pool.next_deliver % pool.njobs);
+#ifdef FST_READER_PARALLEL
+        if (nthreads) {
+            pthread_mutex_lock(&pool.mutex);
+            while (!job->done) {
+                pthread_cond_wait(&pool.done_cond, &pool.mutex);
+            }
+            pthread_mutex_unlock(&pool.mutex);
+        }
+#endif
 
-                    if (xc->double_endian_match) {
-                        memcpy(clone_d, srcdata, 8);
-                    } else {
-                        int j;
+        if (job->status == FST_READER_UNPACK_STOP)
+            break;
 
-                        for (j = 0; j < 8; j++) {
-                            clone_d[j] = srcdata[7 - j];
-                        }
-                    }
+        if (job->status == FST_READER_UNPACK_OK) {
+            fstHandle i;
 
-                    sprintf(buf, "r%.16g", d);
-                    return (buf);
-                }
-            } else {
-                return (fstExtractRvatDataFromFrame(xc, facidx, buf));
+            for (i = 0; i < xc->maxhandle; i++) {
+                struct fstSignalActivity *a = job->act + i;
+
+                act[i].transitions += a->transitions;
+                act[i].toggles += a->toggles;
+                act[i].time_0 += a->time_0;
+                act[i].time_1 += a->time_1;
+                act[i].time_x += a->time_x;
             }
+            memset(job->act, 0, xc->maxhandle * sizeof(struct fstSignalActivity));
         }
+
+        fstReaderUnpackJobFree(job);
+        pool.next_deliver++;
     }
 
-    /* return(NULL); */
+#ifdef FST_READER_PARALLEL
+    if (nthreads) {
+        pthread_mutex_lock(&pool.mutex);
+        pool.exiting = 1;
+        pthread_cond_broadcast(&pool.work_cond);
+        pthread_mutex_unlock(&pool.mutex);
+        for (j = 0; j < nthreads; j++) {
+            pthread_join(threads[j], NULL);
+        }
+        free(threads);
+
+        pthread_cond_destroy(&pool.done_cond);
+        pthread_cond_destroy(&pool.work_cond);
+        pthread_mutex_destroy(&pool.mutex);
+    }
+#endif
+
+    for (j = 0; j < pool.njobs; j++) {
+        fstReaderUnpackJobFree(pool.jobs + j);
+        free(pool.jobs[j].scatterptr);
+        free(pool.jobs[j].headptr);
+        free(pool.jobs[j].length_remaining);
+        free(pool.jobs[j].act);
+    }
+    free(pool.jobs);
+
+    xc->limit_range_valid = saved_limit;
+    return (1);
 }
 
 /**********************************************************************/
@@ -77,8 +77,9 @@ enum fstBlockType
     FST_BL_HIER_LZ4DUO = 7,
     FST_BL_VCDATA_DYN_ALIAS2 = 8,
 
-    FST_BL_ZWRAPPER = 254, /* indicates that whole trace is gz wrapped */
-    FST_BL_SKIP = 255      /* used while block is being written */
+    FST_BL_ZWRAPPER_CHUNKED = 253, /* whole trace is gz wrapped in separately inflatable chunks */
+    FST_BL_ZWRAPPER = 254,         /* indicates that whole trace is gz wrapped */
+    FST_BL_SKIP = 255              /* used while block is being written */
 };
 
 enum fstScopeType
@@ -356,6 +357,52 @@ struct fstHier
     } u;
 };
 
+struct fstFlatVar
+{
+    const char *name;     /* full hierarchical name, scopes separated by '.' */
+    uint32_t name_length; /* strlen(name) */
+    uint32_t length;
+    fstHandle handle;
+    unsigned char typ;       /* FST_VT_MIN ... FST_VT_MAX */
+    unsigned char direction; /* FST_VD_MIN ... FST_VD_MAX */
+    unsigned is_alias : 1;
+};
+
+struct fstReaderValueChange
+{
+    uint64_t time;
+    fstHandle handle;
+    uint32_t len;               /* bytes in value, a NUL follows them */
+    const unsigned char *value; /* same contents as the fstReaderIterBlocks2() callbacks receive */
+};
+
+struct fstSignalHistory
+{
+    uint64_t num_entries;
+    uint64_t *times;       /* ascending, the first entry is the value at the start of the range */
+    char *values;          /* num_entries NUL terminated values, value_stride bytes apart */
+    uint32_t value_stride; /* signal length + 1, 32 for reals */
+};
+
+struct fstSummaryBucket
+{
+    uint64_t beg_time;
+    uint64_t end_time;
+    uint32_t transitions; /* value changes inside the bucket */
+    unsigned char has_xz; /* a value with non 0/1 bits was held in the bucket */
+    const char *first;    /* first value changed to, NULL if none or variable length */
+    const char *last;     /* value at the end of the bucket, NULL before any value or if variable length */
+};
+
+struct fstSignalActivity
+{
+    uint64_t transitions; /* value changes which alter the value */
+    uint64_t toggles;     /* bits going between 0 and 1, summed over the value changes */
+    uint64_t time_0;      /* time spent at 0 summed over the bits, likewise for 1 and anything else */
+    uint64_t time_1;
+    uint64_t time_x;
+};
+
 struct fstETab
 {
     char *name;
@@ -384,10 +431,13 @@ void fstWriterEmitEnumTableRef(void *ctx, fstEnumHandle handle);
 void fstWriterEmitValueChange(void *ctx, fstHandle handle, const void *val);
 void fstWriterEmitValueChange32(void *ctx, fstHandle handle, uint32_t bits, uint32_t val);
 void fstWriterEmitValueChange64(void *ctx, fstHandle handle, uint32_t bits, uint64_t val);
+void fstWriterEmitValueChangeBatch(void *ctx, uint32_t num, const fstHandle *handles, const void *const *vals);
 void fstWriterEmitValueChangeVec32(void *ctx, fstHandle handle, uint32_t bits, const uint32_t *val);
 void fstWriterEmitValueChangeVec64(void *ctx, fstHandle handle, uint32_t bits, const uint64_t *val);
 void fstWriterEmitVariableLengthValueChange(void *ctx, fstHandle handle, const void *val, uint32_t len);
 void fstWriterEmitTimeChange(void *ctx, uint64_t tim);
+void fstWriterEmitTimeChangeBatch(void *ctx, uint64_t tim, uint32_t num, const fstHandle *handles,
+                                  const void *const *vals);
 void fstWriterFlushContext(void *ctx);
 int fstWriterGetDumpSizeLimitReached(void *ctx);
 int fstWriterGetFseekFailed(void *ctx);
@@ -398,10 +448,12 @@ void fstWriterSetDate(void *ctx, const char *dat);
 void fstWriterSetDumpSizeLimit(void *ctx, uint64_t numbytes);
 void fstWriterSetEnvVar(void *ctx, const char *envvar);
 void fstWriterSetFileType(void *ctx, enum fstFileType filetype);
+void fstWriterSetPackThreads(void *ctx, int numthreads); /* compress chains and chunked repack on numthreads threads */
 void fstWriterSetPackType(void *ctx, enum fstWriterPackType typ);
 void fstWriterSetParallelMode(void *ctx, int enable);
-void fstWriterSetRepackOnClose(void *ctx, int enable); /* type = 0 (none), 1 (libz) */
+void fstWriterSetRepackOnClose(void *ctx, int enable); /* type = 0 (none), 1 (libz), 2 (libz, chunked) */
 void fstWriterSetScope(void *ctx, enum fstScopeType scopetype, const char *scopename, const char *scopecomp);
+void fstWriterSetScratchInMemory(void *ctx, uint64_t spill_threshold); /* before 1st time change, 0 = never spill */
 void fstWriterSetSourceInstantiationStem(void *ctx, const char *path, unsigned int line, unsigned int use_realpath);
 void fstWriterSetSourceStem(void *ctx, const char *path, unsigned int line, unsigned int use_realpath);
 void fstWriterSetTimescale(void *ctx, int ts);
@@ -414,9 +466,17 @@ void fstWriterSetVersion(void *ctx, const char *vers);
 /*
  * reader functions
  */
+void *fstReaderClone(void *ctx); /* shares ctx's file data, the clone is usable from another thread, */
+                                 /* but call it only from the thread that owns ctx as it updates ctx */
 void fstReaderClose(void *ctx);
 void fstReaderClrFacProcessMask(void *ctx, fstHandle facidx);
 void fstReaderClrFacProcessMaskAll(void *ctx);
+void fstReaderCursorClose(void *cursor);
+uint32_t fstReaderCursorNext(void *cursor, struct fstReaderValueChange *buf, uint32_t maxitems);
+void *fstReaderCursorOpen(void *ctx); /* pull-based alternative to fstReaderIterBlocks2() */
+void fstReaderFreeSignalHistory(struct fstSignalHistory *hist);
+int fstReaderGetActivity(void *ctx, uint64_t t0, uint64_t t1,
+                         struct fstSignalActivity *act); /* maxhandle entries over [t0, t1), process mask only */
 uint64_t fstReaderGetAliasCount(void *ctx);
 const char *fstReaderGetCurrentFlatScope(void *ctx);
 void *fstReaderGetCurrentScopeUserInfo(void *ctx);
@@ -428,16 +488,25 @@ unsigned char fstReaderGetDumpActivityChangeValue(void *ctx, uint32_t idx);
 uint64_t fstReaderGetEndTime(void *ctx);
 int fstReaderGetFacProcessMask(void *ctx, fstHandle facidx);
 int fstReaderGetFileType(void *ctx);
+const struct fstFlatVar *fstReaderGetFlatVars(void *ctx, uint64_t *num_vars);
 int fstReaderGetFseekFailed(void *ctx);
 fstHandle fstReaderGetMaxHandle(void *ctx);
 uint64_t fstReaderGetMemoryUsedByWriter(void *ctx);
 uint32_t fstReaderGetNumberDumpActivityChanges(void *ctx);
 uint64_t fstReaderGetScopeCount(void *ctx);
+int fstReaderGetSignalHistory(void *ctx, fstHandle handle, uint64_t t0, uint64_t t1,
+                              struct fstSignalHistory *hist); /* values over [t0, t1], decodes only handle's chains, */
+                                                              /* returns 0 for variable length (string) handles */
 uint64_t fstReaderGetStartTime(void *ctx);
 signed char fstReaderGetTimescale(void *ctx);
 int64_t fstReaderGetTimezero(void *ctx);
 uint64_t fstReaderGetValueChangeSectionCount(void *ctx);
+void fstReaderGetValueAtTimeCacheStats(void *ctx, uint64_t *section_hits, uint64_t *section_misses,
+                                       uint64_t *chain_hits, uint64_t *chain_misses);
 char *fstReaderGetValueFromHandleAtTime(void *ctx, uint64_t tim, fstHandle facidx, char *buf);
+int fstReaderGetValuesFromHandlesAtTimes(void *ctx, uint32_t num_handles, const fstHandle *handles,
+                                         uint64_t num_times, const uint64_t *times, char *out,
+                                         uint32_t stride); /* out[time][handle], sorted times */
 uint64_t fstReaderGetVarCount(void *ctx);
 const char *fstReaderGetVersionString(void *ctx);
 struct fstHier *fstReaderIterateHier(void *ctx);
@@ -453,6 +522,16 @@ int fstReaderIterBlocks2(void *ctx,
                                                               fstHandle facidx, const unsigned char *value,
                                                               uint32_t len),
                          void *user_callback_data_pointer, FILE *vcdhandle);
+int fstReaderIterBlocksPacked(void *ctx,
+                              void (*value_change_callback)(void *user_callback_data_pointer, uint64_t time,
+                                                            fstHandle facidx, const unsigned char *value),
+                              void (*value_change_callback_varlen)(void *user_callback_data_pointer, uint64_t time,
+                                                                   fstHandle facidx, const unsigned char *value,
+                                                                   uint32_t len),
+                              void (*value_change_callback_packed)(void *user_callback_data_pointer, uint64_t time,
+                                                                   fstHandle facidx, const uint64_t *value,
+                                                                   const uint64_t *xz_mask, uint32_t bits),
+                              void *user_callback_data_pointer, FILE *vcdhandle);
 void fstReaderIterBlocksSetNativeDoublesOnCallback(void *ctx, int enable);
 void *fstReaderOpen(const char *nam);
 void *fstReaderOpenForUtilitiesOnly(void);
@@ -462,9 +541,22 @@ const char *fstReaderPushScope(void *ctx, const char *nam, void *user_info);
 void fstReaderResetScope(void *ctx);
 void fstReaderSetFacProcessMask(void *ctx, fstHandle facidx);
 void fstReaderSetFacProcessMaskAll(void *ctx);
+void fstReaderSetHierInMemory(void *ctx, int enable); /* decompress hierarchy to memory, not a temp file */
 void fstReaderSetLimitTimeRange(void *ctx, uint64_t start_time, uint64_t end_time);
+void fstReaderSetMmap(void *ctx, int enable); /* read value change data through a mapping of the file */
 void fstReaderSetUnlimitedTimeRange(void *ctx);
+void fstReaderSetUnpackThreads(void *ctx, int numthreads); /* decompress sections on numthreads threads */
+void fstReaderSetValueAtTimeCacheSize(void *ctx, uint64_t bytes); /* decoded data kept for ...ValueFromHandleAtTime() */
 void fstReaderSetVcdExtensions(void *ctx, int enable);
+int fstReaderWriteSummary(void *ctx, const char *nam, int base_shift); /* base_shift < 0 picks one */
+
+/*
+ * summary pyramid sidecar functions
+ */
+void fstSummaryClose(void *ctx);
+uint32_t fstSummaryGetBuckets(void *ctx, fstHandle handle, uint64_t t0, uint64_t t1, uint32_t max_buckets,
+                              struct fstSummaryBucket *out); /* values stay valid until the next call */
+void *fstSummaryOpen(const char *nam);
 
 /*
  * utility functions
@@ -38,6 +38,7 @@ void print_help(char *nam)
            "  -f, --fstname=FILE         specify FST input filename\n"
            "  -o, --output=FILE          specify output filename\n"
            "  -e, --extensions           emit FST extensions to VCD\n"
+           "  -t, --threads=NUM          decompress sections on NUM threads\n"
            "  -h, --help                 display this help then exit\n\n"
            "VCD is emitted to stdout if output filename is unspecified.\n\n"
            "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
@@ -47,6 +48,7 @@ void print_help(char *nam)
            "  -f                         specify FST input filename\n"
            "  -o                         specify output filename\n"
            "  -e                         emit FST extensions to VCD\n"
+           "  -t NUM                     decompress sections on NUM threads\n"
            "  -h                         display this help then exit\n\n"
            "VCD is emitted to stdout if output filename is unspecified.\n\n"
            "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
@@ -66,6 +68,7 @@ int main(int argc, char **argv)
     struct fstReaderContext *xc;
     FILE *fv;
     int use_extensions = 0;
+    int unpack_threads = 1;
 
     WAVE_LOCALE_FIX
 
@@ -76,12 +79,13 @@ int main(int argc, char **argv)
         static struct option long_options[] = {{"extensions", 0, 0, 'e'},
                                                {"fstname", 1, 0, 'f'},
                                                {"output", 1, 0, 'o'},
+                                               {"threads", 1, 0, 't'},
                                                {"help", 0, 0, 'h'},
                                                {0, 0, 0, 0}};
 
-        c = getopt_long(argc, argv, "ef:o:h", long_options, &option_index);
+        c = getopt_long(argc, argv, "ef:o:t:h", long_options, &option_index);
 #else
-        c = getopt(argc, argv, "ef:o:h");
+        c = getopt(argc, argv, "ef:o:t:h");
 #endif
 
         if (c == -1)
@@ -106,6 +110,10 @@ int main(int argc, char **argv)
             strcpy(outname, optarg);
             break;
 
+        case 't':
+            unpack_threads = atoi(optarg);
+            break;
+
         case 'h':
             print_help(argv[0]);
             break;
@@ -166,6 +174,7 @@ int main(int argc, char **argv)
         exit(255);
     }
     fstReaderSetFacProcessMaskAll(xc);       /* these 3 lines do all the VCD writing work */
+    fstReaderSetUnpackThreads(xc, unpack_threads);
     fstReaderIterBlocks(xc, NULL, NULL, fv); /* these 3 lines do all the VCD writing work */
 
     fstReaderClose(xc);
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2012-2014 Tony Bybell.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "fst/fstapi.h"
+
+#if HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "wave_locale.h"
+
+static char **fac_names = NULL;
+static unsigned int *scope_idx = NULL;
+static uint32_t *fac_bits = NULL;
+
+static char **scope_names = NULL;
+static intptr_t *scope_parent = NULL;
+long allocated_scopes = 1;
+static intptr_t num_scopes = 0;
+
+static uint64_t begin_time = 0, end_time = 0;
+static int have_begin = 0, have_end = 0;
+static int by_scope = 0;
+static int num_bins = 0;
+static int num_threads = 0;
+
+struct activity_total
+{
+    uint64_t signals;
+    uint64_t bits;
+    uint64_t transitions;
+    uint64_t toggles;
+    uint64_t time_0, time_1, time_x;
+};
+
+static void strcpy_no_space(char *d, const char *s)
+{
+    while (*s) {
+        char ch = *(s++);
+        if (ch != ' ') {
+            *(d++) = ch;
+        }
+    }
+    *d = 0;
+}
+
+static void extractVarNames(void *xc)
+{
+    struct fstHier *h;
+    char *s;
+    const char *fst_scope_name = NULL;
+    int fst_scope_name_len = 0;
+    intptr_t snum = 0;
+
+    while ((h = fstReaderIterateHier(xc))) {
+        switch (h->htyp) {
+        case FST_HT_SCOPE:
+            if (num_scopes + 1 >= allocated_scopes) {
+                long new_allocated_scopes = allocated_scopes * 2;
+
+                scope_names = realloc(scope_names, new_allocated_scopes * sizeof(char *));
+                scope_parent = realloc(scope_parent, new_allocated_scopes * sizeof(intptr_t));
+                allocated_scopes = new_allocated_scopes;
+            }
+
+            scope_parent[num_scopes + 1] = snum;
+            snum = ++num_scopes;
+            fst_scope_name = fstReaderPushScope(xc, h->u.scope.name, (void *)(snum));
+            scope_names[snum] = strdup(fst_scope_name);
+            break;
+        case FST_HT_UPSCOPE:
+            fstReaderPopScope(xc);
+            fst_scope_name_len = fstReaderGetCurrentScopeLen(xc);
+            snum = fst_scope_name_len ? (intptr_t)fstReaderGetCurrentScopeUserInfo(xc) : 0;
+            break;
+        case FST_HT_VAR:
+            if (!h->u.var.is_alias) {
+                scope_idx[h->u.var.handle] = snum;
+                switch (h->u.var.typ) {
+                case FST_VT_VCD_REAL:
+                case FST_VT_VCD_REAL_PARAMETER:
+                case FST_VT_VCD_REALTIME:
+                case FST_VT_SV_SHORTREAL:
+                    fac_bits[h->u.var.handle] = 0; /* value changes only */
+                    break;
+                default:
+                    fac_bits[h->u.var.handle] = h->u.var.length;
+                    break;
+                }
+
+                s = fac_names[h->u.var.handle] = malloc(h->u.var.name_length + 1);
+                strcpy_no_space(s, h->u.var.name);
+            }
+        }
+    }
+}
+
+static void print_name(fstHandle pnt_facidx)
+{
+    if (scope_idx[pnt_facidx] && scope_names[scope_idx[pnt_facidx]]) {
+        printf("%s.%s", scope_names[scope_idx[pnt_facidx]], fac_names[pnt_facidx]);
+    } else {
+        printf("%s", fac_names[pnt_facidx]);
+    }
+}
+
+static double duty(uint64_t tim, uint64_t bits, uint64_t span)
+{
+    return ((bits && span) ? ((double)tim / ((double)bits * (double)span)) : 0.0);
+}
+
+static void print_total(struct activity_total *t, uint64_t span)
+{
+    printf(" %" PRIu64 " %" PRIu64 " %" PRIu64 " %.6f %.6f %.6f", t->bits, t->transitions, t->toggles,
+           duty(t->time_0, t->bits, span), duty(t->time_1, t->bits, span), duty(t->time_x, t->bits, span));
+}
+
+/* adds a signal's activity to its scope and every scope above it */
+static void add_to_scopes(struct activity_total *totals, fstHandle pnt_facidx, struct fstSignalActivity *act,
+                          int bin)
+{
+    intptr_t snum = scope_idx[pnt_facidx];
+
+    for (;;) {
+        struct activity_total *t = totals + (snum * (num_bins ? num_bins : 1)) + bin;
+
+        t->signals++;
+        t->bits += fac_bits[pnt_facidx];
+        t->transitions += act->transitions;
+        t->toggles += act->toggles;
+        t->time_0 += act->time_0;
+        t->time_1 += act->time_1;
+        t->time_x += act->time_x;
+
+        if (!snum)
+            break;
+        snum = scope_parent[snum];
+    }
+}
+
+int process_fst(char *fname)
+{
+    void *lt;
+    int i;
+
+    lt = fstReaderOpen(fname);
+    if (lt) {
+        int numfacs;
+        fstHandle maxhandle, h;
+        uint64_t t0, t1, span;
+        int nwin = num_bins ? num_bins : 1;
+        struct fstSignalActivity *act;
+        struct fstSignalActivity *binned = NULL;
+        struct activity_total *totals = NULL;
+        int rc = 0;
+
+        numfacs = fstReaderGetVarCount(lt) + 1;
+        maxhandle = fstReaderGetMaxHandle(lt);
+
+        fac_names = calloc(numfacs, sizeof(char *));
+        fac_bits = calloc(numfacs, sizeof(uint32_t));
+        scope_names = calloc(allocated_scopes, sizeof(char *));
+        scope_parent = calloc(allocated_scopes, sizeof(intptr_t));
+        scope_idx = calloc(numfacs, sizeof(unsigned int));
+
+        extractVarNames(lt);
+
+        t0 = have_begin ? begin_time : fstReaderGetStartTime(lt);
+        t1 = have_end ? end_time : (fstReaderGetEndTime(lt) + 1);
+        if (t1 < t0) {
+            t1 = t0;
+        }
+
+        /* the time in state is bounded by the dump */
+        span = ((t1 > fstReaderGetEndTime(lt)) ? fstReaderGetEndTime(lt) : t1);
+        span -= (span > t0) ? ((t0 > fstReaderGetStartTime(lt)) ? t0 : fstReaderGetStartTime(lt)) : span;
+
+        if (num_threads > 1) {
+            fstReaderSetUnpackThreads(lt, num_threads);
+        }
+        fstReaderSetFacProcessMaskAll(lt);
+
+        act = calloc(maxhandle, sizeof(struct fstSignalActivity));
+        if (num_bins) {
+            binned = calloc((size_t)maxhandle * num_bins, sizeof(struct fstSignalActivity));
+        }
+        if (by_scope) {
+            totals = calloc((size_t)(num_scopes + 1) * nwin, sizeof(struct activity_total));
+        }
+
+        for (i = 0; i < nwin; i++) {
+            uint64_t b0 = t0 + (uint64_t)((double)(t1 - t0) * i / nwin);
+            uint64_t b1 = (i == nwin - 1) ? t1 : (t0 + (uint64_t)((double)(t1 - t0) * (i + 1) / nwin));
+
+            if (!fstReaderGetActivity(lt, b0, b1, act)) {
+                fprintf(stderr, "fstReaderGetActivity failed, sections are out of time order\n");
+                rc = 255;
+                break;
+            }
+
+            for (h = 1; h <= maxhandle; h++) {
+                if (fac_names[h]) {
+                    if (totals) {
+                        add_to_scopes(totals, h, act + h - 1, i);
+                    }
+                    if (binned) {
+                        binned[(size_t)(h - 1) * num_bins + i] = act[h - 1];
+                    }
+                }
+            }
+        }
+
+        if (!rc) {
+            if (by_scope) {
+                intptr_t snum;
+
+                printf(num_bins ? "# scope signals toggles/bin...\n"
+                                : "# scope signals bits transitions toggles duty0 duty1 dutyx\n");
+                for (snum = 0; snum <= num_scopes; snum++) {
+                    struct activity_total *t = totals + snum * nwin;
+
+                    if (!t->signals)
+                        continue;
+
+                    printf("%s %" PRIu64, snum ? scope_names[snum] : "(root)", t->signals);
+                    if (num_bins) {
+                        for (i = 0; i < num_bins; i++) {
+                            printf(" %" PRIu64, t[i].toggles);
+                        }
+                    } else {
+                        print_total(t, span);
+                    }
+                    printf("\n");
+                }
+            } else {
+                printf(num_bins ? "# signal toggles/bin...\n"
+                                : "# signal bits transitions toggles duty0 duty1 dutyx\n");
+                for (h = 1; h <= maxhandle; h++) {
+                    if (!fac_names[h])
+                        continue;
+
+                    print_name(h);
+                    if (num_bins) {
+                        for (i = 0; i < num_bins; i++) {
+                            printf(" %" PRIu64, binned[(size_t)(h - 1) * num_bins + i].toggles);
+                        }
+                    } else {
+                        struct activity_total t;
+
+                        memset(&t, 0, sizeof(struct activity_total));
+                        t.bits = fac_bits[h];
+                        t.transitions = act[h - 1].transitions;
+                        t.toggles = act[h - 1].toggles;
+                        t.time_0 = act[h - 1].time_0;
+                        t.time_1 = act[h - 1].time_1;
+                        t.time_x = act[h - 1].time_x;
+                        print_total(&t, span);
+                    }
+                    printf("\n");
+                }
+            }
+        }
+
+        free(totals);
+        free(binned);
+        free(act);
+
+        for (i = 0; i <= num_scopes; i++) {
+            free(scope_names[i]);
+        }
+        free(scope_names);
+        free(scope_parent);
+        free(scope_idx);
+
+        for (i = 0; i < numfacs; i++) {
+            free(fac_names[i]);
+        }
+        free(fac_names);
+        free(fac_bits);
+
+        fstReaderClose(lt);
+        return (rc);
+    } else {
+        fprintf(stderr, "lt=fstReaderOpen failed\n");
+        return (255);
+    }
+}
+
+/*******************************************************************************/
+
+void print_help(char *nam)
+{
+#ifdef __linux__
+    printf("Usage: %s [OPTION]... [FSTFILE]\n\n"
+           "  -d, --dumpfile=FILE        specify FST input dumpfile\n"
+           "  -b, --begin=TIME           start of the window (default: start of dump)\n"
+           "  -e, --end=TIME             end of the window, exclusive (default: end of dump)\n"
+           "  -n, --bins=NUM             split the window into NUM bins of toggle counts\n"
+           "  -s, --scopes               sum each scope including the scopes below it\n"
+           "  -t, --threads=NUM          unpack sections with NUM threads\n"
+           "  -h, --help                 display this help then exit\n\n"
+           "Per signal value changes, 0/1 bit toggles and the fraction of bit time spent\n"
+           "at 0, 1 and anything else are emitted to stdout.\n\n"
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
+           nam);
+#else
+    printf("Usage: %s [OPTION]... [FSTFILE]\n\n"
+           "  -d                         specify FST input dumpfile\n"
+           "  -b                         start of the window (default: start of dump)\n"
+           "  -e                         end of the window, exclusive (default: end of dump)\n"
+           "  -n                         split the window into NUM bins of toggle counts\n"
+           "  -s                         sum each scope including the scopes below it\n"
+           "  -t                         unpack sections with NUM threads\n"
+           "  -h                         display this help then exit\n\n"
+           "Per signal value changes, 0/1 bit toggles and the fraction of bit time spent\n"
+           "at 0, 1 and anything else are emitted to stdout.\n\n"
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
+           nam);
+#endif
+
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    char opt_errors_encountered = 0;
+    char *lxname = NULL;
+    int c;
+    int rc;
+
+    WAVE_LOCALE_FIX
+
+    while (1) {
+#ifdef __linux__
+        int option_index = 0;
+
+        static struct option long_options[] = {{"dumpfile", 1, 0, 'd'}, {"begin", 1, 0, 'b'},   {"end", 1, 0, 'e'},
+                                               {"bins", 1, 0, 'n'},     {"scopes", 0, 0, 's'},  {"threads", 1, 0, 't'},
+                                               {"help", 0, 0, 'h'},     {0, 0, 0, 0}};
+
+        c = getopt_long(argc, argv, "d:b:e:n:st:h", long_options, &option_index);
+#else
+        c = getopt(argc, argv, "d:b:e:n:st:h");
+#endif
+
+        if (c == -1)
+            break; /* no more args */
+
+        switch (c) {
+        case 'b':
+            begin_time = strtoull(optarg, NULL, 10);
+            have_begin = 1;
+            break;
+
+        case 'e':
+            end_time = strtoull(optarg, NULL, 10);
+            have_end = 1;
+            break;
+
+        case 'n':
+            num_bins = atoi(optarg);
+            if (num_bins < 0)
+                num_bins = 0;
+            break;
+
+        case 's':
+            by_scope = 1;
+            break;
+
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+
+        case 'd':
+            if (lxname)
+                free(lxname);
+            lxname = malloc(strlen(optarg) + 1);
+            strcpy(lxname, optarg);
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            break;
+
+        case '?':
+            opt_errors_encountered = 1;
+            break;
+
+        default:
+            /* unreachable */
+            break;
+        }
+    }
+
+    if (opt_errors_encountered) {
+        print_help(argv[0]);
+    }
+
+    if (optind < argc) {
+        while (optind < argc) {
+            if (lxname) {
+                free(lxname);
+            }
+            lxname = malloc(strlen(argv[optind]) + 1);
+            strcpy(lxname, argv[optind++]);
+        }
+    }
+
+    if (!lxname) {
+        print_help(argv[0]);
+    }
+
+    rc = process_fst(lxname);
+    free(lxname);
+
+    return (rc);
+}
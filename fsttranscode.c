@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2012-2014 Tony Bybell.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fsttranscode.h"
+
+/*
+ * value changes travel from the reader to the writer thread in batches
+ * through a single producer/single consumer ring as in vcd2fst's pipeline
+ * mode: each side only advances its own index, the mutex/condvar pair is
+ * only for sleeping when the ring is full or empty.
+ */
+#define FSTX_PIPE_BATCH (1024 * 1024)
+#define FSTX_PIPE_SLOTS (8) /* power of two */
+
+enum fstx_pipe_op
+{
+    FSTX_PIPE_END,
+    FSTX_PIPE_TIME,
+    FSTX_PIPE_VALUE,
+    FSTX_PIPE_VARLEN,
+    FSTX_PIPE_DUMPACTIVE
+};
+
+struct fstx_pipe_rec
+{
+    uint32_t op;
+    fstHandle handle; /* or the dumpactive flag */
+    uint64_t arg;     /* payload length or the time */
+};
+
+struct fstx_pipe_batch
+{
+    unsigned char *mem;
+    size_t len;
+    size_t siz;
+};
+
+enum fstx_kind
+{
+    FSTX_KIND_BITS,
+    FSTX_KIND_REAL,
+    FSTX_KIND_STRING
+};
+
+struct fstx_var
+{
+    fstHandle handle; /* zero for aliases, their values arrive through the root */
+    uint32_t len;
+    unsigned char kind;
+};
+
+struct fstx_trans
+{
+    void *ctx;
+    uint32_t numfacs;
+    struct fstx_var *vars;
+
+    char **scopes; /* currently open scopes, outermost first */
+    int num_scopes;
+    int max_scopes;
+
+    uint64_t prev_time;
+    unsigned time_valid : 1;
+    unsigned blackout : 1;
+    unsigned backtrack_warning : 1;
+
+    struct fstx_pipe_batch batches[FSTX_PIPE_SLOTS];
+    unsigned int head; /* advanced by the reader only */
+    unsigned int tail; /* advanced by the writer thread only */
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void *fstx_realloc(void *ptr, size_t siz)
+{
+    void *pnt = realloc(ptr, siz);
+    if (!pnt) {
+        fprintf(stderr, "ERROR: Out of memory in realloc(), exiting!\n");
+        exit(255);
+    }
+
+    return (pnt);
+}
+
+/*********************************************************/
+/*** vvv hierarchy vvv                                 ***/
+/*********************************************************/
+
+/*
+ * moves the open scopes to those of a dotted name and returns its last
+ * component.  as with fv_output_hier(), nothing after a backslash escaped
+ * identifier starts is split.
+ */
+static const char *fstx_sync_scopes(struct fstx_trans *x, const char *name)
+{
+    const char *pnt = name, *pnt2 = name;
+    char esc = '.';
+    int depth = 0;
+
+    for (;;) {
+        size_t len;
+
+        while ((*pnt2 != esc) && (*pnt2)) {
+            if (*pnt2 == '\\') {
+                esc = 0;
+            }
+            pnt2++;
+        }
+
+        if (!*pnt2) {
+            break;
+        }
+
+        len = pnt2 - pnt;
+        if ((depth < x->num_scopes) && (!strncmp(x->scopes[depth], pnt, len)) && (!x->scopes[depth][len])) {
+            depth++;
+        } else {
+            while (x->num_scopes > depth) {
+                fstWriterSetUpscope(x->ctx);
+                free(x->scopes[--x->num_scopes]);
+            }
+
+            if (x->num_scopes == x->max_scopes) {
+                x->max_scopes = x->max_scopes ? (x->max_scopes * 2) : 16;
+                x->scopes = fstx_realloc(x->scopes, x->max_scopes * sizeof(char *));
+            }
+
+            x->scopes[x->num_scopes] = fstx_realloc(NULL, len + 1);
+            memcpy(x->scopes[x->num_scopes], pnt, len);
+            x->scopes[x->num_scopes][len] = 0;
+            fstWriterSetScope(x->ctx, FST_ST_VCD_MODULE, x->scopes[x->num_scopes], NULL);
+            x->num_scopes++;
+            depth++;
+        }
+
+        pnt = ++pnt2;
+    }
+
+    while (x->num_scopes > depth) {
+        fstWriterSetUpscope(x->ctx);
+        free(x->scopes[--x->num_scopes]);
+    }
+
+    return (pnt);
+}
+
+/*********************************************************/
+/*** vvv writer thread pipeline vvv                    ***/
+/*********************************************************/
+
+static void fstx_pipe_notify(struct fstx_trans *x)
+{
+    pthread_mutex_lock(&x->mutex);
+    pthread_cond_broadcast(&x->cond);
+    pthread_mutex_unlock(&x->mutex);
+}
+
+/* the reader waits for a free batch, the writer thread for a filled one */
+static void fstx_pipe_wait(struct fstx_trans *x, int producer)
+{
+    unsigned int head, tail;
+
+    for (;;) {
+        head = __atomic_load_n(&x->head, __ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&x->tail, __ATOMIC_ACQUIRE);
+        if (producer ? ((head - tail) < FSTX_PIPE_SLOTS) : (head != tail)) {
+            return;
+        }
+
+        pthread_mutex_lock(&x->mutex);
+        head = __atomic_load_n(&x->head, __ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&x->tail, __ATOMIC_ACQUIRE);
+        if (producer ? ((head - tail) >= FSTX_PIPE_SLOTS) : (head == tail)) {
+            pthread_cond_wait(&x->cond, &x->mutex);
+        }
+        pthread_mutex_unlock(&x->mutex);
+    }
+}
+
+static void *fstx_pipe_writer(void *arg)
+{
+    struct fstx_trans *x = (struct fstx_trans *)arg;
+    int done = 0;
+
+    while (!done) {
+        struct fstx_pipe_batch *b;
+        unsigned char *pnt, *end;
+
+        fstx_pipe_wait(x, 0);
+        b = x->batches + (x->tail & (FSTX_PIPE_SLOTS - 1));
+        pnt = b->mem;
+        end = b->mem + b->len;
+
+        while (pnt < end) {
+            struct fstx_pipe_rec *rec = (struct fstx_pipe_rec *)pnt;
+            unsigned char *payload = pnt + sizeof(struct fstx_pipe_rec);
+
+            switch (rec->op) {
+            case FSTX_PIPE_TIME:
+                fstWriterEmitTimeChange(x->ctx, rec->arg);
+                break;
+            case FSTX_PIPE_VALUE:
+                fstWriterEmitValueChange(x->ctx, rec->handle, payload);
+                pnt += (rec->arg + 7) & ~(uint64_t)7;
+                break;
+            case FSTX_PIPE_VARLEN:
+                fstWriterEmitVariableLengthValueChange(x->ctx, rec->handle, payload, rec->arg);
+                pnt += (rec->arg + 7) & ~(uint64_t)7;
+                break;
+            case FSTX_PIPE_DUMPACTIVE:
+                fstWriterEmitDumpActive(x->ctx, rec->handle);
+                break;
+            default:
+                done = 1;
+                break;
+            }
+
+            pnt += sizeof(struct fstx_pipe_rec);
+        }
+
+        __atomic_store_n(&x->tail, x->tail + 1, __ATOMIC_RELEASE);
+        fstx_pipe_notify(x);
+    }
+
+    return (NULL);
+}
+
+/* hand the batch being filled to the writer thread and claim the next free one */
+static void fstx_pipe_push(struct fstx_trans *x)
+{
+    __atomic_store_n(&x->head, x->head + 1, __ATOMIC_RELEASE);
+    fstx_pipe_notify(x);
+    fstx_pipe_wait(x, 1);
+    x->batches[x->head & (FSTX_PIPE_SLOTS - 1)].len = 0;
+}
+
+static unsigned char *fstx_pipe_append(struct fstx_trans *x, uint32_t op, fstHandle handle, uint64_t arg,
+                                       size_t payload)
+{
+    struct fstx_pipe_batch *b = x->batches + (x->head & (FSTX_PIPE_SLOTS - 1));
+    size_t siz = sizeof(struct fstx_pipe_rec) + ((payload + 7) & ~(size_t)7); /* keep records 8 byte aligned */
+    struct fstx_pipe_rec *rec;
+
+    if (b->len + siz > b->siz) {
+        if (b->len) {
+            fstx_pipe_push(x);
+            b = x->batches + (x->head & (FSTX_PIPE_SLOTS - 1));
+        }
+        if (siz > b->siz) {
+            b->siz = siz;
+            b->mem = fstx_realloc(b->mem, b->siz);
+        }
+    }
+
+    rec = (struct fstx_pipe_rec *)(b->mem + b->len);
+    rec->op = op;
+    rec->handle = handle;
+    rec->arg = arg;
+    b->len += siz;
+
+    return ((unsigned char *)(rec + 1));
+}
+
+/*********************************************************/
+/*** vvv api vvv                                       ***/
+/*********************************************************/
+
+struct fstx_trans *fstx_create(void *ctx, uint32_t numfacs)
+{
+    struct fstx_trans *x = calloc(1, sizeof(struct fstx_trans));
+
+    x->ctx = ctx;
+    x->numfacs = numfacs;
+    x->vars = calloc(numfacs ? numfacs : 1, sizeof(struct fstx_var));
+
+    return (x);
+}
+
+void fstx_add_var(struct fstx_trans *x, uint32_t facidx, uint32_t rootidx, enum fstVarType vt, enum fstVarDir vd,
+                  uint32_t len, const char *name)
+{
+    const char *leaf;
+    struct fstx_var *v;
+
+    if (facidx >= x->numfacs) {
+        return;
+    }
+
+    leaf = fstx_sync_scopes(x, name);
+    v = x->vars + facidx;
+
+    if ((rootidx != facidx) && (rootidx < x->numfacs) && (x->vars[rootidx].handle)) {
+        struct fstx_var *r = x->vars + rootidx;
+
+        /* the values are the root's, so a real or string alias must be declared as one */
+        if (r->kind == FSTX_KIND_REAL) {
+            vt = FST_VT_VCD_REAL;
+        } else if (r->kind == FSTX_KIND_STRING) {
+            vt = FST_VT_GEN_STRING;
+        } else if ((vt == FST_VT_VCD_REAL) || (vt == FST_VT_GEN_STRING)) {
+            vt = FST_VT_VCD_WIRE;
+        }
+        fstWriterCreateVar(x->ctx, vt, vd, r->len, leaf, r->handle);
+        return;
+    }
+
+    v->handle = fstWriterCreateVar(x->ctx, vt, vd, len, leaf, 0);
+    v->len = len;
+    switch (vt) {
+    case FST_VT_VCD_REAL:
+        v->kind = FSTX_KIND_REAL;
+        break;
+    case FST_VT_GEN_STRING:
+        v->kind = FSTX_KIND_STRING;
+        break;
+    default:
+        v->kind = FSTX_KIND_BITS;
+        break;
+    }
+}
+
+void fstx_begin(struct fstx_trans *x)
+{
+    int i;
+
+    fstx_sync_scopes(x, "");
+    free(x->scopes);
+    x->scopes = NULL;
+    x->max_scopes = 0;
+
+    for (i = 0; i < FSTX_PIPE_SLOTS; i++) {
+        x->batches[i].siz = FSTX_PIPE_BATCH;
+        x->batches[i].mem = fstx_realloc(NULL, FSTX_PIPE_BATCH);
+    }
+
+    pthread_mutex_init(&x->mutex, NULL);
+    pthread_cond_init(&x->cond, NULL);
+    if (pthread_create(&x->thread, NULL, fstx_pipe_writer, x)) {
+        fprintf(stderr, "ERROR: Could not create writer thread, exiting!\n");
+        exit(255);
+    }
+}
+
+/* times earlier than the last one are dropped as in vcd2fst, their values land on the current time */
+void fstx_change(struct fstx_trans *x, uint64_t tim, uint32_t facidx, const char *value)
+{
+    struct fstx_var *v;
+    unsigned char *pnt;
+    size_t len;
+
+    if ((facidx >= x->numfacs) || (!x->vars[facidx].handle)) {
+        return;
+    }
+    v = x->vars + facidx;
+
+    if ((!x->time_valid) || (tim > x->prev_time)) {
+        fstx_pipe_append(x, FSTX_PIPE_TIME, 0, tim, 0);
+        x->prev_time = tim;
+        x->time_valid = 1;
+    } else if ((tim < x->prev_time) && (!x->backtrack_warning)) {
+        x->backtrack_warning = 1;
+        fprintf(stderr, "Time backtracking encountered: values are moved forward to the latest time.\n");
+    }
+
+    if (!value[0]) {
+        if (!x->blackout) {
+            x->blackout = 1;
+            fstx_pipe_append(x, FSTX_PIPE_DUMPACTIVE, 0, 0, 0);
+        }
+        return;
+    }
+
+    if (x->blackout) {
+        x->blackout = 0;
+        fstx_pipe_append(x, FSTX_PIPE_DUMPACTIVE, 1, 0, 0);
+    }
+
+    switch (v->kind) {
+    case FSTX_KIND_REAL: {
+        double d = strtod(value, NULL);
+
+        pnt = fstx_pipe_append(x, FSTX_PIPE_VALUE, v->handle, sizeof(double), sizeof(double));
+        memcpy(pnt, &d, sizeof(double));
+        break;
+    }
+
+    case FSTX_KIND_STRING:
+        len = strlen(value);
+        pnt = fstx_pipe_append(x, FSTX_PIPE_VARLEN, v->handle, len, len);
+        memcpy(pnt, value, len);
+        break;
+
+    default:
+        pnt = fstx_pipe_append(x, FSTX_PIPE_VALUE, v->handle, v->len, v->len);
+        memcpy(pnt, value, v->len); /* the readers always expand vectors to their full width */
+        break;
+    }
+}
+
+void fstx_finish(struct fstx_trans *x, uint64_t end_time)
+{
+    int i;
+
+    if ((!x->time_valid) || (end_time > x->prev_time)) {
+        fstx_pipe_append(x, FSTX_PIPE_TIME, 0, end_time, 0);
+    }
+
+    fstx_pipe_append(x, FSTX_PIPE_END, 0, 0, 0);
+    __atomic_store_n(&x->head, x->head + 1, __ATOMIC_RELEASE);
+    fstx_pipe_notify(x);
+    pthread_join(x->thread, NULL);
+
+    pthread_cond_destroy(&x->cond);
+    pthread_mutex_destroy(&x->mutex);
+    for (i = 0; i < FSTX_PIPE_SLOTS; i++) {
+        free(x->batches[i].mem);
+    }
+    free(x->vars);
+    free(x);
+}
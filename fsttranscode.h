@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2012-2014 Tony Bybell.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FST_TRANSCODE_H
+#define FST_TRANSCODE_H
+
+#include "fst/fstapi.h"
+
+/*
+ * common back end for the lxt2fst/vzt2fst transcoders: facilities are
+ * declared by index with dotted hierarchical names, then the value changes
+ * handed over from the reader's iter_blocks callback are replayed into the
+ * fstWriter on a separate thread.
+ */
+struct fstx_trans;
+
+struct fstx_trans *fstx_create(void *ctx, uint32_t numfacs);
+void fstx_add_var(struct fstx_trans *x, uint32_t facidx, uint32_t rootidx, enum fstVarType vt, enum fstVarDir vd,
+                  uint32_t len, const char *name); /* rootidx != facidx declares an alias of an earlier facidx */
+void fstx_begin(struct fstx_trans *x);             /* after the last fstx_add_var(), starts the writer thread */
+void fstx_change(struct fstx_trans *x, uint64_t tim, uint32_t facidx, const char *value); /* "" is a blackout */
+void fstx_finish(struct fstx_trans *x, uint64_t end_time); /* drains the writer thread and frees x, ctx stays open */
+
+#endif
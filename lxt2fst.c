@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2003-2014 Tony Bybell.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <config.h>
+#include "lxt2_read.h"
+#include "fsttranscode.h"
+
+#if HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "wave_locale.h"
+
+int pack_type = FST_WR_PT_LZ4; /* set to fstWriterPackType */
+int repack_all = 0;            /* 0 is normal, 1 does the repack (via fstapi) at end, 2 repacks in seekable chunks */
+int parallel_mode = 1;         /* the writer flushes sections on its own thread unless -s is given */
+int pack_threads = 1;          /* number of threads used to compress value changes */
+
+/*
+ * the reader runs lxt2_rd_iter_blocks() on the main thread, the fstWriter
+ * is driven from the transcoder's own thread
+ */
+static void fst_callback(struct lxt2_rd_trace **lt, lxtint64_t *pnt_time, lxtint32_t *pnt_facidx, char **pnt_value)
+{
+    fstx_change((struct fstx_trans *)lxt2_rd_get_user_callback_data_pointer(*lt), *pnt_time, *pnt_facidx,
+                *pnt_value);
+}
+
+static void declare_fac(struct fstx_trans *x, struct lxt2_rd_trace *lt, lxtint32_t i, char *buf)
+{
+    struct lxt2_rd_geometry *g = lxt2_rd_get_fac_geometry(lt, i);
+    char *netname = lxt2_rd_get_facname(lt, i);
+    lxtint32_t root = lxt2_rd_get_alias_root(lt, i);
+    lxtint32_t kind = lxt2_rd_get_fac_flags(lt, root) & (LXT2_RD_SYM_F_DOUBLE | LXT2_RD_SYM_F_STRING);
+    lxtint32_t flags = g->flags | kind; /* an alias follows its root's kind */
+    enum fstVarType vt = (g->flags & LXT2_RD_SYM_F_REG) ? FST_VT_VCD_REG : FST_VT_VCD_WIRE;
+    enum fstVarDir vd = FST_VD_IMPLICIT;
+    uint32_t len = g->len;
+
+    if (g->flags & LXT2_RD_SYM_F_IN) {
+        vd = FST_VD_INPUT;
+    } else if (g->flags & LXT2_RD_SYM_F_OUT) {
+        vd = FST_VD_OUTPUT;
+    } else if (g->flags & LXT2_RD_SYM_F_INOUT) {
+        vd = FST_VD_INOUT;
+    }
+
+    if (flags & LXT2_RD_SYM_F_DOUBLE) {
+        vt = FST_VT_VCD_REAL;
+        len = 8;
+        strcpy(buf, netname);
+    } else if (flags & LXT2_RD_SYM_F_STRING) {
+        vt = FST_VT_GEN_STRING;
+        len = 0;
+        strcpy(buf, netname);
+    } else if (g->flags & LXT2_RD_SYM_F_INTEGER) {
+        vt = FST_VT_VCD_INTEGER;
+        strcpy(buf, netname);
+    } else if (g->len == 1) {
+        if (g->msb != -1) {
+            sprintf(buf, "%s [" LXT2_RD_LD "]", netname, g->msb);
+        } else {
+            strcpy(buf, netname);
+        }
+    } else {
+        sprintf(buf, "%s [" LXT2_RD_LD ":" LXT2_RD_LD "]", netname, g->msb, g->lsb);
+    }
+
+    fstx_add_var(x, i, root, vt, vd, len, buf);
+}
+
+int process_lxt(char *fname, char *fstname)
+{
+    struct lxt2_rd_trace *lt;
+    struct fstx_trans *x;
+    void *ctx;
+    lxtint32_t numfacs, i;
+    lxtsint64_t timezero;
+    char *buf;
+    size_t buf_siz = 0;
+
+    lt = lxt2_rd_init(fname);
+    if (!lt) {
+        fprintf(stderr, "lxt2_rd_init failed\n");
+        return (255);
+    }
+
+    ctx = fstWriterCreate(fstname, 1);
+    if (!ctx) {
+        fprintf(stderr, "Could not open '%s', exiting.\n", fstname);
+        lxt2_rd_close(lt);
+        return (255);
+    }
+
+    fstWriterSetPackType(ctx, pack_type);
+    fstWriterSetRepackOnClose(ctx, repack_all);
+    fstWriterSetParallelMode(ctx, parallel_mode);
+    fstWriterSetPackThreads(ctx, pack_threads);
+    fstWriterSetVersion(ctx, "lxt2fst");
+    fstWriterSetTimescale(ctx, (signed char)lxt2_rd_get_timescale(lt));
+    timezero = lxt2_rd_get_timezero(lt);
+    if (timezero) {
+        fstWriterSetTimezero(ctx, timezero);
+    }
+
+    numfacs = lxt2_rd_get_num_facs(lt);
+    lxt2_rd_set_fac_process_mask_all(lt);
+    lxt2_rd_set_max_block_mem_usage(lt, 0); /* no need to cache blocks */
+
+    for (i = 0; i < numfacs; i++) {
+        size_t siz = strlen(lxt2_rd_get_facname(lt, i)) + 32; /* room for the bit range */
+        if (siz > buf_siz) {
+            buf_siz = siz;
+        }
+    }
+    buf = malloc(buf_siz ? buf_siz : 1);
+
+    x = fstx_create(ctx, numfacs);
+    for (i = 0; i < numfacs; i++) {
+        declare_fac(x, lt, i, buf);
+    }
+    free(buf);
+
+    fstx_begin(x);
+    lxt2_rd_iter_blocks(lt, fst_callback, x);
+    fstx_finish(x, lxt2_rd_get_end_time(lt));
+
+    fstWriterClose(ctx);
+    lxt2_rd_close(lt);
+
+    return (0);
+}
+
+/*******************************************************************************/
+
+void print_help(char *nam)
+{
+#ifdef __linux__
+    printf("Usage: %s [OPTION]... [LXT2FILE] [FSTFILE]\n\n"
+           "  -l, --lxtname=FILE         specify LXT2 input filename\n"
+           "  -f, --fstname=FILE         specify FST output filename\n"
+           "  -4, --fourpack             use lz4 algorithm for speed (default)\n"
+           "  -F, --fastpack             use fastlz algorithm for speed\n"
+           "  -Z, --zlibpack             use zlib algorithm for size\n"
+           "  -c, --compress             zlib compress entire file on close\n"
+           "  -C, --chunked              as -c, but in chunks readers can inflate on demand\n"
+           "  -s, --serial               flush sections on the writer thread itself\n"
+           "  -t, --threads=NUM          compress value changes and -C chunks with NUM threads\n"
+           "  -h, --help                 display this help then exit\n\n"
+
+           "Note that LXT2FILE and FSTFILE are optional provided the\n"
+           "--lxtname and --fstname options are specified.\n\n"
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
+           nam);
+#else
+    printf("Usage: %s [OPTION]... [LXT2FILE] [FSTFILE]\n\n"
+           "  -l FILE                    specify LXT2 input filename\n"
+           "  -f FILE                    specify FST output filename\n"
+           "  -4                         use lz4 algorithm for speed (default)\n"
+           "  -F                         use fastlz algorithm for speed\n"
+           "  -Z                         use zlib algorithm for size\n"
+           "  -c                         zlib compress entire file on close\n"
+           "  -C                         as -c, but in chunks readers can inflate on demand\n"
+           "  -s                         flush sections on the writer thread itself\n"
+           "  -t NUM                     compress value changes and -C chunks with NUM threads\n"
+           "  -h                         display this help then exit\n\n"
+
+           "Note that LXT2FILE and FSTFILE are optional provided the\n"
+           "--lxtname and --fstname options are specified.\n\n"
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n",
+           nam);
+#endif
+
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    char opt_errors_encountered = 0;
+    char *lxname = NULL;
+    char *fstname = NULL;
+    int c;
+    int rc;
+
+    WAVE_LOCALE_FIX
+
+    while (1) {
+#ifdef __linux__
+        int option_index = 0;
+
+        static struct option long_options[] = {
+                {"lxtname", 1, 0, 'l'},  {"fstname", 1, 0, 'f'},  {"fastpack", 0, 0, 'F'},
+                {"fourpack", 0, 0, '4'}, {"zlibpack", 0, 0, 'Z'}, {"compress", 0, 0, 'c'},
+                {"chunked", 0, 0, 'C'},  {"serial", 0, 0, 's'},   {"threads", 1, 0, 't'},
+                {"help", 0, 0, 'h'},     {0, 0, 0, 0}};
+
+        c = getopt_long(argc, argv, "l:f:ZF4cCst:h", long_options, &option_index);
+#else
+        c = getopt(argc, argv, "l:f:ZF4cCst:h");
+#endif
+
+        if (c == -1)
+            break; /* no more args */
+
+        switch (c) {
+        case 'l':
+            if (lxname)
+                free(lxname);
+            lxname = malloc(strlen(optarg) + 1);
+            strcpy(lxname, optarg);
+            break;
+
+        case 'f':
+            if (fstname)
+                free(fstname);
+            fstname = malloc(strlen(optarg) + 1);
+            strcpy(fstname, optarg);
+            break;
+
+        case 'Z':
+            pack_type = FST_WR_PT_ZLIB;
+            break;
+
+        case 'F':
+            pack_type = FST_WR_PT_FASTLZ;
+            break;
+
+        case '4':
+            pack_type = FST_WR_PT_LZ4;
+            break;
+
+        case 'c':
+            repack_all = 1;
+            break;
+
+        case 'C':
+            repack_all = 2;
+            break;
+
+        case 's':
+            parallel_mode = 0;
+            break;
+
+        case 't':
+            pack_threads = atoi(optarg);
+            break;
+
+        case 'h':
+            print_help(argv[0]);
+            break;
+
+        case '?':
+            opt_errors_encountered = 1;
+            break;
+
+        default:
+            /* unreachable */
+            break;
+        }
+    }
+
+    if (opt_errors_encountered) {
+        print_help(argv[0]);
+    }
+
+    if (optind < argc) {
+        while (optind < argc) {
+            if (!lxname) {
+                lxname = malloc(strlen(argv[optind]) + 1);
+                strcpy(lxname, argv[optind++]);
+            } else if (!fstname) {
+                fstname = malloc(strlen(argv[optind]) + 1);
+                strcpy(fstname, argv[optind++]);
+            } else {
+                break;
+            }
+        }
+    }
+
+    if ((!lxname) || (!fstname)) {
+        print_help(argv[0]);
+    }
+
+    rc = process_lxt(lxname, fstname);
+
+    free(lxname);
+    free(fstname);
+
+    return (rc);
+}
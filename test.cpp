@@ -1,6 +1,8 @@
 #include "fst/fstapi.h"
 #include <algorithm>
+#include <cstring>
 #include <map>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -13,6 +15,123 @@ struct FstVar
     int width;
 };
 
+// Samples of one signal kept column-wise: a sorted time array plus a value
+// arena.  Scalar signals pack a 4-bit state code per sample, fixed width
+// values are stored back to back, and only signals whose value length varies
+// (strings, reals) pay for a per-sample offset.
+class FstSignalData
+{
+  public:
+    FstSignalData() : mode(Empty), width(0) {}
+
+    void push(uint64_t time, const char *value, size_t len, bool is_scalar);
+    size_t size() const { return times.size(); }
+    uint64_t timeAt(size_t index) const { return times[index]; }
+    std::string valueAt(size_t index) const;
+    int scalarAt(size_t index) const;
+    size_t indexAt(uint64_t time) const;
+
+  private:
+    enum Mode { Empty, Scalar, Fixed, Variable };
+
+    void toFixed();
+    void toVariable();
+
+    Mode mode;
+    size_t width;
+    std::vector<uint64_t> times;
+    std::vector<unsigned char> arena;
+    std::vector<uint64_t> offsets; // Variable only, one more entry than samples
+};
+
+static const char scalar_states[] = "01xzhuwl-";
+
+void FstSignalData::push(uint64_t time, const char *value, size_t len, bool is_scalar)
+{
+    if (mode == Empty) {
+        mode = is_scalar ? Scalar : Fixed;
+        width = len;
+    }
+    if (mode == Scalar) {
+        const char *state = (len == 1 && value[0]) ? strchr(scalar_states, value[0]) : nullptr;
+        if (state) {
+            size_t i = times.size();
+            if (!(i & 1))
+                arena.push_back(0);
+            arena.back() |= (unsigned char)((state - scalar_states) << ((i & 1) * 4));
+            times.push_back(time);
+            return;
+        }
+        toFixed();
+    }
+    if (mode == Fixed && len != width)
+        toVariable();
+    arena.insert(arena.end(), value, value + len);
+    if (mode == Variable)
+        offsets.push_back(arena.size());
+    times.push_back(time);
+}
+
+void FstSignalData::toFixed()
+{
+    std::vector<unsigned char> chars(times.size());
+    for (size_t i = 0; i < times.size(); i++)
+        chars[i] = scalar_states[scalarAt(i)];
+    arena.swap(chars);
+    mode = Fixed;
+    width = 1;
+}
+
+void FstSignalData::toVariable()
+{
+    offsets.resize(times.size() + 1);
+    for (size_t i = 0; i <= times.size(); i++)
+        offsets[i] = i * width;
+    mode = Variable;
+}
+
+// state code of a single character sample, -1 for anything else
+int FstSignalData::scalarAt(size_t index) const
+{
+    const char *state = nullptr;
+    switch (mode) {
+        case Scalar:
+            return (arena[index >> 1] >> ((index & 1) * 4)) & 15;
+        case Fixed:
+            if (width == 1 && arena[index])
+                state = strchr(scalar_states, arena[index]);
+            break;
+        case Variable:
+            if (offsets[index + 1] - offsets[index] == 1 && arena[offsets[index]])
+                state = strchr(scalar_states, arena[offsets[index]]);
+            break;
+        default:
+            break;
+    }
+    return state ? (int)(state - scalar_states) : -1;
+}
+
+std::string FstSignalData::valueAt(size_t index) const
+{
+    switch (mode) {
+        case Scalar:
+            return std::string(1, scalar_states[scalarAt(index)]);
+        case Fixed:
+            return std::string((const char *)arena.data() + index * width, width);
+        case Variable:
+            return std::string((const char *)arena.data() + offsets[index], offsets[index + 1] - offsets[index]);
+        default:
+            throw std::out_of_range("no samples");
+    }
+}
+
+// last sample at or before time, or the first one if all are later
+size_t FstSignalData::indexAt(uint64_t time) const
+{
+    size_t index = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+    return index ? index - 1 : 0;
+}
+
 class FstData
 {
   public:
@@ -24,16 +143,13 @@ class FstData
 
     std::vector<FstVar>& getVars() { return vars; };
 
-    void reconstruct_callback(uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen);
     void reconstruct(std::vector<fstHandle> &signal);
     void reconstuctAll();
 
-    void reconstruct_callback_attimes(uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen);
     void reconstructAtTimes(std::vector<fstHandle> &signal,std::vector<uint64_t> time);
 
     std::string valueAt(fstHandle signal, uint64_t time);
     std::vector<uint64_t> edges(fstHandle signal, bool positive, bool negative);
-    void recalc_time_offsets(fstHandle signal, std::vector<uint64_t> time);
   private:
     void extractVarNames();
 
@@ -41,12 +157,12 @@ class FstData
     std::vector<std::string> scopes;
     std::vector<FstVar> vars;
     std::map<fstHandle, FstVar> handle_to_var;
-    std::map<fstHandle, std::vector<std::pair<uint64_t, std::string>>> handle_to_data;
-    std::map<fstHandle, std::map<uint64_t, size_t>> time_to_index;
-    std::map<fstHandle, std::map<size_t, uint64_t>> index_to_time;
-    std::vector<uint64_t> sample_times;
-    size_t sample_times_ndx;
-    std::map<fstHandle, std::string> current;
+    std::vector<bool> handle_is_scalar;
+    std::vector<FstSignalData> handle_to_data;
+
+    void clearData();
+    void pushSample(fstHandle handle, uint64_t time, const char *value, size_t len);
+    void reconstructFromCursor();
 };
 
 FstData::FstData(std::string filename) : ctx(nullptr)
@@ -76,6 +192,7 @@ void FstData::extractVarNames()
     struct fstHier *h;
     intptr_t snum = 0;
 
+    handle_is_scalar.assign(fstReaderGetMaxHandle(ctx) + 1, false);
     while (h = fstReaderIterateHier(ctx)) {
         switch (h->htyp) {
             case FST_HT_SCOPE: {
@@ -97,107 +214,74 @@ void FstData::extractVarNames()
                 var.scope = scopes.back();
                 var.width = h->u.var.length;
                 vars.push_back(var);
-                if (!var.is_alias)
+                if (!var.is_alias) {
                     handle_to_var[h->u.var.handle] = var;
+                    handle_is_scalar[h->u.var.handle] = (var.width == 1);
+                }
                 break;
             }
         }
     }
 }
 
-static void reconstruct_clb_varlen(void *user_data, uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen)
+void FstData::clearData()
 {
-    FstData *ptr = (FstData*)user_data;
-    ptr->reconstruct_callback(pnt_time, pnt_facidx, pnt_value, plen);
+    handle_to_data.clear();
+    handle_to_data.resize(fstReaderGetMaxHandle(ctx) + 1);
 }
 
-static void reconstruct_clb(void *user_data, uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value)
+void FstData::pushSample(fstHandle handle, uint64_t time, const char *value, size_t len)
 {
-    FstData *ptr = (FstData*)user_data;
-    uint32_t plen = (pnt_value) ?  strlen((const char *)pnt_value) : 0;
-    ptr->reconstruct_callback(pnt_time, pnt_facidx, pnt_value, plen);
+    handle_to_data[handle].push(time, value, len, handle_is_scalar[handle]);
 }
 
-void FstData::reconstruct_callback(uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen)
+// walks the selected signals in batches
+void FstData::reconstructFromCursor()
 {
-    handle_to_data[pnt_facidx].push_back(std::make_pair(pnt_time, std::string((const char *)pnt_value)));
-    size_t index = handle_to_data[pnt_facidx].size() - 1;
-    time_to_index[pnt_facidx][pnt_time] = index;
-    index_to_time[pnt_facidx][index] = pnt_time;
+    std::vector<fstReaderValueChange> batch(4096);
+    void *cursor = fstReaderCursorOpen(ctx);
+    uint32_t n;
+    while ((n = fstReaderCursorNext(cursor, batch.data(), batch.size()))) {
+        for (uint32_t i = 0; i < n; i++) {
+            const fstReaderValueChange &vc = batch[i];
+            pushSample(vc.handle, vc.time, (const char *)vc.value, vc.len);
+        }
+    }
+    fstReaderCursorClose(cursor);
 }
 
 void FstData::reconstruct(std::vector<fstHandle> &signal)
 {
-    handle_to_data.clear();
-    time_to_index.clear();
-    index_to_time.clear();
+    clearData();
     fstReaderClrFacProcessMaskAll(ctx);
     for(const auto sig : signal)
         fstReaderSetFacProcessMask(ctx,sig);
-    fstReaderIterBlocks2(ctx, reconstruct_clb, reconstruct_clb_varlen, this, nullptr);
+    reconstructFromCursor();
 }
 
 void FstData::reconstuctAll()
 {
-    handle_to_data.clear();
-    time_to_index.clear();
-    index_to_time.clear();
+    clearData();
     fstReaderSetFacProcessMaskAll(ctx);
-    fstReaderIterBlocks2(ctx, reconstruct_clb, reconstruct_clb_varlen, this, nullptr);
-}
-
-static void reconstruct_clb_varlen_attimes(void *user_data, uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen)
-{
-    FstData *ptr = (FstData*)user_data;
-    ptr->reconstruct_callback_attimes(pnt_time, pnt_facidx, pnt_value, plen);
-}
-
-static void reconstruct_clb_attimes(void *user_data, uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value)
-{
-    FstData *ptr = (FstData*)user_data;
-    uint32_t plen = (pnt_value) ?  strlen((const char *)pnt_value) : 0;
-    ptr->reconstruct_callback_attimes(pnt_time, pnt_facidx, pnt_value, plen);
-}
-
-void FstData::reconstruct_callback_attimes(uint64_t pnt_time, fstHandle pnt_facidx, const unsigned char *pnt_value, uint32_t plen)
-{
-    if (sample_times_ndx > sample_times.size()) return;
-    uint64_t time = sample_times[sample_times_ndx];
-    // if we are past the timestamp
-    if (pnt_time > time) {
-        for (auto const& c : current)
-        {
-            handle_to_data[c.first].push_back(std::make_pair(time,c.second));
-            size_t index = handle_to_data[c.first].size() - 1;
-            time_to_index[c.first][time] = index;
-            index_to_time[c.first][index] = time;
-        }
-        sample_times_ndx++;
-    }
-    // always update current
-    current[pnt_facidx] =  std::string((const char *)pnt_value);
+    reconstructFromCursor();
 }
 
+// samples every signal at every (sorted) time in one pass over the sections involved
 void FstData::reconstructAtTimes(std::vector<fstHandle> &signal, std::vector<uint64_t> time)
 {
-    handle_to_data.clear();
-    time_to_index.clear();
-    index_to_time.clear();
-    current.clear();
-    sample_times_ndx = 0;
-    sample_times = time;
-    fstReaderClrFacProcessMaskAll(ctx);
+    clearData();
+    uint32_t stride = 32;
     for(const auto sig : signal)
-        fstReaderSetFacProcessMask(ctx,sig);
-    fstReaderIterBlocks2(ctx, reconstruct_clb_attimes, reconstruct_clb_varlen_attimes, this, nullptr);
-
-    if (time_to_index[signal.back()].count(time.back())==0) {
-        for (auto const& c : current)
-        {
-            handle_to_data[c.first].push_back(std::make_pair(time.back(),c.second));
-            size_t index = handle_to_data[c.first].size() - 1;
-            time_to_index[c.first][time.back()] = index;
-            index_to_time[c.first][index] = time.back();
+        if (handle_to_var.count(sig))
+            stride = std::max(stride, (uint32_t)handle_to_var[sig].width + 1);
+    std::vector<char> out(signal.size() * time.size() * stride);
+    if (!fstReaderGetValuesFromHandlesAtTimes(ctx, signal.size(), signal.data(), time.size(), time.data(), out.data(), stride))
+        return;
+    for (size_t t = 0; t < time.size(); t++) {
+        for (size_t j = 0; j < signal.size(); j++) {
+            const char *cell = &out[(t * signal.size() + j) * stride];
+            if (*cell)
+                pushSample(signal[j], time[t], cell, strlen(cell));
         }
     }
 }
@@ -205,53 +289,27 @@ void FstData::reconstructAtTimes(std::vector<fstHandle> &signal, std::vector<uin
 std::string FstData::valueAt(fstHandle signal, uint64_t time)
 {
     // TODO: Check if signal exist
-    auto &data = handle_to_data[signal];
-    if (time_to_index[signal].count(time)!=0) {
-        size_t index = time_to_index[signal][time];
-        return data.at(index).second;
-    } else {
-        size_t index = 0;
-        for(size_t i = 0; i< data.size(); i++) {
-            uint64_t t = index_to_time[signal][i];
-            if (t > time) 
-                break;
-            index = i;
-        }
-        return data.at(index).second;
-    }
+    auto &data = handle_to_data.at(signal);
+    return data.valueAt(data.indexAt(time));
 }
 
 std::vector<uint64_t> FstData::edges(fstHandle signal, bool positive, bool negative)
 {
     // TODO: Check if signal exist
-    auto &data = handle_to_data[signal];
-    std::string prev = "x";
+    auto &data = handle_to_data.at(signal);
+    int prev = 2; // x
     std::vector<uint64_t> retVal;
-    for(auto &d : data) {
-        if (positive && prev=="0" && d.second=="1")
-            retVal.push_back(d.first);
-        if (negative && prev=="1" && d.second=="0")
-            retVal.push_back(d.first);
-        prev = d.second;
+    for(size_t i = 0; i < data.size(); i++) {
+        int curr = data.scalarAt(i);
+        if (positive && prev==0 && curr==1)
+            retVal.push_back(data.timeAt(i));
+        if (negative && prev==1 && curr==0)
+            retVal.push_back(data.timeAt(i));
+        prev = curr;
     }
     return retVal;
 }
 
-void FstData::recalc_time_offsets(fstHandle signal, std::vector<uint64_t> time)
-{
-    size_t index = 0;
-    auto &data = handle_to_data[signal];
-    for(auto curr : time) {
-        for(size_t i = index; i< data.size(); i++) {
-            uint64_t t = index_to_time[signal][i];
-            if (t > curr) 
-                break;
-            index = i;
-        }
-        time_to_index[signal][curr] = index;
-    }
-}
-
 int main(int argc, char **argv)
 {
 
@@ -30,6 +30,10 @@
 #include "jrb/jrb.h"
 #include "wave_locale.h"
 
+#ifdef FST_WRITER_PARALLEL
+#include <pthread.h>
+#endif
+
 #ifdef EXTLOAD_SUFFIX
 #ifdef EXTCONV_PATH
 #define VCD2FST_EXTLOAD_CONV
@@ -345,41 +349,102 @@ static uint64_t atoi_2(const unsigned char *s)
     return (res);
 }
 
-static inline int getline_replace(char **wbuf, char **buf, size_t *len, FILE *f)
+/*
+ * VCD is read in large blocks and each line is handed back in place, NUL
+ * terminated by temporarily overwriting the first byte of the following
+ * line.  This avoids the per-line fgets() copy and the rescans for the
+ * line end; memchr() is typically vectorized by the C library.
+ */
+#define VCD_LEXER_BLOCK (4 * 1024 * 1024)
+
+struct vcd_lexer
+{
+    FILE *f;
+    char *buf;  /* cap + 1 bytes, so a terminating NUL always fits */
+    size_t cap;
+    size_t len; /* valid bytes in buf */
+    size_t pos; /* start of the next line */
+    char saved; /* byte displaced by the NUL which terminates the current line */
+    int eof;
+};
+
+static void vcd_lexer_init(struct vcd_lexer *lx, FILE *f)
+{
+    memset(lx, 0, sizeof(struct vcd_lexer));
+    lx->f = f;
+    lx->cap = VCD_LEXER_BLOCK;
+    lx->buf = realloc_2(NULL, lx->cap + 1);
+}
+
+static void vcd_lexer_free(struct vcd_lexer *lx)
 {
-    char *fgets_rc;
+    free(lx->buf);
+    lx->buf = NULL;
+}
 
-    if (!*wbuf) {
-        *len = 32767;
-        *wbuf = malloc((*len) + 1);
-        (*wbuf)[*len] = 1;
-    }
+/*
+ * returns the next line with leading spaces removed, *len is its length
+ * including any trailing newline
+ */
+static inline int vcd_lexer_getline(struct vcd_lexer *lx, char **buf, size_t *len)
+{
+    size_t scan;
+    char *eol, *pnt;
+
+    lx->buf[lx->pos] = lx->saved;
+    scan = lx->pos;
+
+    for (;;) {
+        size_t rd;
+
+        eol = memchr(lx->buf + scan, '\n', lx->len - scan);
+        if (eol) {
+            eol++;
+            break;
+        }
 
-    (*wbuf)[0] = 0;
-    fgets_rc = fgets(*wbuf, (*len) + 1, f);
-    while (((*wbuf)[*len] != 1) && !feof(f)) {
-        /* fprintf(stderr, "overflow %d\n", (int)(*len)); */
-        *wbuf = realloc_2(*wbuf, (*len) * 2 + 1);
-        (*wbuf)[(*len) * 2] = 1;
+        if (lx->eof) {
+            if (lx->pos == lx->len) {
+                return (0);
+            }
+            eol = lx->buf + lx->len;
+            break;
+        }
 
-        fgets_rc = fgets(*wbuf + (*len), (*len) + 1, f);
-        *len = 2 * (*len);
+        if (lx->pos) /* slide the partial line to the front then refill */
+        {
+            lx->len -= lx->pos;
+            memmove(lx->buf, lx->buf + lx->pos, lx->len);
+            lx->pos = 0;
+        }
+
+        if (lx->len == lx->cap) {
+            lx->cap *= 2;
+            lx->buf = realloc_2(lx->buf, lx->cap + 1);
+        }
+
+        scan = lx->len;
+        rd = fread(lx->buf + lx->len, 1, lx->cap - lx->len, lx->f);
+        if (!rd) {
+            lx->eof = 1;
+        }
+        lx->len += rd;
     }
 
-    *buf = *wbuf;
-    while (*(buf)[0] == ' ') {
-        (*buf)++;
+    pnt = lx->buf + lx->pos;
+    lx->pos = eol - lx->buf;
+    lx->saved = *eol;
+    *eol = 0;
+
+    while (*pnt == ' ') {
+        pnt++;
     } /* verilator leading spaces fix */
 
-    if ((!(*buf)[0]) || (!fgets_rc)) {
-        return (0);
-    } else {
-        return (1);
-    }
+    *buf = pnt;
+    *len = eol - pnt;
+    return (*pnt != 0);
 }
 
-JRB vcd_ids = NULL;
-
 static unsigned int vcdid_hash(char *s, int len)
 {
     unsigned int val = 0;
@@ -395,10 +460,409 @@ static unsigned int vcdid_hash(char *s, int len)
     return (val);
 }
 
+/*
+ * open addressing table keyed by the raw VCD identifier bytes, used when the
+ * identifiers are too long or sparse to index node_len_array directly.  it
+ * grows while the header is parsed and is resized once more at
+ * $enddefinitions so every lookup in the value change loop is O(1).
+ */
+struct vcdid_entry
+{
+    size_t id_offs;      /* into vcdid_table.pool */
+    unsigned int id_len; /* zero marks an empty slot */
+    unsigned int hash;
+    fstHandle handle;
+    int len;
+};
+
+struct vcdid_table
+{
+    struct vcdid_entry *ents;
+    unsigned int shift; /* 32 - log2(number of slots) */
+    unsigned int mask;
+    unsigned int count;
+
+    char *pool;
+    size_t pool_len;
+    size_t pool_siz;
+};
+
+static struct vcdid_table vcd_ids;
+
+static inline unsigned int vcdid_slot(struct vcdid_table *t, unsigned int hash)
+{
+    return ((hash * 2654435761U) >> t->shift); /* fibonacci hashing */
+}
+
+static void vcdid_resize(struct vcdid_table *t, unsigned int count)
+{
+    struct vcdid_entry *old_ents = t->ents;
+    unsigned int old_siz = t->ents ? t->mask + 1 : 0;
+    unsigned int siz = 16, bits = 4;
+    unsigned int i;
+
+    while (siz < count * 2) /* keep the load factor at or below one half */
+    {
+        siz *= 2;
+        bits++;
+    }
+
+    t->ents = calloc(siz, sizeof(struct vcdid_entry));
+    if (!t->ents) {
+        fprintf(stderr, "ERROR: Out of memory in calloc(), exiting!\n");
+        exit(255);
+    }
+    t->shift = 32 - bits;
+    t->mask = siz - 1;
+
+    for (i = 0; i < old_siz; i++) {
+        if (old_ents[i].id_len) {
+            unsigned int slot = vcdid_slot(t, old_ents[i].hash);
+            while (t->ents[slot].id_len) {
+                slot = (slot + 1) & t->mask;
+            }
+            t->ents[slot] = old_ents[i];
+        }
+    }
+
+    free(old_ents);
+}
+
+static inline struct vcdid_entry *vcdid_find(struct vcdid_table *t, const char *s, int len, unsigned int hash)
+{
+    unsigned int slot;
+
+    if (!t->ents || (len <= 0)) {
+        return (NULL);
+    }
+
+    slot = vcdid_slot(t, hash);
+    for (;;) {
+        struct vcdid_entry *e = t->ents + slot;
+
+        if (!e->id_len) {
+            return (NULL);
+        }
+        if ((e->hash == hash) && (e->id_len == (unsigned int)len) && !memcmp(t->pool + e->id_offs, s, len)) {
+            return (e);
+        }
+        slot = (slot + 1) & t->mask;
+    }
+}
+
+static void vcdid_insert(struct vcdid_table *t, const char *s, int len, unsigned int hash, fstHandle handle,
+                         int node_len)
+{
+    struct vcdid_entry *e;
+    unsigned int slot;
+
+    if (!t->ents || ((t->count + 1) * 2 > t->mask + 1)) {
+        vcdid_resize(t, t->count + 1);
+    }
+
+    if (t->pool_len + len > t->pool_siz) {
+        t->pool_siz = (t->pool_siz ? t->pool_siz : 65536);
+        while (t->pool_len + len > t->pool_siz) {
+            t->pool_siz *= 2;
+        }
+        t->pool = realloc_2(t->pool, t->pool_siz);
+    }
+
+    slot = vcdid_slot(t, hash);
+    while (t->ents[slot].id_len) {
+        slot = (slot + 1) & t->mask;
+    }
+
+    e = t->ents + slot;
+    e->id_offs = t->pool_len;
+    e->id_len = len;
+    e->hash = hash;
+    e->handle = handle;
+    e->len = node_len;
+
+    memcpy(t->pool + t->pool_len, s, len);
+    t->pool_len += len;
+    t->count++;
+}
+
+static void vcdid_free(struct vcdid_table *t)
+{
+    free(t->ents);
+    free(t->pool);
+    memset(t, 0, sizeof(struct vcdid_table));
+}
+
 int pack_type = FST_WR_PT_LZ4; /* set to fstWriterPackType */
 int compression_explicitly_set = 0;
-int repack_all = 0;    /* 0 is normal, 1 does the repack (via fstapi) at end */
+int repack_all = 0;    /* 0 is normal, 1 does the repack (via fstapi) at end, 2 repacks in seekable chunks */
 int parallel_mode = 0; /* 0 is is single threaded, 1 is multi-threaded */
+int pack_threads = 1;  /* number of threads used to compress value change chains */
+int pipeline_mode = 0; /* 0 parses and writes on one thread, 1 hands value changes to a writer thread */
+
+int mem_scratch = 0;            /* 1 keeps the writer's scratch files in memory */
+uint64_t mem_scratch_spill = 0; /* scratch file size at which it moves to disk, 0 = never */
+
+/*
+ * the value change loop can run as a two stage pipeline: the parser packs
+ * resolved value changes into batches and a second thread replays them into
+ * the fstWriter.  batches travel through a single producer/single consumer
+ * ring whose indices are only ever advanced by their owning side, so the
+ * fast path needs no lock; the mutex/condvar pair is only for sleeping when
+ * the ring is full or empty.
+ */
+#define VCD_PIPE_BATCH (1024 * 1024)
+#define VCD_PIPE_SLOTS (8) /* power of two */
+
+enum vcd_pipe_op
+{
+    VCD_PIPE_END,
+    VCD_PIPE_TIME,
+    VCD_PIPE_VALUE,
+    VCD_PIPE_VARLEN,
+    VCD_PIPE_DUMPACTIVE
+};
+
+struct vcd_pipe_rec
+{
+    uint32_t op;
+    fstHandle handle; /* or the dumpactive flag */
+    uint64_t arg;     /* payload length or the time */
+};
+
+struct vcd_pipe_batch
+{
+    unsigned char *mem;
+    size_t len;
+    size_t siz;
+};
+
+struct vcd_pipe
+{
+    void *ctx;
+    const int *handle_len; /* indexed by handle, for padding short values */
+    fstHandle maxhandle;
+
+    struct vcd_pipe_batch batches[VCD_PIPE_SLOTS];
+    unsigned int head; /* advanced by the parser only */
+    unsigned int tail; /* advanced by the writer thread only */
+
+#ifdef FST_WRITER_PARALLEL
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+#ifdef FST_WRITER_PARALLEL
+
+static void vcd_pipe_notify(struct vcd_pipe *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/* the parser waits for a free batch, the writer thread for a filled one */
+static void vcd_pipe_wait(struct vcd_pipe *p, int producer)
+{
+    unsigned int head, tail;
+
+    for (;;) {
+        head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+        if (producer ? ((head - tail) < VCD_PIPE_SLOTS) : (head != tail)) {
+            return;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+        if (producer ? ((head - tail) >= VCD_PIPE_SLOTS) : (head == tail)) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+}
+
+static void *vcd_pipe_writer(void *arg)
+{
+    struct vcd_pipe *p = (struct vcd_pipe *)arg;
+    int done = 0;
+
+    while (!done) {
+        struct vcd_pipe_batch *b;
+        unsigned char *pnt, *end;
+
+        vcd_pipe_wait(p, 0);
+        b = p->batches + (p->tail & (VCD_PIPE_SLOTS - 1));
+        pnt = b->mem;
+        end = b->mem + b->len;
+
+        while (pnt < end) {
+            struct vcd_pipe_rec *rec = (struct vcd_pipe_rec *)pnt;
+            unsigned char *payload = pnt + sizeof(struct vcd_pipe_rec);
+
+            switch (rec->op) {
+            case VCD_PIPE_TIME:
+                fstWriterEmitTimeChange(p->ctx, rec->arg);
+                break;
+            case VCD_PIPE_VALUE:
+                fstWriterEmitValueChange(p->ctx, rec->handle, payload);
+                pnt += (rec->arg + 7) & ~(uint64_t)7;
+                break;
+            case VCD_PIPE_VARLEN:
+                fstWriterEmitVariableLengthValueChange(p->ctx, rec->handle, payload, rec->arg);
+                pnt += (rec->arg + 7) & ~(uint64_t)7;
+                break;
+            case VCD_PIPE_DUMPACTIVE:
+                fstWriterEmitDumpActive(p->ctx, rec->handle);
+                break;
+            default:
+                done = 1;
+                break;
+            }
+
+            pnt += sizeof(struct vcd_pipe_rec);
+        }
+
+        __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+        vcd_pipe_notify(p);
+    }
+
+    return (NULL);
+}
+
+static struct vcd_pipe *vcd_pipe_create(void *ctx, const int *handle_len, fstHandle maxhandle)
+{
+    struct vcd_pipe *p = calloc(1, sizeof(struct vcd_pipe));
+    int i;
+
+    p->ctx = ctx;
+    p->handle_len = handle_len;
+    p->maxhandle = maxhandle;
+
+    for (i = 0; i < VCD_PIPE_SLOTS; i++) {
+        p->batches[i].siz = VCD_PIPE_BATCH;
+        p->batches[i].mem = realloc_2(NULL, VCD_PIPE_BATCH);
+    }
+
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, vcd_pipe_writer, p)) {
+        fprintf(stderr, "ERROR: Could not create writer thread, exiting!\n");
+        exit(255);
+    }
+
+    return (p);
+}
+
+/* hand the batch being filled to the writer thread and claim the next free one */
+static void vcd_pipe_push(struct vcd_pipe *p)
+{
+    __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+    vcd_pipe_notify(p);
+    vcd_pipe_wait(p, 1);
+    p->batches[p->head & (VCD_PIPE_SLOTS - 1)].len = 0;
+}
+
+static unsigned char *vcd_pipe_append(struct vcd_pipe *p, uint32_t op, fstHandle handle, uint64_t arg,
+                                      size_t payload)
+{
+    struct vcd_pipe_batch *b = p->batches + (p->head & (VCD_PIPE_SLOTS - 1));
+    size_t siz = sizeof(struct vcd_pipe_rec) + ((payload + 7) & ~(size_t)7); /* keep records 8 byte aligned */
+    struct vcd_pipe_rec *rec;
+
+    if (b->len + siz > b->siz) {
+        if (b->len) {
+            vcd_pipe_push(p);
+            b = p->batches + (p->head & (VCD_PIPE_SLOTS - 1));
+        }
+        if (siz > b->siz) {
+            b->siz = siz;
+            b->mem = realloc_2(b->mem, b->siz);
+        }
+    }
+
+    rec = (struct vcd_pipe_rec *)(b->mem + b->len);
+    rec->op = op;
+    rec->handle = handle;
+    rec->arg = arg;
+    b->len += siz;
+
+    return ((unsigned char *)(rec + 1));
+}
+
+static void vcd_pipe_destroy(struct vcd_pipe *p)
+{
+    int i;
+
+    vcd_pipe_append(p, VCD_PIPE_END, 0, 0, 0);
+    __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+    vcd_pipe_notify(p);
+    pthread_join(p->thread, NULL);
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->mutex);
+    for (i = 0; i < VCD_PIPE_SLOTS; i++) {
+        free(p->batches[i].mem);
+    }
+    free(p);
+}
+
+#endif
+
+static inline void vcd_emit_time(void *ctx, struct vcd_pipe *p, uint64_t tim)
+{
+#ifdef FST_WRITER_PARALLEL
+    if (p) {
+        vcd_pipe_append(p, VCD_PIPE_TIME, 0, tim, 0);
+        return;
+    }
+#endif
+    fstWriterEmitTimeChange(ctx, tim);
+}
+
+/* siz is how many bytes are valid at val, the writer may want up to the declared length of the handle */
+static inline void vcd_emit_value(void *ctx, struct vcd_pipe *p, fstHandle handle, const void *val, size_t siz)
+{
+#ifdef FST_WRITER_PARALLEL
+    if (p) {
+        size_t need = (handle <= p->maxhandle) ? (size_t)p->handle_len[handle] : 0;
+        unsigned char *pnt = vcd_pipe_append(p, VCD_PIPE_VALUE, handle, (need > siz) ? need : siz,
+                                             (need > siz) ? need : siz);
+
+        memcpy(pnt, val, siz);
+        if (need > siz) {
+            memset(pnt + siz, 0, need - siz);
+        }
+        return;
+    }
+#endif
+    (void)siz;
+    fstWriterEmitValueChange(ctx, handle, val);
+}
+
+static inline void vcd_emit_varlen(void *ctx, struct vcd_pipe *p, fstHandle handle, const void *val, uint32_t len)
+{
+#ifdef FST_WRITER_PARALLEL
+    if (p) {
+        memcpy(vcd_pipe_append(p, VCD_PIPE_VARLEN, handle, len, len), val, len);
+        return;
+    }
+#endif
+    fstWriterEmitVariableLengthValueChange(ctx, handle, val, len);
+}
+
+static inline void vcd_emit_dump_active(void *ctx, struct vcd_pipe *p, int enable)
+{
+#ifdef FST_WRITER_PARALLEL
+    if (p) {
+        vcd_pipe_append(p, VCD_PIPE_DUMPACTIVE, enable, 0, 0);
+        return;
+    }
+#endif
+    fstWriterEmitDumpActive(ctx, enable);
+}
 
 #ifdef VCD2FST_EXTLOADERS_CONV
 static int suffix_check(const char *s, const char *sfx)
@@ -411,13 +875,14 @@ static int suffix_check(const char *s, const char *sfx)
 int fst_main(char *vname, char *fstname)
 {
     FILE *f;
-    char *buf = NULL, *wbuf = NULL;
+    struct vcd_lexer lx;
+    char *buf = NULL;
     size_t glen = 0;
     void *ctx;
     int line = 0;
     int ss;
     fstHandle returnedhandle;
-    JRB node;
+    struct vcdid_entry *node;
     uint64_t prev_tim = 0;
     ssize_t bin_fixbuff_len = 65537;
     char *bin_fixbuff = NULL;
@@ -430,6 +895,7 @@ int fst_main(char *vname, char *fstname)
     void *xc = NULL;
 #endif
     int port_encountered = 0;
+    struct vcd_pipe *vpipe = NULL;
 
     bin_fixbuff = malloc(bin_fixbuff_len);
 
@@ -497,15 +963,19 @@ int fst_main(char *vname, char *fstname)
     }
 #endif
 
-    vcd_ids = make_jrb();
     fstWriterSetPackType(ctx, pack_type);
     fstWriterSetRepackOnClose(ctx, repack_all);
     fstWriterSetParallelMode(ctx, parallel_mode);
+    fstWriterSetPackThreads(ctx, pack_threads);
+    if (mem_scratch) {
+        fstWriterSetScratchInMemory(ctx, mem_scratch_spill);
+    }
+    vcd_lexer_init(&lx, f);
 
-    while (!feof(f)) {
+    for (;;) {
         char *buf1;
 
-        ss = getline_replace(&wbuf, &buf, &glen, f);
+        ss = vcd_lexer_getline(&lx, &buf, &glen);
         if (!ss) {
             break;
         }
@@ -520,6 +990,8 @@ int fst_main(char *vname, char *fstname)
             enum fstVarType vartype;
             int len;
             char *nam;
+            char *vcdid;
+            int vcdid_len;
             unsigned int hash;
 
             if (!st) {
@@ -664,7 +1136,9 @@ int fst_main(char *vname, char *fstname)
             }
 
             st = strtok(NULL, " \t"); /* vcdid */
-            hash = vcdid_hash(st, strlen(st));
+            vcdid = st;
+            vcdid_len = strlen(st);
+            hash = vcdid_hash(st, vcdid_len);
 
             if (hash == (hash_max + 1)) {
                 hash_max = hash;
@@ -682,18 +1156,16 @@ int fst_main(char *vname, char *fstname)
                     *(st - 1) = ' ';
                 }
 
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, vcdid, vcdid_len, hash);
                 if (!node) {
-                    Jval val;
                     returnedhandle = fstWriterCreateVar(
                             ctx, vartype, !var_direction ? FST_VD_IMPLICIT : var_direction[var_direction_idx++], len,
                             nam, 0);
-                    val.i = returnedhandle;
-                    jrb_insert_int(vcd_ids, hash, val)->val2.i = len;
+                    vcdid_insert(&vcd_ids, vcdid, vcdid_len, hash, returnedhandle, len);
                 } else {
                     fstWriterCreateVar(ctx, vartype,
                                        !var_direction ? FST_VD_IMPLICIT : var_direction[var_direction_idx++],
-                                       node->val2.i, nam, node->val.i);
+                                       node->len, nam, node->handle);
                 }
 
 #if defined(VCD2FST_EXTLOAD_CONV)
@@ -885,7 +1357,7 @@ int fst_main(char *vname, char *fstname)
                 *pnt = 0;
                 sscanf(buf + 10, "%" SCNd64, &tzero);
             } else {
-                ss = getline_replace(&wbuf, &buf, &glen, f);
+                ss = vcd_lexer_getline(&lx, &buf, &glen);
                 if (!ss) {
                     break;
                 }
@@ -912,7 +1384,7 @@ int fst_main(char *vname, char *fstname)
             }
 
             if (!num) {
-                ss = getline_replace(&wbuf, &buf, &glen, f);
+                ss = vcd_lexer_getline(&lx, &buf, &glen);
                 if (!ss) {
                     break;
                 }
@@ -1013,7 +1485,7 @@ int fst_main(char *vname, char *fstname)
             }
 
             if (!found) {
-                ss = getline_replace(&wbuf, &buf, &glen, f);
+                ss = vcd_lexer_getline(&lx, &buf, &glen);
                 if (!ss) {
                     break;
                 }
@@ -1042,7 +1514,7 @@ int fst_main(char *vname, char *fstname)
                     }
                 }
             } else {
-                ss = getline_replace(&wbuf, &buf, &glen, f);
+                ss = vcd_lexer_getline(&lx, &buf, &glen);
                 if (!ss) {
                     break;
                 }
@@ -1067,26 +1539,57 @@ int fst_main(char *vname, char *fstname)
         }
     }
 
-    if ((!hash_kill) && (vcd_ids)) {
+    if (!hash_kill) {
         unsigned int hash;
 
         node_len_array = calloc(hash_max + 1, sizeof(int));
 
         for (hash = 1; hash <= hash_max; hash++) {
-            node = jrb_find_int(vcd_ids, hash);
-            if (node) {
-                node_len_array[hash] = node->val2.i;
-            } else {
-                node_len_array[hash] = 1; /* should never happen */
+            node_len_array[hash] = 1; /* should never be left at this */
+        }
+
+        if (vcd_ids.ents) {
+            unsigned int slot;
+
+            for (slot = 0; slot <= vcd_ids.mask; slot++) {
+                node = vcd_ids.ents + slot;
+                if (node->id_len) {
+                    node_len_array[node->hash] = node->len;
+                }
             }
         }
 
-        jrb_free_tree(vcd_ids);
-        vcd_ids = NULL;
+        vcdid_free(&vcd_ids);
     } else {
-        hash_kill = 1; /* scan-build */
+        vcdid_resize(&vcd_ids, vcd_ids.count); /* final size is known now */
     }
 
+#ifdef FST_WRITER_PARALLEL
+    if (pipeline_mode) {
+        if (!hash_kill) {
+            vpipe = vcd_pipe_create(ctx, node_len_array, hash_max);
+        } else {
+            fstHandle maxhandle = 0;
+            unsigned int slot;
+
+            for (slot = 0; slot <= vcd_ids.mask; slot++) {
+                if (vcd_ids.ents[slot].id_len && (vcd_ids.ents[slot].handle > maxhandle)) {
+                    maxhandle = vcd_ids.ents[slot].handle;
+                }
+            }
+
+            node_len_array = calloc(maxhandle + 1, sizeof(int)); /* indexed by handle rather than hash */
+            for (slot = 0; slot <= vcd_ids.mask; slot++) {
+                if (vcd_ids.ents[slot].id_len) {
+                    node_len_array[vcd_ids.ents[slot].handle] = vcd_ids.ents[slot].len;
+                }
+            }
+
+            vpipe = vcd_pipe_create(ctx, node_len_array, maxhandle);
+        }
+    }
+#endif
+
     for (;;) /* was while(!feof(f)) */
     {
         unsigned int hash;
@@ -1094,19 +1597,19 @@ int fst_main(char *vname, char *fstname)
         char *nl, *sp;
         double doub;
 
-        ss = getline_replace(&wbuf, &buf, &glen, f);
+        ss = vcd_lexer_getline(&lx, &buf, &glen);
         if (!ss) {
             break;
         }
 
-        nl = buf;
-        while (*nl) {
-            if ((*nl == '\n') || (*nl == '\r')) {
-                *nl = 0;
-                break;
-            }
-            nl++;
+        nl = buf + glen; /* the lexer already knows where the line ends */
+        if ((nl != buf) && (nl[-1] == '\n')) {
+            nl--;
         }
+        if ((nl != buf) && (nl[-1] == '\r')) {
+            nl--;
+        }
+        *nl = 0;
 
         switch (buf[0]) {
         case '0':
@@ -1115,11 +1618,11 @@ int fst_main(char *vname, char *fstname)
         case 'z':
             hash = vcdid_hash(buf + 1, nl - (buf + 1));
             if (!hash_kill) {
-                fstWriterEmitValueChange(ctx, hash, buf);
+                vcd_emit_value(ctx, vpipe, hash, buf, nl - buf + 1);
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, buf + 1, nl - (buf + 1), hash);
                 if (node) {
-                    fstWriterEmitValueChange(ctx, node->val.i, buf);
+                    vcd_emit_value(ctx, vpipe, node->handle, buf, nl - buf + 1);
                 } else {
                 }
             }
@@ -1150,7 +1653,7 @@ int fst_main(char *vname, char *fstname)
                 int node_len = node_len_array[hash];
 
                 if (bin_len >= node_len) {
-                    fstWriterEmitValueChange(ctx, hash, buf + 1);
+                    vcd_emit_value(ctx, vpipe, hash, buf + 1, bin_len + 1);
                 } else {
                     int delta = node_len - bin_len;
 
@@ -1161,15 +1664,15 @@ int fst_main(char *vname, char *fstname)
 
                     memset(bin_fixbuff, buf[1] != '1' ? buf[1] : '0', delta);
                     memcpy(bin_fixbuff + delta, buf + 1, bin_len);
-                    fstWriterEmitValueChange(ctx, hash, bin_fixbuff);
+                    vcd_emit_value(ctx, vpipe, hash, bin_fixbuff, node_len);
                 }
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, sp + 1, nl - (sp + 1), hash);
                 if (node) {
                     int bin_len = sp - (buf + 1); /* strlen(buf+1) */
-                    int node_len = node->val2.i;
+                    int node_len = node->len;
                     if (bin_len >= node_len) {
-                        fstWriterEmitValueChange(ctx, node->val.i, buf + 1);
+                        vcd_emit_value(ctx, vpipe, node->handle, buf + 1, bin_len + 1);
                     } else {
                         int delta = node_len - bin_len;
 
@@ -1180,7 +1683,7 @@ int fst_main(char *vname, char *fstname)
 
                         memset(bin_fixbuff, buf[1] != '1' ? buf[1] : '0', delta);
                         memcpy(bin_fixbuff + delta, buf + 1, bin_len);
-                        fstWriterEmitValueChange(ctx, node->val.i, bin_fixbuff);
+                        vcd_emit_value(ctx, vpipe, node->handle, bin_fixbuff, node_len);
                     }
                 } else {
                 }
@@ -1197,14 +1700,14 @@ int fst_main(char *vname, char *fstname)
                 int bin_len = sp - (buf + 1); /* strlen(buf+1) */
 
                 bin_len = fstUtilityEscToBin(NULL, (unsigned char *)(buf + 1), bin_len);
-                fstWriterEmitVariableLengthValueChange(ctx, hash, buf + 1, bin_len);
+                vcd_emit_varlen(ctx, vpipe, hash, buf + 1, bin_len);
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, sp + 1, nl - (sp + 1), hash);
                 if (node) {
                     int bin_len = sp - (buf + 1); /* strlen(buf+1) */
 
                     bin_len = fstUtilityEscToBin(NULL, (unsigned char *)(buf + 1), bin_len);
-                    fstWriterEmitVariableLengthValueChange(ctx, node->val.i, buf + 1, bin_len);
+                    vcd_emit_varlen(ctx, vpipe, node->handle, buf + 1, bin_len);
                 } else {
                 }
             }
@@ -1249,11 +1752,11 @@ int fst_main(char *vname, char *fstname)
 
             hash = vcdid_hash(sp + 1, strlen(sp + 1)); /* nl is no longer good here */
             if (!hash_kill) {
-                fstWriterEmitValueChange(ctx, hash, bin_fixbuff);
+                vcd_emit_value(ctx, vpipe, hash, bin_fixbuff, sp - bin_fixbuff + 1);
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, sp + 1, strlen(sp + 1), hash);
                 if (node) {
-                    fstWriterEmitValueChange(ctx, node->val.i, bin_fixbuff);
+                    vcd_emit_value(ctx, vpipe, node->handle, bin_fixbuff, sp - bin_fixbuff + 1);
                 } else {
                 }
             }
@@ -1265,13 +1768,13 @@ int fst_main(char *vname, char *fstname)
                 break;
             hash = vcdid_hash(sp + 1, nl - (sp + 1));
             if (!hash_kill) {
-                sscanf(buf + 1, "%lg", &doub);
-                fstWriterEmitValueChange(ctx, hash, &doub);
+                doub = strtod(buf + 1, NULL);
+                vcd_emit_value(ctx, vpipe, hash, &doub, sizeof(double));
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, sp + 1, nl - (sp + 1), hash);
                 if (node) {
-                    sscanf(buf + 1, "%lg", &doub);
-                    fstWriterEmitValueChange(ctx, node->val.i, &doub);
+                    doub = strtod(buf + 1, NULL);
+                    vcd_emit_value(ctx, vpipe, node->handle, &doub, sizeof(double));
                 } else {
                 }
             }
@@ -1284,11 +1787,11 @@ int fst_main(char *vname, char *fstname)
         case '-':
             hash = vcdid_hash(buf + 1, nl - (buf + 1));
             if (!hash_kill) {
-                fstWriterEmitValueChange(ctx, hash, buf);
+                vcd_emit_value(ctx, vpipe, hash, buf, nl - buf + 1);
             } else {
-                node = jrb_find_int(vcd_ids, hash);
+                node = vcdid_find(&vcd_ids, buf + 1, nl - (buf + 1), hash);
                 if (node) {
-                    fstWriterEmitValueChange(ctx, node->val.i, buf);
+                    vcd_emit_value(ctx, vpipe, node->handle, buf, nl - buf + 1);
                 } else {
                 }
             }
@@ -1298,15 +1801,15 @@ int fst_main(char *vname, char *fstname)
             tim = atoi_2((unsigned char *)(buf + 1));
             if ((tim >= prev_tim) || (!prev_tim)) {
                 prev_tim = tim;
-                fstWriterEmitTimeChange(ctx, tim);
+                vcd_emit_time(ctx, vpipe, tim);
             }
             break;
 
         default:
             if (!strncmp(buf, "$dumpon", 7)) {
-                fstWriterEmitDumpActive(ctx, 1);
+                vcd_emit_dump_active(ctx, vpipe, 1);
             } else if (!strncmp(buf, "$dumpoff", 8)) {
-                fstWriterEmitDumpActive(ctx, 0);
+                vcd_emit_dump_active(ctx, vpipe, 0);
             } else if (!strncmp(buf, "$dumpvars", 9)) {
                 /* nothing */
             } else {
@@ -1316,6 +1819,13 @@ int fst_main(char *vname, char *fstname)
         }
     }
 
+#ifdef FST_WRITER_PARALLEL
+    if (vpipe) {
+        vcd_pipe_destroy(vpipe);
+        vpipe = NULL;
+    }
+#endif
+
     fstWriterClose(ctx);
 
 #if defined(VCD2FST_EXTLOAD_CONV)
@@ -1324,15 +1834,11 @@ int fst_main(char *vname, char *fstname)
     }
 #endif
 
-    if (vcd_ids) {
-        jrb_free_tree(vcd_ids);
-        vcd_ids = NULL;
-    }
+    vcdid_free(&vcd_ids);
 
     free(bin_fixbuff);
     bin_fixbuff = NULL;
-    free(wbuf);
-    wbuf = NULL;
+    vcd_lexer_free(&lx);
     free(node_len_array);
     node_len_array = NULL;
 
@@ -1392,7 +1898,11 @@ void print_help(char *nam)
            "  -F, --fastpack             use fastlz algorithm for speed\n"
            "  -Z, --zlibpack             use zlib algorithm for size\n"
            "  -c, --compress             zlib compress entire file on close\n"
+           "  -C, --chunked              as -c, but in chunks readers can inflate on demand\n"
            "  -p, --parallel             enable parallel mode\n"
+           "  -t, --threads=NUM          compress value changes and -C chunks with NUM threads\n"
+           "  -P, --pipeline             parse and write on separate threads\n"
+           "  -m, --memscratch=BYTES     keep scratch files in memory, to disk past BYTES (0 = never)\n"
            "  -h, --help                 display this help then exit\n\n"
 
            "Note that VCDFILE and FSTFILE are optional provided the\n"
@@ -1416,7 +1926,11 @@ void print_help(char *nam)
            "  -F                         use fastlz algorithm for speed\n"
            "  -Z                         use zlib algorithm for size\n"
            "  -c                         zlib compress entire file on close\n"
+           "  -C                         as -c, but in chunks readers can inflate on demand\n"
            "  -p                         enable parallel mode\n"
+           "  -t NUM                     compress value changes and -C chunks with NUM threads\n"
+           "  -P                         parse and write on separate threads\n"
+           "  -m BYTES                   keep scratch files in memory, to disk past BYTES (0 = never)\n"
            "  -h                         display this help then exit\n\n"
 
            "Note that VCDFILE and FSTFILE are optional provided the\n"
@@ -1452,11 +1966,13 @@ int main(int argc, char **argv)
         static struct option long_options[] = {
                 {"vcdname", 1, 0, 'v'},  {"fstname", 1, 0, 'f'},  {"fastpack", 0, 0, 'F'},
                 {"fourpack", 0, 0, '4'}, {"zlibpack", 0, 0, 'Z'}, {"compress", 0, 0, 'c'},
-                {"parallel", 0, 0, 'p'}, {"help", 0, 0, 'h'},     {0, 0, 0, 0}};
+                {"chunked", 0, 0, 'C'},  {"parallel", 0, 0, 'p'}, {"threads", 1, 0, 't'},
+                {"pipeline", 0, 0, 'P'}, {"memscratch", 1, 0, 'm'}, {"help", 0, 0, 'h'},
+                {0, 0, 0, 0}};
 
-        c = getopt_long(argc, argv, "v:f:ZF4cph", long_options, &option_index);
+        c = getopt_long(argc, argv, "v:f:ZF4cCpt:Pm:h", long_options, &option_index);
 #else
-        c = getopt(argc, argv, "v:f:ZF4cph");
+        c = getopt(argc, argv, "v:f:ZF4cCpt:Pm:h");
 #endif
 
         if (c == -1)
@@ -1496,10 +2012,27 @@ int main(int argc, char **argv)
             repack_all = 1;
             break;
 
+        case 'C':
+            repack_all = 2;
+            break;
+
         case 'p':
             parallel_mode = 1;
             break;
 
+        case 't':
+            pack_threads = atoi(optarg);
+            break;
+
+        case 'P':
+            pipeline_mode = 1;
+            break;
+
+        case 'm':
+            mem_scratch = 1;
+            mem_scratch_spill = strtoull(optarg, NULL, 10);
+            break;
+
         case 'h':
             print_help(argv[0]);
             break;